@@ -14,3 +14,18 @@ int maxidx(double* vec, int len)
 
     return maxidx;
 }
+
+int maxidx_f32(float* vec, int len)
+{
+    float maxval = vec[0];
+    int maxidx = 0;
+
+    for (int i = 1; i < len; i++) {
+        if (vec[i] > maxval) {
+            maxval = vec[i];
+            maxidx = i;
+        }
+    }
+
+    return maxidx;
+}
@@ -3,5 +3,6 @@
 
 
 int maxidx(double* vec, int len);
+int maxidx_f32(float* vec, int len);
 
 #endif
@@ -1,9 +1,21 @@
+// for mmap
+#define _DEFAULT_SOURCE
+
 #include "mnist_loader.h"
 
 #include <byteswap.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Maps the whole file at filepath read-only. Returns MAP_FAILED on error.
+ */
+static void* map_file(const char* filepath, size_t* len);
 
 int load_label_file(const char* filepath, uint8_t** target)
 {
@@ -39,6 +51,7 @@ int load_label_file(const char* filepath, uint8_t** target)
         return 0;
     }
 
+    fclose(fp);
     return head[1];
 }
 
@@ -80,6 +93,7 @@ int load_data_file(const char* filepath, uint32_t wh[2], uint8_t*** target)
         }
     }
 
+    fclose(fp);
     return head[1];
 
 cleanup:
@@ -139,3 +153,160 @@ int load_data_file_doubles(const char* filepath, double*** target)
     free(data_u8);
     return numel;
 }
+
+int load_label_file_floats(const char* filepath, float*** target)
+{
+    uint8_t* labels_u8;
+    int numel = load_label_file(filepath, &labels_u8);
+
+    if (numel == 0) {
+        *target = NULL;
+    } else {
+        *target = malloc(numel * sizeof(float*));
+        for (int i = 0; i < numel; i++) {
+            (*target)[i] = malloc(10 * sizeof(float));
+            for (int j = 0; j < 10; j++) {
+                ((*target)[i])[j] = (j == labels_u8[i]) ? 1.0f : 0.0f;
+            }
+        }
+    }
+    free(labels_u8);
+
+    return numel;
+}
+
+int load_data_file_floats(const char* filepath, float*** target)
+{
+    uint8_t** data_u8;
+    uint32_t wh[2];
+    int numel = load_data_file(filepath, wh, &data_u8);
+
+    if (numel == 0) {
+        *target = NULL;
+    } else {
+        *target = calloc(numel, sizeof(float*));
+        for (int i = 0; i < numel; i++) {
+            ((*target)[i]) = malloc(sizeof(float) * wh[0] * wh[1]);
+            for (int j = 0; j < (wh[0] * wh[1]); j++) {
+                ((*target)[i])[j] = (float)(data_u8[i])[j];
+                ((*target)[i])[j] /= 255.0f;
+            }
+            free(data_u8[i]);
+        }
+    }
+
+    free(data_u8);
+    return numel;
+}
+
+
+mnist_dataset_t* mnist_dataset_open(const char* data_path, const char* label_path)
+{
+    mnist_dataset_t* ds = calloc(1, sizeof(mnist_dataset_t));
+    ds->image_map = MAP_FAILED;
+    ds->label_map = MAP_FAILED;
+
+    // images: magic, count, height, width, then the pixels.
+    ds->image_map = map_file(data_path, &ds->image_map_len);
+    if (ds->image_map == MAP_FAILED) {
+        goto cleanup;
+    }
+    const uint32_t* head = ds->image_map;
+    if ((ds->image_map_len < (4 * sizeof(uint32_t))) || (__bswap_32(head[0]) != 0x00000803)) {
+        printf("file %s is not a valid MNIST data file\n", data_path);
+        goto cleanup;
+    }
+    ds->count  = __bswap_32(head[1]);
+    ds->width  = __bswap_32(head[2]);
+    ds->height = __bswap_32(head[3]);
+    ds->images = (const uint8_t*)ds->image_map + (4 * sizeof(uint32_t));
+    if (((uint64_t)ds->count * ds->width * ds->height) >
+        (ds->image_map_len - (4 * sizeof(uint32_t)))) {
+        printf("file %s is shorter than its header says\n", data_path);
+        goto cleanup;
+    }
+
+    // labels: magic, count, then one byte per label.
+    if (label_path != NULL) {
+        ds->label_map = map_file(label_path, &ds->label_map_len);
+        if (ds->label_map == MAP_FAILED) {
+            goto cleanup;
+        }
+        head = ds->label_map;
+        if ((ds->label_map_len < (2 * sizeof(uint32_t))) || (__bswap_32(head[0]) != 0x00000801)) {
+            printf("file %s is not a valid MNIST label file\n", label_path);
+            goto cleanup;
+        }
+        if ((__bswap_32(head[1]) != ds->count) ||
+            (ds->count > (ds->label_map_len - (2 * sizeof(uint32_t))))) {
+            printf("file %s doesn't have a label for each of the %u images in %s\n", label_path,
+                   ds->count, data_path);
+            goto cleanup;
+        }
+        ds->labels = (const uint8_t*)ds->label_map + (2 * sizeof(uint32_t));
+    }
+
+    return ds;
+
+cleanup:
+    mnist_dataset_close(ds);
+    return NULL;
+}
+
+
+void mnist_dataset_close(mnist_dataset_t* ds)
+{
+    if (ds == NULL) {
+        return;
+    }
+
+    if (ds->image_map != MAP_FAILED) {
+        munmap(ds->image_map, ds->image_map_len);
+    }
+    if (ds->label_map != MAP_FAILED) {
+        munmap(ds->label_map, ds->label_map_len);
+    }
+    free(ds);
+}
+
+
+void mnist_dataset_advise(mnist_dataset_t* ds, mnist_access_t access)
+{
+    madvise(ds->image_map, ds->image_map_len,
+            (access == MNIST_ACCESS_RANDOM) ? MADV_RANDOM : MADV_NORMAL);
+}
+
+
+int mnist_dataset_check_labels(const mnist_dataset_t* ds, uint32_t num_classes)
+{
+    for (uint32_t i = 0; (ds->labels != NULL) && (i < ds->count); i++) {
+        if (ds->labels[i] >= num_classes) {
+            printf("image %u has label %u, expected 0 - %u\n", i, ds->labels[i], num_classes - 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static void* map_file(const char* filepath, size_t* len)
+{
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open file %s\n", filepath);
+        return MAP_FAILED;
+    }
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        *len = (size_t)st.st_size;
+        map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        printf("failed to map file %s\n", filepath);
+    }
+
+    close(fd);
+    return map;
+}
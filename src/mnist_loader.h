@@ -6,6 +6,7 @@
  * http://yann.lecun.com/exdb/mnist/
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -25,5 +26,75 @@ int load_label_file_doubles(const char* filepath, double*** target);
 
 int load_data_file_doubles(const char* filepath, double*** target);
 
+/**
+ * Same as the _doubles loaders, but for float32 nets.
+ */
+int load_label_file_floats(const char* filepath, float*** target);
+int load_data_file_floats(const char* filepath, float*** target);
+
+/**
+ * An IDX image file (and optionally its label file) mapped straight into memory.
+ *
+ * Nothing is copied or expanded: images points at the pixels inside the mapping, one row of
+ * width * height bytes per image, and labels at the label bytes. Pages are read in by the kernel
+ * as they're touched and shared with every other process mapping the same files.
+ */
+typedef struct mnist_dataset
+{
+    uint32_t count;
+    uint32_t width;
+    uint32_t height;
+
+    /**
+     * count x (width * height) row-major pixels, 0 - 255.
+     */
+    const uint8_t* images;
+
+    /**
+     * count class indices (0 - 9), or NULL if no label file was given.
+     */
+    const uint8_t* labels;
+
+    void* image_map;
+    size_t image_map_len;
+    void* label_map;
+    size_t label_map_len;
+} mnist_dataset_t;
+
+/**
+ * How a dataset's images are going to be read, so the kernel can tune its readahead.
+ */
+typedef enum mnist_access
+{
+    /**
+     * The kernel's default readahead, e.g. for passes over the images in order.
+     */
+    MNIST_ACCESS_NORMAL,
+
+    /**
+     * Images visited in shuffled order, as training does, where readahead would mostly be wasted.
+     */
+    MNIST_ACCESS_RANDOM,
+} mnist_access_t;
+
+/**
+ * Maps the given IDX files, for MNIST_ACCESS_NORMAL reads. label_path may be NULL. Returns NULL
+ * if either file can't be mapped, isn't a valid IDX file, or if they disagree on the number of
+ * examples.
+ */
+mnist_dataset_t* mnist_dataset_open(const char* data_path, const char* label_path);
+void mnist_dataset_close(mnist_dataset_t* ds);
+
+/**
+ * Tells the kernel how ds's images are going to be read from now on.
+ */
+void mnist_dataset_advise(mnist_dataset_t* ds, mnist_access_t access);
+
+/**
+ * Returns nonzero after saying which image is wrong if any of ds's labels isn't below
+ * num_classes, e.g. the size of the net's output layer.
+ */
+int mnist_dataset_check_labels(const mnist_dataset_t* ds, uint32_t num_classes);
+
 
 #endif
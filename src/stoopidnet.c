@@ -1,4 +1,11 @@
+// for posix_memalign, mmap and madvise
+#define _DEFAULT_SOURCE
+
 #include "stoopidnet.h"
+#include "stoopidnet_checkpoint.h"
+#include "stoopidnet_kernels.h"
+#include "stoopidnet_profile.h"
+#include "thread_pool.h"
 
 #include <assert.h>
 #include <math.h>
@@ -6,6 +13,167 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Number of examples stoopidnet_evaluate_batch pushes through the net together.
+ */
+#define EVALUATE_BATCH_CHUNK 64
+
+/**
+ * Number of minibatches the training prefetcher stages at once: the one training and the next.
+ */
+#define PREFETCH_DEPTH 2
+
+/**
+ * Parameters converted between 16-bit storage and double go through a float buffer this many
+ * elements long.
+ */
+#define CONVERT_CHUNK 1024
+
+/**
+ * Training instrumentation; see stoopidnet_profile.h. With it on, each hook costs a test of the
+ * training parameters' profile pointer when there's no profile. Off, the hooks compile to nothing.
+ */
+#ifndef STOOPIDNET_PROFILING
+#define STOOPIDNET_PROFILING 1
+#endif
+
+#if STOOPIDNET_PROFILING
+#define PROFILE_START(prof) (((prof) != NULL) ? stoopidnet_profile_now() : 0)
+#define PROFILE_RECORD(prof, phase, layer, thread, start, flops, bytes)                            \
+    do {                                                                                           \
+        if ((prof) != NULL) {                                                                      \
+            stoopidnet_profile_record((prof), (phase), (layer), (thread), (start), (flops),        \
+                                      (bytes));                                                    \
+        }                                                                                          \
+    } while (0)
+#define PROFILE_SAMPLES(prof, samples, batches)                                                    \
+    do {                                                                                           \
+        if ((prof) != NULL) {                                                                      \
+            stoopidnet_profile_count_samples((prof), (samples), (batches));                        \
+        }                                                                                          \
+    } while (0)
+#define PROFILE_ALLOC(prof, allocations, bytes)                                                    \
+    do {                                                                                           \
+        if ((prof) != NULL) {                                                                      \
+            stoopidnet_profile_count_alloc((prof), (allocations), (bytes));                        \
+        }                                                                                          \
+    } while (0)
+#else
+#define PROFILE_START(prof) ((void)(prof), 0)
+#define PROFILE_RECORD(prof, phase, layer, thread, start, flops, bytes)                           \
+    ((void)(start), (void)(flops), (void)(bytes))
+#define PROFILE_SAMPLES(prof, samples, batches) ((void)0)
+#define PROFILE_ALLOC(prof, allocations, bytes) ((void)0)
+#endif
+
+/**
+ * Estimated work of one pass of an n-example batch through a fully connected layer with an
+ * out x in weight matrix: a multiply-add per weight per example, reading the weights once and the
+ * batch's input and output rows once.
+ */
+#define FC_FLOPS(in, out, n) (2ull * (in) * (out) * (n))
+#define FC_BYTES(in, out, n, esize)                                                                \
+    ((((uint64_t)(in) * (out)) + ((uint64_t)(n) * ((in) + (out)))) * (esize))
+
+/**
+ * Every tensor in a parameter slab starts on a boundary of this many bytes.
+ */
+#define PARAM_ALIGN 64
+
+/**
+ * Parameter slabs at least this big are aligned to (and advised as) transparent huge pages.
+ */
+#define PARAM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Serialized float32 nets start with this word ("SN32") in place of the layer count, followed by
+ * the same layout as a double net with floats in place of doubles.
+ */
+#define SERIALIZE_F32_MAGIC 0x32334e53u
+
+/**
+ * v2 model files start with this word ("SNv2"). SERIALIZE_V2_ENDIAN is written in the writer's
+ * byte order, so a reader can tell a file from a machine of the other endianness.
+ */
+#define SERIALIZE_V2_MAGIC   0x32764e53u
+#define SERIALIZE_V2_VERSION 2
+
+/**
+ * v2 files with 16-bit parameters carry this version instead, so that builds that can't widen
+ * them turn them down rather than misreading the layout.
+ */
+#define SERIALIZE_V2_VERSION_HALF 3
+#define SERIALIZE_V2_ENDIAN  0x01020304u
+
+/**
+ * Start of the checksum every v2 file carries (64-bit FNV-1a offset basis).
+ */
+#define SERIALIZE_V2_CHECKSUM_SEED 0xcbf29ce484222325ull
+
+/**
+ * v2 model file layout:
+ *
+ * stoopidnet_file_header_t                       64 bytes
+ * uint32_t[num_layers] nodes_per_layer
+ * stoopidnet_file_layer_t[num_layers - 1]        one per set of weights and biases
+ * zero padding up to params_offset               a multiple of PARAM_ALIGN
+ * params                                         exactly the in-memory parameter slab
+ * optimizer state                                params_bytes per state slab, if any
+ *
+ * Since the parameters are stored exactly as the slab lays them out, every tensor starts on a
+ * PARAM_ALIGN boundary and a loader can use a mapping of the file as the net's slab without
+ * copying anything. The checksum covers everything after the header.
+ *
+ * Files with 16-bit parameters (version 3) have the slab with each element narrowed to 16 bits:
+ * the same element offsets, with the layer table's byte offsets at 2 bytes an element. They never
+ * have optimizer state.
+ */
+typedef struct stoopidnet_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t endian;
+    uint32_t precision;
+    uint32_t num_layers;
+
+    /**
+     * stoopidnet_optimizer_t whose state follows the parameters (none for SGD), and how many
+     * steps it's taken.
+     */
+    uint32_t optimizer;
+    uint64_t params_offset;
+    uint64_t params_bytes;
+    uint64_t checksum;
+    uint64_t optimizer_step;
+
+    /**
+     * stoopidnet_storage_t of the parameters.
+     */
+    uint32_t storage;
+    uint8_t pad[4];
+} stoopidnet_file_header_t;
+
+typedef struct stoopidnet_file_layer
+{
+    /**
+     * Byte offsets of the layer's weights and biases from the start of the parameters.
+     */
+    uint64_t weight_offset;
+    uint64_t bias_offset;
+
+    /**
+     * flags[0] is the layer's stoopidnet_activation_t. flags[1] is reserved, and must be zero.
+     */
+    uint32_t flags[2];
+} stoopidnet_file_layer_t;
+
+typedef char stoopidnet_file_header_size_check[(sizeof(stoopidnet_file_header_t) == 64) ? 1 : -1];
 
 struct stoopidnet
 {
@@ -13,535 +181,1745 @@ struct stoopidnet
     uint32_t* layer_sizes;
 
     /**
-     * weights[i] has size layer_sizes[i] * layer_sizes[i + 1] and represents weights between layers
-     * i and i + 1.
+     * Scalar type of every parameter, and of the activations computed while evaluating or
+     * training the net.
+     */
+    stoopidnet_precision_t precision;
+
+    /**
+     * All weights and biases live in this single PARAM_ALIGN-aligned slab of params_len elements
+     * of the net's precision. Layer i's weights are followed by its biases, and each tensor starts
+     * on a PARAM_ALIGN boundary. Padding between tensors is kept at zero.
+     */
+    void* params;
+    size_t params_len;
+
+    /**
+     * weight_offsets[i] is where the weights between layers i and i + 1 start in params, in
+     * elements. They're layer_sizes[i] * layer_sizes[i + 1] long, with weights
+     * w_0,0, w_0,1, w_0,2... w_0,{layer_sizes[i]} adjencent to each other.
      *
-     * weights[i] has weights w_0,0, w_0,1, w_0,2... w_0,{layer_sizes[i]} adjencent to each other.
+     * bias_offsets[i] is where the biases for layer i + 1 start.
+     */
+    size_t* weight_offsets;
+    size_t* bias_offsets;
+
+    /**
+     * activations[i] is the activation function of layer i + 1.
+     */
+    stoopidnet_activation_t* activations;
+
+    /**
+     * Optimizer state, or NULL if there isn't any: optimizer_state_slabs(optimizer) slabs laid
+     * out like params, back to back (velocities for momentum, first then second moments for
+     * Adam). optimizer_step counts the updates made with it. The state is always the net's own
+     * memory, even when params is mapped.
+     */
+    stoopidnet_optimizer_t optimizer;
+    void* opt_state;
+    uint64_t opt_step;
+
+    /**
+     * Set on snapshots that copy the optimizer state along with the parameters.
+     */
+    int snapshot_state;
+
+    /**
+     * If non-NULL, params points into this read-only mapping of a v2 model file instead of at a
+     * slab of the net's own. Anything that modifies the parameters has to call
+     * stoopidnet_own_params first.
+     */
+    void* map;
+    size_t map_len;
+};
+
+/**
+ * Scratch space for pushing a whole minibatch through the net at once.
+ *
+ * Every matrix is row-major with one row per example, so a[l] and delta[l] are
+ * capacity x layer_sizes[l]. Keeping the examples of a batch adjacent lets each layer run as one
+ * matrix-matrix product, which reads every weight once per batch rather than once per example.
+ * Elements are of the net's precision.
+ */
+typedef struct stoopidnet_batch_buffers
+{
+    uint32_t capacity;
+
+    /**
+     * a[0] contains the packed input activations.
+     */
+    void** a;
+
+    /**
+     * delta[0] is unused, delta[1] contains the errors for layer 1 (first hidden layer). z isn't
+     * kept since every activation's derivative can be had from a.
+     */
+    void** delta;
+
+    /**
+     * expected outputs for the batch, capacity x layer_sizes[num_layers - 1]
+     */
+    void* y;
+} stoopidnet_batch_buffers_t;
+
+struct stoopidnet_workspace
+{
+    uint32_t num_layers;
+    uint32_t widest;
+    uint32_t capacity;
+    stoopidnet_precision_t precision;
+
+    /**
+     * Two ping-pong activation matrices, each capacity x widest. A layer reads from one and writes
+     * into the other, so evaluation never needs more than these two no matter how deep the net.
+     */
+    void* act[2];
+};
+
+/**
+ * Where a set of example rows (inputs or expected outputs) comes from. Rows get gathered out of
+ * one of these into batches of the net's precision right before they're used, so callers never
+ * have to expand their data into the net's format up front.
+ */
+typedef enum stoopidnet_data_kind
+{
+    /**
+     * rows[i] points at example i, in elements of precision.
+     */
+    DATA_ROWS,
+
+    /**
+     * Example i is row i of the row-major matrix packed, in elements of precision.
+     */
+    DATA_PACKED,
+
+    /**
+     * Example i is row i of the row-major uint8 matrix packed, scaled to [0, 1].
+     */
+    DATA_U8,
+
+    /**
+     * Example i is the one-hot encoding of the class index packed[i] (a uint8).
+     */
+    DATA_U8_LABELS,
+} stoopidnet_data_kind_t;
+
+typedef struct stoopidnet_data
+{
+    stoopidnet_data_kind_t kind;
+    const void* const* rows;
+    const void* packed;
+    stoopidnet_precision_t precision;
+} stoopidnet_data_t;
+
+/**
+ * Producer thread that packs shuffled minibatches into contiguous staging matrices ahead of
+ * training. Batch b goes in slot b % PREFETCH_DEPTH, and the producer only reuses a slot once
+ * the trainer has released the batch that was in it.
+ */
+typedef struct stoopidnet_prefetch
+{
+    stoopidnet_t* net;
+    const stoopidnet_data_t* inputs;
+    const stoopidnet_data_t* outputs;
+    const int* order;
+    uint32_t n_inputs;
+    uint32_t batch_size;
+    stoopidnet_profile_t* prof;
+
+    /**
+     * Staging matrices, batch_size x (input or output layer size) in the net's precision.
+     */
+    void* a[PREFETCH_DEPTH];
+    void* y[PREFETCH_DEPTH];
+
+    /**
+     * Batches staged, handed to the trainer, and released by it so far.
      */
-    double** weights;
+    uint32_t produced;
+    uint32_t consumed;
+    uint32_t released;
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} stoopidnet_prefetch_t;
+
+////////////////////////////////////////////////////////////////
+// static helper function decls
+////////////////////////////////////////////////////////////////
+
+static double box_mueller_norm()
+{
+    double u[2] = { ((double)rand()) / ((double)RAND_MAX), ((double)rand()) / ((double)RAND_MAX) };
+    return sqrt(-2 * log(u[0])) * cos(2 * 3.141592653 * u[1]);
+}
+
+/**
+ * Size in bytes of one element of the given precision.
+ */
+static size_t precision_size(stoopidnet_precision_t precision);
+
+/**
+ * splitmix64: advances *state and returns the next 64 random bits.
+ */
+static uint64_t rng_next(uint64_t* state);
+
+/**
+ * Returns an allocated list of numbers [0, n) that have been shuffled with the generator *rng.
+ */
+static int* gen_shuffled_ints(int n, uint64_t* rng);
+
+/**
+ * Copies n elements from src to dst, converting between precisions if they differ.
+ */
+static void convert_elems(void* dst, stoopidnet_precision_t dst_precision,
+                          const void* src, stoopidnet_precision_t src_precision, size_t n);
+
+/**
+ * Gathers n examples of the given width from src into the contiguous row-major matrix dst,
+ * converting them to dst_precision. Row s is example order[s], or example first + s if order is
+ * NULL.
+ */
+static void pack_data(void* dst, stoopidnet_precision_t dst_precision, const stoopidnet_data_t* src,
+                      uint32_t first, const int* order, uint32_t n, uint32_t width);
+
+/**
+ * Works out where each layer's weights and biases sit in a parameter slab of elem_size-byte
+ * elements for a net with the given layer sizes. Offsets are in elements; either offset array
+ * may be NULL.
+ *
+ * Returns the length of the slab in elements.
+ */
+static size_t param_slab_layout(uint32_t num_layers, const uint32_t* layer_sizes,
+                                size_t elem_size, size_t* weight_offsets, size_t* bias_offsets);
+
+/**
+ * Allocates a zeroed parameter slab of the given size in bytes, aligned to PARAM_ALIGN. Big slabs
+ * are put on huge page boundaries and advised as such to cut TLB misses on wide layers. Free with
+ * free().
+ */
+static void* param_slab_alloc(size_t bytes);
+
+/**
+ * Allocates a net with the given layer sizes and a zeroed parameter slab.
+ */
+static stoopidnet_t* stoopidnet_alloc(uint32_t num_layers, const uint32_t* layer_sizes,
+                                      stoopidnet_precision_t precision);
+
+/**
+ * Same as stoopidnet_alloc, but leaves params NULL for the caller to fill in.
+ */
+static stoopidnet_t* stoopidnet_alloc_shell(uint32_t num_layers, const uint32_t* layer_sizes,
+                                            stoopidnet_precision_t precision);
+
+/**
+ * If net's parameters live in a file mapping, copies them into a slab of its own so they can be
+ * modified.
+ */
+static void stoopidnet_own_params(stoopidnet_t* net);
+
+/**
+ * Number of params_len slabs of state the optimizer keeps.
+ */
+static uint32_t optimizer_state_slabs(stoopidnet_optimizer_t optimizer);
+
+/**
+ * Makes sure the net has state for the given optimizer, starting it over at zero if it had state
+ * for a different one (or none).
+ */
+static void stoopidnet_prepare_optimizer(stoopidnet_t* net, stoopidnet_optimizer_t optimizer);
+
+/**
+ * Converts each tensor of src_net's slab src into the matching tensor of dst_net's slab dst. The
+ * nets have the same layers but may differ in precision, and with it slab layout.
+ */
+static void convert_slab(stoopidnet_t* dst_net, void* dst, stoopidnet_t* src_net, const void* src);
+
+/**
+ * Fills in buf (of stoopidnet_v2_params_offset(net) bytes) with a v2 file's header and layer
+ * tables for net. The checksum is left for the caller to fill in.
+ */
+static void serialize_v2_header(stoopidnet_t* net, stoopidnet_storage_t storage, uint8_t* buf);
+static size_t stoopidnet_v2_params_offset(stoopidnet_t* net);
+
+/**
+ * Bytes per parameter of the given net stored as storage.
+ */
+static size_t storage_size(stoopidnet_t* net, stoopidnet_storage_t storage);
+
+/**
+ * Returns the net's parameters narrowed to storage (fp16 or bf16), in a buffer the caller frees.
+ */
+static uint16_t* narrow_params(stoopidnet_t* net, stoopidnet_storage_t storage);
+
+/**
+ * Fills the net's own parameter slab from src, the same slab narrowed to storage.
+ */
+static void widen_params(stoopidnet_t* net, const uint16_t* src, stoopidnet_storage_t storage);
+
+/**
+ * Folds len bytes of data into a running v2 checksum.
+ */
+static uint64_t checksum_v2(uint64_t h, const void* data, size_t len);
+
+/**
+ * Checks that data (len bytes) holds a well formed v2 model file and builds a net from it. With
+ * borrow set, the net's params point straight into data instead of into a copy, unless they're
+ * stored in 16 bits and have to be widened.
+ */
+static stoopidnet_t* deserialize_v2(const uint8_t* data, size_t len, int borrow);
+
+/**
+ * Creates buffers for minibatches of up to capacity examples. Their allocations are counted in
+ * prof if it isn't NULL.
+ */
+static stoopidnet_batch_buffers_t* stoopidnet_batch_buffers_create(stoopidnet_t* net,
+                                                                    uint32_t capacity,
+                                                                    stoopidnet_profile_t* prof);
+static void stoopidnet_batch_buffers_destroy(stoopidnet_t* net, stoopidnet_batch_buffers_t* bufs);
+
+/**
+ * Returns how many rows of a row-major matrix with the given row length in bytes fit in the cache
+ * budget that the blocked matrix kernels aim for.
+ */
+static uint32_t gemm_block_rows(size_t row_bytes);
+
+/**
+ * Evaluates n_inputs inputs into outputs (n_inputs x output layer size, out_precision) in chunks
+ * of the workspace's capacity. Inputs and outputs are converted to and from the net's precision
+ * as needed.
+ */
+static void stoopidnet_evaluate_chunked(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                        uint32_t n_inputs, const stoopidnet_data_t* inputs,
+                                        void* outputs, stoopidnet_precision_t out_precision);
+
+/**
+ * Starts a producer thread staging the n_inputs examples of inputs and outputs, in the given
+ * order, as minibatches of batch_size. Packing is recorded in prof if it isn't NULL.
+ */
+static stoopidnet_prefetch_t* stoopidnet_prefetch_start(stoopidnet_t* net,
+                                                        const stoopidnet_data_t* inputs,
+                                                        const stoopidnet_data_t* outputs,
+                                                        const int* order, uint32_t n_inputs,
+                                                        uint32_t batch_size,
+                                                        stoopidnet_profile_t* prof);
+
+/**
+ * Waits for the next minibatch to be staged and points *a and *y at it. It stays valid until
+ * the matching stoopidnet_prefetch_release.
+ */
+static void stoopidnet_prefetch_next(stoopidnet_prefetch_t* pf, const void** a, const void** y);
+static void stoopidnet_prefetch_release(stoopidnet_prefetch_t* pf);
+
+/**
+ * Stops the producer (if it's still going) and frees everything.
+ */
+static void stoopidnet_prefetch_stop(stoopidnet_prefetch_t* pf);
+
+/**
+ * Calls params->progress, if there is one, with samples_done of samples_total examples trained in
+ * batches_done minibatches since start (a stoopidnet_profile_now timestamp).
+ */
+static void report_progress(const stoopidnet_training_parameters_t* params, uint64_t samples_done,
+                            uint64_t samples_total, uint64_t batches_done, uint64_t start);
+
+/**
+ * Picks the training implementation for the net's precision.
+ */
+static void stoopidnet_train_dispatch(stoopidnet_t* net,
+                                      const stoopidnet_training_parameters_t* params,
+                                      uint32_t n_inputs,
+                                      const stoopidnet_data_t* inputs,
+                                      const stoopidnet_data_t* outputs);
+
+////////////////////////////////////////////////////////////////
+// precision-specific implementations
+////////////////////////////////////////////////////////////////
+#define REAL double
+#define SN_FN(name) name##_f64
+#include "stoopidnet_impl.h"
+#undef REAL
+#undef SN_FN
+
+#define REAL float
+#define SN_FN(name) name##_f32
+#include "stoopidnet_impl.h"
+#undef REAL
+#undef SN_FN
+
+
+stoopidnet_t* stoopidnet_create(uint32_t num_input_nodes)
+{
+    return stoopidnet_alloc(1, &num_input_nodes, STOOPIDNET_PRECISION_F64);
+}
+
+
+stoopidnet_t* stoopidnet_create_with_precision(uint32_t num_input_nodes,
+                                               stoopidnet_precision_t precision)
+{
+    return stoopidnet_alloc(1, &num_input_nodes, precision);
+}
+
+
+void stoopidnet_destroy(stoopidnet_t* net)
+{
+    if (net->map != NULL) {
+        munmap(net->map, net->map_len);
+    } else {
+        free(net->params);
+    }
+    free(net->opt_state);
+    free(net->weight_offsets);
+    free(net->bias_offsets);
+    free(net->activations);
+    free(net->layer_sizes);
+    free(net);
+}
+
+
+stoopidnet_t* stoopidnet_convert_precision(stoopidnet_t* net, stoopidnet_precision_t precision)
+{
+    stoopidnet_t* conv = stoopidnet_alloc(net->num_layers, net->layer_sizes, precision);
+    const size_t src_size = precision_size(net->precision);
+    const size_t dst_size = precision_size(precision);
+    memcpy(conv->activations, net->activations,
+           (net->num_layers - 1) * sizeof(stoopidnet_activation_t));
+
+    convert_slab(conv, conv->params, net, net->params);
+    if (net->opt_state != NULL) {
+        stoopidnet_prepare_optimizer(conv, net->optimizer);
+        conv->opt_step = net->opt_step;
+        for (uint32_t i = 0; i < optimizer_state_slabs(net->optimizer); i++) {
+            convert_slab(conv, (uint8_t*)conv->opt_state + (i * conv->params_len * dst_size),
+                         net, (uint8_t*)net->opt_state + (i * net->params_len * src_size));
+        }
+    }
+
+    return conv;
+}
+
+
+stoopidnet_t* stoopidnet_snapshot(stoopidnet_t* net)
+{
+    stoopidnet_t* snapshot = stoopidnet_alloc(net->num_layers, net->layer_sizes, net->precision);
+    stoopidnet_snapshot_update(snapshot, net);
+    return snapshot;
+}
+
+
+stoopidnet_t* stoopidnet_snapshot_with_state(stoopidnet_t* net)
+{
+    stoopidnet_t* snapshot = stoopidnet_alloc(net->num_layers, net->layer_sizes, net->precision);
+    snapshot->snapshot_state = 1;
+    stoopidnet_snapshot_update(snapshot, net);
+    return snapshot;
+}
+
+
+int stoopidnet_snapshot_update(stoopidnet_t* snapshot, stoopidnet_t* net)
+{
+    if ((snapshot->num_layers != net->num_layers) || (snapshot->precision != net->precision) ||
+        memcmp(snapshot->layer_sizes, net->layer_sizes, net->num_layers * sizeof(uint32_t))) {
+        fprintf(stderr, "Snapshot doesn't have the same layers as the net\n");
+        return 0;
+    }
+
+    // same layers and precision means the same slab layout, padding included.
+    memcpy(snapshot->activations, net->activations,
+           (net->num_layers - 1) * sizeof(stoopidnet_activation_t));
+    memcpy(snapshot->params, net->params, net->params_len * precision_size(net->precision));
+
+    // the state only gets allocated again if the net changed optimizers.
+    if (snapshot->snapshot_state) {
+        if (net->opt_state != NULL) {
+            stoopidnet_prepare_optimizer(snapshot, net->optimizer);
+            memcpy(snapshot->opt_state, net->opt_state, optimizer_state_slabs(net->optimizer) *
+                                                        net->params_len *
+                                                        precision_size(net->precision));
+        } else {
+            stoopidnet_clear_optimizer_state(snapshot);
+            snapshot->optimizer = net->optimizer;
+        }
+        snapshot->opt_step = net->opt_step;
+    }
+    return 1;
+}
+
+
+stoopidnet_precision_t stoopidnet_get_precision(stoopidnet_t* net)
+{
+    return net->precision;
+}
+
+
+/**
+ * Serializes to the v2 format (see stoopidnet_file_header_t).
+ *
+ * Returns size in bytes.
+ */
+uint32_t stoopidnet_serialize(stoopidnet_t* net, uint8_t** target)
+{
+    return stoopidnet_serialize_with_storage(net, STOOPIDNET_STORAGE_NATIVE, target);
+}
+
+
+uint32_t stoopidnet_serialize_with_storage(stoopidnet_t* net, stoopidnet_storage_t storage,
+                                           uint8_t** _target)
+{
+    assert(storage < STOOPIDNET_NUM_STORAGES);
+    const int native = (storage == STOOPIDNET_STORAGE_NATIVE);
+    const size_t offset = stoopidnet_v2_params_offset(net);
+    const size_t params_bytes = net->params_len * storage_size(net, storage);
+    const size_t state_bytes = (native && (net->opt_state != NULL)) ?
+                               (optimizer_state_slabs(net->optimizer) * params_bytes) : 0;
+    const size_t len = offset + params_bytes + state_bytes;
+    if (len > UINT32_MAX) {
+        *_target = NULL;
+        return 0;
+    }
+
+    uint8_t* target = malloc(len);
+    serialize_v2_header(net, storage, target);
+    if (native) {
+        memcpy(target + offset, net->params, params_bytes);
+    } else {
+        uint16_t* narrowed = narrow_params(net, storage);
+        memcpy(target + offset, narrowed, params_bytes);
+        free(narrowed);
+    }
+    if (state_bytes > 0) {
+        memcpy(target + offset + params_bytes, net->opt_state, state_bytes);
+    }
+
+    stoopidnet_file_header_t* header = (stoopidnet_file_header_t*)target;
+    header->checksum = checksum_v2(SERIALIZE_V2_CHECKSUM_SEED, target + sizeof(*header),
+                                   len - sizeof(*header));
+
+    *_target = target;
+    return len;
+}
+
+
+/**
+ * Also reads the two older formats:
+ *
+ * uint32_t num layers
+ * uint32_t[num_layers] nodes_per_layer
+ * double[num_layers - 1][] biases
+ * double[num_layers - 1][nodes_per_layer[l]][nodes_per_layer[l - 1]] weights
+ *
+ * and the same prefixed with SERIALIZE_F32_MAGIC, with floats instead of doubles.
+ */
+stoopidnet_t* stoopidnet_deserialize(uint8_t *data, uint32_t datalen)
+{
+    if ((datalen >= sizeof(uint32_t)) && (*((uint32_t*)data) == SERIALIZE_V2_MAGIC)) {
+        return deserialize_v2(data, datalen, 0);
+    }
+
+    uint32_t idx = 0;
+    stoopidnet_precision_t precision = STOOPIDNET_PRECISION_F64;
+    if ((idx + sizeof(uint32_t)) > datalen) {
+        goto failed;
+    }
+
+    if (*((uint32_t*)(data + idx)) == SERIALIZE_F32_MAGIC) {
+        precision = STOOPIDNET_PRECISION_F32;
+        idx += sizeof(uint32_t);
+        if ((idx + sizeof(uint32_t)) > datalen) {
+            goto failed;
+        }
+    }
+    const size_t esize = precision_size(precision);
+
+    uint32_t num_layers = *((uint32_t*)(data + idx));
+    idx += sizeof(uint32_t);
+    if ((num_layers == 0) || (((uint64_t)num_layers * sizeof(uint32_t)) > (datalen - idx))) {
+        goto failed;
+    }
+
+    // unpack all layer sizes and make sure the rest of the buffer is exactly the parameters.
+    uint32_t* layer_sizes = (uint32_t*)(data + idx);
+    idx += num_layers * sizeof(uint32_t);
+
+    uint64_t numparams = 0;
+    for (int layer = 0; layer < (num_layers - 1); layer++) {
+        numparams += (uint64_t)layer_sizes[layer + 1] * (layer_sizes[layer] + 1);
+    }
+    if ((numparams * esize) != (datalen - idx)) {
+        goto failed;
+    }
+
+    stoopidnet_t* net = stoopidnet_alloc(num_layers, layer_sizes, precision);
+
+    // get all biases.
+    for (int layer = 0; layer < (net->num_layers - 1); layer++) {
+        uint32_t len = net->layer_sizes[layer + 1] * esize;
+        memcpy((uint8_t*)net->params + (net->bias_offsets[layer] * esize), data + idx, len);
+        idx += len;
+    }
+
+    // get all weights.
+    for (int layer = 0; layer < (net->num_layers - 1); layer++) {
+        uint32_t len = net->layer_sizes[layer] * net->layer_sizes[layer + 1] * esize;
+        memcpy((uint8_t*)net->params + (net->weight_offsets[layer] * esize), data + idx, len);
+        idx += len;
+    }
+
+    return net;
+
+failed:
+    fprintf(stderr, "Given buffer is wrong length for deseralization.\n");
+
+    return NULL;
+}
+
+
+stoopidnet_t* stoopidnet_load_from_file(const char* file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s\n", file);
+        return NULL;
+    }
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s\n", file);
+        return NULL;
+    }
+
+    // v2 files are used in place: the net's parameters are the page cache's copy of the file,
+    // shared with every other process that loads the same model. Older formats get copied out.
+    const size_t len = (size_t)st.st_size;
+    stoopidnet_t* net = NULL;
+    if ((len >= sizeof(uint32_t)) && (*((uint32_t*)map) == SERIALIZE_V2_MAGIC)) {
+        // 16-bit parameters are widened into a slab of the net's own, so those files aren't kept.
+        net = deserialize_v2(map, len, 1);
+        if ((net != NULL) && (net->params == ((uint8_t*)map + stoopidnet_v2_params_offset(net)))) {
+            net->map = map;
+            net->map_len = len;
+            return net;
+        }
+    } else if (len <= UINT32_MAX) {
+        net = stoopidnet_deserialize(map, (uint32_t)len);
+    }
+
+    munmap(map, len);
+    return net;
+}
+
+
+int stoopidnet_store_to_file(stoopidnet_t* net, const char* file)
+{
+    return stoopidnet_store_to_file_with_storage(net, file, STOOPIDNET_STORAGE_NATIVE);
+}
+
+
+int stoopidnet_store_to_file_with_storage(stoopidnet_t* net, const char* file,
+                                          stoopidnet_storage_t storage)
+{
+    int retval = 0;
+    assert(storage < STOOPIDNET_NUM_STORAGES);
+
+    // header and parameters go out separately so the slab doesn't need copying.
+    const int native = (storage == STOOPIDNET_STORAGE_NATIVE);
+    const size_t offset = stoopidnet_v2_params_offset(net);
+    const size_t params_bytes = net->params_len * storage_size(net, storage);
+    const size_t state_bytes = (native && (net->opt_state != NULL)) ?
+                               (optimizer_state_slabs(net->optimizer) * params_bytes) : 0;
+    uint16_t* narrowed = native ? NULL : narrow_params(net, storage);
+    const void* params = native ? net->params : (const void*)narrowed;
+    uint8_t* header = malloc(offset);
+    serialize_v2_header(net, storage, header);
+    uint64_t checksum = checksum_v2(SERIALIZE_V2_CHECKSUM_SEED,
+                                    header + sizeof(stoopidnet_file_header_t),
+                                    offset - sizeof(stoopidnet_file_header_t));
+    checksum = checksum_v2(checksum, params, params_bytes);
+    ((stoopidnet_file_header_t*)header)->checksum = checksum_v2(checksum, net->opt_state,
+                                                                state_bytes);
+
+    // write to a temporary file and rename it over the old one, rather than truncating a file that
+    // other processes (or this net) may have mapped.
+    char* tmpfile = malloc(strlen(file) + sizeof(".tmp"));
+    sprintf(tmpfile, "%s.tmp", file);
+    FILE* fp = fopen(tmpfile, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s for writing\n", tmpfile);
+        retval = -1;
+        goto cleanup;
+    }
+
+    size_t writelen = fwrite(header, 1, offset, fp) + fwrite(params, 1, params_bytes, fp);
+    if (state_bytes > 0) {
+        writelen += fwrite(net->opt_state, 1, state_bytes, fp);
+    }
+    if ((fclose(fp) != 0) || (writelen != (offset + params_bytes + state_bytes)) ||
+        (rename(tmpfile, file) != 0)) {
+        fprintf(stderr, "Error writing network to file\n");
+        remove(tmpfile);
+        retval = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    free(tmpfile);
+    free(header);
+    free(narrowed);
+    return retval;
+}
+
+void stoopidnet_add_fc_layer(stoopidnet_t* net, uint32_t num_nodes)
+{
+    stoopidnet_add_fc_layer_with_activation(net, num_nodes, STOOPIDNET_ACTIVATION_SIGMOID);
+}
+
+
+void stoopidnet_add_fc_layer_with_activation(stoopidnet_t* net, uint32_t num_nodes,
+                                             stoopidnet_activation_t activation)
+{
+    assert(activation < STOOPIDNET_NUM_ACTIVATIONS);
+    const size_t esize = precision_size(net->precision);
+    stoopidnet_own_params(net);
+    stoopidnet_clear_optimizer_state(net);
+    net->num_layers++;
+
+    // ======= allocate. =======
+    net->layer_sizes    = realloc(net->layer_sizes, net->num_layers * sizeof(uint32_t));
+    net->weight_offsets = realloc(net->weight_offsets, (net->num_layers - 1) * sizeof(size_t));
+    net->bias_offsets   = realloc(net->bias_offsets, (net->num_layers - 1) * sizeof(size_t));
+    net->activations    = realloc(net->activations,
+                                  (net->num_layers - 1) * sizeof(stoopidnet_activation_t));
+    net->layer_sizes[net->num_layers - 1] = num_nodes;
+    net->activations[net->num_layers - 2] = activation;
+
+    // the new layer is appended to the end of the slab, so existing tensors keep their offsets
+    // and can be carried over in one copy.
+    size_t len = param_slab_layout(net->num_layers, net->layer_sizes, esize,
+                                   net->weight_offsets, net->bias_offsets);
+    void* params = param_slab_alloc(len * esize);
+    if (net->params != NULL) {
+        memcpy(params, net->params, net->params_len * esize);
+    }
+    free(net->params);
+    net->params     = params;
+    net->params_len = len;
+
+    // ======= fill. =======
+    // Set up the biases and weights to be normally distributed. Sigmoids saturate, so they're
+    // fine with unit variance, but ReLU, tanh and softmax layers need their parameters scaled
+    // down to keep z from growing with the fan-in.
+    const int l = net->num_layers - 2;
+    int nbiases  = net->layer_sizes[l + 1];
+    int nweights = net->layer_sizes[l + 1] * net->layer_sizes[l];
+    double wscale = 1.0;
+    if ((activation == STOOPIDNET_ACTIVATION_RELU) ||
+        (activation == STOOPIDNET_ACTIVATION_LEAKY_RELU)) {
+        wscale = sqrt(2.0 / net->layer_sizes[l]);
+    } else if ((activation == STOOPIDNET_ACTIVATION_TANH) ||
+               (activation == STOOPIDNET_ACTIVATION_SOFTMAX)) {
+        wscale = sqrt(1.0 / net->layer_sizes[l]);
+    }
+
+    for (int i = 0; i < nbiases; i++) {
+        double val = box_mueller_norm() * wscale;
+        convert_elems((uint8_t*)net->params + ((net->bias_offsets[l] + i) * esize), net->precision,
+                      &val, STOOPIDNET_PRECISION_F64, 1);
+    }
+
+    for (int i = 0; i < nweights; i++) {
+        double val = box_mueller_norm() * wscale;
+        convert_elems((uint8_t*)net->params + ((net->weight_offsets[l] + i) * esize),
+                      net->precision, &val, STOOPIDNET_PRECISION_F64, 1);
+    }
+}
+
+
+void stoopidnet_add_fc_layer_with_starting_weights(stoopidnet_t* net,
+                                                   uint32_t num_nodes,
+                                                   double* weights)
+{
+    printf("XXX TODO");
+    stoopidnet_add_fc_layer(net, num_nodes);
+
+}
+
+
+uint32_t stoopidnet_get_num_nodes_in_layer(stoopidnet_t* net, uint32_t layer_idx)
+{
+    assert(layer_idx < net->num_layers);
+    return net->layer_sizes[layer_idx];
+}
+
+
+uint32_t stoopidnet_get_num_layers(stoopidnet_t* net)
+{
+    return net->num_layers;
+}
+
+
+stoopidnet_activation_t stoopidnet_get_layer_activation(stoopidnet_t* net, uint32_t layer_idx)
+{
+    assert((layer_idx > 0) && (layer_idx < net->num_layers));
+    return net->activations[layer_idx - 1];
+}
+
+
+const char* stoopidnet_optimizer_name(stoopidnet_optimizer_t optimizer)
+{
+    switch (optimizer) {
+    case STOOPIDNET_OPTIMIZER_SGD:      return "sgd";
+    case STOOPIDNET_OPTIMIZER_MOMENTUM: return "momentum";
+    case STOOPIDNET_OPTIMIZER_NESTEROV: return "nesterov";
+    case STOOPIDNET_OPTIMIZER_ADAM:     return "adam";
+    default:                            return NULL;
+    }
+}
+
+
+const char* stoopidnet_storage_name(stoopidnet_storage_t storage)
+{
+    switch (storage) {
+    case STOOPIDNET_STORAGE_NATIVE: return "native";
+    case STOOPIDNET_STORAGE_F16:    return "fp16";
+    case STOOPIDNET_STORAGE_BF16:   return "bf16";
+    default:                        return NULL;
+    }
+}
+
+
+void stoopidnet_clear_optimizer_state(stoopidnet_t* net)
+{
+    free(net->opt_state);
+    net->opt_state = NULL;
+    net->optimizer = STOOPIDNET_OPTIMIZER_SGD;
+    net->opt_step  = 0;
+}
+
+
+const char* stoopidnet_activation_name(stoopidnet_activation_t activation)
+{
+    switch (activation) {
+    case STOOPIDNET_ACTIVATION_SIGMOID:      return "sigmoid";
+    case STOOPIDNET_ACTIVATION_RELU:         return "relu";
+    case STOOPIDNET_ACTIVATION_LEAKY_RELU:   return "leaky-relu";
+    case STOOPIDNET_ACTIVATION_TANH:         return "tanh";
+    case STOOPIDNET_ACTIVATION_FAST_SIGMOID: return "fast-sigmoid";
+    case STOOPIDNET_ACTIVATION_SOFTMAX:      return "softmax";
+    default:                                 return NULL;
+    }
+}
+
+
+void stoopidnet_set_layer_weights(stoopidnet_t* net, uint32_t layer_idx, double* weights)
+{
+    assert((layer_idx > 0) && (layer_idx < net->num_layers));
+    const size_t esize = precision_size(net->precision);
+    const uint32_t in  = net->layer_sizes[layer_idx - 1];
+    const uint32_t out = net->layer_sizes[layer_idx];
+
+    stoopidnet_own_params(net);
+    convert_elems((uint8_t*)net->params + (net->weight_offsets[layer_idx - 1] * esize),
+                  net->precision, weights, STOOPIDNET_PRECISION_F64, (size_t)in * out);
+}
+
+
+void stoopidnet_get_layer_params(stoopidnet_t* net, uint32_t layer_idx, double* weights,
+                                 double* biases)
+{
+    assert((layer_idx > 0) && (layer_idx < net->num_layers));
+    const size_t esize = precision_size(net->precision);
+    const uint32_t in  = net->layer_sizes[layer_idx - 1];
+    const uint32_t out = net->layer_sizes[layer_idx];
+
+    if (weights != NULL) {
+        convert_elems(weights, STOOPIDNET_PRECISION_F64,
+                      (uint8_t*)net->params + (net->weight_offsets[layer_idx - 1] * esize),
+                      net->precision, (size_t)in * out);
+    }
+    if (biases != NULL) {
+        convert_elems(biases, STOOPIDNET_PRECISION_F64,
+                      (uint8_t*)net->params + (net->bias_offsets[layer_idx - 1] * esize),
+                      net->precision, out);
+    }
+}
+
+
+void stoopidnet_evaluate(stoopidnet_t* net, double* input, double** output)
+{
+    // It's the caller's responsibility to free the result.
+    *output = malloc(net->layer_sizes[net->num_layers - 1] * sizeof(double));
+
+    stoopidnet_workspace_t* ws = stoopidnet_workspace_create(net, 1);
+    const stoopidnet_data_t in = { DATA_PACKED, NULL, input, STOOPIDNET_PRECISION_F64 };
+    stoopidnet_evaluate_chunked(net, ws, 1, &in, *output, STOOPIDNET_PRECISION_F64);
+    stoopidnet_workspace_destroy(ws);
+}
+
+
+void stoopidnet_evaluate_batch(stoopidnet_t* net, uint32_t n_inputs, double** inputs,
+                               double* outputs)
+{
+    stoopidnet_workspace_t* ws = stoopidnet_workspace_create(net, EVALUATE_BATCH_CHUNK);
+    const stoopidnet_data_t in = { DATA_ROWS, (const void* const*)inputs, NULL,
+                                   STOOPIDNET_PRECISION_F64 };
+    stoopidnet_evaluate_chunked(net, ws, n_inputs, &in, outputs, STOOPIDNET_PRECISION_F64);
+    stoopidnet_workspace_destroy(ws);
+}
+
+
+void stoopidnet_evaluate_batch_f32(stoopidnet_t* net, uint32_t n_inputs, float** inputs,
+                                   float* outputs)
+{
+    stoopidnet_workspace_t* ws = stoopidnet_workspace_create(net, EVALUATE_BATCH_CHUNK);
+    const stoopidnet_data_t in = { DATA_ROWS, (const void* const*)inputs, NULL,
+                                   STOOPIDNET_PRECISION_F32 };
+    stoopidnet_evaluate_chunked(net, ws, n_inputs, &in, outputs, STOOPIDNET_PRECISION_F32);
+    stoopidnet_workspace_destroy(ws);
+}
+
+
+stoopidnet_workspace_t* stoopidnet_workspace_create(stoopidnet_t* net, uint32_t batch_capacity)
+{
+    stoopidnet_workspace_t* ws = calloc(1, sizeof(stoopidnet_workspace_t));
+    ws->num_layers = net->num_layers;
+    ws->precision  = net->precision;
+    ws->capacity   = (batch_capacity == 0) ? 1 : batch_capacity;
+    for (int l = 0; l < net->num_layers; l++) {
+        ws->widest = (net->layer_sizes[l] > ws->widest) ? net->layer_sizes[l] : ws->widest;
+    }
+
+    const size_t esize = precision_size(net->precision);
+    ws->act[0] = malloc((size_t)ws->capacity * ws->widest * esize);
+    ws->act[1] = malloc((size_t)ws->capacity * ws->widest * esize);
+
+    return ws;
+}
 
-    /**
-     * biases[i] corresponds to layer i + 1.
-     */
-    double** biases;
-};
 
-typedef struct stoopidnet_forward_prop_results
+void stoopidnet_workspace_destroy(stoopidnet_workspace_t* ws)
 {
-    /**
-     * a[0] contains input activations
-     */
-    double** a;
+    if (ws == NULL) {
+        return;
+    }
 
-    /**
-     * z[0] contains nothing, z[1] contains z for layer 1 (first hidden layer).
-     */
-    double** z;
-} stoopidnet_forward_prop_results_t;
+    free(ws->act[0]);
+    free(ws->act[1]);
+    free(ws);
+}
 
-////////////////////////////////////////////////////////////////
-// static helper function decls
-////////////////////////////////////////////////////////////////
 
-static double box_mueller_norm()
+void stoopidnet_evaluate_with_workspace(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                        const double* input, double* output)
 {
-    double u[2] = { ((double)rand()) / ((double)RAND_MAX), ((double)rand()) / ((double)RAND_MAX) };
-    return sqrt(-2 * log(u[0])) * cos(2 * 3.141592653 * u[1]);
+    const stoopidnet_data_t in = { DATA_PACKED, NULL, input, STOOPIDNET_PRECISION_F64 };
+    stoopidnet_evaluate_chunked(net, ws, 1, &in, output, STOOPIDNET_PRECISION_F64);
 }
 
-/**
- * Calculates the sigmoid function for a given value.
- */
-static double sigmoid(double z);
 
-/**
- * Calculates d sigmoid(z) / dz
- */
-static double sigmoid_prime(double z);
+void stoopidnet_evaluate_with_workspace_f32(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                            const float* input, float* output)
+{
+    const stoopidnet_data_t in = { DATA_PACKED, NULL, input, STOOPIDNET_PRECISION_F32 };
+    stoopidnet_evaluate_chunked(net, ws, 1, &in, output, STOOPIDNET_PRECISION_F32);
+}
 
-/**
- * Returns an allocated list of numbers [0, n) that have been shuffled.
- */
-static int* gen_shuffled_ints(int n);
 
-/**
- *
- */
-static void doubles_memset(double* d, int numel, double val);
+void stoopidnet_evaluate_batch_with_workspace(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                              uint32_t n_inputs, const double* inputs,
+                                              double* outputs)
+{
+    const stoopidnet_data_t in = { DATA_PACKED, NULL, inputs, STOOPIDNET_PRECISION_F64 };
+    stoopidnet_evaluate_chunked(net, ws, n_inputs, &in, outputs, STOOPIDNET_PRECISION_F64);
+}
 
-//static void stoopidnet_forward_prop_results_destroy(stoopidnet_t* net,
-//                                                    stoopidnet_forward_prop_results_t* res);
 
-/**
- * Fundamentally does the same thing as eval, but stores some intermediate results that will be
- * useful for calculating backprop.
- */
-static stoopidnet_forward_prop_results_t* stoopidnet_forward_prop(stoopidnet_t* net,
-                                                                  double *input);
+void stoopidnet_evaluate_batch_with_workspace_f32(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                                  uint32_t n_inputs, const float* inputs,
+                                                  float* outputs)
+{
+    const stoopidnet_data_t in = { DATA_PACKED, NULL, inputs, STOOPIDNET_PRECISION_F32 };
+    stoopidnet_evaluate_chunked(net, ws, n_inputs, &in, outputs, STOOPIDNET_PRECISION_F32);
+}
 
 
-stoopidnet_t* stoopidnet_create(uint32_t num_input_nodes)
+void stoopidnet_train(stoopidnet_t* net,
+                      const stoopidnet_training_parameters_t* params,
+                      uint32_t n_inputs,
+                      double** inputs,
+                      double** outputs)
 {
-    stoopidnet_t *net = calloc(1, sizeof(stoopidnet_t));
-    net->num_layers = 1;
-    // clown shoes allocation so re-alloc will generally be ok.
-    net->layer_sizes = malloc(8 * sizeof(uint32_t));
-    net->weights = malloc(8 * sizeof(double*));
-    net->biases  = malloc(8 * sizeof(double*));
+    const stoopidnet_data_t in  = { DATA_ROWS, (const void* const*)inputs, NULL,
+                                    STOOPIDNET_PRECISION_F64 };
+    const stoopidnet_data_t out = { DATA_ROWS, (const void* const*)outputs, NULL,
+                                    STOOPIDNET_PRECISION_F64 };
+    stoopidnet_train_dispatch(net, params, n_inputs, &in, &out);
+}
 
-    // setup values
-    net->layer_sizes[0] = num_input_nodes;
 
-    return net;
+void stoopidnet_train_labels(stoopidnet_t* net,
+                             const stoopidnet_training_parameters_t* params,
+                             uint32_t n_inputs,
+                             double** inputs,
+                             const uint8_t* labels)
+{
+    const stoopidnet_data_t in  = { DATA_ROWS, (const void* const*)inputs, NULL,
+                                    STOOPIDNET_PRECISION_F64 };
+    const stoopidnet_data_t out = { DATA_U8_LABELS, NULL, labels, net->precision };
+    stoopidnet_train_dispatch(net, params, n_inputs, &in, &out);
 }
 
 
-void stoopidnet_destroy(stoopidnet_t* net)
+void stoopidnet_train_f32(stoopidnet_t* net,
+                          const stoopidnet_training_parameters_t* params,
+                          uint32_t n_inputs,
+                          float** inputs,
+                          float** outputs)
 {
-    for (int i = 0; i < net->num_layers; i++) {
-        free(net->biases[i]);
-    }
+    const stoopidnet_data_t in  = { DATA_ROWS, (const void* const*)inputs, NULL,
+                                    STOOPIDNET_PRECISION_F32 };
+    const stoopidnet_data_t out = { DATA_ROWS, (const void* const*)outputs, NULL,
+                                    STOOPIDNET_PRECISION_F32 };
+    stoopidnet_train_dispatch(net, params, n_inputs, &in, &out);
+}
 
-    for (int i = 0; i < (net->num_layers - 1); i++) {
-        free(net->weights[i]);
-    }
-    free(net->layer_sizes);
-    free(net);
+
+void stoopidnet_evaluate_batch_u8(stoopidnet_t* net, uint32_t n_inputs, const uint8_t* inputs,
+                                  double* outputs)
+{
+    stoopidnet_workspace_t* ws = stoopidnet_workspace_create(net, EVALUATE_BATCH_CHUNK);
+    const stoopidnet_data_t in = { DATA_U8, NULL, inputs, net->precision };
+    stoopidnet_evaluate_chunked(net, ws, n_inputs, &in, outputs, STOOPIDNET_PRECISION_F64);
+    stoopidnet_workspace_destroy(ws);
 }
 
 
-/**
- * serialization format:
- *
- * uint32_t num layers
- * uint32_t[num_layers] nodes_per_layer
- * double[num_layers - 1][] biases
- * double[num_layers - 1][nodes_per_layer[l]][nodes_per_layer[l - 1]] weights
- *
- * Returns size in bytes.
- */
-uint32_t stoopidnet_serialize(stoopidnet_t* net, uint8_t** _target)
+void stoopidnet_train_u8(stoopidnet_t* net,
+                         const stoopidnet_training_parameters_t* params,
+                         uint32_t n_inputs,
+                         const uint8_t* inputs,
+                         const uint8_t* labels)
 {
-    uint32_t capacity = 1024;
-    uint32_t size = 0;
-    uint8_t* target = malloc(capacity);
+    const stoopidnet_data_t in  = { DATA_U8, NULL, inputs, net->precision };
+    const stoopidnet_data_t out = { DATA_U8_LABELS, NULL, labels, net->precision };
+    stoopidnet_train_dispatch(net, params, n_inputs, &in, &out);
+}
 
-    // First encode the number of layers
-    *((uint32_t*)(target + size)) = net->num_layers;
-    size += 4;
 
-    // Encode the nodes per layer array.
-    for (int i = 0; i < net->num_layers; i++) {
-        if ((size + sizeof(uint32_t)) >= capacity) {
-            capacity *= 2;
-            target = realloc(target, capacity);
-        }
+////////////////////////////////////////////////////////////////
+// static function impl
+////////////////////////////////////////////////////////////////
+static size_t precision_size(stoopidnet_precision_t precision)
+{
+    return (precision == STOOPIDNET_PRECISION_F32) ? sizeof(float) : sizeof(double);
+}
 
-        *((uint32_t*)(target + size)) = net->layer_sizes[i];
-        size += sizeof(uint32_t);
-    }
+static uint64_t rng_next(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
 
-    // Encode the biases arrays
-    for (int l = 0; l < (net->num_layers - 1); l++) {
-        for (int j = 0; j < net->layer_sizes[l + 1]; j++) {
-            if ((size + sizeof(double)) >= capacity) {
-                capacity *= 2;
-                target = realloc(target, capacity);
-            }
+static int* gen_shuffled_ints(int n, uint64_t* rng)
+{
+    int* array = malloc(n * sizeof(int));
 
-            *((double*)(target + size)) = (net->biases[l])[j];
-            size += sizeof(double);
-        }
+    for (int i = 0; i < n; i++) {
+        array[i] = i;
     }
 
-    // Encode the weights
-    for (int layer = 0; layer < (net->num_layers - 1); layer++) {
-        int numweights = (net->layer_sizes[layer] * net->layer_sizes[layer + 1]);
-        for (int weight_idx = 0; weight_idx < numweights; weight_idx++) {
-            if ((size + sizeof(double)) >= capacity) {
-                capacity *= 2;
-                target = realloc(target, capacity);
-            }
-
-            *((double*)(target + size)) = (net->weights[layer])[weight_idx];
-            size += sizeof(double);
-        }
+    // Fisher-Yates; the top 32 bits scaled to [0, i] are plenty uniform for any n that fits.
+    for (int i = n - 1; i > 0; i--) {
+        const int j = (int)(((rng_next(rng) >> 32) * (uint64_t)(i + 1)) >> 32);
+        const int t = array[j];
+        array[j] = array[i];
+        array[i] = t;
     }
 
-    *_target = target;
-    return size;
+    return array;
 }
 
-
-stoopidnet_t* stoopidnet_deserialize(uint8_t *data, uint32_t datalen)
+static void convert_elems(void* dst, stoopidnet_precision_t dst_precision,
+                          const void* src, stoopidnet_precision_t src_precision, size_t n)
 {
-    uint32_t idx = 0;
-    stoopidnet_t* net = NULL;
-    if (idx >= datalen) {
-        goto failed_1;
-    }
-
-    uint32_t num_layers = *((uint32_t*)(data + idx));
-    idx += sizeof(uint32_t);
-
-    net = calloc(1, sizeof(stoopidnet_t));
-    net->num_layers  = num_layers;
-    net->layer_sizes = calloc(num_layers, sizeof(uint32_t));
-    net->weights     = calloc(num_layers, sizeof(double*));
-    net->biases      = calloc(num_layers, sizeof(double*));
-
-    // unpack all layer sizes.
-    for (int i = 0; i < net->num_layers; i++) {
-        if (idx >= datalen) {
-            goto failed_2;
+    if (dst_precision == src_precision) {
+        memcpy(dst, src, n * precision_size(src_precision));
+    } else if (dst_precision == STOOPIDNET_PRECISION_F32) {
+        const double* s = src;
+        float* d = dst;
+        for (size_t i = 0; i < n; i++) {
+            d[i] = (float)s[i];
+        }
+    } else {
+        const float* s = src;
+        double* d = dst;
+        for (size_t i = 0; i < n; i++) {
+            d[i] = (double)s[i];
         }
-        net->layer_sizes[i] = *((uint32_t*)(data + idx));
-        idx += sizeof(uint32_t);
     }
+}
 
-    // get all biases.
-    for (int layer = 0; layer < (net->num_layers - 1); layer++) {
-        net->biases[layer] = malloc(net->layer_sizes[layer + 1] * sizeof(double));
-        for (int j = 0; j < net->layer_sizes[layer + 1]; j++) {
-            if (idx >= datalen) {
-                goto failed_3;
+static void pack_data(void* dst, stoopidnet_precision_t dst_precision, const stoopidnet_data_t* src,
+                      uint32_t first, const int* order, uint32_t n, uint32_t width)
+{
+    const size_t dst_size  = precision_size(dst_precision);
+    const size_t src_size  = precision_size(src->precision);
+    const size_t row_bytes = (size_t)width * dst_size;
+
+    for (uint32_t s = 0; s < n; s++) {
+        const size_t idx = (order != NULL) ? (size_t)order[s] : ((size_t)first + s);
+        void* row = (uint8_t*)dst + (s * row_bytes);
+
+        switch (src->kind) {
+        case DATA_ROWS:
+            convert_elems(row, dst_precision, src->rows[idx], src->precision, width);
+            break;
+
+        case DATA_PACKED:
+            convert_elems(row, dst_precision,
+                          (const uint8_t*)src->packed + (idx * width * src_size), src->precision,
+                          width);
+            break;
+
+        case DATA_U8: {
+            // same arithmetic as the mnist loaders, so u8 data trains identically to expanded data.
+            const uint8_t* px = (const uint8_t*)src->packed + (idx * width);
+            if (dst_precision == STOOPIDNET_PRECISION_F32) {
+                for (uint32_t k = 0; k < width; k++) {
+                    ((float*)row)[k] = (float)px[k] / 255.0f;
+                }
+            } else {
+                for (uint32_t k = 0; k < width; k++) {
+                    ((double*)row)[k] = (double)px[k] / 255.0;
+                }
             }
-
-            (net->biases[layer])[j] = *((double*)(data + idx));
-            idx += sizeof(double);
+            break;
         }
-    }
 
-    // get all weights.
-    for (int layer = 0; layer < (net->num_layers - 1); layer++) {
-        int numweights = (net->layer_sizes[layer] * net->layer_sizes[layer + 1]);
-        net->weights[layer] = malloc(numweights * sizeof(double));
-        for (int weight_idx = 0; weight_idx < numweights; weight_idx++) {
-            if (idx > datalen) {
-                goto failed_4;
+        case DATA_U8_LABELS: {
+            const uint8_t label = ((const uint8_t*)src->packed)[idx];
+            memset(row, 0, row_bytes);
+            if (label < width) {
+                if (dst_precision == STOOPIDNET_PRECISION_F32) {
+                    ((float*)row)[label] = 1.0f;
+                } else {
+                    ((double*)row)[label] = 1.0;
+                }
             }
-
-            (net->weights[layer])[weight_idx] = *((double*)(data + idx));
-            idx += sizeof(double);
+            break;
+        }
         }
     }
+}
+
+static size_t param_slab_layout(uint32_t num_layers, const uint32_t* layer_sizes,
+                                size_t elem_size, size_t* weight_offsets, size_t* bias_offsets)
+{
+    const size_t align = PARAM_ALIGN / elem_size;
+    size_t len = 0;
 
-    if (idx != datalen) {
-        goto failed_4;
+    for (int l = 0; l < (int)num_layers - 1; l++) {
+        if (weight_offsets != NULL) { weight_offsets[l] = len; }
+        len += (size_t)layer_sizes[l] * layer_sizes[l + 1];
+        len = ((len + align - 1) / align) * align;
+
+        if (bias_offsets != NULL) { bias_offsets[l] = len; }
+        len += layer_sizes[l + 1];
+        len = ((len + align - 1) / align) * align;
     }
 
-    return net;
+    return len;
+}
+
+static void* param_slab_alloc(size_t bytes)
+{
+    size_t align = PARAM_ALIGN;
+    void* slab = NULL;
 
-failed_4:
-    for (int i = 0; i < (net->num_layers - 1); i++) {
-        free(net->weights[i]);
+    if (bytes == 0) {
+        return NULL;
     }
 
-failed_3:
-    for (int i = 0; i < (net->num_layers - 1); i++) {
-        free(net->biases[i]);
+    if (bytes >= PARAM_HUGEPAGE_SIZE) {
+        align = PARAM_HUGEPAGE_SIZE;
+        bytes = ((bytes + PARAM_HUGEPAGE_SIZE - 1) / PARAM_HUGEPAGE_SIZE) * PARAM_HUGEPAGE_SIZE;
     }
 
-failed_2:
-    free(net->layer_sizes);
-    free(net->biases);
-    free(net->weights);
-    free(net);
+    if (posix_memalign(&slab, align, bytes) != 0) {
+        fprintf(stderr, "Failed to allocate %zu byte parameter slab\n", bytes);
+        abort();
+    }
 
-failed_1:
-    fprintf(stderr, "Given buffer is wrong length for deseralization.\n");
+#ifdef MADV_HUGEPAGE
+    // just advice; if transparent huge pages are off we still have a perfectly good slab.
+    if (align == PARAM_HUGEPAGE_SIZE) {
+        madvise(slab, bytes, MADV_HUGEPAGE);
+    }
+#endif
 
-    return NULL;
+    memset(slab, 0, bytes);
+    return slab;
 }
 
+static stoopidnet_t* stoopidnet_alloc(uint32_t num_layers, const uint32_t* layer_sizes,
+                                      stoopidnet_precision_t precision)
+{
+    stoopidnet_t* net = stoopidnet_alloc_shell(num_layers, layer_sizes, precision);
+    net->params = param_slab_alloc(net->params_len * precision_size(precision));
+
+    return net;
+}
 
-stoopidnet_t* stoopidnet_load_from_file(const char* file)
+static stoopidnet_t* stoopidnet_alloc_shell(uint32_t num_layers, const uint32_t* layer_sizes,
+                                            stoopidnet_precision_t precision)
 {
-    FILE* fp = fopen(file, "rb");
+    stoopidnet_t* net = calloc(1, sizeof(stoopidnet_t));
+    net->num_layers  = num_layers;
+    net->precision   = precision;
+    net->layer_sizes = malloc(num_layers * sizeof(uint32_t));
+    memcpy(net->layer_sizes, layer_sizes, num_layers * sizeof(uint32_t));
 
-    // get file length and load it.
-    fseek(fp, 0L, SEEK_END);
-    uint32_t sz = ftell(fp);
-    rewind(fp);
-    uint8_t* data = malloc(sz);
-    int foo = fread(data, sizeof(uint8_t), sz, fp);
+    net->weight_offsets = calloc(num_layers, sizeof(size_t));
+    net->bias_offsets   = calloc(num_layers, sizeof(size_t));
+    net->activations    = calloc(num_layers, sizeof(stoopidnet_activation_t));
+    net->params_len = param_slab_layout(num_layers, layer_sizes, precision_size(precision),
+                                        net->weight_offsets, net->bias_offsets);
 
-    stoopidnet_t* net = stoopidnet_deserialize(data, sz);
     return net;
 }
 
-
-int stoopidnet_store_to_file(stoopidnet_t* net, const char* file)
+static void stoopidnet_own_params(stoopidnet_t* net)
 {
-    int retval = 0;
+    if (net->map == NULL) {
+        return;
+    }
 
-    FILE* fp = fopen(file, "wb");
-    uint8_t* data;
-    uint32_t len = stoopidnet_serialize(net, &data);
+    void* params = param_slab_alloc(net->params_len * precision_size(net->precision));
+    memcpy(params, net->params, net->params_len * precision_size(net->precision));
+    munmap(net->map, net->map_len);
+    net->params = params;
+    net->map = NULL;
+    net->map_len = 0;
+}
 
-    if (len == 0) {
-        fprintf(stderr, "Tried to store invalid net to file\n");
-        retval = -1;
-        goto cleanup;
+static uint32_t optimizer_state_slabs(stoopidnet_optimizer_t optimizer)
+{
+    switch (optimizer) {
+    case STOOPIDNET_OPTIMIZER_MOMENTUM:
+    case STOOPIDNET_OPTIMIZER_NESTEROV: return 1;
+    case STOOPIDNET_OPTIMIZER_ADAM:     return 2;
+    default:                            return 0;
     }
+}
 
-    size_t writelen = fwrite(data, sizeof(uint8_t), len, fp);
-    fclose(fp);
-    if (writelen != len) {
-        fprintf(stderr, "Error writing network to file\n");
-        retval = -1;
-        goto cleanup;
+static void stoopidnet_prepare_optimizer(stoopidnet_t* net, stoopidnet_optimizer_t optimizer)
+{
+    const uint32_t slabs = optimizer_state_slabs(optimizer);
+    if ((net->optimizer == optimizer) && ((net->opt_state != NULL) || (slabs == 0))) {
+        return;
     }
 
-cleanup:
-    free(data);
-    return retval;
+    stoopidnet_clear_optimizer_state(net);
+    net->optimizer = optimizer;
+    net->opt_state = param_slab_alloc(slabs * net->params_len * precision_size(net->precision));
 }
 
-void stoopidnet_add_fc_layer(stoopidnet_t* net, uint32_t num_nodes)
+static void convert_slab(stoopidnet_t* dst_net, void* dst, stoopidnet_t* src_net, const void* src)
 {
-    net->num_layers++;
+    const size_t src_size = precision_size(src_net->precision);
+    const size_t dst_size = precision_size(dst_net->precision);
+
+    // the slab layouts differ between precisions, so go tensor by tensor.
+    for (int l = 0; l < (int)src_net->num_layers - 1; l++) {
+        convert_elems((uint8_t*)dst + (dst_net->weight_offsets[l] * dst_size), dst_net->precision,
+                      (const uint8_t*)src + (src_net->weight_offsets[l] * src_size),
+                      src_net->precision,
+                      (size_t)src_net->layer_sizes[l] * src_net->layer_sizes[l + 1]);
+        convert_elems((uint8_t*)dst + (dst_net->bias_offsets[l] * dst_size), dst_net->precision,
+                      (const uint8_t*)src + (src_net->bias_offsets[l] * src_size),
+                      src_net->precision, src_net->layer_sizes[l + 1]);
+    }
+}
 
-    // ======= allocate. =======
-    net->layer_sizes = realloc(net->layer_sizes, net->num_layers * sizeof(uint32_t));
-    net->weights     = realloc(net->weights, (net->num_layers - 1) * sizeof(double*));
-    net->biases      = realloc(net->biases, (net->num_layers - 1) * sizeof(double*));
+static size_t stoopidnet_v2_params_offset(stoopidnet_t* net)
+{
+    size_t len = sizeof(stoopidnet_file_header_t) + (net->num_layers * sizeof(uint32_t)) +
+                 ((net->num_layers - 1) * sizeof(stoopidnet_file_layer_t));
+    return ((len + PARAM_ALIGN - 1) / PARAM_ALIGN) * PARAM_ALIGN;
+}
 
-    // ======= fill. =======
-    net->layer_sizes[net->num_layers - 1] = num_nodes;
+static size_t storage_size(stoopidnet_t* net, stoopidnet_storage_t storage)
+{
+    return (storage == STOOPIDNET_STORAGE_NATIVE) ? precision_size(net->precision) :
+                                                    sizeof(uint16_t);
+}
 
-    // Set up the biases and weights to be randomly distributed on [-1, 1]
-    net->biases[net->num_layers - 2] = malloc(net->layer_sizes[net->num_layers - 1] * sizeof(double));
-    for (int i = 0; i < net->layer_sizes[net->num_layers - 1]; i++) {
-        (net->biases[net->num_layers - 2])[i] = box_mueller_norm();
+static uint16_t* narrow_params(stoopidnet_t* net, stoopidnet_storage_t storage)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    void (*narrow)(size_t, const float*, uint16_t*) = (storage == STOOPIDNET_STORAGE_F16) ?
+                                                      kernels->f32_to_f16 : kernels->f32_to_bf16;
+    uint16_t* dst = malloc(net->params_len * sizeof(uint16_t));
+    if (net->precision == STOOPIDNET_PRECISION_F32) {
+        narrow(net->params_len, net->params, dst);
+        return dst;
     }
 
-    int nweights = net->layer_sizes[net->num_layers - 1] * net->layer_sizes[net->num_layers - 2];
-    net->weights[net->num_layers - 2] = malloc(nweights * sizeof(double));
-
-    for (int i = 0; i < nweights; i++) {
-        (net->weights[net->num_layers - 2])[i] = box_mueller_norm();
+    float chunk[CONVERT_CHUNK];
+    const double* src = net->params;
+    for (size_t i = 0; i < net->params_len; i += CONVERT_CHUNK) {
+        const size_t n = ((net->params_len - i) < CONVERT_CHUNK) ? (net->params_len - i) :
+                                                                   CONVERT_CHUNK;
+        convert_elems(chunk, STOOPIDNET_PRECISION_F32, src + i, STOOPIDNET_PRECISION_F64, n);
+        narrow(n, chunk, dst + i);
     }
+    return dst;
 }
 
-
-void stoopidnet_add_fc_layer_with_starting_weights(stoopidnet_t* net,
-                                                   uint32_t num_nodes,
-                                                   double* weights)
+static void widen_params(stoopidnet_t* net, const uint16_t* src, stoopidnet_storage_t storage)
 {
-    printf("XXX TODO");
-    stoopidnet_add_fc_layer(net, num_nodes);
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    void (*widen)(size_t, const uint16_t*, float*) = (storage == STOOPIDNET_STORAGE_F16) ?
+                                                     kernels->f16_to_f32 : kernels->bf16_to_f32;
+    if (net->precision == STOOPIDNET_PRECISION_F32) {
+        widen(net->params_len, src, net->params);
+        return;
+    }
 
+    float chunk[CONVERT_CHUNK];
+    double* dst = net->params;
+    for (size_t i = 0; i < net->params_len; i += CONVERT_CHUNK) {
+        const size_t n = ((net->params_len - i) < CONVERT_CHUNK) ? (net->params_len - i) :
+                                                                   CONVERT_CHUNK;
+        widen(n, src + i, chunk);
+        convert_elems(dst + i, STOOPIDNET_PRECISION_F64, chunk, STOOPIDNET_PRECISION_F32, n);
+    }
 }
 
-
-uint32_t stoopidnet_get_num_nodes_in_layer(stoopidnet_t* net, uint32_t layer_idx)
+static void serialize_v2_header(stoopidnet_t* net, stoopidnet_storage_t storage, uint8_t* buf)
 {
-    assert(layer_idx < net->num_layers);
-    return net->layer_sizes[layer_idx];
-}
+    const size_t esize  = storage_size(net, storage);
+    const size_t offset = stoopidnet_v2_params_offset(net);
+    memset(buf, 0, offset);
+
+    stoopidnet_file_header_t* header = (stoopidnet_file_header_t*)buf;
+    header->magic         = SERIALIZE_V2_MAGIC;
+    header->version       = (storage == STOOPIDNET_STORAGE_NATIVE) ? SERIALIZE_V2_VERSION :
+                                                                     SERIALIZE_V2_VERSION_HALF;
+    header->endian        = SERIALIZE_V2_ENDIAN;
+    header->precision     = net->precision;
+    header->num_layers    = net->num_layers;
+    header->params_offset = offset;
+    header->params_bytes  = net->params_len * esize;
+    header->storage       = storage;
+    if ((storage == STOOPIDNET_STORAGE_NATIVE) && (net->opt_state != NULL)) {
+        header->optimizer      = net->optimizer;
+        header->optimizer_step = net->opt_step;
+    }
 
+    uint8_t* p = buf + sizeof(stoopidnet_file_header_t);
+    memcpy(p, net->layer_sizes, net->num_layers * sizeof(uint32_t));
+    p += net->num_layers * sizeof(uint32_t);
+
+    for (uint32_t l = 0; l < (net->num_layers - 1); l++) {
+        stoopidnet_file_layer_t layer = { 0 };
+        layer.weight_offset = net->weight_offsets[l] * esize;
+        layer.bias_offset   = net->bias_offsets[l] * esize;
+        layer.flags[0]      = net->activations[l];
+        memcpy(p, &layer, sizeof(layer));
+        p += sizeof(layer);
+    }
+}
 
-uint32_t stoopidnet_get_num_layers(stoopidnet_t* net)
+static uint64_t checksum_v2(uint64_t h, const void* data, size_t len)
 {
-    return net->num_layers;
+    // FNV-1a, a word at a time.
+    const uint8_t* p = data;
+    size_t i = 0;
+    for (; (i + sizeof(uint64_t)) <= len; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    for (; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
 }
 
-
-void stoopidnet_set_layer_weights(stoopidnet_t* net, uint32_t layer_idx, double* weights)
+static stoopidnet_t* deserialize_v2(const uint8_t* data, size_t len, int borrow)
 {
+    stoopidnet_file_header_t header;
+    if (len < sizeof(header)) {
+        fprintf(stderr, "Model file is too short for its header.\n");
+        return NULL;
+    }
+    memcpy(&header, data, sizeof(header));
 
-}
+    if (header.endian != SERIALIZE_V2_ENDIAN) {
+        fprintf(stderr, "Model file was written on a machine of the other endianness.\n");
+        return NULL;
+    }
+    if ((header.version != SERIALIZE_V2_VERSION) && (header.version != SERIALIZE_V2_VERSION_HALF)) {
+        fprintf(stderr, "Unsupported model file version %u.\n", header.version);
+        return NULL;
+    }
+    const stoopidnet_storage_t storage = (stoopidnet_storage_t)header.storage;
+    const int native = (storage == STOOPIDNET_STORAGE_NATIVE);
+    if (((header.precision != STOOPIDNET_PRECISION_F64) &&
+         (header.precision != STOOPIDNET_PRECISION_F32)) || (header.num_layers == 0) ||
+        (header.optimizer >= STOOPIDNET_NUM_OPTIMIZERS) ||
+        (header.storage >= STOOPIDNET_NUM_STORAGES) ||
+        (native != (header.version == SERIALIZE_V2_VERSION)) ||
+        (!native && (header.optimizer != STOOPIDNET_OPTIMIZER_SGD)) ||
+        (header.num_layers > ((len - sizeof(header)) / (sizeof(uint32_t) +
+                                                        sizeof(stoopidnet_file_layer_t))))) {
+        fprintf(stderr, "Model file has a malformed header.\n");
+        return NULL;
+    }
+
+    const uint32_t* layer_sizes = (const uint32_t*)(data + sizeof(header));
+    const uint8_t* layer_table  = data + sizeof(header) + (header.num_layers * sizeof(uint32_t));
+    stoopidnet_t* net = stoopidnet_alloc_shell(header.num_layers, layer_sizes, header.precision);
+    const size_t esize = storage_size(net, storage);
+
+    // the file has to be laid out exactly the way this build would lay out the slab.
+    const uint64_t state_bytes = optimizer_state_slabs(header.optimizer) * header.params_bytes;
+    int ok = (header.params_offset == stoopidnet_v2_params_offset(net)) &&
+             (header.params_bytes == (net->params_len * esize)) &&
+             (header.params_offset <= len) &&
+             ((header.params_bytes + state_bytes) == (len - header.params_offset));
+    for (uint32_t l = 0; ok && (l < (net->num_layers - 1)); l++) {
+        stoopidnet_file_layer_t layer;
+        memcpy(&layer, layer_table + (l * sizeof(layer)), sizeof(layer));
+        ok = (layer.weight_offset == (net->weight_offsets[l] * esize)) &&
+             (layer.bias_offset == (net->bias_offsets[l] * esize)) &&
+             (layer.flags[0] < STOOPIDNET_NUM_ACTIVATIONS) && (layer.flags[1] == 0);
+        if (ok) {
+            net->activations[l] = (stoopidnet_activation_t)layer.flags[0];
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Model file's layer table is malformed.\n");
+        goto failed;
+    }
 
+    if (checksum_v2(SERIALIZE_V2_CHECKSUM_SEED, data + sizeof(header), len - sizeof(header)) !=
+        header.checksum) {
+        fprintf(stderr, "Model file checksum mismatch.\n");
+        goto failed;
+    }
 
-void stoopidnet_evaluate(stoopidnet_t* net, double* input, double** output)
+    if (!native) {
+        net->params = param_slab_alloc(net->params_len * precision_size(net->precision));
+        widen_params(net, (const uint16_t*)(data + header.params_offset), storage);
+    } else if (borrow) {
+        net->params = (void*)(data + header.params_offset);
+    } else {
+        net->params = param_slab_alloc(header.params_bytes);
+        memcpy(net->params, data + header.params_offset, header.params_bytes);
+    }
+
+    // the optimizer state only matters for training, which writes to it, so it's always copied.
+    if (state_bytes > 0) {
+        stoopidnet_prepare_optimizer(net, header.optimizer);
+        memcpy(net->opt_state, data + header.params_offset + header.params_bytes, state_bytes);
+        net->opt_step = header.optimizer_step;
+    }
+    return net;
+
+failed:
+    stoopidnet_destroy(net);
+    return NULL;
+}
+
+static stoopidnet_batch_buffers_t* stoopidnet_batch_buffers_create(stoopidnet_t* net,
+                                                                    uint32_t capacity,
+                                                                    stoopidnet_profile_t* prof)
 {
-    double *activation = malloc(net->layer_sizes[0] * sizeof(double));
-    memcpy(activation, input, sizeof(double) * net->layer_sizes[0]);
-    double *activiation_next = NULL;
+    const size_t esize = precision_size(net->precision);
+    stoopidnet_batch_buffers_t* bufs = calloc(1, sizeof(stoopidnet_batch_buffers_t));
+    bufs->capacity = capacity;
+    bufs->a     = calloc(net->num_layers, sizeof(void*));
+    bufs->delta = calloc(net->num_layers, sizeof(void*));
 
+    bufs->a[0] = malloc(capacity * net->layer_sizes[0] * esize);
     for (int l = 1; l < net->num_layers; l++) {
-        activiation_next = calloc(net->layer_sizes[l], sizeof(double));
-
-        // calculate next layer into activiation_next
-        for (int j = 0; j < net->layer_sizes[l]; j++) {
-            double accum = 0.;
-            for (int k = 0; k < net->layer_sizes[l - 1]; k++) {
-                int idx = (j * net->layer_sizes[l - 1]) + k;
-                accum += (net->weights[l - 1])[idx] * activation[k];
-            }
-            activiation_next[j] = sigmoid(accum + (net->biases[l - 1])[j]);
-        }
+        bufs->a[l]     = malloc(capacity * net->layer_sizes[l] * esize);
+        bufs->delta[l] = malloc(capacity * net->layer_sizes[l] * esize);
+    }
+    bufs->y = malloc(capacity * net->layer_sizes[net->num_layers - 1] * esize);
 
-        // copy new layer into activiation.
-        free(activation);
-        activation = activiation_next;
+    uint64_t elems = (uint64_t)capacity * (net->layer_sizes[0] +
+                                           net->layer_sizes[net->num_layers - 1]);
+    for (int l = 1; l < net->num_layers; l++) {
+        elems += 2ull * capacity * net->layer_sizes[l];
     }
+    PROFILE_ALLOC(prof, 2 * net->num_layers + 2,
+                  sizeof(stoopidnet_batch_buffers_t) + (2 * net->num_layers * sizeof(void*)) +
+                  (elems * esize));
 
-    //activation now contains result. It's the caller's responsibility to free.
-    *output = activation;
+    return bufs;
 }
 
-
-void stoopidnet_train(stoopidnet_t* net,
-                      const stoopidnet_training_parameters_t* params,
-                      uint32_t n_inputs,
-                      double** inputs,
-                      double** outputs)
+static void stoopidnet_batch_buffers_destroy(stoopidnet_t* net, stoopidnet_batch_buffers_t* bufs)
 {
-    // shuffle training examples
-    int* shuffle = gen_shuffled_ints(n_inputs);
-
-    // setup empty arrays for accumulating average of gradients over training mini-batch
-    double** weight_grads = calloc(net->num_layers - 1, sizeof(double*));
-    double** bias_grads   = calloc(net->num_layers - 1, sizeof(double*));
-    for (int i = 0; i < net->num_layers - 1; i++) {
-        weight_grads[i] = malloc(net->layer_sizes[i] * net->layer_sizes[i + 1] * sizeof(double));
-        bias_grads[i] = malloc(net->layer_sizes[i + 1] * sizeof(double));
+    for (int l = 0; l < net->num_layers; l++) {
+        free(bufs->a[l]);
+        free(bufs->delta[l]);
     }
+    free(bufs->a);
+    free(bufs->delta);
+    free(bufs->y);
+    free(bufs);
+}
+
+static uint32_t gemm_block_rows(size_t row_bytes)
+{
+    // aim to keep a block of weight rows resident in L2 while every example in the batch streams
+    // past it.
+    const size_t budget = 128 * 1024;
+    uint32_t rows = budget / row_bytes;
+    return (rows == 0) ? 1 : rows;
+}
 
-    // do mini batches
-    int prev_print = 0;
-    for (int i = 0; i < n_inputs;) {
-        // reset gradient vectors
-        for (int j = 0; j < net->num_layers - 1; j++) {
-            doubles_memset(weight_grads[j], net->layer_sizes[j] * net->layer_sizes[j + 1], 0.0);
-            doubles_memset(bias_grads[j], net->layer_sizes[j + 1], 0.0);
+static void stoopidnet_evaluate_chunked(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                        uint32_t n_inputs, const stoopidnet_data_t* inputs,
+                                        void* outputs, stoopidnet_precision_t out_precision)
+{
+    assert(ws->num_layers == net->num_layers);
+    assert(ws->precision == net->precision);
+
+    const uint32_t in  = net->layer_sizes[0];
+    const uint32_t out = net->layer_sizes[net->num_layers - 1];
+    const size_t in_size  = precision_size(inputs->precision);
+    const size_t out_size = precision_size(out_precision);
+
+    for (uint32_t i = 0; i < n_inputs; i += ws->capacity) {
+        const uint32_t n = ((n_inputs - i) < ws->capacity) ? (n_inputs - i) : ws->capacity;
+
+        // use the caller's rows in place if they're already packed and of the net's precision,
+        // otherwise gather and/or convert them into a workspace buffer.
+        const void* src = ws->act[0];
+        if ((inputs->kind == DATA_PACKED) && (inputs->precision == net->precision)) {
+            src = (const uint8_t*)inputs->packed + ((size_t)i * in * in_size);
+        } else {
+            pack_data(ws->act[0], net->precision, inputs, i, NULL, n, in);
+        }
+        void* dst = (uint8_t*)outputs + ((size_t)i * out * out_size);
+        void* res = (out_precision == net->precision) ? dst : NULL;
+        if (net->precision == STOOPIDNET_PRECISION_F32) {
+            res = evaluate_rows_f32(net, ws, src, n, res);
+        } else {
+            res = evaluate_rows_f64(net, ws, src, n, res);
         }
 
-        // actual backprop happens here
-        // allocate array for layer-by-layer error
-        double** layer_error = calloc(net->num_layers, sizeof(double*));
-        for (int j = 1; j < net->num_layers; j++) {
-            layer_error[j] = malloc(net->layer_sizes[j] * sizeof(double));
+        if (res != dst) {
+            convert_elems(dst, out_precision, res, net->precision, (size_t)n * out);
         }
+    }
+}
 
-        for (int j = 0; (j < params->batch_size) && (i < n_inputs); j++, i++) {
-            // first run network forward and cache z-values and a-values.
-            stoopidnet_forward_prop_results_t* fp = stoopidnet_forward_prop(net,
-                                                                            inputs[shuffle[i]]);
-
-            // backpropagate
-            // final layer is special case:
-            // BP1: d_L = grada(C) hadamard sig'(z_L)
-            int backprop_layer = net->num_layers - 1;
-            for (int k = 0; k < net->layer_sizes[backprop_layer]; k++) {
-                layer_error[backprop_layer][k] = ((fp->a[backprop_layer][k] -
-                                                   (outputs[shuffle[i]])[k]) *
-                                                      sigmoid_prime(fp->z[backprop_layer][k]));
-            }
-            backprop_layer--;
-            // calc BP2: d_l = ((w_{l+1})_T * d_{l+1}) hadamard sig'(z_l)
-            for (;backprop_layer > 0; backprop_layer--) {
-                for (int k = 0; k < net->layer_sizes[backprop_layer]; k++) {
-                    layer_error[backprop_layer][k] = 0.;
-                    for (int l = 0; l < net->layer_sizes[backprop_layer + 1]; l++) {
-                        int idx = (l * net->layer_sizes[backprop_layer]) + k;
-                        layer_error[backprop_layer][k] +=
-                            (net->weights[backprop_layer][idx] *
-                             layer_error[backprop_layer + 1][l]);
-                    }
-                    layer_error[backprop_layer][k] *= sigmoid_prime(fp->z[backprop_layer][k]);
-                }
-            }
+static void* stoopidnet_prefetch_main(void* arg)
+{
+    stoopidnet_prefetch_t* pf = arg;
+    stoopidnet_t* net = pf->net;
 
-            // add to gradient vectors.
-            for (int k = 1; k < net->num_layers; k++) {
-                for (int l = 0; l < net->layer_sizes[k]; l++) {
-                    bias_grads[k - 1][l] += layer_error[k][l];
-                    for (int m = 0; m < net->layer_sizes[k - 1]; m++) {
-                        int idx = (l * net->layer_sizes[k - 1]) + m;
-                        weight_grads[k - 1][idx] += fp->a[k - 1][m] * layer_error[k][l];
-                    }
-                }
-            }
-        }
+    for (uint32_t start = 0; start < pf->n_inputs; start += pf->batch_size) {
+        const uint32_t n = ((pf->n_inputs - start) < pf->batch_size) ? (pf->n_inputs - start) :
+                                                                       pf->batch_size;
 
-        // update network state with gradient.
-        double lrate = (params->learn_rate / ((double)params->batch_size));
-        for (int layer = 0; layer < net->num_layers - 1; layer++) {
-            for (int l_plus_1_idx = 0; l_plus_1_idx < net->layer_sizes[layer + 1]; l_plus_1_idx++) {
-                net->biases[layer][l_plus_1_idx] -= lrate * (bias_grads[layer][l_plus_1_idx]);
-                for (int l_idx = 0; l_idx < net->layer_sizes[layer]; l_idx++) {
-                    int widx = (l_plus_1_idx * net->layer_sizes[layer]) + l_idx;
-                    net->weights[layer][widx] -= lrate * (weight_grads[layer][widx]);
-                }
-            }
+        // wait for the trainer to be done with whatever was last in this slot.
+        pthread_mutex_lock(&pf->lock);
+        while (!pf->stop && ((pf->produced - pf->released) >= PREFETCH_DEPTH)) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        }
+        const int stop = pf->stop;
+        const uint32_t slot = pf->produced % PREFETCH_DEPTH;
+        pthread_mutex_unlock(&pf->lock);
+        if (stop) {
+            break;
         }
+
+        const uint64_t t0 = PROFILE_START(pf->prof);
+        pack_data(pf->a[slot], net->precision, pf->inputs, 0, pf->order + start, n,
+                  net->layer_sizes[0]);
+        pack_data(pf->y[slot], net->precision, pf->outputs, 0, pf->order + start, n,
+                  net->layer_sizes[net->num_layers - 1]);
+        PROFILE_RECORD(pf->prof, STOOPIDNET_PHASE_PACK, 0, STOOPIDNET_PROFILE_PREFETCH_THREAD, t0,
+                       0, (uint64_t)n * precision_size(net->precision) *
+                          (net->layer_sizes[0] + net->layer_sizes[net->num_layers - 1]));
+
+        pthread_mutex_lock(&pf->lock);
+        pf->produced++;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
     }
-}
 
+    return NULL;
+}
 
-////////////////////////////////////////////////////////////////
-// static function impl
-////////////////////////////////////////////////////////////////
-static double sigmoid(const double z)
+static stoopidnet_prefetch_t* stoopidnet_prefetch_start(stoopidnet_t* net,
+                                                        const stoopidnet_data_t* inputs,
+                                                        const stoopidnet_data_t* outputs,
+                                                        const int* order, uint32_t n_inputs,
+                                                        uint32_t batch_size,
+                                                        stoopidnet_profile_t* prof)
 {
-    return 1. / (1. + exp(-z));
+    const size_t esize = precision_size(net->precision);
+    stoopidnet_prefetch_t* pf = calloc(1, sizeof(stoopidnet_prefetch_t));
+    pf->net = net;
+    pf->prof = prof;
+    pf->inputs = inputs;
+    pf->outputs = outputs;
+    pf->order = order;
+    pf->n_inputs = n_inputs;
+    pf->batch_size = batch_size;
+    for (int i = 0; i < PREFETCH_DEPTH; i++) {
+        pf->a[i] = param_slab_alloc((size_t)batch_size * net->layer_sizes[0] * esize);
+        pf->y[i] = param_slab_alloc((size_t)batch_size * net->layer_sizes[net->num_layers - 1] *
+                                    esize);
+    }
+    PROFILE_ALLOC(prof, 1 + (2 * PREFETCH_DEPTH), sizeof(stoopidnet_prefetch_t) +
+                  (PREFETCH_DEPTH * (size_t)batch_size *
+                   (net->layer_sizes[0] + net->layer_sizes[net->num_layers - 1]) * esize));
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+
+    if (pthread_create(&pf->thread, NULL, stoopidnet_prefetch_main, pf) != 0) {
+        fprintf(stderr, "Failed to start prefetch thread\n");
+        abort();
+    }
+
+    return pf;
 }
 
-static double sigmoid_prime(const double z)
+static void stoopidnet_prefetch_next(stoopidnet_prefetch_t* pf, const void** a, const void** y)
 {
-    return (sigmoid(z) * (1 - sigmoid(z)));
+    pthread_mutex_lock(&pf->lock);
+    while (pf->produced <= pf->consumed) {
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    }
+    const uint32_t slot = pf->consumed % PREFETCH_DEPTH;
+    pf->consumed++;
+    pthread_mutex_unlock(&pf->lock);
+
+    *a = pf->a[slot];
+    *y = pf->y[slot];
 }
 
-static int* gen_shuffled_ints(int n)
+static void stoopidnet_prefetch_release(stoopidnet_prefetch_t* pf)
 {
-    int* array = malloc(n * sizeof(int));
+    pthread_mutex_lock(&pf->lock);
+    pf->released++;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
 
-    for (int i = 0; i < n; i++) {
-        array[i] = i;
+static void stoopidnet_prefetch_stop(stoopidnet_prefetch_t* pf)
+{
+    if (pf == NULL) {
+        return;
     }
 
-    if (n > 1) {
-        size_t i;
-	for (i = 0; i < n - 1; i++) {
-	  size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
-	  int t = array[j];
-	  array[j] = array[i];
-	  array[i] = t;
-	}
-    }
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
 
-    return array;
+    for (int i = 0; i < PREFETCH_DEPTH; i++) {
+        free(pf->a[i]);
+        free(pf->y[i]);
+    }
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    free(pf);
 }
 
-static void doubles_memset(double* d, int numel, double val)
+static void report_progress(const stoopidnet_training_parameters_t* params, uint64_t samples_done,
+                            uint64_t samples_total, uint64_t batches_done, uint64_t start)
 {
-    for (int i = 0; i < numel; i++) {
-        d[i] = val;
+    if (params->progress == NULL) {
+        return;
     }
+
+    stoopidnet_progress_t progress = {
+        .samples_done = samples_done,
+        .samples_total = samples_total,
+        .batches_done = batches_done,
+        .seconds = (stoopidnet_profile_now() - start) * 1e-9,
+    };
+    progress.samples_per_sec = (progress.seconds > 0) ? (samples_done / progress.seconds) : 0;
+    params->progress(params->progress_ctx, &progress);
 }
 
-static stoopidnet_forward_prop_results_t* stoopidnet_forward_prop(stoopidnet_t* net,
-                                                                  double *input)
+static void stoopidnet_train_dispatch(stoopidnet_t* net,
+                                      const stoopidnet_training_parameters_t* params,
+                                      uint32_t n_inputs,
+                                      const stoopidnet_data_t* inputs,
+                                      const stoopidnet_data_t* outputs)
 {
-    stoopidnet_forward_prop_results_t* results =
-        calloc(1, sizeof(stoopidnet_forward_prop_results_t));
-
-    results->z = calloc(net->num_layers, sizeof(double*));
-    results->a = calloc(net->num_layers, sizeof(double*));
-
-    results->z[0] = NULL;
-    results->a[0] = malloc(net->layer_sizes[0] * sizeof(double));
+    assert(params->optimizer < STOOPIDNET_NUM_OPTIMIZERS);
+    const stoopidnet_activation_t out_act = net->activations[net->num_layers - 2];
+    if ((params->loss == STOOPIDNET_LOSS_CROSS_ENTROPY) &&
+        (out_act != STOOPIDNET_ACTIVATION_SIGMOID) &&
+        (out_act != STOOPIDNET_ACTIVATION_FAST_SIGMOID) &&
+        (out_act != STOOPIDNET_ACTIVATION_SOFTMAX)) {
+        fprintf(stderr, "Cross-entropy loss needs a sigmoid or softmax output layer, not %s.\n",
+                stoopidnet_activation_name(out_act));
+        return;
+    }
 
-    memcpy(results->a[0], input, sizeof(double) * net->layer_sizes[0]);
+    if (params->start > n_inputs) {
+        fprintf(stderr, "Can't start training at example %u of %u.\n", params->start, n_inputs);
+        return;
+    }
 
-    for (int l = 1; l < net->num_layers; l++) {
-        results->z[l] = calloc(net->layer_sizes[l], sizeof(double));
-        results->a[l] = calloc(net->layer_sizes[l], sizeof(double));
-
-        // calculate next layer into activiation_next
-        for (int j = 0; j < net->layer_sizes[l]; j++) {
-            double accum = 0.;
-            for (int k = 0; k < net->layer_sizes[l - 1]; k++) {
-                int idx = (j * net->layer_sizes[l - 1]) + k;
-                accum += (net->weights[l - 1])[idx] * results->a[l - 1][k];
+    // a label past the output layer would silently train towards all zeros.
+    if (outputs->kind == DATA_U8_LABELS) {
+        const uint8_t* labels = outputs->packed;
+        const uint32_t num_outputs = net->layer_sizes[net->num_layers - 1];
+        for (uint32_t i = 0; i < n_inputs; i++) {
+            if (labels[i] >= num_outputs) {
+                fprintf(stderr, "Example %u has label %u, but the net only has %u outputs.\n", i,
+                        labels[i], num_outputs);
+                return;
             }
-            results->z[l][j] = accum + (net->biases[l - 1][j]);
-            results->a[l][j] = sigmoid(results->z[l][j]);
         }
     }
 
-    return results;
+    stoopidnet_own_params(net);
+    stoopidnet_prepare_optimizer(net, params->optimizer);
+
+    uint64_t seeded = 0;
+    uint64_t* rng = params->rng;
+    if (rng == NULL) {
+        seeded = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+        rng = &seeded;
+    }
+    const uint64_t t0 = stoopidnet_profile_now();
+
+    if (net->precision == STOOPIDNET_PRECISION_F32) {
+        train_f32(net, params, n_inputs, inputs, outputs, rng, t0);
+    } else {
+        train_f64(net, params, n_inputs, inputs, outputs, rng, t0);
+    }
+
+    PROFILE_RECORD(params->profile, STOOPIDNET_PHASE_TRAIN, 0, 0, t0, 0, 0);
+    if (params->stats != NULL) {
+        stoopidnet_training_stats_t* stats = params->stats;
+        stats->samples = n_inputs - params->start;
+        stats->seconds = (stoopidnet_profile_now() - t0) * 1e-9;
+        stats->samples_per_sec = (stats->seconds > 0) ? (stats->samples / stats->seconds) : 0;
+        stats->num_threads = (params->num_threads > 1) ? params->num_threads : 1;
+    }
 }
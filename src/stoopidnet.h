@@ -4,11 +4,234 @@
 #include <stdint.h>
 
 typedef struct stoopidnet stoopidnet_t;
+typedef struct stoopidnet_workspace stoopidnet_workspace_t;
+typedef struct stoopidnet_profile stoopidnet_profile_t;
+typedef struct stoopidnet_checkpointer stoopidnet_checkpointer_t;
+
+/**
+ * Scalar type a net keeps its parameters in and does its math in.
+ */
+typedef enum stoopidnet_precision
+{
+    STOOPIDNET_PRECISION_F64 = 0,
+    STOOPIDNET_PRECISION_F32 = 1,
+} stoopidnet_precision_t;
+
+/**
+ * How a saved net's parameters are stored. 16-bit parameters are widened back to the net's
+ * precision when it's loaded, and make files a quarter (double nets) or half (float nets) the
+ * size. They're meant for shipping finished models, so they're saved without optimizer state.
+ */
+typedef enum stoopidnet_storage
+{
+    /**
+     * Exactly as the net holds them.
+     */
+    STOOPIDNET_STORAGE_NATIVE = 0,
+
+    /**
+     * IEEE half precision: 11 significant bits, magnitudes up to 65504.
+     */
+    STOOPIDNET_STORAGE_F16 = 1,
+
+    /**
+     * bfloat16: float's range with 8 significant bits.
+     */
+    STOOPIDNET_STORAGE_BF16 = 2,
+
+    STOOPIDNET_NUM_STORAGES
+} stoopidnet_storage_t;
+
+/**
+ * Function applied to each node's z to get its activation. Layers are sigmoid unless they're
+ * added with something else. Backprop computes every derivative from the layer's activations, so
+ * none of them cost a transcendental, and the ReLUs don't need one going forward either.
+ */
+typedef enum stoopidnet_activation
+{
+    STOOPIDNET_ACTIVATION_SIGMOID = 0,
+
+    /**
+     * max(0, z)
+     */
+    STOOPIDNET_ACTIVATION_RELU = 1,
+
+    /**
+     * z for z > 0, 0.01 * z otherwise
+     */
+    STOOPIDNET_ACTIVATION_LEAKY_RELU = 2,
+    STOOPIDNET_ACTIVATION_TANH = 3,
+
+    /**
+     * Sigmoid built on a polynomial exp that's good to about float precision.
+     */
+    STOOPIDNET_ACTIVATION_FAST_SIGMOID = 4,
+
+    /**
+     * exp(z_i) / sum_j exp(z_j) over the layer, so its outputs are a probability distribution.
+     * Meant for the output layer, trained with STOOPIDNET_LOSS_CROSS_ENTROPY.
+     */
+    STOOPIDNET_ACTIVATION_SOFTMAX = 5,
+
+    STOOPIDNET_NUM_ACTIVATIONS
+} stoopidnet_activation_t;
+
+/**
+ * Cost function training minimizes.
+ */
+typedef enum stoopidnet_loss
+{
+    /**
+     * 1/2 |a - y|^2. The output error gets multiplied by the output activation's derivative, so
+     * saturated sigmoid outputs learn slowly.
+     */
+    STOOPIDNET_LOSS_QUADRATIC = 0,
+
+    /**
+     * -sum y ln a for a softmax output layer, or the per-output binary cross-entropy for a
+     * sigmoid one. Either way the output error comes out as exactly a - y, which is what gets
+     * used; the log and the activation's derivative cancel and are never computed. The output
+     * layer has to be softmax or one of the sigmoids.
+     */
+    STOOPIDNET_LOSS_CROSS_ENTROPY = 1,
+} stoopidnet_loss_t;
+
+/**
+ * How each minibatch's gradient turns into a weight update. Everything but plain SGD keeps state
+ * the size of the parameters in the net, which carries over between stoopidnet_train calls and
+ * gets saved along with the net.
+ */
+typedef enum stoopidnet_optimizer
+{
+    /**
+     * w -= learn_rate * mean gradient
+     */
+    STOOPIDNET_OPTIMIZER_SGD = 0,
+
+    /**
+     * Heavy-ball momentum: v = momentum * v + gradient, w -= learn_rate * v.
+     */
+    STOOPIDNET_OPTIMIZER_MOMENTUM = 1,
+
+    /**
+     * Nesterov momentum: like MOMENTUM, but steps by the gradient plus the updated velocity.
+     */
+    STOOPIDNET_OPTIMIZER_NESTEROV = 2,
+
+    /**
+     * Adam, with momentum as beta1. Wants a much smaller learn_rate than SGD, e.g. 0.001.
+     */
+    STOOPIDNET_OPTIMIZER_ADAM = 3,
+
+    STOOPIDNET_NUM_OPTIMIZERS
+} stoopidnet_optimizer_t;
+
+/**
+ * Throughput of one stoopidnet_train call.
+ */
+typedef struct stoopidnet_training_stats
+{
+    uint64_t samples;
+    double seconds;
+    double samples_per_sec;
+    uint32_t num_threads;
+} stoopidnet_training_stats_t;
+
+/**
+ * How far along a stoopidnet_train call is.
+ */
+typedef struct stoopidnet_progress
+{
+    uint64_t samples_done;
+    uint64_t samples_total;
+    uint64_t batches_done;
+    double seconds;
+    double samples_per_sec;
+} stoopidnet_progress_t;
+
+typedef void (*stoopidnet_progress_fn)(void* ctx, const stoopidnet_progress_t* progress);
 
 typedef struct stoopidnet_training_parameters
 {
     double learn_rate;
     uint32_t batch_size;
+    stoopidnet_loss_t loss;
+
+    /**
+     * Optimizer and its hyperparameters; leaving any of the doubles at 0 picks its usual default
+     * (momentum 0.9, beta2 0.999, epsilon 1e-8). Training with a different optimizer than the
+     * net's state was built with starts that state over.
+     */
+    stoopidnet_optimizer_t optimizer;
+    double momentum;
+    double beta2;
+    double epsilon;
+
+    /**
+     * State of the generator that shuffles the examples, advanced by every call. Training from
+     * the same state gives the same order, independent of rand(). If NULL, each call seeds its
+     * own from rand().
+     */
+    uint64_t* rng;
+
+    /**
+     * Skips the first start examples of the shuffled order, e.g. to finish an epoch that a
+     * checkpoint was taken part-way through. Give the rng state the epoch started with.
+     */
+    uint32_t start;
+
+    /**
+     * Number of threads each minibatch is split across. 0 or 1 trains on the calling thread only.
+     * Results are deterministic for a given seed and thread count.
+     */
+    uint32_t num_threads;
+
+    /**
+     * If nonzero (and num_threads > 1), train Hogwild-style: workers pull batch_size examples at
+     * a time off a shared cursor and apply their updates straight to the shared weights without
+     * locking or waiting for each other. Faster, but not deterministic. Only used with SGD; the
+     * other optimizers always train synchronously.
+     */
+    uint32_t asynchronous;
+
+    /**
+     * If nonzero, a background thread gathers each shuffled minibatch into a contiguous staging
+     * buffer while the one before it trains, so the training threads never wait on data (e.g. on
+     * a memory-mapped data set being paged in from disk). Not used by asynchronous training.
+     */
+    uint32_t prefetch;
+
+    /**
+     * If nonzero, weights that are exactly zero when the call starts stay zero, so a pruned net
+     * (stoopidnet_sparse.h) can be fine-tuned under its mask without losing its sparsity. Biases
+     * are trained as usual.
+     */
+    uint32_t keep_pruned;
+
+    /**
+     * If non-NULL, filled in with the throughput of each stoopidnet_train call.
+     */
+    stoopidnet_training_stats_t* stats;
+
+    /**
+     * If non-NULL, called with progress_ctx every progress_interval minibatches (every one if 0)
+     * and once more when training finishes, from the thread that called stoopidnet_train.
+     */
+    stoopidnet_progress_fn progress;
+    void* progress_ctx;
+    uint32_t progress_interval;
+
+    /**
+     * If non-NULL, the time spent in each phase of training and the work done in it get added to
+     * this profile; see stoopidnet_profile.h.
+     */
+    stoopidnet_profile_t* profile;
+
+    /**
+     * If non-NULL, told about every minibatch so it can take checkpoints while training runs; see
+     * stoopidnet_checkpoint.h. Asynchronous training isn't checkpointed part-way through.
+     */
+    stoopidnet_checkpointer_t* checkpointer;
 } stoopidnet_training_parameters_t;
 
 /**
@@ -16,6 +239,40 @@ typedef struct stoopidnet_training_parameters
  */
 stoopidnet_t* stoopidnet_create(uint32_t num_input_nodes);
 
+/**
+ * Same as stoopidnet_create, but the net's parameters and math use the given precision. The
+ * double and float APIs below work on nets of either precision; data of the other type gets
+ * converted on the way in and out, so matching the net's precision is fastest.
+ */
+stoopidnet_t* stoopidnet_create_with_precision(uint32_t num_input_nodes,
+                                               stoopidnet_precision_t precision);
+
+/**
+ * Returns a newly allocated copy of net with its parameters converted to the given precision.
+ */
+stoopidnet_t* stoopidnet_convert_precision(stoopidnet_t* net, stoopidnet_precision_t precision);
+
+stoopidnet_precision_t stoopidnet_get_precision(stoopidnet_t* net);
+
+/**
+ * Returns a copy of net's layers and parameters, without any optimizer state, for evaluating
+ * while net goes on training. The parameters are a single slab, so taking a snapshot or
+ * refreshing one with stoopidnet_snapshot_update is one memcpy.
+ */
+stoopidnet_t* stoopidnet_snapshot(stoopidnet_t* net);
+
+/**
+ * Same as stoopidnet_snapshot, but the copy keeps net's optimizer state and step count, and gets
+ * them again with every stoopidnet_snapshot_update, so it can be saved to resume training from.
+ */
+stoopidnet_t* stoopidnet_snapshot_with_state(stoopidnet_t* net);
+
+/**
+ * Copies net's current parameters into snapshot, which must have net's layers and precision
+ * (e.g. an earlier stoopidnet_snapshot of it). Returns 0 if it doesn't.
+ */
+int stoopidnet_snapshot_update(stoopidnet_t* snapshot, stoopidnet_t* net);
+
 /**
  * Destroys the given stoopidnet_t.
  */
@@ -23,35 +280,182 @@ void stoopidnet_destroy(stoopidnet_t* net);
 
 
 /**
- * Loads a stoopdinet into a flat uint8_t array so that it can be written to a file.
+ * Loads a stoopdinet into a flat uint8_t array so that it can be written to a file. The array is
+ * in the versioned, checksummed v2 format.
  *
  * Returns the number of bytes in the returned array.
  */
 uint32_t stoopidnet_serialize(stoopidnet_t* net, uint8_t** target);
 
 /**
- * Loads a stoopidnet that was serialized.
+ * Same as stoopidnet_serialize, with the parameters stored as given.
+ */
+uint32_t stoopidnet_serialize_with_storage(stoopidnet_t* net, stoopidnet_storage_t storage,
+                                           uint8_t** target);
+
+/**
+ * Loads a stoopidnet that was serialized, in either the v2 or the older unversioned formats.
  */
 stoopidnet_t* stoopidnet_deserialize(uint8_t *data, uint32_t datalen);
 
 
+/**
+ * Adds a layer to the end of the net. Any optimizer state is dropped.
+ */
 void stoopidnet_add_fc_layer(stoopidnet_t* net, uint32_t num_nodes);
+
+/**
+ * Same as stoopidnet_add_fc_layer, with the given activation function rather than sigmoid. The
+ * parameters of ReLU, tanh and softmax layers start out scaled down by the square root of the
+ * fan-in (He and Xavier initialization) so their outputs don't blow up.
+ */
+void stoopidnet_add_fc_layer_with_activation(stoopidnet_t* net, uint32_t num_nodes,
+                                             stoopidnet_activation_t activation);
 void stoopidnet_add_fc_layer_with_starting_weights(stoopidnet_t* net,
                                                    uint32_t num_nodes,
                                                    double* weights);
 
+/**
+ * Loads a net from a file. v2 files are mapped read-only and the net's parameters point straight
+ * into the mapping, so loading is nearly free and every process that loads the same model shares
+ * one copy of it. The parameters are copied out the first time the net is trained or grown. Files
+ * with 16-bit parameters are widened into memory of the net's own instead.
+ */
 stoopidnet_t* stoopidnet_load_from_file(const char* file);
+
+/**
+ * Writes net to file in the v2 format, including any optimizer state so that training can pick
+ * up where it left off. The file is replaced atomically, so processes that have the old one loaded
+ * are unaffected.
+ */
 int stoopidnet_store_to_file(stoopidnet_t* net, const char* file);
 
+/**
+ * Same as stoopidnet_store_to_file, with the parameters stored as given.
+ */
+int stoopidnet_store_to_file_with_storage(stoopidnet_t* net, const char* file,
+                                          stoopidnet_storage_t storage);
+
 uint32_t stoopidnet_get_num_layers(stoopidnet_t* net);
 uint32_t stoopidnet_get_num_nodes_in_layer(stoopidnet_t* net, uint32_t layer_idx);
+
+/**
+ * Replaces the weights feeding layer layer_idx (1 <= layer_idx < num_layers), given laid out as
+ * stoopidnet_get_layer_params returns them. The optimizer state is left as it is.
+ */
 void stoopidnet_set_layer_weights(stoopidnet_t* net, uint32_t layer_idx, double* weights);
 
+/**
+ * Activation function of layer layer_idx (1 <= layer_idx < num_layers).
+ */
+stoopidnet_activation_t stoopidnet_get_layer_activation(stoopidnet_t* net, uint32_t layer_idx);
+
+/**
+ * Short lowercase name of the activation function, e.g. "relu", or NULL if there's no such one.
+ */
+const char* stoopidnet_activation_name(stoopidnet_activation_t activation);
+
+/**
+ * Same, for optimizers, e.g. "adam".
+ */
+const char* stoopidnet_optimizer_name(stoopidnet_optimizer_t optimizer);
+
+/**
+ * Same, for storage formats: "native", "fp16" or "bf16".
+ */
+const char* stoopidnet_storage_name(stoopidnet_storage_t storage);
+
+/**
+ * Frees the net's optimizer state, e.g. so that a finished model saves without it. Training
+ * again starts the state over.
+ */
+void stoopidnet_clear_optimizer_state(stoopidnet_t* net);
+
+/**
+ * Copies out the parameters feeding layer layer_idx (1 <= layer_idx < num_layers) as doubles.
+ * weights gets the layer_sizes[layer_idx] x layer_sizes[layer_idx - 1] row-major weight matrix,
+ * one row per node of the layer, and biases gets one bias per node. Either may be NULL.
+ */
+void stoopidnet_get_layer_params(stoopidnet_t* net, uint32_t layer_idx, double* weights,
+                                 double* biases);
+
 void stoopidnet_evaluate(stoopidnet_t *net, double *input, double **output);
+
+/**
+ * Evaluates n_inputs examples at once.
+ *
+ * outputs is caller-provided and must hold n_inputs * (size of the output layer) doubles; the
+ * result for inputs[i] is written to the i-th row. Examples are pushed through the net in chunks
+ * so that each layer's weights are read once per chunk rather than once per example.
+ */
+void stoopidnet_evaluate_batch(stoopidnet_t* net, uint32_t n_inputs, double** inputs,
+                               double* outputs);
+void stoopidnet_evaluate_batch_f32(stoopidnet_t* net, uint32_t n_inputs, float** inputs,
+                                   float* outputs);
+
+/**
+ * Creates scratch space for evaluating the given net, big enough for batch_capacity examples at
+ * a time. The workspace can be reused for any number of evaluations of the net, but not shared
+ * between threads.
+ */
+stoopidnet_workspace_t* stoopidnet_workspace_create(stoopidnet_t* net, uint32_t batch_capacity);
+void stoopidnet_workspace_destroy(stoopidnet_workspace_t* ws);
+
+/**
+ * Same as stoopidnet_evaluate, but all intermediate activations live in ws and the result is
+ * written to the caller-provided output (size of the output layer). Makes no heap calls.
+ */
+void stoopidnet_evaluate_with_workspace(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                        const double* input, double* output);
+void stoopidnet_evaluate_with_workspace_f32(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                            const float* input, float* output);
+
+/**
+ * Evaluates n_inputs row-major packed inputs into the n_inputs x out output matrix, in chunks of
+ * the workspace's batch capacity. Makes no heap calls.
+ */
+void stoopidnet_evaluate_batch_with_workspace(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                              uint32_t n_inputs, const double* inputs,
+                                              double* outputs);
+void stoopidnet_evaluate_batch_with_workspace_f32(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                                  uint32_t n_inputs, const float* inputs,
+                                                  float* outputs);
+
 void stoopidnet_train(stoopidnet_t* net,
                       const stoopidnet_training_parameters_t* params,
                       uint32_t n_inputs,
                       double** inputs,
                       double** expected_outputs);
+void stoopidnet_train_f32(stoopidnet_t* net,
+                          const stoopidnet_training_parameters_t* params,
+                          uint32_t n_inputs,
+                          float** inputs,
+                          float** expected_outputs);
+
+/**
+ * Training and batch evaluation straight from compact 8-bit data, e.g. an mnist_dataset_t.
+ *
+ * inputs is an n_inputs x (size of the input layer) row-major matrix of bytes, which get scaled
+ * to [0, 1] as they're packed into each batch, so the data set never has to be expanded into
+ * doubles. labels holds one class index per example; the expected output is its one-hot encoding
+ * over the output layer, so every label has to be less than the size of the output layer.
+ * Training refuses to start otherwise.
+ */
+void stoopidnet_train_u8(stoopidnet_t* net,
+                         const stoopidnet_training_parameters_t* params,
+                         uint32_t n_inputs,
+                         const uint8_t* inputs,
+                         const uint8_t* labels);
+/**
+ * Same as stoopidnet_train, with expected outputs given as class indices like
+ * stoopidnet_train_u8's labels rather than as one-hot vectors.
+ */
+void stoopidnet_train_labels(stoopidnet_t* net,
+                             const stoopidnet_training_parameters_t* params,
+                             uint32_t n_inputs,
+                             double** inputs,
+                             const uint8_t* labels);
+void stoopidnet_evaluate_batch_u8(stoopidnet_t* net, uint32_t n_inputs, const uint8_t* inputs,
+                                  double* outputs);
 
 #endif
@@ -0,0 +1,598 @@
+// for clock_gettime and mkdtemp
+#define _DEFAULT_SOURCE
+
+#include "mnist_loader.h"
+#include "stoopidnet.h"
+#include "stoopidnet_half.h"
+#include "stoopidnet_kernels.h"
+#include "stoopidnet_sparse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_CLASSES 10
+#define IMAGE_SIDE 28
+#define IMAGE_SIZE (IMAGE_SIDE * IMAGE_SIDE)
+
+/**
+ * Hidden layer sizes of the nets that evaluation is timed on, in both precisions. Each row is
+ * zero-terminated; the input and output layers are always IMAGE_SIZE and NUM_CLASSES.
+ */
+static const uint32_t EVALUATE_SHAPES[][5] = {
+    { 32 },
+    { 128 },
+    { 512 },
+    { 128, 128 },
+    { 128, 128, 128, 128 },
+};
+
+/**
+ * Fraction of every hidden layer's weights pruned away for the sparse evaluation benchmark.
+ */
+#define EVALUATE_SPARSITY 0.9
+
+static const uint32_t TRAIN_BATCH_SIZES[] = { 1, 10, 32, 128 };
+
+/**
+ * Hidden layer of the nets that training is timed on, and that get serialized and loaded.
+ */
+#define TRAIN_HIDDEN 30
+#define SERDES_HIDDEN 512
+
+typedef struct bench_config
+{
+    int trials;
+    int warmup;
+    uint32_t num_threads;
+
+    /**
+     * Scratch directory for the synthetic IDX files and the model file.
+     */
+    char dir[256];
+
+    /**
+     * If non-NULL, only the group with this name is run.
+     */
+    const char* only;
+
+    /**
+     * The dataset everything is timed on and the files it came from.
+     */
+    mnist_dataset_t* ds;
+    uint32_t count;
+    char data_path[300];
+    char label_path[300];
+
+    /**
+     * The first count images expanded to rows of doubles, for the single-example APIs.
+     */
+    double** rows;
+
+    /**
+     * No result has been printed yet; the next one doesn't need a leading comma.
+     */
+    int first_result;
+} bench_config_t;
+
+/**
+ * Everything a timed function might need. Each benchmark uses a few of these.
+ */
+typedef struct bench_job
+{
+    const bench_config_t* cfg;
+    stoopidnet_t* net;
+    stoopidnet_workspace_t* ws;
+    double* outputs;
+    const stoopidnet_training_parameters_t* params;
+    stoopidnet_half_t* half;
+    stoopidnet_sparse_t* sparse;
+    uint8_t* blob;
+    uint32_t blob_len;
+    stoopidnet_storage_t storage;
+    char model_path[300];
+} bench_job_t;
+
+typedef void (*bench_fn)(bench_job_t* job);
+
+typedef struct bench_stats
+{
+    double min;
+    double median;
+    double mean;
+    double max;
+} bench_stats_t;
+
+/**
+ * Keeps the compiler from throwing away work whose result nothing else looks at.
+ */
+static volatile double bench_sink;
+
+static double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec * 1e-9);
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Calls fn cfg->warmup times untimed, then cfg->trials times timed, and summarizes the trials.
+ */
+static void bench_run(const bench_config_t* cfg, bench_fn fn, bench_job_t* job,
+                      bench_stats_t* stats)
+{
+    for (int i = 0; i < cfg->warmup; i++) {
+        fn(job);
+    }
+
+    double* times = malloc(cfg->trials * sizeof(double));
+    double sum = 0;
+    for (int i = 0; i < cfg->trials; i++) {
+        const double t0 = now_seconds();
+        fn(job);
+        times[i] = now_seconds() - t0;
+        sum += times[i];
+    }
+    qsort(times, cfg->trials, sizeof(double), compare_doubles);
+
+    stats->min = times[0];
+    stats->max = times[cfg->trials - 1];
+    stats->mean = sum / cfg->trials;
+    stats->median = (cfg->trials & 1) ? times[cfg->trials / 2] :
+                    ((times[cfg->trials / 2 - 1] + times[cfg->trials / 2]) / 2);
+    free(times);
+}
+
+/**
+ * Prints one result object. items is how many units each trial processes, so the rate is based
+ * on the median trial. net (may be NULL) and batch (0 for none) describe what was timed.
+ */
+static void bench_report(bench_config_t* cfg, const char* group, const char* name,
+                         stoopidnet_t* net, uint32_t batch, double items, const char* unit,
+                         const bench_stats_t* stats)
+{
+    printf("%s\n    {\"group\": \"%s\", \"name\": \"%s\"", cfg->first_result ? "" : ",", group,
+           name);
+    cfg->first_result = 0;
+    if (net != NULL) {
+        printf(", \"precision\": \"%s\", \"layers\": [",
+               (stoopidnet_get_precision(net) == STOOPIDNET_PRECISION_F32) ? "f32" : "f64");
+        for (uint32_t i = 0; i < stoopidnet_get_num_layers(net); i++) {
+            printf("%s%u", i ? ", " : "", stoopidnet_get_num_nodes_in_layer(net, i));
+        }
+        printf("]");
+    }
+    if (batch) {
+        printf(", \"batch\": %u", batch);
+    }
+    printf(", \"items\": %.0f, \"unit\": \"%s\", \"min_s\": %.9g, \"median_s\": %.9g, "
+           "\"mean_s\": %.9g, \"max_s\": %.9g, \"per_sec\": %.6g}", items, unit, stats->min,
+           stats->median, stats->mean, stats->max, items / stats->median);
+    fflush(stdout);
+}
+
+static int want_group(const bench_config_t* cfg, const char* group)
+{
+    return (cfg->only == NULL) || !strcmp(cfg->only, group);
+}
+
+static stoopidnet_t* make_net(const uint32_t* hidden, stoopidnet_precision_t precision)
+{
+    stoopidnet_t* net = stoopidnet_create_with_precision(IMAGE_SIZE, precision);
+    for (; *hidden; hidden++) {
+        stoopidnet_add_fc_layer(net, *hidden);
+    }
+    stoopidnet_add_fc_layer(net, NUM_CLASSES);
+    return net;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// timed functions
+
+static void time_evaluate(bench_job_t* job)
+{
+    double* output;
+    for (uint32_t i = 0; i < job->cfg->count; i++) {
+        stoopidnet_evaluate(job->net, job->cfg->rows[i], &output);
+        bench_sink = output[0];
+        free(output);
+    }
+}
+
+static void time_evaluate_with_workspace(bench_job_t* job)
+{
+    for (uint32_t i = 0; i < job->cfg->count; i++) {
+        stoopidnet_evaluate_with_workspace(job->net, job->ws, job->cfg->rows[i], job->outputs);
+    }
+    bench_sink = job->outputs[0];
+}
+
+static void time_evaluate_batch(bench_job_t* job)
+{
+    stoopidnet_evaluate_batch_u8(job->net, job->cfg->count, job->cfg->ds->images, job->outputs);
+    bench_sink = job->outputs[0];
+}
+
+static void time_half_evaluate_batch(bench_job_t* job)
+{
+    stoopidnet_half_evaluate_batch_u8(job->half, job->cfg->count, job->cfg->ds->images,
+                                      job->outputs);
+    bench_sink = job->outputs[0];
+}
+
+static void time_sparse_evaluate_batch(bench_job_t* job)
+{
+    stoopidnet_sparse_evaluate_batch_u8(job->sparse, job->cfg->count, job->cfg->ds->images,
+                                        job->outputs);
+    bench_sink = job->outputs[0];
+}
+
+static void time_train(bench_job_t* job)
+{
+    stoopidnet_train_u8(job->net, job->params, job->cfg->count, job->cfg->ds->images,
+                        job->cfg->ds->labels);
+}
+
+static void time_serialize(bench_job_t* job)
+{
+    uint8_t* blob;
+    stoopidnet_serialize_with_storage(job->net, job->storage, &blob);
+    bench_sink = blob[0];
+    free(blob);
+}
+
+static void time_deserialize(bench_job_t* job)
+{
+    stoopidnet_destroy(stoopidnet_deserialize(job->blob, job->blob_len));
+}
+
+static void time_store(bench_job_t* job)
+{
+    stoopidnet_store_to_file_with_storage(job->net, job->model_path, job->storage);
+}
+
+static void time_load(bench_job_t* job)
+{
+    stoopidnet_destroy(stoopidnet_load_from_file(job->model_path));
+}
+
+static void time_dataset_open(bench_job_t* job)
+{
+    // touch every pixel so that the time includes faulting the mapping in.
+    mnist_dataset_t* ds = mnist_dataset_open(job->cfg->data_path, job->cfg->label_path);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < ((size_t)ds->count * ds->width * ds->height); i++) {
+        sum += ds->images[i];
+    }
+    for (uint32_t i = 0; i < ds->count; i++) {
+        sum += ds->labels[i];
+    }
+    bench_sink = sum;
+    mnist_dataset_close(ds);
+}
+
+static void time_load_doubles(bench_job_t* job)
+{
+    double** data;
+    const int n = load_data_file_doubles(job->cfg->data_path, &data);
+    for (int i = 0; i < n; i++) {
+        free(data[i]);
+    }
+    free(data);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// benchmark groups
+
+static void bench_evaluate(bench_config_t* cfg)
+{
+    const uint32_t num_shapes = sizeof(EVALUATE_SHAPES) / sizeof(EVALUATE_SHAPES[0]);
+    for (int p = 0; p < 2; p++) {
+        for (uint32_t s = 0; s < num_shapes; s++) {
+            bench_job_t job = { .cfg = cfg };
+            bench_stats_t stats;
+            job.net = make_net(EVALUATE_SHAPES[s], p ? STOOPIDNET_PRECISION_F32 :
+                                                       STOOPIDNET_PRECISION_F64);
+            job.ws = stoopidnet_workspace_create(job.net, 1);
+            job.outputs = malloc((size_t)cfg->count * NUM_CLASSES * sizeof(double));
+
+            bench_run(cfg, time_evaluate, &job, &stats);
+            bench_report(cfg, "evaluate", "evaluate", job.net, 1, cfg->count, "samples",
+                         &stats);
+            bench_run(cfg, time_evaluate_with_workspace, &job, &stats);
+            bench_report(cfg, "evaluate", "evaluate_with_workspace", job.net, 1, cfg->count,
+                         "samples", &stats);
+            bench_run(cfg, time_evaluate_batch, &job, &stats);
+            bench_report(cfg, "evaluate", "evaluate_batch_u8", job.net, cfg->count, cfg->count,
+                         "samples", &stats);
+            for (int f = STOOPIDNET_STORAGE_F16; f <= STOOPIDNET_STORAGE_BF16; f++) {
+                char name[64];
+                snprintf(name, sizeof(name), "half_evaluate_batch_u8_%s",
+                         stoopidnet_storage_name(f));
+                job.half = stoopidnet_half_create(job.net, f);
+                bench_run(cfg, time_half_evaluate_batch, &job, &stats);
+                bench_report(cfg, "evaluate", name, job.net, cfg->count, cfg->count, "samples",
+                             &stats);
+                stoopidnet_half_destroy(job.half);
+            }
+
+            // the same net with its hidden layers pruned, through the CSR path.
+            stoopidnet_t* pruned = stoopidnet_convert_precision(job.net,
+                                                                stoopidnet_get_precision(job.net));
+            for (uint32_t l = 1; l < (stoopidnet_get_num_layers(pruned) - 1); l++) {
+                stoopidnet_sparse_prune(pruned, l, EVALUATE_SPARSITY);
+            }
+            job.sparse = stoopidnet_sparse_create(pruned);
+            bench_run(cfg, time_sparse_evaluate_batch, &job, &stats);
+            bench_report(cfg, "evaluate", "sparse_evaluate_batch_u8", job.net, cfg->count,
+                         cfg->count, "samples", &stats);
+            stoopidnet_sparse_destroy(job.sparse);
+            stoopidnet_destroy(pruned);
+
+            free(job.outputs);
+            stoopidnet_workspace_destroy(job.ws);
+            stoopidnet_destroy(job.net);
+        }
+    }
+}
+
+static void bench_train(bench_config_t* cfg)
+{
+    const uint32_t hidden[] = { TRAIN_HIDDEN, 0 };
+    const uint32_t num_sizes = sizeof(TRAIN_BATCH_SIZES) / sizeof(TRAIN_BATCH_SIZES[0]);
+    for (int p = 0; p < 2; p++) {
+        for (uint32_t b = 0; b < num_sizes; b++) {
+            stoopidnet_training_parameters_t params = {
+                .learn_rate = 0.1,
+                .batch_size = TRAIN_BATCH_SIZES[b],
+                .loss = STOOPIDNET_LOSS_QUADRATIC,
+                .optimizer = STOOPIDNET_OPTIMIZER_SGD,
+                .num_threads = cfg->num_threads,
+            };
+            bench_job_t job = { .cfg = cfg, .params = &params };
+            bench_stats_t stats;
+            job.net = make_net(hidden, p ? STOOPIDNET_PRECISION_F32 : STOOPIDNET_PRECISION_F64);
+
+            bench_run(cfg, time_train, &job, &stats);
+            bench_report(cfg, "train", "train_u8", job.net, params.batch_size, cfg->count,
+                         "samples", &stats);
+            stoopidnet_destroy(job.net);
+        }
+    }
+}
+
+/**
+ * Reports a serdes result, naming it after the storage format unless that's native.
+ */
+static void report_serdes(bench_config_t* cfg, const char* name, const bench_job_t* job,
+                          const bench_stats_t* stats)
+{
+    char full[64];
+    if (job->storage == STOOPIDNET_STORAGE_NATIVE) {
+        snprintf(full, sizeof(full), "%s", name);
+    } else {
+        snprintf(full, sizeof(full), "%s_%s", name, stoopidnet_storage_name(job->storage));
+    }
+    bench_report(cfg, "serdes", full, job->net, 0, job->blob_len, "bytes", stats);
+}
+
+static void bench_serdes(bench_config_t* cfg)
+{
+    const uint32_t hidden[] = { SERDES_HIDDEN, 0 };
+    for (int p = 0; p < 2; p++) {
+        for (int f = 0; f < STOOPIDNET_NUM_STORAGES; f++) {
+            bench_job_t job = { .cfg = cfg, .storage = f };
+            bench_stats_t stats;
+            job.net = make_net(hidden, p ? STOOPIDNET_PRECISION_F32 : STOOPIDNET_PRECISION_F64);
+            job.blob_len = stoopidnet_serialize_with_storage(job.net, job.storage, &job.blob);
+            snprintf(job.model_path, sizeof(job.model_path), "%s/model.stoopidnet", cfg->dir);
+
+            bench_run(cfg, time_serialize, &job, &stats);
+            report_serdes(cfg, "serialize", &job, &stats);
+            bench_run(cfg, time_deserialize, &job, &stats);
+            report_serdes(cfg, "deserialize", &job, &stats);
+            bench_run(cfg, time_store, &job, &stats);
+            report_serdes(cfg, "store_to_file", &job, &stats);
+            bench_run(cfg, time_load, &job, &stats);
+            report_serdes(cfg, "load_from_file", &job, &stats);
+
+            unlink(job.model_path);
+            free(job.blob);
+            stoopidnet_destroy(job.net);
+        }
+    }
+}
+
+static void bench_loader(bench_config_t* cfg)
+{
+    bench_job_t job = { .cfg = cfg };
+    bench_stats_t stats;
+    bench_run(cfg, time_dataset_open, &job, &stats);
+    bench_report(cfg, "loader", "mnist_dataset_open", NULL, 0, cfg->ds->count, "samples",
+                 &stats);
+    bench_run(cfg, time_load_doubles, &job, &stats);
+    bench_report(cfg, "loader", "load_data_file_doubles", NULL, 0, cfg->ds->count, "samples",
+                 &stats);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// synthetic data
+
+static int write_be32(FILE* fp, uint32_t v)
+{
+    const uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+    return fwrite(b, 1, 4, fp) == 4;
+}
+
+/**
+ * Writes an MNIST-shaped pair of IDX files to cfg->data_path and cfg->label_path: count images
+ * that are mostly background with random strokes, and random labels. Returns 0 on failure.
+ */
+static int write_synthetic_dataset(bench_config_t* cfg, uint32_t count)
+{
+    int ok = 0;
+    FILE* images = fopen(cfg->data_path, "wb");
+    FILE* labels = fopen(cfg->label_path, "wb");
+    uint8_t* row = malloc(IMAGE_SIZE);
+    if ((images == NULL) || (labels == NULL)) {
+        goto cleanup;
+    }
+
+    if (!write_be32(images, 0x00000803) || !write_be32(images, count) ||
+        !write_be32(images, IMAGE_SIDE) || !write_be32(images, IMAGE_SIDE) ||
+        !write_be32(labels, 0x00000801) || !write_be32(labels, count)) {
+        goto cleanup;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < IMAGE_SIZE; j++) {
+            row[j] = ((rand() % 5) == 0) ? (rand() % 256) : 0;
+        }
+        const uint8_t label = rand() % NUM_CLASSES;
+        if ((fwrite(row, 1, IMAGE_SIZE, images) != IMAGE_SIZE) ||
+            (fwrite(&label, 1, 1, labels) != 1)) {
+            goto cleanup;
+        }
+    }
+    ok = 1;
+
+cleanup:
+    if ((images != NULL) && fclose(images)) {
+        ok = 0;
+    }
+    if ((labels != NULL) && fclose(labels)) {
+        ok = 0;
+    }
+    free(row);
+    return ok;
+}
+
+
+int main(int argc, char** argv)
+{
+    bench_config_t cfg = {
+        .trials = 5,
+        .warmup = 1,
+        .num_threads = 1,
+        .first_result = 1,
+    };
+    uint32_t count = 2000;
+    int synthetic = 0;
+    int argi = 1;
+    for (; (argi < argc) && !strncmp(argv[argi], "--", 2); argi++) {
+        if (!strcmp(argv[argi], "--synthetic")) {
+            synthetic = 1;
+        } else if (!strcmp(argv[argi], "--trials") && ((argi + 1) < argc)) {
+            cfg.trials = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--warmup") && ((argi + 1) < argc)) {
+            cfg.warmup = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--samples") && ((argi + 1) < argc)) {
+            count = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--threads") && ((argi + 1) < argc)) {
+            cfg.num_threads = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--only") && ((argi + 1) < argc)) {
+            cfg.only = argv[++argi];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[argi]);
+            return -1;
+        }
+    }
+
+    if ((cfg.trials < 1) || (cfg.warmup < 0) || (count == 0) ||
+        !(((argc - argi) == 2) || (synthetic && (argc == argi)))) {
+        printf("Usage: %s [--trials N] [--warmup N] [--samples N] [--threads N] [--only GROUP] "
+               "(--synthetic | <mnist data> <mnist labels>)\n", argv[0]);
+        printf("  --synthetic  time everything on generated MNIST-shaped data instead of files\n");
+        printf("  --trials N   timed runs of each benchmark (default 5)\n");
+        printf("  --warmup N   untimed runs before the timed ones (default 1)\n");
+        printf("  --samples N  number of images each run goes through (default 2000)\n");
+        printf("  --threads N  threads to train with\n");
+        printf("  --only GROUP just run one of evaluate, train, serdes or loader\n");
+        printf("Results are written to stdout as JSON. The SIMD kernels in use can be picked with "
+               "the\nSTOOPIDNET_KERNELS environment variable to compare them.\n");
+        return -1;
+    }
+
+    const char* tmp = getenv("TMPDIR");
+    snprintf(cfg.dir, sizeof(cfg.dir), "%s/stoopidnet-bench-XXXXXX", tmp ? tmp : "/tmp");
+    if (mkdtemp(cfg.dir) == NULL) {
+        fprintf(stderr, "Couldn't create a scratch directory in %s\n", tmp ? tmp : "/tmp");
+        return -1;
+    }
+
+    int ret = -1;
+    if (synthetic) {
+        srand(1);
+        snprintf(cfg.data_path, sizeof(cfg.data_path), "%s/images.idx", cfg.dir);
+        snprintf(cfg.label_path, sizeof(cfg.label_path), "%s/labels.idx", cfg.dir);
+        if (!write_synthetic_dataset(&cfg, count)) {
+            fprintf(stderr, "Couldn't write the synthetic dataset to %s\n", cfg.dir);
+            goto cleanup;
+        }
+    } else {
+        snprintf(cfg.data_path, sizeof(cfg.data_path), "%s", argv[argi]);
+        snprintf(cfg.label_path, sizeof(cfg.label_path), "%s", argv[argi + 1]);
+    }
+
+    cfg.ds = mnist_dataset_open(cfg.data_path, cfg.label_path);
+    if ((cfg.ds == NULL) || (cfg.ds->count == 0) || (cfg.ds->labels == NULL) ||
+        ((cfg.ds->width * cfg.ds->height) != IMAGE_SIZE)) {
+        fprintf(stderr, "Something went wrong loading the mnist files\n");
+        goto cleanup;
+    }
+    cfg.count = (cfg.ds->count < count) ? cfg.ds->count : count;
+    cfg.rows = malloc(cfg.count * sizeof(double*));
+    for (uint32_t i = 0; i < cfg.count; i++) {
+        cfg.rows[i] = malloc(IMAGE_SIZE * sizeof(double));
+        for (uint32_t j = 0; j < IMAGE_SIZE; j++) {
+            cfg.rows[i][j] = cfg.ds->images[(size_t)i * IMAGE_SIZE + j] / 255.0;
+        }
+    }
+
+    printf("{\n  \"kernels\": \"%s\",\n  \"data\": \"%s\",\n  \"samples\": %u,\n"
+           "  \"trials\": %d,\n  \"warmup\": %d,\n  \"threads\": %u,\n  \"results\": [",
+           stoopidnet_kernels()->name, synthetic ? "synthetic" : "mnist", cfg.count, cfg.trials,
+           cfg.warmup, cfg.num_threads);
+    if (want_group(&cfg, "evaluate")) {
+        bench_evaluate(&cfg);
+    }
+    if (want_group(&cfg, "train")) {
+        bench_train(&cfg);
+    }
+    if (want_group(&cfg, "serdes")) {
+        bench_serdes(&cfg);
+    }
+    if (want_group(&cfg, "loader")) {
+        bench_loader(&cfg);
+    }
+    printf("\n  ]\n}\n");
+    ret = 0;
+
+cleanup:
+    if (cfg.rows != NULL) {
+        for (uint32_t i = 0; i < cfg.count; i++) {
+            free(cfg.rows[i]);
+        }
+        free(cfg.rows);
+    }
+    if (cfg.ds != NULL) {
+        mnist_dataset_close(cfg.ds);
+    }
+    if (synthetic) {
+        unlink(cfg.data_path);
+        unlink(cfg.label_path);
+    }
+    rmdir(cfg.dir);
+    return ret;
+}
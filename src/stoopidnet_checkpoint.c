@@ -0,0 +1,302 @@
+// for clock_gettime, fileno and fsync
+#define _DEFAULT_SOURCE
+
+#include "stoopidnet_checkpoint.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * "SNck" when read as a little-endian uint32.
+ */
+#define CHECKPOINT_MAGIC 0x6b634e53
+#define CHECKPOINT_VERSION 1
+
+/**
+ * Neither of the two snapshot slots.
+ */
+#define NO_SLOT -1
+
+/**
+ * Start of a checkpoint file; the serialized net (stoopidnet_serialize) follows.
+ */
+typedef struct checkpoint_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t epoch;
+    uint64_t rng;
+    uint32_t position;
+    uint32_t reserved;
+    uint64_t model_bytes;
+    uint8_t pad[24];
+} checkpoint_header_t;
+
+struct stoopidnet_checkpointer
+{
+    char* file;
+    char* tmpfile;
+    uint32_t every_batches;
+    double every_seconds;
+
+    /**
+     * Only touched by the training thread.
+     */
+    uint64_t epoch;
+    uint32_t batches;
+    double last_time;
+
+    /**
+     * pending is the slot waiting to be written and writing the one being written, or NO_SLOT.
+     * A slot that's neither belongs to the training thread. Snapshots are made on first use.
+     */
+    stoopidnet_t* snapshots[2];
+    stoopidnet_checkpoint_info_t infos[2];
+    int pending;
+    int writing;
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+static void* checkpointer_main(void* arg);
+static int checkpoint_write(const char* file, const char* tmpfile, stoopidnet_t* net,
+                            const stoopidnet_checkpoint_info_t* info);
+static double now_seconds(void);
+
+
+stoopidnet_checkpointer_t* stoopidnet_checkpointer_create(const char* file, uint32_t every_batches,
+                                                          double every_seconds)
+{
+    stoopidnet_checkpointer_t* ck = calloc(1, sizeof(stoopidnet_checkpointer_t));
+    ck->file = strdup(file);
+    ck->tmpfile = malloc(strlen(file) + sizeof(".tmp"));
+    sprintf(ck->tmpfile, "%s.tmp", file);
+    ck->every_batches = every_batches;
+    ck->every_seconds = every_seconds;
+    ck->last_time = now_seconds();
+    ck->pending = NO_SLOT;
+    ck->writing = NO_SLOT;
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+
+    if (pthread_create(&ck->thread, NULL, checkpointer_main, ck) != 0) {
+        fprintf(stderr, "Failed to start checkpoint thread\n");
+        abort();
+    }
+
+    return ck;
+}
+
+
+void stoopidnet_checkpointer_destroy(stoopidnet_checkpointer_t* ck)
+{
+    if (ck == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&ck->lock);
+    ck->stop = 1;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+    pthread_join(ck->thread, NULL);
+
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->cond);
+    for (int i = 0; i < 2; i++) {
+        if (ck->snapshots[i] != NULL) {
+            stoopidnet_destroy(ck->snapshots[i]);
+        }
+    }
+    free(ck->tmpfile);
+    free(ck->file);
+    free(ck);
+}
+
+
+void stoopidnet_checkpointer_begin_epoch(stoopidnet_checkpointer_t* ck, uint64_t epoch)
+{
+    ck->epoch = epoch;
+}
+
+
+void stoopidnet_checkpointer_save(stoopidnet_checkpointer_t* ck, stoopidnet_t* net,
+                                  const stoopidnet_checkpoint_info_t* info)
+{
+    // take back the slot that isn't being written, even if it's still waiting to be: this
+    // checkpoint supersedes it.
+    pthread_mutex_lock(&ck->lock);
+    const int slot = (ck->writing == 0) ? 1 : 0;
+    if (ck->pending == slot) {
+        ck->pending = NO_SLOT;
+    }
+    pthread_mutex_unlock(&ck->lock);
+
+    // the slot is neither pending nor being written, so the writer won't touch it while it's
+    // copied.
+    if (ck->snapshots[slot] == NULL) {
+        ck->snapshots[slot] = stoopidnet_snapshot_with_state(net);
+    } else if (!stoopidnet_snapshot_update(ck->snapshots[slot], net)) {
+        stoopidnet_destroy(ck->snapshots[slot]);
+        ck->snapshots[slot] = stoopidnet_snapshot_with_state(net);
+    }
+
+    pthread_mutex_lock(&ck->lock);
+    ck->infos[slot] = *info;
+    ck->pending = slot;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+
+    ck->batches = 0;
+    ck->last_time = now_seconds();
+}
+
+
+void stoopidnet_checkpointer_batch_done(stoopidnet_checkpointer_t* ck, stoopidnet_t* net,
+                                        uint32_t position, uint64_t rng)
+{
+    ck->batches++;
+    const int due = ((ck->every_batches > 0) && (ck->batches >= ck->every_batches)) ||
+                    ((ck->every_seconds > 0) && ((now_seconds() - ck->last_time) >=
+                                                 ck->every_seconds));
+    if (due) {
+        const stoopidnet_checkpoint_info_t info = { ck->epoch, position, rng };
+        stoopidnet_checkpointer_save(ck, net, &info);
+    }
+}
+
+
+stoopidnet_t* stoopidnet_checkpoint_load(const char* file, stoopidnet_checkpoint_info_t* info)
+{
+    stoopidnet_t* net = NULL;
+    uint8_t* model = NULL;
+    checkpoint_header_t header;
+
+    FILE* fp = fopen(file, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s\n", file);
+        goto cleanup;
+    }
+
+    if ((fread(&header, sizeof(header), 1, fp) != 1) || (header.magic != CHECKPOINT_MAGIC)) {
+        fprintf(stderr, "%s isn't a checkpoint.\n", file);
+        goto cleanup;
+    }
+    if (header.version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "%s is a version %u checkpoint; only version %u is supported.\n", file,
+                header.version, CHECKPOINT_VERSION);
+        goto cleanup;
+    }
+    if ((header.model_bytes == 0) || (header.model_bytes > UINT32_MAX)) {
+        fprintf(stderr, "%s has a bad model size.\n", file);
+        goto cleanup;
+    }
+
+    model = malloc(header.model_bytes);
+    if (fread(model, 1, header.model_bytes, fp) != header.model_bytes) {
+        fprintf(stderr, "%s is truncated.\n", file);
+        goto cleanup;
+    }
+
+    net = stoopidnet_deserialize(model, (uint32_t)header.model_bytes);
+    if (net != NULL) {
+        info->epoch = header.epoch;
+        info->position = header.position;
+        info->rng = header.rng;
+    }
+
+cleanup:
+    free(model);
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    return net;
+}
+
+
+////////////////////////////////////////////////////////////////
+// static function impl
+////////////////////////////////////////////////////////////////
+static void* checkpointer_main(void* arg)
+{
+    stoopidnet_checkpointer_t* ck = arg;
+
+    pthread_mutex_lock(&ck->lock);
+    for (;;) {
+        // the last checkpoint still gets written before stopping.
+        while ((ck->pending == NO_SLOT) && !ck->stop) {
+            pthread_cond_wait(&ck->cond, &ck->lock);
+        }
+        if (ck->pending == NO_SLOT) {
+            break;
+        }
+        ck->writing = ck->pending;
+        ck->pending = NO_SLOT;
+        pthread_mutex_unlock(&ck->lock);
+
+        checkpoint_write(ck->file, ck->tmpfile, ck->snapshots[ck->writing],
+                         &ck->infos[ck->writing]);
+
+        pthread_mutex_lock(&ck->lock);
+        ck->writing = NO_SLOT;
+        pthread_cond_broadcast(&ck->cond);
+    }
+    pthread_mutex_unlock(&ck->lock);
+
+    return NULL;
+}
+
+static int checkpoint_write(const char* file, const char* tmpfile, stoopidnet_t* net,
+                            const stoopidnet_checkpoint_info_t* info)
+{
+    int retval = 0;
+    uint8_t* model = NULL;
+    const uint32_t model_bytes = stoopidnet_serialize(net, &model);
+    if (model_bytes == 0) {
+        fprintf(stderr, "Net is too big to checkpoint\n");
+        return 0;
+    }
+
+    const checkpoint_header_t header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .epoch = info->epoch,
+        .rng = info->rng,
+        .position = info->position,
+        .model_bytes = model_bytes,
+    };
+
+    // the checkpoint is synced to disk before it replaces the old one, so a crash at any point
+    // leaves one or the other whole.
+    FILE* fp = fopen(tmpfile, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s for writing\n", tmpfile);
+        goto cleanup;
+    }
+    const int written = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+                        (fwrite(model, 1, model_bytes, fp) == model_bytes) &&
+                        (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+    if ((fclose(fp) != 0) || !written || (rename(tmpfile, file) != 0)) {
+        fprintf(stderr, "Failed to write checkpoint %s\n", file);
+        remove(tmpfile);
+        goto cleanup;
+    }
+    retval = 1;
+
+cleanup:
+    free(model);
+    return retval;
+}
+
+static double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
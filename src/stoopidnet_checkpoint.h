@@ -0,0 +1,82 @@
+#ifndef STOOPIDNET_CHECKPOINT_H
+#define STOOPIDNET_CHECKPOINT_H
+
+/**
+ * Periodic checkpoints of a net while it trains, for picking training back up after a crash.
+ *
+ * A checkpoint holds the net's parameters and optimizer state along with where training was: the
+ * epoch, how far into that epoch's shuffled order, and the shuffle generator's state at the start
+ * of the epoch. Training resumed from one with the same parameters goes on exactly as if it had
+ * never stopped, except asynchronous training, which may redo or skip the minibatches that were
+ * in flight when the checkpoint was taken.
+ *
+ * Taking a checkpoint copies the net into one of two snapshots and returns; a background thread
+ * writes it out to a temporary file, syncs it and renames it over the checkpoint file, so the file
+ * is always either the old checkpoint or the new one. If the disk falls behind, the snapshot that
+ * hasn't started being written yet is replaced with the newer one, so training never waits on it.
+ */
+
+#include "stoopidnet.h"
+
+#include <stdint.h>
+
+typedef struct stoopidnet_checkpoint_info
+{
+    /**
+     * Epochs finished before this one.
+     */
+    uint64_t epoch;
+
+    /**
+     * Examples of this epoch's shuffled order already trained on; what to give
+     * stoopidnet_training_parameters_t::start.
+     */
+    uint32_t position;
+
+    /**
+     * State of the shuffle generator (stoopidnet_training_parameters_t::rng) before this epoch
+     * was shuffled.
+     */
+    uint64_t rng;
+} stoopidnet_checkpoint_info_t;
+
+/**
+ * Creates a checkpointer that writes to file, taking a checkpoint during training whenever
+ * every_batches minibatches or every_seconds seconds have passed since the last one. Either
+ * can be 0 to leave it out.
+ */
+stoopidnet_checkpointer_t* stoopidnet_checkpointer_create(const char* file, uint32_t every_batches,
+                                                          double every_seconds);
+
+/**
+ * Waits for the latest checkpoint to be written, then stops the writer thread.
+ */
+void stoopidnet_checkpointer_destroy(stoopidnet_checkpointer_t* ck);
+
+/**
+ * Sets the epoch that the checkpoints taken during the following training are tagged with.
+ */
+void stoopidnet_checkpointer_begin_epoch(stoopidnet_checkpointer_t* ck, uint64_t epoch);
+
+/**
+ * Takes a checkpoint of net now, e.g. at the end of an epoch. Must not be called while net is
+ * training, other than by training itself: from the training thread between minibatches, or
+ * from asynchronous training's first worker while the others keep updating the net.
+ */
+void stoopidnet_checkpointer_save(stoopidnet_checkpointer_t* ck, stoopidnet_t* net,
+                                  const stoopidnet_checkpoint_info_t* info);
+
+/**
+ * Called by training after every minibatch's update, with the examples done so far this epoch
+ * and the generator state the epoch started with. Takes a checkpoint if one is due.
+ */
+void stoopidnet_checkpointer_batch_done(stoopidnet_checkpointer_t* ck, stoopidnet_t* net,
+                                        uint32_t position, uint64_t rng);
+
+/**
+ * Loads the net saved in a checkpoint file and fills in info. Returns NULL if the file can't be
+ * read or isn't a checkpoint.
+ */
+stoopidnet_t* stoopidnet_checkpoint_load(const char* file, stoopidnet_checkpoint_info_t* info);
+
+#endif
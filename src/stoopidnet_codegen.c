@@ -0,0 +1,441 @@
+#include "stoopidnet.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Alignment of the generated weight arrays and activation buffers, in bytes; the widest vectors
+ * the generated code uses.
+ */
+#define CODEGEN_ALIGN 64
+
+/**
+ * Bytes' worth of nodes each input is multiplied into at a time, with the sums held in vector
+ * registers for the whole pass over the inputs: two AVX-512 vectors, four AVX or eight SSE/NEON
+ * ones. Layers are padded to whole tiles, so every row of the input-major weight arrays is made
+ * of them.
+ */
+#define CODEGEN_TILE 128
+
+/**
+ * Vector sizes the generated code has a version of its inner loops for, picked between by the
+ * compiler's target macros.
+ */
+static const uint32_t CODEGEN_VECTOR_BYTES[] = { 64, 32, 16 };
+
+/**
+ * Generated source lines are wrapped before they get this long.
+ */
+#define CODEGEN_LINE 100
+
+/**
+ * What the generated code is emitted in: C type, literal suffix and libm functions.
+ */
+typedef struct codegen_real
+{
+    const char* type;
+    const char* suffix;
+    const char* exp;
+    const char* tanh;
+    size_t size;
+} codegen_real_t;
+
+static const codegen_real_t CODEGEN_F32 = { "float", "f", "expf", "tanhf", sizeof(float) };
+static const codegen_real_t CODEGEN_F64 = { "double", "", "exp", "tanh", sizeof(double) };
+
+/**
+ * Everything the emitters need about the net being generated.
+ */
+typedef struct codegen
+{
+    FILE* fp;
+    const char* name;
+    const codegen_real_t* real;
+    uint32_t num_layers;
+    uint32_t* sizes;
+
+    /**
+     * sizes[i] rounded up to whole tiles.
+     */
+    uint32_t* padded;
+    stoopidnet_activation_t* activations;
+} codegen_t;
+
+static uint32_t pad_nodes(const codegen_t* cg, uint32_t n)
+{
+    const uint32_t lanes = CODEGEN_TILE / cg->real->size;
+    return ((n + lanes - 1) / lanes) * lanes;
+}
+
+/**
+ * Writes values as a brace-enclosed list of exact hexadecimal literals, wrapped at CODEGEN_LINE,
+ * with each line indented by indent spaces.
+ */
+static void emit_values(const codegen_t* cg, const double* values, uint32_t n, int indent)
+{
+    char literal[64];
+    int column = indent + 1;
+    fprintf(cg->fp, "%*s{", indent, "");
+    for (uint32_t i = 0; i < n; i++) {
+        const double v = (cg->real == &CODEGEN_F32) ? (double)(float)values[i] : values[i];
+        const int len = snprintf(literal, sizeof(literal), "%s%a%s%s", (i > 0) ? " " : "", v,
+                                 cg->real->suffix, (i < (n - 1)) ? "," : "");
+        if ((i > 0) && ((column + len) >= CODEGEN_LINE)) {
+            fprintf(cg->fp, "\n%*s", indent + 1, "");
+            column = indent + 1;
+            fputs(literal + 1, cg->fp);
+            column += len - 1;
+        } else {
+            fputs(literal, cg->fp);
+            column += len;
+        }
+    }
+    fprintf(cg->fp, "}");
+}
+
+/**
+ * Writes layer l's weights, transposed so that each input's weights to every node are
+ * contiguous, and its biases, both padded with zeros to the padded node count.
+ */
+static void emit_layer_params(const codegen_t* cg, stoopidnet_t* net, uint32_t l)
+{
+    const uint32_t in = cg->sizes[l - 1];
+    const uint32_t out = cg->sizes[l];
+    const uint32_t padded = cg->padded[l];
+    double* weights = malloc((size_t)in * out * sizeof(double));
+    double* biases = malloc(out * sizeof(double));
+    double* row = calloc(padded, sizeof(double));
+    stoopidnet_get_layer_params(net, l, weights, biases);
+
+    fprintf(cg->fp, "/**\n * Layer %u: %u -> %u, %s. w%u[k][j] is the weight from input k to node "
+            "j.\n */\n", l, in, out, stoopidnet_activation_name(cg->activations[l]), l);
+    fprintf(cg->fp, "static const %s %s_w%u[%u][%u] %s_ALIGN = {\n", cg->real->type, cg->name, l,
+            in, padded, cg->name);
+    for (uint32_t k = 0; k < in; k++) {
+        for (uint32_t j = 0; j < out; j++) {
+            row[j] = weights[((size_t)j * in) + k];
+        }
+        emit_values(cg, row, padded, 4);
+        fprintf(cg->fp, ",\n");
+    }
+    fprintf(cg->fp, "};\n\n");
+
+    memset(row, 0, padded * sizeof(double));
+    memcpy(row, biases, out * sizeof(double));
+    fprintf(cg->fp, "static const %s %s_b%u[%u] %s_ALIGN =\n", cg->real->type, cg->name, l,
+            padded, cg->name);
+    emit_values(cg, row, padded, 4);
+    fprintf(cg->fp, ";\n\n");
+
+    free(row);
+    free(biases);
+    free(weights);
+}
+
+/**
+ * Writes the statements that compute layer l's activations into a<l> from src.
+ */
+static void emit_layer_eval(const codegen_t* cg, uint32_t l, const char* src)
+{
+    FILE* fp = cg->fp;
+    const codegen_real_t* r = cg->real;
+    const uint32_t in = cg->sizes[l - 1];
+    const uint32_t out = cg->sizes[l];
+    const uint32_t padded = cg->padded[l];
+
+    // every input's contribution to a tile of the layer's nodes at once, the tile's sums kept in
+    // vector registers throughout. There's no reduction for the compiler to reassociate, so the
+    // sums come out the same either way.
+    fprintf(fp, "    // layer %u: %u -> %u, %s\n", l, in, out,
+            stoopidnet_activation_name(cg->activations[l]));
+    for (uint32_t i = 0; i < (sizeof(CODEGEN_VECTOR_BYTES) / sizeof(uint32_t)); i++) {
+        const uint32_t bytes = CODEGEN_VECTOR_BYTES[i];
+        const uint32_t tile = CODEGEN_TILE / bytes;
+        fprintf(fp, "#%s %s_VECTOR_BYTES == %u\n", (i == 0) ? "if" : "elif", cg->name, bytes);
+        fprintf(fp, "    for (int t = 0; t < %u; t += %u) {\n",
+                (uint32_t)((padded * r->size) / bytes), tile);
+        for (uint32_t v = 0; v < tile; v++) {
+            fprintf(fp, "        %s_vec acc%u = ((const %s_vec*)%s_b%u)[t + %u];\n", cg->name, v,
+                    cg->name, cg->name, l, v);
+        }
+        fprintf(fp, "        for (int k = 0; k < %u; k++) {\n", in);
+        fprintf(fp, "            const %s_vec* w = (const %s_vec*)%s_w%u[k] + t;\n", cg->name,
+                cg->name, cg->name, l);
+        for (uint32_t v = 0; v < tile; v++) {
+            fprintf(fp, "            acc%u += %s[k] * w[%u];\n", v, src, v);
+        }
+        fprintf(fp, "        }\n");
+        for (uint32_t v = 0; v < tile; v++) {
+            fprintf(fp, "        ((%s_vec*)a%u)[t + %u] = acc%u;\n", cg->name, l, v, v);
+        }
+        fprintf(fp, "    }\n");
+    }
+    fprintf(fp, "#else\n");
+    fprintf(fp, "    for (int j = 0; j < %u; j++) {\n", padded);
+    fprintf(fp, "        a%u[j] = %s_b%u[j];\n", l, cg->name, l);
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    for (int k = 0; k < %u; k++) {\n", in);
+    fprintf(fp, "        const %s x = %s[k];\n", r->type, src);
+    fprintf(fp, "        for (int j = 0; j < %u; j++) {\n", padded);
+    fprintf(fp, "            a%u[j] += x * %s_w%u[k][j];\n", l, cg->name, l);
+    fprintf(fp, "        }\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "#endif\n");
+
+    switch (cg->activations[l]) {
+    case STOOPIDNET_ACTIVATION_RELU:
+        fprintf(fp, "    for (int j = 0; j < %u; j++) {\n", padded);
+        fprintf(fp, "        a%u[j] = (a%u[j] > 0) ? a%u[j] : 0;\n", l, l, l);
+        fprintf(fp, "    }\n");
+        break;
+    case STOOPIDNET_ACTIVATION_LEAKY_RELU:
+        fprintf(fp, "    for (int j = 0; j < %u; j++) {\n", padded);
+        fprintf(fp, "        a%u[j] = (a%u[j] > 0) ? a%u[j] : (a%u[j] * (%s)0.01);\n", l, l, l,
+                l, r->type);
+        fprintf(fp, "    }\n");
+        break;
+    case STOOPIDNET_ACTIVATION_TANH:
+        fprintf(fp, "    for (int j = 0; j < %u; j++) {\n", padded);
+        fprintf(fp, "        a%u[j] = %s(a%u[j]);\n", l, r->tanh, l);
+        fprintf(fp, "    }\n");
+        break;
+    case STOOPIDNET_ACTIVATION_FAST_SIGMOID:
+        fprintf(fp, "    for (int j = 0; j < %u; j++) {\n", padded);
+        fprintf(fp, "        a%u[j] = 1 / (1 + %s_fast_exp(-a%u[j]));\n", l, cg->name, l);
+        fprintf(fp, "    }\n");
+        break;
+    case STOOPIDNET_ACTIVATION_SOFTMAX:
+        // only over the real nodes; shifting by the max keeps exp from overflowing.
+        fprintf(fp, "    {\n");
+        fprintf(fp, "        %s max = a%u[0];\n", r->type, l);
+        fprintf(fp, "        for (int j = 1; j < %u; j++) {\n", out);
+        fprintf(fp, "            max = (a%u[j] > max) ? a%u[j] : max;\n", l, l);
+        fprintf(fp, "        }\n");
+        fprintf(fp, "        %s sum = 0;\n", r->type);
+        fprintf(fp, "        for (int j = 0; j < %u; j++) {\n", out);
+        fprintf(fp, "            a%u[j] = %s(a%u[j] - max);\n", l, r->exp, l);
+        fprintf(fp, "            sum += a%u[j];\n", l);
+        fprintf(fp, "        }\n");
+        fprintf(fp, "        const %s scale = 1 / sum;\n", r->type);
+        fprintf(fp, "        for (int j = 0; j < %u; j++) {\n", out);
+        fprintf(fp, "            a%u[j] *= scale;\n", l);
+        fprintf(fp, "        }\n");
+        fprintf(fp, "    }\n");
+        break;
+    default:
+        fprintf(fp, "    for (int j = 0; j < %u; j++) {\n", padded);
+        fprintf(fp, "        a%u[j] = 1 / (1 + %s(-a%u[j]));\n", l, r->exp, l);
+        fprintf(fp, "    }\n");
+        break;
+    }
+    fprintf(fp, "\n");
+}
+
+/**
+ * The fast sigmoid's exp, the same polynomial the library uses.
+ */
+static void emit_fast_exp(const codegen_t* cg)
+{
+    FILE* fp = cg->fp;
+    const int f32 = (cg->real == &CODEGEN_F32);
+    const char* t = cg->real->type;
+    const char* s = cg->real->suffix;
+
+    fprintf(fp, "/**\n * exp(x) for the fast sigmoid, good to about float precision.\n */\n");
+    fprintf(fp, "static inline %s %s_fast_exp(%s x)\n{\n", t, cg->name, t);
+    fprintf(fp, "    x = (x < -80.%s) ? -80.%s : ((x > 80.%s) ? 80.%s : x);\n", s, s, s, s);
+    fprintf(fp, "    const %s y = x * %s;\n", t, f32 ? "1.44269504f" : "1.4426950408889634");
+    fprintf(fp, "    const int32_t k = (int32_t)(y + ((y < 0) ? -0.5%s : 0.5%s));\n", s, s);
+    fprintf(fp, "    const %s r = (y - (%s)k) * %s;\n", t, t,
+            f32 ? "0.693147181f" : "0.6931471805599453");
+    fprintf(fp, "    const %s p = 1.%s + r * (1.%s + r * (1.%s / 2 + r * (1.%s / 6 + "
+            "r * (1.%s / 24 +\n               r * (1.%s / 120 + r * (1.%s / 720))))));\n", t, s, s,
+            s, s, s, s, s);
+    if (f32) {
+        fprintf(fp, "    const int32_t bits = (k + 127) << 23;\n");
+    } else {
+        fprintf(fp, "    const int64_t bits = (int64_t)(k + 1023) << 52;\n");
+    }
+    fprintf(fp, "    %s scale;\n", t);
+    fprintf(fp, "    memcpy(&scale, &bits, sizeof(scale));\n");
+    fprintf(fp, "    return p * scale;\n}\n\n");
+}
+
+static int emit_source(const codegen_t* cg, stoopidnet_t* net, const char* model_file)
+{
+    FILE* fp = cg->fp;
+    const char* t = cg->real->type;
+    const char* n = cg->name;
+    const uint32_t last = cg->num_layers - 1;
+    int fast_exp = 0;
+    for (uint32_t l = 1; l <= last; l++) {
+        fast_exp |= (cg->activations[l] == STOOPIDNET_ACTIVATION_FAST_SIGMOID);
+    }
+
+    fprintf(fp, "/**\n * Generated by stoopidnet-codegen from %s.\n *\n * A", model_file);
+    for (uint32_t l = 0; l <= last; l++) {
+        fprintf(fp, "%s%u", (l > 0) ? "-" : " ", cg->sizes[l]);
+    }
+    fprintf(fp, " network with %s weights. It only needs libm. Declare\n", t);
+    fprintf(fp, " * whichever of these get called:\n *\n");
+    fprintf(fp, " *     void %s_evaluate(const %s* input, %s* output);\n", n, t, t);
+    fprintf(fp, " *     void %s_evaluate_batch(size_t n, const %s* inputs, %s* outputs);\n", n, t,
+            t);
+    fprintf(fp, " *     int %s_classify(const %s* input);\n *\n", n, t);
+    fprintf(fp, " * input holds %u values and output %u; batches are row-major, one example per "
+            "row.\n * classify returns the index of the largest output.\n */\n\n", cg->sizes[0],
+            cg->sizes[last]);
+
+    fprintf(fp, "#include <math.h>\n#include <stddef.h>\n");
+    if (fast_exp) {
+        fprintf(fp, "#include <stdint.h>\n#include <string.h>\n");
+    }
+    fprintf(fp, "\n#define %s_INPUTS %u\n#define %s_OUTPUTS %u\n\n", n, cg->sizes[0], n,
+            cg->sizes[last]);
+    // GCC and Clang get vector types as wide as the target has for the layers' sums; other
+    // compilers get plain loops.
+    fprintf(fp, "#if defined(__GNUC__)\n#define %s_ALIGN __attribute__((aligned(%d)))\n", n,
+            CODEGEN_ALIGN);
+    fprintf(fp, "#if defined(__AVX512F__)\n#define %s_VECTOR_BYTES 64\n"
+            "#elif defined(__AVX__)\n#define %s_VECTOR_BYTES 32\n"
+            "#else\n#define %s_VECTOR_BYTES 16\n#endif\n", n, n, n);
+    fprintf(fp, "typedef %s %s_vec __attribute__((vector_size(%s_VECTOR_BYTES), may_alias));\n",
+            t, n, n);
+    fprintf(fp, "#else\n#define %s_ALIGN\n#define %s_VECTOR_BYTES 0\n#endif\n\n", n, n);
+
+    fprintf(fp, "void %s_evaluate(const %s* input, %s* output);\n", n, t, t);
+    fprintf(fp, "void %s_evaluate_batch(size_t n, const %s* inputs, %s* outputs);\n", n, t, t);
+    fprintf(fp, "int %s_classify(const %s* input);\n\n", n, t);
+
+    for (uint32_t l = 1; l <= last; l++) {
+        emit_layer_params(cg, net, l);
+    }
+    if (fast_exp) {
+        emit_fast_exp(cg);
+    }
+
+    // evaluate: one fixed-size, aligned buffer per layer.
+    fprintf(fp, "void %s_evaluate(const %s* input, %s* output)\n{\n", n, t, t);
+    for (uint32_t l = 1; l <= last; l++) {
+        fprintf(fp, "    %s a%u[%u] %s_ALIGN;\n", t, l, cg->padded[l], n);
+    }
+    fprintf(fp, "\n");
+    for (uint32_t l = 1; l <= last; l++) {
+        char src[16] = "input";
+        if (l > 1) {
+            snprintf(src, sizeof(src), "a%u", l - 1);
+        }
+        emit_layer_eval(cg, l, src);
+    }
+    fprintf(fp, "    for (int j = 0; j < %s_OUTPUTS; j++) {\n", n);
+    fprintf(fp, "        output[j] = a%u[j];\n", last);
+    fprintf(fp, "    }\n}\n\n");
+
+    fprintf(fp, "void %s_evaluate_batch(size_t n, const %s* inputs, %s* outputs)\n{\n", n, t, t);
+    fprintf(fp, "    for (size_t i = 0; i < n; i++) {\n");
+    fprintf(fp, "        %s_evaluate(inputs + (i * %s_INPUTS), outputs + (i * %s_OUTPUTS));\n", n,
+            n, n);
+    fprintf(fp, "    }\n}\n\n");
+
+    fprintf(fp, "int %s_classify(const %s* input)\n{\n", n, t);
+    fprintf(fp, "    %s output[%s_OUTPUTS];\n", t, n);
+    fprintf(fp, "    %s_evaluate(input, output);\n", n);
+    fprintf(fp, "    int best = 0;\n");
+    fprintf(fp, "    for (int j = 1; j < %s_OUTPUTS; j++) {\n", n);
+    fprintf(fp, "        best = (output[j] > output[best]) ? j : best;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    return best;\n}\n");
+
+    return ferror(fp) ? -1 : 0;
+}
+
+/**
+ * Whether name can start C identifiers.
+ */
+static int valid_name(const char* name)
+{
+    if (!isalpha((unsigned char)name[0]) && (name[0] != '_')) {
+        return 0;
+    }
+    for (const char* c = name; *c != '\0'; c++) {
+        if (!isalnum((unsigned char)*c) && (*c != '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    // options come before the positional arguments.
+    int argi = 1;
+    const char* name = "stoopidnet_model";
+    int use_f32 = 0;
+    for (; (argi < argc) && !strncmp(argv[argi], "--", 2); argi++) {
+        if (!strcmp(argv[argi], "--name") && ((argi + 1) < argc)) {
+            name = argv[++argi];
+        } else if (!strcmp(argv[argi], "--f32")) {
+            use_f32 = 1;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[argi]);
+            return -1;
+        }
+    }
+
+    if (((argc - argi) != 2) || !valid_name(name)) {
+        printf("Usage: %s [--name NAME] [--f32] <stoopidnet input file> <C output file>\n",
+               argv[0]);
+        printf("  --name NAME  prefix of the generated functions, arrays and macros\n"
+               "               (default stoopidnet_model)\n");
+        printf("  --f32        generate float code for a double net (a float net always gets\n"
+               "               float code)\n");
+        return -1;
+    }
+    argv += argi - 1;
+
+    stoopidnet_t* net = stoopidnet_load_from_file(argv[1]);
+    if (net == NULL) {
+        return -1;
+    }
+
+    codegen_t cg = {
+        .name = name,
+        .real = (use_f32 || (stoopidnet_get_precision(net) == STOOPIDNET_PRECISION_F32)) ?
+                &CODEGEN_F32 : &CODEGEN_F64,
+        .num_layers = stoopidnet_get_num_layers(net),
+    };
+    cg.sizes = calloc(cg.num_layers, sizeof(uint32_t));
+    cg.padded = calloc(cg.num_layers, sizeof(uint32_t));
+    cg.activations = calloc(cg.num_layers, sizeof(stoopidnet_activation_t));
+    for (uint32_t l = 0; l < cg.num_layers; l++) {
+        cg.sizes[l] = stoopidnet_get_num_nodes_in_layer(net, l);
+        cg.padded[l] = pad_nodes(&cg, cg.sizes[l]);
+        cg.activations[l] = (l > 0) ? stoopidnet_get_layer_activation(net, l) :
+                                      STOOPIDNET_ACTIVATION_SIGMOID;
+    }
+
+    int retval = -1;
+    if (cg.num_layers < 2) {
+        fprintf(stderr, "%s has no layers to generate\n", argv[1]);
+        goto cleanup;
+    }
+    cg.fp = fopen(argv[2], "w");
+    if (cg.fp == NULL) {
+        fprintf(stderr, "Failed to open %s for writing\n", argv[2]);
+        goto cleanup;
+    }
+    retval = emit_source(&cg, net, argv[1]);
+    if ((fclose(cg.fp) != 0) || (retval != 0)) {
+        fprintf(stderr, "Failed to write %s\n", argv[2]);
+        retval = -1;
+    }
+
+cleanup:
+    free(cg.sizes);
+    free(cg.padded);
+    free(cg.activations);
+    stoopidnet_destroy(net);
+    return retval;
+}
@@ -0,0 +1,213 @@
+// for clock_gettime
+#define _DEFAULT_SOURCE
+
+#include "stoopidnet_evaluator.h"
+#include "math_util.h"
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Examples each scoring worker pushes through stoopidnet_evaluate_batch_u8 at once.
+ */
+#define EVALUATOR_CHUNK 256
+
+/**
+ * Neither of the two snapshot slots.
+ */
+#define NO_SLOT -1
+
+struct stoopidnet_evaluator
+{
+    uint32_t num_threads;
+    uint32_t n;
+    const uint8_t* inputs;
+    const uint8_t* labels;
+    stoopidnet_eval_fn fn;
+    void* ctx;
+
+    /**
+     * pending is the slot waiting to be scored and busy the one being scored, or NO_SLOT. A slot
+     * that's neither belongs to the submitter.
+     */
+    stoopidnet_t* snapshots[2];
+    uint64_t tags[2];
+    int pending;
+    int busy;
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+/**
+ * One scoring pass over the evaluator's examples; every worker counts its own contiguous share.
+ */
+typedef struct evaluator_job
+{
+    stoopidnet_evaluator_t* ev;
+    stoopidnet_t* net;
+    uint32_t* correct;
+} evaluator_job_t;
+
+static void* evaluator_main(void* arg);
+static void evaluator_score_share(void* ctx, uint32_t worker, uint32_t num_workers);
+
+
+stoopidnet_evaluator_t* stoopidnet_evaluator_create(stoopidnet_t* net, uint32_t num_threads,
+                                                    uint32_t n, const uint8_t* inputs,
+                                                    const uint8_t* labels, stoopidnet_eval_fn fn,
+                                                    void* ctx)
+{
+    stoopidnet_evaluator_t* ev = calloc(1, sizeof(stoopidnet_evaluator_t));
+    ev->num_threads = num_threads;
+    ev->n = n;
+    ev->inputs = inputs;
+    ev->labels = labels;
+    ev->fn = fn;
+    ev->ctx = ctx;
+    ev->snapshots[0] = stoopidnet_snapshot(net);
+    ev->snapshots[1] = stoopidnet_snapshot(net);
+    ev->pending = NO_SLOT;
+    ev->busy = NO_SLOT;
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+
+    if (pthread_create(&ev->thread, NULL, evaluator_main, ev) != 0) {
+        fprintf(stderr, "Failed to start evaluator thread\n");
+        abort();
+    }
+
+    return ev;
+}
+
+
+void stoopidnet_evaluator_destroy(stoopidnet_evaluator_t* ev)
+{
+    if (ev == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&ev->lock);
+    ev->stop = 1;
+    pthread_cond_broadcast(&ev->cond);
+    pthread_mutex_unlock(&ev->lock);
+    pthread_join(ev->thread, NULL);
+
+    pthread_mutex_destroy(&ev->lock);
+    pthread_cond_destroy(&ev->cond);
+    stoopidnet_destroy(ev->snapshots[0]);
+    stoopidnet_destroy(ev->snapshots[1]);
+    free(ev);
+}
+
+
+void stoopidnet_evaluator_submit(stoopidnet_evaluator_t* ev, stoopidnet_t* net, uint64_t tag)
+{
+    pthread_mutex_lock(&ev->lock);
+    while (ev->pending != NO_SLOT) {
+        pthread_cond_wait(&ev->cond, &ev->lock);
+    }
+    const int slot = (ev->busy == 0) ? 1 : 0;
+    pthread_mutex_unlock(&ev->lock);
+
+    // the slot is neither pending nor busy, so the evaluator won't touch it while it's copied.
+    stoopidnet_snapshot_update(ev->snapshots[slot], net);
+
+    pthread_mutex_lock(&ev->lock);
+    ev->tags[slot] = tag;
+    ev->pending = slot;
+    pthread_cond_broadcast(&ev->cond);
+    pthread_mutex_unlock(&ev->lock);
+}
+
+
+void stoopidnet_evaluator_wait(stoopidnet_evaluator_t* ev)
+{
+    pthread_mutex_lock(&ev->lock);
+    while ((ev->pending != NO_SLOT) || (ev->busy != NO_SLOT)) {
+        pthread_cond_wait(&ev->cond, &ev->lock);
+    }
+    pthread_mutex_unlock(&ev->lock);
+}
+
+
+////////////////////////////////////////////////////////////////
+// static function impl
+////////////////////////////////////////////////////////////////
+static void* evaluator_main(void* arg)
+{
+    stoopidnet_evaluator_t* ev = arg;
+    thread_pool_t* pool = thread_pool_create(ev->num_threads);
+    uint32_t* correct = calloc(thread_pool_size(pool), sizeof(uint32_t));
+
+    pthread_mutex_lock(&ev->lock);
+    for (;;) {
+        // anything still pending gets scored before stopping.
+        while ((ev->pending == NO_SLOT) && !ev->stop) {
+            pthread_cond_wait(&ev->cond, &ev->lock);
+        }
+        if (ev->pending == NO_SLOT) {
+            break;
+        }
+        ev->busy = ev->pending;
+        ev->pending = NO_SLOT;
+        pthread_cond_broadcast(&ev->cond);
+        pthread_mutex_unlock(&ev->lock);
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        evaluator_job_t job = { ev, ev->snapshots[ev->busy], correct };
+        thread_pool_run(pool, evaluator_score_share, &job);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        stoopidnet_eval_result_t result = {
+            .tag = ev->tags[ev->busy],
+            .count = ev->n,
+            .seconds = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9,
+        };
+        for (uint32_t i = 0; i < thread_pool_size(pool); i++) {
+            result.correct += correct[i];
+        }
+        ev->fn(ev->ctx, &result);
+
+        pthread_mutex_lock(&ev->lock);
+        ev->busy = NO_SLOT;
+        pthread_cond_broadcast(&ev->cond);
+    }
+    pthread_mutex_unlock(&ev->lock);
+
+    free(correct);
+    thread_pool_destroy(pool);
+    return NULL;
+}
+
+static void evaluator_score_share(void* ctx, uint32_t worker, uint32_t num_workers)
+{
+    evaluator_job_t* job = ctx;
+    const stoopidnet_evaluator_t* ev = job->ev;
+    const uint32_t width = stoopidnet_get_num_nodes_in_layer(job->net, 0);
+    const uint32_t out = stoopidnet_get_num_nodes_in_layer(job->net,
+                                                           stoopidnet_get_num_layers(job->net) - 1);
+    const uint32_t lo = (uint32_t)(((uint64_t)ev->n * worker) / num_workers);
+    const uint32_t hi = (uint32_t)(((uint64_t)ev->n * (worker + 1)) / num_workers);
+
+    double* outputs = malloc((size_t)EVALUATOR_CHUNK * out * sizeof(double));
+    uint32_t correct = 0;
+    for (uint32_t i = lo; i < hi; i += EVALUATOR_CHUNK) {
+        const uint32_t n = ((hi - i) < EVALUATOR_CHUNK) ? (hi - i) : EVALUATOR_CHUNK;
+        stoopidnet_evaluate_batch_u8(job->net, n, ev->inputs + ((size_t)i * width), outputs);
+        for (uint32_t j = 0; j < n; j++) {
+            if (maxidx(&outputs[(size_t)j * out], out) == ev->labels[i + j]) {
+                correct++;
+            }
+        }
+    }
+    free(outputs);
+
+    job->correct[worker] = correct;
+}
@@ -0,0 +1,67 @@
+#ifndef STOOPIDNET_EVALUATOR_H
+#define STOOPIDNET_EVALUATOR_H
+
+/**
+ * Scores snapshots of a net on a background thread while the net keeps training.
+ *
+ * The evaluator keeps two snapshots of the net: the one being scored and the next one to score.
+ * Submitting copies the net's parameters into the free one with a single memcpy and returns right
+ * away; the results are handed to a callback on the evaluator's thread once the snapshot has been
+ * scored.
+ */
+
+#include "stoopidnet.h"
+
+#include <stdint.h>
+
+typedef struct stoopidnet_evaluator stoopidnet_evaluator_t;
+
+typedef struct stoopidnet_eval_result
+{
+    /**
+     * Whatever was passed to the stoopidnet_evaluator_submit call that took the snapshot.
+     */
+    uint64_t tag;
+
+    /**
+     * Examples whose highest output was their label, out of count.
+     */
+    uint32_t correct;
+    uint32_t count;
+    double seconds;
+} stoopidnet_eval_result_t;
+
+/**
+ * Called on the evaluator's thread with each snapshot's results, in the order they were submitted.
+ */
+typedef void (*stoopidnet_eval_fn)(void* ctx, const stoopidnet_eval_result_t* result);
+
+/**
+ * Creates an evaluator for snapshots of net that scores the n examples in inputs (row-major
+ * bytes, laid out as for stoopidnet_evaluate_batch_u8) against their class labels, splitting them
+ * across num_threads threads (0 means one per online CPU). The data has to stay valid until the
+ * evaluator is destroyed.
+ */
+stoopidnet_evaluator_t* stoopidnet_evaluator_create(stoopidnet_t* net, uint32_t num_threads,
+                                                    uint32_t n, const uint8_t* inputs,
+                                                    const uint8_t* labels, stoopidnet_eval_fn fn,
+                                                    void* ctx);
+
+/**
+ * Waits for every submitted snapshot to be scored, then stops the evaluator's threads.
+ */
+void stoopidnet_evaluator_destroy(stoopidnet_evaluator_t* ev);
+
+/**
+ * Snapshots net's current parameters and queues them to be scored with the given tag. Only
+ * blocks if the evaluator is still busy with two earlier snapshots. Must not be called while net
+ * is training, and only from one thread.
+ */
+void stoopidnet_evaluator_submit(stoopidnet_evaluator_t* ev, stoopidnet_t* net, uint64_t tag);
+
+/**
+ * Waits for every submitted snapshot to be scored.
+ */
+void stoopidnet_evaluator_wait(stoopidnet_evaluator_t* ev);
+
+#endif
@@ -0,0 +1,226 @@
+// for posix_memalign
+#define _DEFAULT_SOURCE
+
+#include "stoopidnet_half.h"
+#include "stoopidnet_kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Weight rows start this many bytes apart, and are zero padded up to it.
+ */
+#define HALF_ROW_ALIGN 64
+
+/**
+ * Examples evaluated together. Each weight row is read once per block, and a block's activations
+ * for the widest layer stay in L2.
+ */
+#define HALF_BLOCK 16
+
+typedef struct stoopidnet_half_layer
+{
+    uint32_t in;
+    uint32_t out;
+    stoopidnet_activation_t activation;
+
+    /**
+     * out rows of stride elements each, pointing into the half net's weight slab.
+     */
+    size_t stride;
+    uint16_t* weights;
+    float* biases;
+} stoopidnet_half_layer_t;
+
+struct stoopidnet_half
+{
+    uint32_t num_layers;
+    uint32_t* layer_sizes;
+    uint32_t widest;
+
+    /**
+     * dot_f32_f16 or dot_f32_bf16, to match the weights.
+     */
+    float (*dot)(const float* x, const uint16_t* w, uint32_t n);
+
+    /**
+     * layers[i] holds the parameters feeding layer i + 1.
+     */
+    stoopidnet_half_layer_t* layers;
+    uint16_t* weight_slab;
+    size_t weight_slab_len;
+};
+
+static size_t round_up(size_t n, size_t to)
+{
+    return ((n + to - 1) / to) * to;
+}
+
+/**
+ * Evaluates n_inputs inputs, taken from the rows in inputs or, if that's NULL, from the row-major
+ * byte matrix inputs_u8.
+ */
+static void half_evaluate(stoopidnet_half_t* h, uint32_t n_inputs, double** inputs,
+                          const uint8_t* inputs_u8, double* outputs);
+
+
+stoopidnet_half_t* stoopidnet_half_create(stoopidnet_t* net, stoopidnet_storage_t format)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    if ((format != STOOPIDNET_STORAGE_F16) && (format != STOOPIDNET_STORAGE_BF16)) {
+        return NULL;
+    }
+    void (*narrow)(size_t, const float*, uint16_t*) = (format == STOOPIDNET_STORAGE_F16) ?
+                                                      kernels->f32_to_f16 : kernels->f32_to_bf16;
+
+    stoopidnet_half_t* h = calloc(1, sizeof(stoopidnet_half_t));
+    h->num_layers = stoopidnet_get_num_layers(net);
+    h->layer_sizes = calloc(h->num_layers, sizeof(uint32_t));
+    h->layers = calloc(h->num_layers - 1, sizeof(stoopidnet_half_layer_t));
+    h->dot = (format == STOOPIDNET_STORAGE_F16) ? kernels->dot_f32_f16 : kernels->dot_f32_bf16;
+
+    for (uint32_t i = 0; i < h->num_layers; i++) {
+        h->layer_sizes[i] = stoopidnet_get_num_nodes_in_layer(net, i);
+        h->widest = (h->layer_sizes[i] > h->widest) ? h->layer_sizes[i] : h->widest;
+    }
+
+    // lay out every layer's rows in one aligned slab.
+    for (uint32_t l = 0; l < (h->num_layers - 1); l++) {
+        stoopidnet_half_layer_t* layer = &h->layers[l];
+        layer->in = h->layer_sizes[l];
+        layer->out = h->layer_sizes[l + 1];
+        layer->activation = stoopidnet_get_layer_activation(net, l + 1);
+        layer->stride = round_up(layer->in, HALF_ROW_ALIGN / sizeof(uint16_t));
+        h->weight_slab_len += layer->stride * layer->out;
+    }
+    void* slab = NULL;
+    if (posix_memalign(&slab, HALF_ROW_ALIGN, h->weight_slab_len * sizeof(uint16_t)) != 0) {
+        stoopidnet_half_destroy(h);
+        return NULL;
+    }
+    h->weight_slab = slab;
+    memset(h->weight_slab, 0, h->weight_slab_len * sizeof(uint16_t));
+
+    // narrow each layer's parameters a row at a time.
+    uint16_t* rows = h->weight_slab;
+    float* row = malloc(h->widest * sizeof(float));
+    for (uint32_t l = 0; l < (h->num_layers - 1); l++) {
+        stoopidnet_half_layer_t* layer = &h->layers[l];
+        double* weights = malloc((size_t)layer->in * layer->out * sizeof(double));
+        double* biases = malloc(layer->out * sizeof(double));
+        stoopidnet_get_layer_params(net, l + 1, weights, biases);
+
+        layer->weights = rows;
+        layer->biases = malloc(layer->out * sizeof(float));
+        rows += layer->stride * layer->out;
+        for (uint32_t j = 0; j < layer->out; j++) {
+            const double* w = weights + ((size_t)j * layer->in);
+            for (uint32_t k = 0; k < layer->in; k++) {
+                row[k] = (float)w[k];
+            }
+            narrow(layer->in, row, layer->weights + (j * layer->stride));
+            layer->biases[j] = (float)biases[j];
+        }
+
+        free(weights);
+        free(biases);
+    }
+    free(row);
+
+    return h;
+}
+
+
+void stoopidnet_half_destroy(stoopidnet_half_t* h)
+{
+    if (h == NULL) {
+        return;
+    }
+
+    if (h->layers != NULL) {
+        for (uint32_t l = 0; l < (h->num_layers - 1); l++) {
+            free(h->layers[l].biases);
+        }
+    }
+    free(h->layers);
+    free(h->weight_slab);
+    free(h->layer_sizes);
+    free(h);
+}
+
+
+size_t stoopidnet_half_size(const stoopidnet_half_t* h)
+{
+    size_t bytes = h->weight_slab_len * sizeof(uint16_t);
+    for (uint32_t l = 0; l < (h->num_layers - 1); l++) {
+        bytes += h->layers[l].out * sizeof(float);
+    }
+    return bytes;
+}
+
+
+void stoopidnet_half_evaluate_batch(stoopidnet_half_t* h, uint32_t n_inputs, double** inputs,
+                                    double* outputs)
+{
+    half_evaluate(h, n_inputs, inputs, NULL, outputs);
+}
+
+
+void stoopidnet_half_evaluate_batch_u8(stoopidnet_half_t* h, uint32_t n_inputs,
+                                       const uint8_t* inputs, double* outputs)
+{
+    half_evaluate(h, n_inputs, NULL, inputs, outputs);
+}
+
+
+static void half_evaluate(stoopidnet_half_t* h, uint32_t n_inputs, double** inputs,
+                          const uint8_t* inputs_u8, double* outputs)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    const uint32_t in_size = h->layer_sizes[0];
+    const uint32_t out_size = h->layer_sizes[h->num_layers - 1];
+
+    // a block's activations ping-pong between two buffers, each holding the block's rows of one
+    // layer back to back.
+    float* act[2] = { malloc((size_t)HALF_BLOCK * h->widest * sizeof(float)),
+                      malloc((size_t)HALF_BLOCK * h->widest * sizeof(float)) };
+
+    for (uint32_t s0 = 0; s0 < n_inputs; s0 += HALF_BLOCK) {
+        const uint32_t nb = ((n_inputs - s0) < HALF_BLOCK) ? (n_inputs - s0) : HALF_BLOCK;
+        for (uint32_t b = 0; b < nb; b++) {
+            float* dst = act[0] + ((size_t)b * in_size);
+            if (inputs != NULL) {
+                for (uint32_t k = 0; k < in_size; k++) {
+                    dst[k] = (float)inputs[s0 + b][k];
+                }
+            } else {
+                const uint8_t* src = inputs_u8 + ((size_t)(s0 + b) * in_size);
+                for (uint32_t k = 0; k < in_size; k++) {
+                    dst[k] = src[k] / 255.0f;
+                }
+            }
+        }
+
+        for (uint32_t l = 0; l < (h->num_layers - 1); l++) {
+            const stoopidnet_half_layer_t* layer = &h->layers[l];
+            const float* src = act[l & 1];
+            float* dst = act[(l + 1) & 1];
+            for (uint32_t j = 0; j < layer->out; j++) {
+                const uint16_t* w = layer->weights + (j * layer->stride);
+                for (uint32_t b = 0; b < nb; b++) {
+                    dst[((size_t)b * layer->out) + j] =
+                        h->dot(src + ((size_t)b * layer->in), w, layer->in) + layer->biases[j];
+                }
+            }
+            kernels->activate_f32(layer->activation, nb, layer->out, dst, dst);
+        }
+
+        const float* result = act[(h->num_layers - 1) & 1];
+        for (size_t i = 0; i < ((size_t)nb * out_size); i++) {
+            outputs[((size_t)s0 * out_size) + i] = result[i];
+        }
+    }
+
+    free(act[0]);
+    free(act[1]);
+}
@@ -0,0 +1,45 @@
+#ifndef STOOPIDNET_HALF_H
+#define STOOPIDNET_HALF_H
+
+/**
+ * Inference with a trained stoopidnet's weights kept in 16 bits.
+ *
+ * Weights are stored as fp16 or bf16 and widened to float in registers by the dot product
+ * kernels, so every pass over them reads a half (float nets) or a quarter (double nets) of the
+ * bytes. Biases and activations stay float. Examples are evaluated in blocks that share each
+ * weight row while it's in cache. The half net is read-only; it can't be trained or serialized.
+ */
+
+#include "stoopidnet.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct stoopidnet_half stoopidnet_half_t;
+
+/**
+ * Builds a copy of net with its weights in format, STOOPIDNET_STORAGE_F16 or
+ * STOOPIDNET_STORAGE_BF16. Returns NULL for any other format.
+ */
+stoopidnet_half_t* stoopidnet_half_create(stoopidnet_t* net, stoopidnet_storage_t format);
+void stoopidnet_half_destroy(stoopidnet_half_t* h);
+
+/**
+ * Bytes taken up by the 16-bit weights and float biases.
+ */
+size_t stoopidnet_half_size(const stoopidnet_half_t* h);
+
+/**
+ * Same contract as stoopidnet_evaluate_batch: outputs must hold n_inputs * (size of the output
+ * layer) doubles. Safe to call from several threads at once.
+ */
+void stoopidnet_half_evaluate_batch(stoopidnet_half_t* h, uint32_t n_inputs, double** inputs,
+                                    double* outputs);
+
+/**
+ * Same as stoopidnet_half_evaluate_batch, for inputs laid out as in stoopidnet_evaluate_batch_u8.
+ */
+void stoopidnet_half_evaluate_batch_u8(stoopidnet_half_t* h, uint32_t n_inputs,
+                                       const uint8_t* inputs, double* outputs);
+
+#endif
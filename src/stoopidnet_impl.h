@@ -0,0 +1,717 @@
+/**
+ * Precision-generic numeric core of stoopidnet.
+ *
+ * This file is included by stoopidnet.c once per supported precision, with
+ *
+ *     REAL         the scalar type (double or float)
+ *     SN_FN(name)  name mangled with the precision's suffix, e.g. name##_f64
+ *
+ * defined beforehand. Everything in here is static and only ever sees matrices of REAL; any
+ * conversion from the caller's data type happens when inputs are packed, before these run.
+ */
+
+#ifndef REAL
+#error "stoopidnet_impl.h must be included from stoopidnet.c with REAL defined"
+#endif
+
+#define SN_WEIGHTS(net, l) (((REAL*)(net)->params) + (net)->weight_offsets[l])
+#define SN_BIASES(net, l)  (((REAL*)(net)->params) + (net)->bias_offsets[l])
+
+/**
+ * Aout = f(A * W^T + b) for a fully connected layer with activation function f.
+ *
+ * A is n x in, W is out x in, Aout is n x out. z is computed into Aout and then activated in
+ * place in one pass over the whole batch.
+ */
+static void SN_FN(fc_forward_batch)(const REAL* W, const REAL* b, stoopidnet_activation_t f,
+                                    uint32_t in, uint32_t out, const REAL* A, uint32_t n,
+                                    REAL* Aout)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    const uint32_t jblock = gemm_block_rows(in * sizeof(REAL));
+
+    for (uint32_t j0 = 0; j0 < out; j0 += jblock) {
+        const uint32_t j1 = ((j0 + jblock) < out) ? (j0 + jblock) : out;
+        for (uint32_t s = 0; s < n; s++) {
+            const REAL* a = A + ((size_t)s * in);
+            for (uint32_t j = j0; j < j1; j++) {
+                const REAL* w = W + ((size_t)j * in);
+                Aout[((size_t)s * out) + j] = kernels->SN_FN(dot)(w, a, in) + b[j];
+            }
+        }
+    }
+
+    kernels->SN_FN(activate)(f, n, out, Aout, Aout);
+}
+
+/**
+ * D_in = D_out * W, i.e. (W^T * d) for every example in the batch. D_out is n x out, W is
+ * out x in, D_in is n x in.
+ */
+static void SN_FN(fc_backprop_batch)(const REAL* W, uint32_t in, uint32_t out,
+                                     const REAL* D_out, uint32_t n, REAL* D_in)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    const uint32_t jblock = gemm_block_rows(in * sizeof(REAL));
+
+    memset(D_in, 0, (size_t)n * in * sizeof(REAL));
+    for (uint32_t j0 = 0; j0 < out; j0 += jblock) {
+        const uint32_t j1 = ((j0 + jblock) < out) ? (j0 + jblock) : out;
+        for (uint32_t s = 0; s < n; s++) {
+            REAL* d_in = D_in + ((size_t)s * in);
+            for (uint32_t j = j0; j < j1; j++) {
+                kernels->SN_FN(axpy)(in, D_out[((size_t)s * out) + j], W + ((size_t)j * in),
+                                     d_in);
+            }
+        }
+    }
+}
+
+/**
+ * G += D^T * A and g += sum of the rows of D, accumulating weight and bias gradients for a whole
+ * batch. D is n x out, A is n x in, G is out x in.
+ */
+static void SN_FN(fc_accumulate_grads_batch)(uint32_t in, uint32_t out, const REAL* D,
+                                             const REAL* A, uint32_t n, REAL* G, REAL* g)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    const uint32_t jblock = gemm_block_rows(in * sizeof(REAL));
+
+    for (uint32_t j0 = 0; j0 < out; j0 += jblock) {
+        const uint32_t j1 = ((j0 + jblock) < out) ? (j0 + jblock) : out;
+        for (uint32_t s = 0; s < n; s++) {
+            const REAL* d = D + ((size_t)s * out);
+            kernels->SN_FN(ger)(j1 - j0, in, d + j0, A + ((size_t)s * in),
+                                G + ((size_t)j0 * in), in);
+            for (uint32_t j = j0; j < j1; j++) {
+                g[j] += d[j];
+            }
+        }
+    }
+}
+
+/**
+ * Evaluates n row-major packed inputs using only the workspace's buffers. input may be one of
+ * the workspace's own buffers.
+ *
+ * The output layer is written to output (n x output layer size), or left in whichever workspace
+ * buffer is free if output is NULL. Returns a pointer to wherever the output layer ended up.
+ */
+static REAL* SN_FN(evaluate_rows)(stoopidnet_t* net, stoopidnet_workspace_t* ws,
+                                  const REAL* input, uint32_t n, REAL* output)
+{
+    const uint32_t last = net->num_layers - 1;
+    const REAL* src = input;
+    REAL* dst = (REAL*)input;
+    for (uint32_t l = 1; l < net->num_layers; l++) {
+        // the final layer goes straight into the caller's output rows; everything else lands in
+        // whichever workspace buffer isn't currently being read.
+        REAL* spare = (src == (REAL*)ws->act[0]) ? (REAL*)ws->act[1] : (REAL*)ws->act[0];
+        dst = ((l == last) && (output != NULL)) ? output : spare;
+        SN_FN(fc_forward_batch)(SN_WEIGHTS(net, l - 1), SN_BIASES(net, l - 1),
+                                net->activations[l - 1], net->layer_sizes[l - 1],
+                                net->layer_sizes[l], src, n, dst);
+        src = dst;
+    }
+
+    return dst;
+}
+
+/**
+ * Runs the first n rows of bufs->a[0] forward through the net, filling in a for every layer.
+ * Each layer is recorded in prof (if it isn't NULL) as done by the given worker.
+ */
+static void SN_FN(forward_batch)(stoopidnet_t* net, stoopidnet_batch_buffers_t* bufs, uint32_t n,
+                                 stoopidnet_profile_t* prof, uint32_t worker)
+{
+    assert(n <= bufs->capacity);
+
+    for (int l = 1; l < net->num_layers; l++) {
+        const uint32_t in  = net->layer_sizes[l - 1];
+        const uint32_t out = net->layer_sizes[l];
+        const uint64_t t0  = PROFILE_START(prof);
+        SN_FN(fc_forward_batch)(SN_WEIGHTS(net, l - 1), SN_BIASES(net, l - 1),
+                                net->activations[l - 1], in, out, bufs->a[l - 1], n, bufs->a[l]);
+        PROFILE_RECORD(prof, STOOPIDNET_PHASE_FORWARD, l, worker, t0, FC_FLOPS(in, out, n),
+                       FC_BYTES(in, out, n, sizeof(REAL)) + (out * sizeof(REAL)));
+    }
+}
+
+/**
+ * Backpropagates the first n examples packed into bufs (inputs in a[0], expected outputs in y)
+ * and adds the gradients of the given loss with respect to their weights and biases into grads,
+ * which has the parameter slab's layout. Each phase is recorded in prof as done by worker.
+ *
+ * If a0_active isn't NULL, it holds just num_active of the inputs' columns (n x num_active), the
+ * rest being zero for every example, and the first layer's weight gradients are accumulated
+ * against those alone: into an out x num_active matrix at the start of the first layer's weights
+ * in grads, rather than the whole out x in one.
+ */
+static void SN_FN(backprop_batch)(stoopidnet_t* net, stoopidnet_batch_buffers_t* bufs,
+                                  uint32_t n, stoopidnet_loss_t loss, REAL* grads,
+                                  const REAL* a0_active, uint32_t num_active,
+                                  stoopidnet_profile_t* prof, uint32_t worker)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    const uint32_t last = net->num_layers - 1;
+    REAL** a     = (REAL**)bufs->a;
+    REAL** delta = (REAL**)bufs->delta;
+    REAL*  y     = (REAL*)bufs->y;
+
+    // first run network forward and cache a-values.
+    SN_FN(forward_batch)(net, bufs, n, prof, worker);
+
+    // backpropagate
+    // final layer is special case:
+    // BP1: d_L = grada(C) hadamard f'(z_L). For cross-entropy against a softmax or sigmoid
+    // output, grada(C) is (a - y) / f'(z_L) and d_L is just a - y.
+    uint64_t t0 = PROFILE_START(prof);
+    for (uint32_t k = 0; k < n * net->layer_sizes[last]; k++) {
+        delta[last][k] = a[last][k] - y[k];
+    }
+    if (loss != STOOPIDNET_LOSS_CROSS_ENTROPY) {
+        kernels->SN_FN(activate_prime)(net->activations[last - 1], n, net->layer_sizes[last],
+                                       a[last], delta[last]);
+    }
+    PROFILE_RECORD(prof, STOOPIDNET_PHASE_BP1, last, worker, t0,
+                   (uint64_t)n * net->layer_sizes[last],
+                   3ull * n * net->layer_sizes[last] * sizeof(REAL));
+
+    // calc BP2: d_l = ((w_{l+1})_T * d_{l+1}) hadamard f'(z_l)
+    for (uint32_t l = last - 1; l > 0; l--) {
+        t0 = PROFILE_START(prof);
+        SN_FN(fc_backprop_batch)(SN_WEIGHTS(net, l), net->layer_sizes[l],
+                                 net->layer_sizes[l + 1], delta[l + 1], n, delta[l]);
+        kernels->SN_FN(activate_prime)(net->activations[l - 1], n, net->layer_sizes[l], a[l],
+                                       delta[l]);
+        PROFILE_RECORD(prof, STOOPIDNET_PHASE_BP2, l, worker, t0,
+                       FC_FLOPS(net->layer_sizes[l], net->layer_sizes[l + 1], n),
+                       FC_BYTES(net->layer_sizes[l], net->layer_sizes[l + 1], n, sizeof(REAL)));
+    }
+
+    // add to gradient vectors. Both the gradients and the batch are read, and the gradients
+    // written back.
+    for (uint32_t l = 1; l < net->num_layers; l++) {
+        const int compact = (l == 1) && (a0_active != NULL);
+        const uint32_t in  = compact ? num_active : net->layer_sizes[l - 1];
+        const uint32_t out = net->layer_sizes[l];
+        t0 = PROFILE_START(prof);
+        SN_FN(fc_accumulate_grads_batch)(in, out, delta[l], compact ? a0_active : a[l - 1], n,
+                                         grads + net->weight_offsets[l - 1],
+                                         grads + net->bias_offsets[l - 1]);
+        PROFILE_RECORD(prof, STOOPIDNET_PHASE_GRADIENTS, l, worker, t0,
+                       FC_FLOPS(in, out, n) + ((uint64_t)n * out),
+                       FC_BYTES(in, out, n, sizeof(REAL)) +
+                       (((uint64_t)in * out + 2ull * out) * sizeof(REAL)));
+    }
+}
+
+/**
+ * State shared by the workers training one epoch. Each worker owns grads[worker] and
+ * bufs[worker].
+ */
+struct SN_FN(train_job)
+{
+    stoopidnet_t* net;
+    const stoopidnet_training_parameters_t* params;
+    const stoopidnet_data_t* inputs;
+    const stoopidnet_data_t* outputs;
+    const int* shuffle;
+    uint32_t n_inputs;
+
+    /**
+     * Next unclaimed position in shuffle when training asynchronously.
+     */
+    uint32_t cursor;
+
+    /**
+     * The current minibatch is shuffle[batch_start, batch_start + batch_len).
+     */
+    uint32_t batch_start;
+    uint32_t batch_len;
+    REAL lrate;
+
+    /**
+     * Optimizer hyperparameters; adam is recomputed for every step.
+     */
+    REAL momentum;
+    stoopidnet_adam_step_t adam;
+
+    /**
+     * If non-NULL, the current minibatch has already been packed into these by the prefetcher.
+     */
+    const REAL* staged_a;
+    const REAL* staged_y;
+
+    /**
+     * With keep_pruned, keep[k] is 0 for the weights held at zero and 1 for every other parameter;
+     * otherwise NULL.
+     */
+    const uint8_t* keep;
+
+    uint32_t num_workers;
+    REAL** grads;
+    stoopidnet_batch_buffers_t** bufs;
+
+    /**
+     * When the stoopidnet_train call started, for progress reports.
+     */
+    uint64_t start;
+
+    /**
+     * State of the shuffle generator before this epoch was shuffled, for checkpoints.
+     */
+    uint64_t epoch_rng;
+};
+
+/**
+ * thread_pool_fn that computes the gradients for worker's contiguous share of the current
+ * minibatch into that worker's private gradient slab.
+ */
+static void SN_FN(train_batch_share)(void* ctx, uint32_t worker, uint32_t num_workers)
+{
+    struct SN_FN(train_job)* job = ctx;
+    stoopidnet_t* net = job->net;
+    const uint32_t last = net->num_layers - 1;
+
+    const uint32_t lo = (uint32_t)(((uint64_t)job->batch_len * worker) / num_workers);
+    const uint32_t hi = (uint32_t)(((uint64_t)job->batch_len * (worker + 1)) / num_workers);
+    const uint32_t n  = hi - lo;
+    const int* order  = job->shuffle + job->batch_start + lo;
+    stoopidnet_batch_buffers_t* bufs = job->bufs[worker];
+    stoopidnet_profile_t* prof = job->params->profile;
+
+    // reset gradient vectors
+    memset(job->grads[worker], 0, net->params_len * sizeof(REAL));
+    if (n == 0) {
+        return;
+    }
+
+    if (job->staged_a != NULL) {
+        // train on this worker's rows of the staged batch in place. backprop only reads a[0] and
+        // y, so they can borrow the staging buffer.
+        void* a0 = bufs->a[0];
+        void* y  = bufs->y;
+        bufs->a[0] = (REAL*)(job->staged_a + ((size_t)lo * net->layer_sizes[0]));
+        bufs->y    = (REAL*)(job->staged_y + ((size_t)lo * net->layer_sizes[last]));
+        SN_FN(backprop_batch)(net, bufs, n, job->params->loss, job->grads[worker], NULL, 0, prof,
+                              worker);
+        bufs->a[0] = a0;
+        bufs->y    = y;
+        return;
+    }
+
+    // gather the examples into contiguous rows
+    const uint64_t t0 = PROFILE_START(prof);
+    pack_data(bufs->a[0], net->precision, job->inputs, 0, order, n, net->layer_sizes[0]);
+    pack_data(bufs->y, net->precision, job->outputs, 0, order, n, net->layer_sizes[last]);
+    PROFILE_RECORD(prof, STOOPIDNET_PHASE_PACK, 0, worker, t0, 0,
+                   (uint64_t)n * (net->layer_sizes[0] + net->layer_sizes[last]) * sizeof(REAL));
+
+    SN_FN(backprop_batch)(net, bufs, n, job->params->loss, job->grads[worker], NULL, 0, prof,
+                          worker);
+}
+
+/**
+ * thread_pool_fn that sums every worker's gradients and applies the update, with each worker
+ * handling one slice of the parameter slab.
+ *
+ * The sum is a pairwise tree over worker index (0 += 1, 2 += 3, ... then 0 += 2, ...) that doesn't
+ * depend on which worker handles which slice, so results are bit-identical from run to run for a
+ * given thread count.
+ */
+static void SN_FN(train_reduce_update)(void* ctx, uint32_t worker, uint32_t num_workers)
+{
+    struct SN_FN(train_job)* job = ctx;
+    stoopidnet_t* net = job->net;
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    const uint32_t nbufs = job->num_workers;
+    stoopidnet_profile_t* prof = job->params->profile;
+
+    // slices are whole cache lines so workers never share one.
+    const size_t line  = PARAM_ALIGN / sizeof(REAL);
+    const size_t slice = ((((net->params_len + num_workers - 1) / num_workers) + line - 1) / line) *
+                         line;
+    const size_t lo = slice * worker;
+    const size_t hi = ((lo + slice) < net->params_len) ? (lo + slice) : net->params_len;
+    if (lo >= hi) {
+        return;
+    }
+
+    uint64_t t0 = PROFILE_START(prof);
+    uint64_t sums = 0;
+    for (uint32_t stride = 1; stride < nbufs; stride *= 2) {
+        for (uint32_t i = 0; (i + stride) < nbufs; i += 2 * stride) {
+            // an update with a rate of -1 is a plain sum.
+            kernels->SN_FN(update)(hi - lo, -1, job->grads[i + stride] + lo, job->grads[i] + lo);
+            sums++;
+        }
+    }
+    if (sums > 0) {
+        PROFILE_RECORD(prof, STOOPIDNET_PHASE_REDUCE, 0, worker, t0, sums * (hi - lo),
+                       3 * sums * (hi - lo) * sizeof(REAL));
+    }
+
+    // update network state with gradient.
+    // padding between tensors is zero in every slab, so it's safe to sweep the whole thing. The
+    // optimizer state is laid out like the parameters and gets sliced the same way.
+    // per element: flops, and elements read plus written.
+    uint32_t flops, elems;
+    const REAL* g = job->grads[0] + lo;
+    REAL* w = (REAL*)net->params + lo;
+    REAL* state = (REAL*)net->opt_state;
+    t0 = PROFILE_START(prof);
+    switch (net->optimizer) {
+    case STOOPIDNET_OPTIMIZER_MOMENTUM:
+    case STOOPIDNET_OPTIMIZER_NESTEROV:
+        kernels->SN_FN(momentum)(hi - lo, job->lrate, job->momentum,
+                                 net->optimizer == STOOPIDNET_OPTIMIZER_NESTEROV, g, state + lo, w);
+        flops = (net->optimizer == STOOPIDNET_OPTIMIZER_NESTEROV) ? 6 : 4;
+        elems = 5;
+        break;
+    case STOOPIDNET_OPTIMIZER_ADAM:
+        kernels->SN_FN(adam)(hi - lo, &job->adam, g, state + lo, state + net->params_len + lo, w);
+        flops = 13;
+        elems = 7;
+        break;
+    default:
+        kernels->SN_FN(update)(hi - lo, job->lrate, g, w);
+        flops = 2;
+        elems = 3;
+        break;
+    }
+
+    // the optimizer moves pruned weights like any others (momentum and Adam can even with a zero
+    // gradient), so they're put back afterwards.
+    if (job->keep != NULL) {
+        for (size_t k = 0; k < (hi - lo); k++) {
+            w[k] = job->keep[lo + k] ? w[k] : 0;
+        }
+    }
+    PROFILE_RECORD(prof, STOOPIDNET_PHASE_UPDATE, 0, worker, t0, (uint64_t)flops * (hi - lo),
+                   (uint64_t)elems * (hi - lo) * sizeof(REAL));
+}
+
+/**
+ * Adds the gradient g of parameter k straight to the shared weights, unless it's zero or k is
+ * held at zero. Returns whether it did.
+ */
+static inline int SN_FN(hogwild_apply)(const struct SN_FN(train_job)* job, REAL* params, size_t k,
+                                       REAL g)
+{
+    if ((g == 0) || ((job->keep != NULL) && !job->keep[k])) {
+        return 0;
+    }
+    REAL w;
+    __atomic_load(&params[k], &w, __ATOMIC_RELAXED);
+    w -= job->lrate * g;
+    __atomic_store(&params[k], &w, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * thread_pool_fn for asynchronous (Hogwild) training. Each worker repeatedly claims the next
+ * batch_size shuffled examples, computes their gradients against whatever the shared weights
+ * currently are, and applies the update straight to the shared weights.
+ *
+ * There are no locks. Updates read and write each parameter with relaxed atomics, so concurrent
+ * updates to the same weight can be lost but never torn. The forward and backward passes (and
+ * checkpoint snapshots) read the weights with the ordinary kernels' plain loads while other
+ * workers update them: that's a deliberate data race, and one batch's gradients may see some
+ * weights from before another worker's update and some from after it.
+ *
+ * The first layer's weight gradients are only built, cleared and applied for the input columns
+ * that are nonzero somewhere in the batch; for MNIST-like inputs that's a fraction of the first
+ * layer, which is most of the parameters, so workers do less work and rarely collide. The other
+ * layers are dense, and only their nonzero gradients are stored.
+ *
+ * Worker 0 takes the checkpoints, at the examples claimed so far. Batches other workers are still
+ * on may or may not have made it into the snapshot, and resuming skips them either way, so
+ * resuming asynchronous training doesn't pick up exactly where it stopped.
+ */
+static void SN_FN(train_hogwild_worker)(void* ctx, uint32_t worker, uint32_t num_workers)
+{
+    struct SN_FN(train_job)* job = ctx;
+    stoopidnet_t* net = job->net;
+    const uint32_t last = net->num_layers - 1;
+    const uint32_t batch_size = job->params->batch_size;
+    const uint32_t in = net->layer_sizes[0];
+    const uint32_t out = net->layer_sizes[1];
+    stoopidnet_batch_buffers_t* bufs = job->bufs[worker];
+    REAL* grads  = job->grads[worker];
+    REAL* params = (REAL*)net->params;
+    stoopidnet_profile_t* prof = job->params->profile;
+    uint64_t batches = 0;
+    uint64_t checkpointed = 0;
+
+    // the batch's active input columns, and the inputs narrowed down to just those.
+    uint8_t* active = malloc(in);
+    uint32_t* cols  = malloc(in * sizeof(uint32_t));
+    REAL* a0_active = malloc((size_t)batch_size * in * sizeof(REAL));
+    PROFILE_ALLOC(prof, 3, in + (in * sizeof(uint32_t)) +
+                           ((uint64_t)batch_size * in * sizeof(REAL)));
+
+    // everything but the first layer's weights is cleared once here and after every apply.
+    memset(grads, 0, net->params_len * sizeof(REAL));
+
+    for (;;) {
+        const uint32_t start = __atomic_fetch_add(&job->cursor, batch_size, __ATOMIC_RELAXED);
+        if (start >= job->n_inputs) {
+            break;
+        }
+        const uint32_t n = ((job->n_inputs - start) < batch_size) ? (job->n_inputs - start) :
+                                                                      batch_size;
+
+        uint64_t t0 = PROFILE_START(prof);
+        pack_data(bufs->a[0], net->precision, job->inputs, 0, job->shuffle + start, n, in);
+        pack_data(bufs->y, net->precision, job->outputs, 0, job->shuffle + start, n,
+                  net->layer_sizes[last]);
+        const REAL* a0 = (const REAL*)bufs->a[0];
+        memset(active, 0, in);
+        for (uint32_t s = 0; s < n; s++) {
+            for (uint32_t k = 0; k < in; k++) {
+                active[k] |= (a0[((size_t)s * in) + k] != 0);
+            }
+        }
+        uint32_t num_active = 0;
+        for (uint32_t k = 0; k < in; k++) {
+            cols[num_active] = k;
+            num_active += active[k];
+        }
+        for (uint32_t s = 0; s < n; s++) {
+            for (uint32_t c = 0; c < num_active; c++) {
+                a0_active[((size_t)s * num_active) + c] = a0[((size_t)s * in) + cols[c]];
+            }
+        }
+        PROFILE_RECORD(prof, STOOPIDNET_PHASE_PACK, 0, worker, t0, 0,
+                       (uint64_t)n * (in + num_active + net->layer_sizes[last]) * sizeof(REAL));
+
+        REAL* g1 = grads + net->weight_offsets[0];
+        memset(g1, 0, (size_t)out * num_active * sizeof(REAL));
+        SN_FN(backprop_batch)(net, bufs, n, job->params->loss, grads, a0_active, num_active, prof,
+                              worker);
+
+        // the first layer's weights through the active columns, then everything else, clearing
+        // the gradients behind it for the next batch.
+        t0 = PROFILE_START(prof);
+        uint64_t touched = 0;
+        uint64_t scanned = (uint64_t)out * num_active;
+        for (uint32_t j = 0; j < out; j++) {
+            const size_t row = net->weight_offsets[0] + ((size_t)j * in);
+            for (uint32_t c = 0; c < num_active; c++) {
+                touched += SN_FN(hogwild_apply)(job, params, row + cols[c],
+                                                g1[((size_t)j * num_active) + c]);
+            }
+        }
+        for (uint32_t l = 1; l <= last; l++) {
+            const size_t w = (l > 1) ? ((size_t)net->layer_sizes[l - 1] * net->layer_sizes[l]) : 0;
+            const size_t regions[2][2] = { { net->weight_offsets[l - 1], w },
+                                           { net->bias_offsets[l - 1], net->layer_sizes[l] } };
+            for (int r = 0; r < 2; r++) {
+                for (size_t k = regions[r][0]; k < (regions[r][0] + regions[r][1]); k++) {
+                    touched += SN_FN(hogwild_apply)(job, params, k, grads[k]);
+                    grads[k] = 0;
+                }
+                scanned += regions[r][1];
+            }
+        }
+        PROFILE_RECORD(prof, STOOPIDNET_PHASE_UPDATE, 0, worker, t0, 2 * touched,
+                       (scanned + (2 * touched)) * sizeof(REAL));
+        PROFILE_SAMPLES(prof, n, 1);
+
+        // only the calling thread reports progress and takes checkpoints, counting the examples
+        // claimed so far.
+        batches++;
+        if (worker != 0) {
+            continue;
+        }
+        const uint32_t claimed = __atomic_load_n(&job->cursor, __ATOMIC_RELAXED);
+        const uint32_t position = (claimed < job->n_inputs) ? claimed : job->n_inputs;
+        if ((claimed < job->n_inputs) &&
+            ((job->params->progress_interval == 0) ||
+             ((batches % job->params->progress_interval) == 0))) {
+            report_progress(job->params, claimed, job->n_inputs, claimed / batch_size, job->start);
+        }
+        if (job->params->checkpointer != NULL) {
+            // every batch claimed since the last time counts towards the next checkpoint.
+            const uint64_t claimed_batches = (position - job->params->start + batch_size - 1) /
+                                             batch_size;
+            for (; checkpointed < claimed_batches; checkpointed++) {
+                stoopidnet_checkpointer_batch_done(job->params->checkpointer, net, position,
+                                                   job->epoch_rng);
+            }
+        }
+    }
+
+    free(active);
+    free(cols);
+    free(a0_active);
+}
+
+/**
+ * One epoch of minibatch SGD. Examples are gathered out of inputs and outputs, and converted into
+ * the net's precision, a minibatch at a time.
+ *
+ * With params->num_threads > 1, every minibatch is split across a pool of workers that each
+ * accumulate into their own gradient slab, and the slabs are summed before the update. If
+ * params->asynchronous is set (and the optimizer is SGD) the workers run Hogwild-style instead.
+ *
+ * The net's optimizer state has to be set up for params->optimizer already. The examples are
+ * shuffled with *rng, and training starts params->start examples into the shuffled order. start is
+ * when the stoopidnet_train call began (a stoopidnet_profile_now timestamp).
+ */
+static void SN_FN(train)(stoopidnet_t* net,
+                         const stoopidnet_training_parameters_t* params,
+                         uint32_t n_inputs,
+                         const stoopidnet_data_t* inputs,
+                         const stoopidnet_data_t* outputs,
+                         uint64_t* rng,
+                         uint64_t start)
+{
+    stoopidnet_profile_t* prof = params->profile;
+    const uint32_t nthreads = (params->num_threads > 1) ? params->num_threads : 1;
+    const int hogwild = (nthreads > 1) && params->asynchronous &&
+                        (params->optimizer == STOOPIDNET_OPTIMIZER_SGD);
+
+    // synchronous workers each take a slice of every minibatch; hogwild workers take whole ones.
+    const uint32_t share = hogwild ? params->batch_size :
+                                     ((params->batch_size + nthreads - 1) / nthreads);
+
+    struct SN_FN(train_job) job = {
+        .net = net,
+        .params = params,
+        .inputs = inputs,
+        .outputs = outputs,
+        .n_inputs = n_inputs,
+        .cursor = params->start,
+        .lrate = (REAL)(params->learn_rate / ((double)params->batch_size)),
+        .momentum = (REAL)((params->momentum != 0) ? params->momentum : 0.9),
+        .num_workers = nthreads,
+        .start = start,
+        .epoch_rng = *rng,
+    };
+    job.adam.beta1   = (params->momentum != 0) ? params->momentum : 0.9;
+    job.adam.beta2   = (params->beta2 != 0) ? params->beta2 : 0.999;
+    job.adam.epsilon = (params->epsilon != 0) ? params->epsilon : 1e-8;
+
+    // the mask is taken from the weights as they are now, so it holds for the whole call.
+    uint8_t* keep = NULL;
+    if (params->keep_pruned) {
+        const REAL* w = net->params;
+        keep = malloc(net->params_len);
+        memset(keep, 1, net->params_len);
+        for (uint32_t l = 0; l < (net->num_layers - 1); l++) {
+            const size_t lo = net->weight_offsets[l];
+            const size_t hi = lo + ((size_t)net->layer_sizes[l] * net->layer_sizes[l + 1]);
+            for (size_t k = lo; k < hi; k++) {
+                keep[k] = (w[k] != 0);
+            }
+        }
+    }
+    job.keep = keep;
+
+    // shuffle training examples. Checkpoints record the generator's state from before the shuffle
+    // so that resuming can deal out the same order again.
+    const uint64_t epoch_rng = job.epoch_rng;
+    int* shuffle = gen_shuffled_ints(n_inputs, rng);
+    job.shuffle = shuffle;
+
+    // setup per-worker arrays for accumulating gradients over training mini-batch. They share the
+    // parameter slab's layout so reduction and update can run as flat passes.
+    job.grads = calloc(nthreads, sizeof(REAL*));
+    job.bufs  = calloc(nthreads, sizeof(stoopidnet_batch_buffers_t*));
+    for (uint32_t t = 0; t < nthreads; t++) {
+        job.grads[t] = param_slab_alloc(net->params_len * sizeof(REAL));
+        job.bufs[t]  = stoopidnet_batch_buffers_create(net, share, prof);
+    }
+    PROFILE_ALLOC(prof, 3 + nthreads, ((uint64_t)n_inputs * sizeof(int)) +
+                  (nthreads * (sizeof(REAL*) + sizeof(stoopidnet_batch_buffers_t*) +
+                               (net->params_len * sizeof(REAL)))));
+
+    thread_pool_t* pool = (nthreads > 1) ? thread_pool_create(nthreads) : NULL;
+
+    // hogwild workers do the whole epoch themselves, so there are no minibatches left for the
+    // loop below.
+    const uint32_t n_total = n_inputs;
+    uint64_t batches = 0;
+    if (hogwild) {
+        thread_pool_run(pool, SN_FN(train_hogwild_worker), &job);
+        batches = (n_inputs - params->start + params->batch_size - 1) / params->batch_size;
+        n_inputs = 0;
+    }
+
+    stoopidnet_prefetch_t* pf = NULL;
+    if (params->prefetch && (n_inputs > 0)) {
+        pf = stoopidnet_prefetch_start(net, inputs, outputs, shuffle + params->start,
+                                       n_inputs - params->start, params->batch_size, prof);
+    }
+
+    // do mini batches
+    for (uint32_t i = params->start; i < n_inputs; i += job.batch_len) {
+        job.batch_start = i;
+        job.batch_len = ((n_inputs - i) < params->batch_size) ? (n_inputs - i) :
+                                                                 params->batch_size;
+
+        if (pf != NULL) {
+            const void* a;
+            const void* y;
+            const uint64_t t0 = PROFILE_START(prof);
+            stoopidnet_prefetch_next(pf, &a, &y);
+            PROFILE_RECORD(prof, STOOPIDNET_PHASE_PREFETCH_WAIT, 0, 0, t0, 0, 0);
+            job.staged_a = a;
+            job.staged_y = y;
+        }
+
+        if (pool != NULL) {
+            thread_pool_run(pool, SN_FN(train_batch_share), &job);
+        } else {
+            SN_FN(train_batch_share)(&job, 0, 1);
+        }
+
+        // the gradients are in, so the staged batch can be reused while they're applied.
+        if (pf != NULL) {
+            stoopidnet_prefetch_release(pf);
+        }
+
+        // Adam works on the mean gradient, with its moments' bias corrections for this step.
+        net->opt_step++;
+        if (net->optimizer == STOOPIDNET_OPTIMIZER_ADAM) {
+            job.adam.gscale = 1.0 / job.batch_len;
+            job.adam.rate   = params->learn_rate / (1 - pow(job.adam.beta1, (double)net->opt_step));
+            job.adam.vscale = 1 / (1 - pow(job.adam.beta2, (double)net->opt_step));
+        }
+
+        if (pool != NULL) {
+            thread_pool_run(pool, SN_FN(train_reduce_update), &job);
+        } else {
+            SN_FN(train_reduce_update)(&job, 0, 1);
+        }
+
+        PROFILE_SAMPLES(prof, job.batch_len, 1);
+        batches++;
+        const uint32_t done = i + job.batch_len;
+        if ((done < n_inputs) && ((params->progress_interval == 0) ||
+                                  ((batches % params->progress_interval) == 0))) {
+            report_progress(params, done, n_inputs, batches, start);
+        }
+        if (params->checkpointer != NULL) {
+            stoopidnet_checkpointer_batch_done(params->checkpointer, net, done, epoch_rng);
+        }
+    }
+
+    stoopidnet_prefetch_stop(pf);
+    report_progress(params, n_total, n_total, batches, start);
+
+    thread_pool_destroy(pool);
+    for (uint32_t t = 0; t < nthreads; t++) {
+        free(job.grads[t]);
+        stoopidnet_batch_buffers_destroy(net, job.bufs[t]);
+    }
+    free(job.grads);
+    free(job.bufs);
+    free(keep);
+    free(shuffle);
+}
+
+#undef SN_WEIGHTS
+#undef SN_BIASES
@@ -0,0 +1,1338 @@
+#include "stoopidnet_kernels.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+
+#define TARGET_SSE2   __attribute__((target("sse2")))
+#define TARGET_AVX2   __attribute__((target("avx2,fma,f16c")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define TARGET_AVX512VNNI __attribute__((target("avx512f,avx512bw,avx512vnni")))
+#endif
+
+#define TARGET_SCALAR
+
+/**
+ * Slope of STOOPIDNET_ACTIVATION_LEAKY_RELU for negative z.
+ */
+#define LEAKY_RELU_SLOPE 0.01
+
+/**
+ * exp(x) for the fast sigmoid, good to about float precision. x is split into k ln2 + r with
+ * |r| <= ln2 / 2, e^r comes from a degree 6 polynomial and 2^k is built straight into the
+ * exponent bits. It's all plain arithmetic, so loops over it vectorize where exp() calls might
+ * not. x is clamped to +-80, which is plenty for a sigmoid.
+ */
+static inline float fast_exp_f32(float x)
+{
+    x = (x < -80.f) ? -80.f : ((x > 80.f) ? 80.f : x);
+    const float y = x * 1.44269504f;
+    const int32_t k = (int32_t)(y + ((y < 0) ? -0.5f : 0.5f));
+    const float r = (y - (float)k) * 0.693147181f;
+    const float p = 1.f + r * (1.f + r * (1.f / 2 + r * (1.f / 6 + r * (1.f / 24 +
+                    r * (1.f / 120 + r * (1.f / 720))))));
+
+    const int32_t bits = (k + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+static inline double fast_exp_f64(double x)
+{
+    x = (x < -80.) ? -80. : ((x > 80.) ? 80. : x);
+    const double y = x * 1.4426950408889634;
+    const int32_t k = (int32_t)(y + ((y < 0) ? -0.5 : 0.5));
+    const double r = (y - (double)k) * 0.6931471805599453;
+    const double p = 1. + r * (1. + r * (1. / 2 + r * (1. / 6 + r * (1. / 24 +
+                     r * (1. / 120 + r * (1. / 720))))));
+
+    const int64_t bits = (int64_t)(k + 1023) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+/**
+ * Scalar fp16 and bf16 conversions, for the portable kernels and the vector kernels' tails.
+ */
+static inline float f16_to_float(uint16_t h)
+{
+    const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    const uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        // NaNs come out quiet, as they do from F16C.
+        bits = sign | 0x7f800000 | (mant << 13) | (mant ? 0x400000 : 0);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // subnormal; every one of them is a normal float.
+        uint32_t e = 113;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            e--;
+        }
+        bits = sign | (e << 23) | ((mant & 0x3ff) << 13);
+    }
+
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint16_t float_to_f16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+
+    if (x >= 0x7f800000) {
+        return sign | 0x7c00 | ((x > 0x7f800000) ? 0x200 : 0);
+    }
+    if (x >= 0x477ff000) {
+        // at least halfway between 65504 and 65536, so it rounds to infinity.
+        return sign | 0x7c00;
+    }
+    if (x < 0x38800000) {
+        // below 2^-14: a subnormal, counted in units of 2^-24, or zero.
+        if (x <= 0x33000000) {
+            return sign;
+        }
+        const uint32_t shift = 126 - (x >> 23);
+        const uint32_t m = (x & 0x7fffff) | 0x800000;
+        const uint32_t q = m >> shift;
+        const uint32_t rem = m & ((1u << shift) - 1);
+        const uint32_t half = 1u << (shift - 1);
+        return sign | (q + ((rem > half) || ((rem == half) && (q & 1))));
+    }
+
+    // rebias the exponent from 127 to 15 and round off 13 bits; a carry runs into the exponent.
+    const uint32_t r = x - 0x38000000;
+    return sign | ((r + 0xfff + ((r >> 13) & 1)) >> 13);
+}
+
+static inline float bf16_to_float(uint16_t h)
+{
+    const uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint16_t float_to_bf16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) {
+        // keep NaNs NaN (and quiet) rather than letting the rounding carry them into infinity.
+        return (x >> 16) | 0x40;
+    }
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+/**
+ * The activation kernels are elementwise loops with no cross-iteration dependencies (or, for
+ * softmax, a few of them per row), so rather than being written out in intrinsics they're stamped
+ * out under each instruction set's target attribute and left to the compiler to vectorize. Every
+ * case is its own loop so that the activation switch isn't inside any of them.
+ */
+#define DEFINE_ACTIVATION_KERNELS(isa, target, sfx, real, expfn, tanhfn)                        \
+    target static void activate_##sfx##_##isa(stoopidnet_activation_t f, uint32_t rows,         \
+                                              uint32_t width, const real* z, real* a)           \
+    {                                                                                           \
+        const size_t n = (size_t)rows * width;                                                  \
+        switch (f) {                                                                            \
+        case STOOPIDNET_ACTIVATION_RELU:                                                        \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                a[i] = (z[i] > 0) ? z[i] : 0;                                                   \
+            }                                                                                   \
+            break;                                                                              \
+        case STOOPIDNET_ACTIVATION_LEAKY_RELU:                                                  \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                a[i] = (z[i] > 0) ? z[i] : (z[i] * (real)LEAKY_RELU_SLOPE);                     \
+            }                                                                                   \
+            break;                                                                              \
+        case STOOPIDNET_ACTIVATION_TANH:                                                        \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                a[i] = tanhfn(z[i]);                                                            \
+            }                                                                                   \
+            break;                                                                              \
+        case STOOPIDNET_ACTIVATION_FAST_SIGMOID:                                                \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                a[i] = (real)1 / ((real)1 + fast_exp_##sfx(-z[i]));                             \
+            }                                                                                   \
+            break;                                                                              \
+        case STOOPIDNET_ACTIVATION_SOFTMAX:                                                     \
+            /* shifting by the row's max keeps exp from overflowing. */                         \
+            for (uint32_t r = 0; r < rows; r++) {                                               \
+                const real* zr = z + ((size_t)r * width);                                       \
+                real* ar = a + ((size_t)r * width);                                             \
+                real max = zr[0];                                                               \
+                for (uint32_t i = 1; i < width; i++) {                                          \
+                    max = (zr[i] > max) ? zr[i] : max;                                          \
+                }                                                                               \
+                real sum = 0;                                                                   \
+                for (uint32_t i = 0; i < width; i++) {                                          \
+                    ar[i] = expfn(zr[i] - max);                                                 \
+                    sum += ar[i];                                                               \
+                }                                                                               \
+                const real scale = (real)1 / sum;                                               \
+                for (uint32_t i = 0; i < width; i++) {                                          \
+                    ar[i] *= scale;                                                             \
+                }                                                                               \
+            }                                                                                   \
+            break;                                                                              \
+        default:                                                                                \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                a[i] = (real)1 / ((real)1 + expfn(-z[i]));                                      \
+            }                                                                                   \
+            break;                                                                              \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    target static void activate_prime_##sfx##_##isa(stoopidnet_activation_t f, uint32_t rows,  \
+                                                    uint32_t width, const real* a, real* d)     \
+    {                                                                                           \
+        const size_t n = (size_t)rows * width;                                                  \
+        switch (f) {                                                                            \
+        case STOOPIDNET_ACTIVATION_RELU:                                                        \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                d[i] = (a[i] > 0) ? d[i] : 0;                                                   \
+            }                                                                                   \
+            break;                                                                              \
+        case STOOPIDNET_ACTIVATION_LEAKY_RELU:                                                  \
+            /* a > 0 exactly when z > 0, since the slope is positive. */                        \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                d[i] = (a[i] > 0) ? d[i] : (d[i] * (real)LEAKY_RELU_SLOPE);                     \
+            }                                                                                   \
+            break;                                                                              \
+        case STOOPIDNET_ACTIVATION_TANH:                                                        \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                d[i] *= (real)1 - (a[i] * a[i]);                                                \
+            }                                                                                   \
+            break;                                                                              \
+        case STOOPIDNET_ACTIVATION_SOFTMAX:                                                     \
+            /* J = diag(a) - a a^T, so J d = a * (d - dot(a, d)). */                            \
+            for (uint32_t r = 0; r < rows; r++) {                                               \
+                const real* ar = a + ((size_t)r * width);                                       \
+                real* dr = d + ((size_t)r * width);                                             \
+                real dot = 0;                                                                   \
+                for (uint32_t i = 0; i < width; i++) {                                          \
+                    dot += ar[i] * dr[i];                                                       \
+                }                                                                               \
+                for (uint32_t i = 0; i < width; i++) {                                          \
+                    dr[i] = ar[i] * (dr[i] - dot);                                              \
+                }                                                                               \
+            }                                                                                   \
+            break;                                                                              \
+        default:                                                                                \
+            /* both sigmoids. */                                                                \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                d[i] *= a[i] * ((real)1 - a[i]);                                                \
+            }                                                                                   \
+            break;                                                                              \
+        }                                                                                       \
+    }
+
+/**
+ * The optimizer updates are elementwise too, and get the same treatment. Each reads the gradient
+ * and its state once and writes the state and the weight once.
+ */
+#define DEFINE_OPTIMIZER_KERNELS(isa, target, sfx, real, sqrtfn)                                \
+    target static void momentum_##sfx##_##isa(size_t n, real rate, real mu, int nesterov,       \
+                                              const real* g, real* v, real* w)                  \
+    {                                                                                           \
+        if (nesterov) {                                                                         \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                const real vi = (mu * v[i]) + g[i];                                             \
+                v[i] = vi;                                                                      \
+                w[i] -= rate * (g[i] + (mu * vi));                                              \
+            }                                                                                   \
+        } else {                                                                                \
+            for (size_t i = 0; i < n; i++) {                                                    \
+                const real vi = (mu * v[i]) + g[i];                                             \
+                v[i] = vi;                                                                      \
+                w[i] -= rate * vi;                                                              \
+            }                                                                                   \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    target static void adam_##sfx##_##isa(size_t n, const stoopidnet_adam_step_t* step,         \
+                                          const real* g, real* m, real* v, real* w)             \
+    {                                                                                           \
+        const real gscale = (real)step->gscale;                                                 \
+        const real b1 = (real)step->beta1;                                                      \
+        const real b2 = (real)step->beta2;                                                      \
+        const real eps = (real)step->epsilon;                                                   \
+        const real rate = (real)step->rate;                                                     \
+        const real vscale = (real)step->vscale;                                                 \
+        for (size_t i = 0; i < n; i++) {                                                        \
+            const real gi = g[i] * gscale;                                                      \
+            const real mi = (b1 * m[i]) + (((real)1 - b1) * gi);                                \
+            const real vi = (b2 * v[i]) + (((real)1 - b2) * gi * gi);                           \
+            m[i] = mi;                                                                          \
+            v[i] = vi;                                                                          \
+            w[i] -= (rate * mi) / (sqrtfn(vi * vscale) + eps);                                  \
+        }                                                                                       \
+    }
+
+/**
+ * ger and update are the same for every instruction set given that instruction set's axpy, so
+ * they're stamped out from it, along with the activation and optimizer kernels.
+ */
+#define DEFINE_DERIVED_KERNELS(isa, target)                                                     \
+    DEFINE_ACTIVATION_KERNELS(isa, target, f64, double, exp, tanh)                              \
+    DEFINE_ACTIVATION_KERNELS(isa, target, f32, float, expf, tanhf)                             \
+    DEFINE_OPTIMIZER_KERNELS(isa, target, f64, double, sqrt)                                    \
+    DEFINE_OPTIMIZER_KERNELS(isa, target, f32, float, sqrtf)                                    \
+                                                                                                \
+    target static void ger_f64_##isa(uint32_t m, uint32_t n, const double* d, const double* a, \
+                                     double* G, size_t ldg)                                     \
+    {                                                                                           \
+        for (uint32_t j = 0; j < m; j++) {                                                      \
+            axpy_f64_##isa(n, d[j], a, G + (j * ldg));                                          \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    target static void ger_f32_##isa(uint32_t m, uint32_t n, const float* d, const float* a,   \
+                                     float* G, size_t ldg)                                      \
+    {                                                                                           \
+        for (uint32_t j = 0; j < m; j++) {                                                      \
+            axpy_f32_##isa(n, d[j], a, G + (j * ldg));                                          \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    target static void update_f64_##isa(size_t n, double rate, const double* g, double* w)     \
+    {                                                                                           \
+        /* axpy takes 32-bit lengths, parameter slabs might not fit. */                         \
+        const size_t step = (size_t)1 << 30;                                                    \
+        for (size_t i = 0; i < n; i += step) {                                                  \
+            axpy_f64_##isa(((n - i) < step) ? (n - i) : step, -rate, g + i, w + i);             \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    target static void update_f32_##isa(size_t n, float rate, const float* g, float* w)        \
+    {                                                                                           \
+        const size_t step = (size_t)1 << 30;                                                    \
+        for (size_t i = 0; i < n; i += step) {                                                  \
+            axpy_f32_##isa(((n - i) < step) ? (n - i) : step, -rate, g + i, w + i);             \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    static const stoopidnet_kernels_t kernels_##isa = {                                         \
+        #isa,                                                                                   \
+        dot_f64_##isa, dot_f32_##isa,                                                           \
+        axpy_f64_##isa, axpy_f32_##isa,                                                         \
+        ger_f64_##isa, ger_f32_##isa,                                                           \
+        update_f64_##isa, update_f32_##isa,                                                     \
+        momentum_f64_##isa, momentum_f32_##isa,                                                 \
+        adam_f64_##isa, adam_f32_##isa,                                                         \
+        dot_u8s8_##isa,                                                                         \
+        f16_to_f32_##isa, bf16_to_f32_##isa,                                                    \
+        f32_to_f16_##isa, f32_to_bf16_##isa,                                                    \
+        dot_f32_f16_##isa, dot_f32_bf16_##isa,                                                  \
+        spdot_f32_##isa, spmm_f32_##isa,                                                        \
+        activate_f64_##isa, activate_f32_##isa,                                                 \
+        activate_prime_f64_##isa, activate_prime_f32_##isa,                                     \
+    };
+
+////////////////////////////////////////////////////////////////
+// portable fallback
+////////////////////////////////////////////////////////////////
+static double dot_f64_scalar(const double* x, const double* y, uint32_t n)
+{
+    double accum = 0.;
+    for (uint32_t i = 0; i < n; i++) {
+        accum += x[i] * y[i];
+    }
+    return accum;
+}
+
+static float dot_f32_scalar(const float* x, const float* y, uint32_t n)
+{
+    float accum = 0.f;
+    for (uint32_t i = 0; i < n; i++) {
+        accum += x[i] * y[i];
+    }
+    return accum;
+}
+
+static void axpy_f64_scalar(uint32_t n, double alpha, const double* x, double* y)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+static void axpy_f32_scalar(uint32_t n, float alpha, const float* x, float* y)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+static int32_t dot_u8s8_scalar(const uint8_t* a, const int8_t* w, uint32_t n)
+{
+    int32_t accum = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        accum += (int32_t)a[i] * (int32_t)w[i];
+    }
+    return accum;
+}
+
+static void f16_to_f32_scalar(size_t n, const uint16_t* src, float* dst)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = f16_to_float(src[i]);
+    }
+}
+
+static void bf16_to_f32_scalar(size_t n, const uint16_t* src, float* dst)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = bf16_to_float(src[i]);
+    }
+}
+
+static void f32_to_f16_scalar(size_t n, const float* src, uint16_t* dst)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = float_to_f16(src[i]);
+    }
+}
+
+static void f32_to_bf16_scalar(size_t n, const float* src, uint16_t* dst)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+static float dot_f32_f16_scalar(const float* x, const uint16_t* w, uint32_t n)
+{
+    float accum = 0.f;
+    for (uint32_t i = 0; i < n; i++) {
+        accum += x[i] * f16_to_float(w[i]);
+    }
+    return accum;
+}
+
+static float dot_f32_bf16_scalar(const float* x, const uint16_t* w, uint32_t n)
+{
+    float accum = 0.f;
+    for (uint32_t i = 0; i < n; i++) {
+        accum += x[i] * bf16_to_float(w[i]);
+    }
+    return accum;
+}
+
+static float spdot_f32_scalar(const float* vals, const uint32_t* cols, uint32_t nnz,
+                              const float* x)
+{
+    float accum = 0.f;
+    for (uint32_t i = 0; i < nnz; i++) {
+        accum += vals[i] * x[cols[i]];
+    }
+    return accum;
+}
+
+static void spmm_f32_scalar(uint32_t nnz, const float* vals, const uint32_t* cols, const float* x,
+                            uint32_t n, float* z)
+{
+    for (uint32_t i = 0; i < nnz; i++) {
+        const float* xi = x + ((size_t)cols[i] * n);
+        for (uint32_t b = 0; b < n; b++) {
+            z[b] += vals[i] * xi[b];
+        }
+    }
+}
+
+DEFINE_DERIVED_KERNELS(scalar, TARGET_SCALAR)
+
+#ifdef KERNELS_X86
+////////////////////////////////////////////////////////////////
+// SSE2
+////////////////////////////////////////////////////////////////
+TARGET_SSE2 static double dot_f64_sse2(const double* x, const double* y, uint32_t n)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    uint32_t i = 0;
+    for (; (i + 4) <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    double accum = lanes[0] + lanes[1];
+    for (; i < n; i++) {
+        accum += x[i] * y[i];
+    }
+    return accum;
+}
+
+TARGET_SSE2 static float dot_f32_sse2(const float* x, const float* y, uint32_t n)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    uint32_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(y + i + 4)));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    float accum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) {
+        accum += x[i] * y[i];
+    }
+    return accum;
+}
+
+TARGET_SSE2 static void axpy_f64_sse2(uint32_t n, double alpha, const double* x, double* y)
+{
+    const __m128d a = _mm_set1_pd(alpha);
+    uint32_t i = 0;
+    for (; (i + 2) <= n; i += 2) {
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(a, _mm_loadu_pd(x + i))));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+TARGET_SSE2 static void axpy_f32_sse2(uint32_t n, float alpha, const float* x, float* y)
+{
+    const __m128 a = _mm_set1_ps(alpha);
+    uint32_t i = 0;
+    for (; (i + 4) <= n; i += 4) {
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(a, _mm_loadu_ps(x + i))));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+TARGET_SSE2 static int32_t dot_u8s8_sse2(const uint8_t* a, const int8_t* w, uint32_t n)
+{
+    // no pmaddubsw before SSSE3, so widen both sides to 16 bits and use pmaddwd.
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        const __m128i av = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i wv = _mm_loadu_si128((const __m128i*)(w + i));
+        const __m128i wlo = _mm_srai_epi16(_mm_unpacklo_epi8(wv, wv), 8);
+        const __m128i whi = _mm_srai_epi16(_mm_unpackhi_epi8(wv, wv), 8);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(av, zero), wlo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(av, zero), whi));
+    }
+
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    int32_t accum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) {
+        accum += (int32_t)a[i] * (int32_t)w[i];
+    }
+    return accum;
+}
+
+/**
+ * No F16C before the AVX2 generation.
+ */
+TARGET_SSE2 static void f16_to_f32_sse2(size_t n, const uint16_t* src, float* dst)
+{
+    f16_to_f32_scalar(n, src, dst);
+}
+
+TARGET_SSE2 static void f32_to_f16_sse2(size_t n, const float* src, uint16_t* dst)
+{
+    f32_to_f16_scalar(n, src, dst);
+}
+
+TARGET_SSE2 static float dot_f32_f16_sse2(const float* x, const uint16_t* w, uint32_t n)
+{
+    return dot_f32_f16_scalar(x, w, n);
+}
+
+TARGET_SSE2 static void bf16_to_f32_sse2(size_t n, const uint16_t* src, float* dst)
+{
+    // interleaving zeros below each bf16 is the shift left by 16 that makes it a float.
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        const __m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(zero, h));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(zero, h));
+    }
+    for (; i < n; i++) {
+        dst[i] = bf16_to_float(src[i]);
+    }
+}
+
+TARGET_SSE2 static void f32_to_bf16_sse2(size_t n, const float* src, uint16_t* dst)
+{
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i bias = _mm_set1_epi32(0x7fff);
+    const __m128i abs_mask = _mm_set1_epi32(0x7fffffff);
+    const __m128i inf = _mm_set1_epi32(0x7f800000);
+    const __m128i quiet = _mm_set1_epi32(0x40);
+    size_t i = 0;
+    for (; (i + 4) <= n; i += 4) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        const __m128i hi = _mm_srli_epi32(x, 16);
+        const __m128i rounded = _mm_srli_epi32(_mm_add_epi32(x, _mm_add_epi32(bias,
+                                               _mm_and_si128(hi, one))), 16);
+        const __m128i nan = _mm_cmpgt_epi32(_mm_and_si128(x, abs_mask), inf);
+        __m128i r = _mm_or_si128(_mm_and_si128(nan, _mm_or_si128(hi, quiet)),
+                                 _mm_andnot_si128(nan, rounded));
+        // sign extend so the saturating pack leaves the 16 bits alone.
+        r = _mm_srai_epi32(_mm_slli_epi32(r, 16), 16);
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packs_epi32(r, r));
+    }
+    for (; i < n; i++) {
+        dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+TARGET_SSE2 static float dot_f32_bf16_sse2(const float* x, const uint16_t* w, uint32_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    uint32_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        const __m128i h = _mm_loadu_si128((const __m128i*)(w + i));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i),
+                                           _mm_castsi128_ps(_mm_unpacklo_epi16(zero, h))));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4),
+                                           _mm_castsi128_ps(_mm_unpackhi_epi16(zero, h))));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    float accum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) {
+        accum += x[i] * bf16_to_float(w[i]);
+    }
+    return accum;
+}
+
+/**
+ * No gathers before AVX2.
+ */
+TARGET_SSE2 static float spdot_f32_sse2(const float* vals, const uint32_t* cols, uint32_t nnz,
+                                        const float* x)
+{
+    return spdot_f32_scalar(vals, cols, nnz, x);
+}
+
+TARGET_SSE2 static void spmm_f32_sse2(uint32_t nnz, const float* vals, const uint32_t* cols,
+                                      const float* x, uint32_t n, float* z)
+{
+    // each slice of z stays in registers while the whole row streams past it.
+    uint32_t b = 0;
+    for (; (b + 8) <= n; b += 8) {
+        __m128 acc0 = _mm_loadu_ps(z + b);
+        __m128 acc1 = _mm_loadu_ps(z + b + 4);
+        for (uint32_t i = 0; i < nnz; i++) {
+            const float* xi = x + ((size_t)cols[i] * n) + b;
+            const __m128 v = _mm_set1_ps(vals[i]);
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(v, _mm_loadu_ps(xi)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(v, _mm_loadu_ps(xi + 4)));
+        }
+        _mm_storeu_ps(z + b, acc0);
+        _mm_storeu_ps(z + b + 4, acc1);
+    }
+    for (; (b + 4) <= n; b += 4) {
+        __m128 acc = _mm_loadu_ps(z + b);
+        for (uint32_t i = 0; i < nnz; i++) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(vals[i]),
+                                             _mm_loadu_ps(x + ((size_t)cols[i] * n) + b)));
+        }
+        _mm_storeu_ps(z + b, acc);
+    }
+    for (; b < n; b++) {
+        float accum = z[b];
+        for (uint32_t i = 0; i < nnz; i++) {
+            accum += vals[i] * x[((size_t)cols[i] * n) + b];
+        }
+        z[b] = accum;
+    }
+}
+
+DEFINE_DERIVED_KERNELS(sse2, TARGET_SSE2)
+
+////////////////////////////////////////////////////////////////
+// AVX2 + FMA
+////////////////////////////////////////////////////////////////
+TARGET_AVX2 static double dot_f64_avx2(const double* x, const double* y, uint32_t n)
+{
+    __m256d acc[4] = { _mm256_setzero_pd(), _mm256_setzero_pd(),
+                       _mm256_setzero_pd(), _mm256_setzero_pd() };
+    uint32_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        for (int u = 0; u < 4; u++) {
+            acc[u] = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + (4 * u)),
+                                     _mm256_loadu_pd(y + i + (4 * u)), acc[u]);
+        }
+    }
+    for (; (i + 4) <= n; i += 4) {
+        acc[0] = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), acc[0]);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(acc[0], acc[1]),
+                                          _mm256_add_pd(acc[2], acc[3])));
+    double accum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) {
+        accum += x[i] * y[i];
+    }
+    return accum;
+}
+
+TARGET_AVX2 static float dot_f32_avx2(const float* x, const float* y, uint32_t n)
+{
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(),
+                      _mm256_setzero_ps(), _mm256_setzero_ps() };
+    uint32_t i = 0;
+    for (; (i + 32) <= n; i += 32) {
+        for (int u = 0; u < 4; u++) {
+            acc[u] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + (8 * u)),
+                                     _mm256_loadu_ps(y + i + (8 * u)), acc[u]);
+        }
+    }
+    for (; (i + 8) <= n; i += 8) {
+        acc[0] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc[0]);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]),
+                                          _mm256_add_ps(acc[2], acc[3])));
+    float accum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                  ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; i < n; i++) {
+        accum += x[i] * y[i];
+    }
+    return accum;
+}
+
+TARGET_AVX2 static void axpy_f64_avx2(uint32_t n, double alpha, const double* x, double* y)
+{
+    const __m256d a = _mm256_set1_pd(alpha);
+    uint32_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(a, _mm256_loadu_pd(x + i),
+                                                _mm256_loadu_pd(y + i)));
+        _mm256_storeu_pd(y + i + 4, _mm256_fmadd_pd(a, _mm256_loadu_pd(x + i + 4),
+                                                    _mm256_loadu_pd(y + i + 4)));
+    }
+    for (; (i + 4) <= n; i += 4) {
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(a, _mm256_loadu_pd(x + i),
+                                                _mm256_loadu_pd(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+TARGET_AVX2 static void axpy_f32_avx2(uint32_t n, float alpha, const float* x, float* y)
+{
+    const __m256 a = _mm256_set1_ps(alpha);
+    uint32_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i),
+                                                _mm256_loadu_ps(y + i)));
+        _mm256_storeu_ps(y + i + 8, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i + 8),
+                                                    _mm256_loadu_ps(y + i + 8)));
+    }
+    for (; (i + 8) <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i),
+                                                _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+TARGET_AVX2 static int32_t dot_u8s8_avx2(const uint8_t* a, const int8_t* w, uint32_t n)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; (i + 32) <= n; i += 32) {
+        const __m256i pairs = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                                   _mm256_loadu_si256((const __m256i*)(w + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+    }
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    int32_t accum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                    ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; i < n; i++) {
+        accum += (int32_t)a[i] * (int32_t)w[i];
+    }
+    return accum;
+}
+
+TARGET_AVX2 static void f16_to_f32_avx2(size_t n, const uint16_t* src, float* dst)
+{
+    size_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+    }
+    for (; i < n; i++) {
+        dst[i] = f16_to_float(src[i]);
+    }
+}
+
+TARGET_AVX2 static void bf16_to_f32_avx2(size_t n, const uint16_t* src, float* dst)
+{
+    size_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        const __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_slli_epi32(h, 16));
+    }
+    for (; i < n; i++) {
+        dst[i] = bf16_to_float(src[i]);
+    }
+}
+
+TARGET_AVX2 static void f32_to_f16_avx2(size_t n, const float* src, uint16_t* dst)
+{
+    size_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        _mm_storeu_si128((__m128i*)(dst + i),
+                         _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < n; i++) {
+        dst[i] = float_to_f16(src[i]);
+    }
+}
+
+TARGET_AVX2 static void f32_to_bf16_avx2(size_t n, const float* src, uint16_t* dst)
+{
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i bias = _mm256_set1_epi32(0x7fff);
+    const __m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
+    const __m256i inf = _mm256_set1_epi32(0x7f800000);
+    const __m256i quiet = _mm256_set1_epi32(0x40);
+    size_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+        const __m256i hi = _mm256_srli_epi32(x, 16);
+        const __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(x, _mm256_add_epi32(bias,
+                                                  _mm256_and_si256(hi, one))), 16);
+        const __m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(x, abs_mask), inf);
+        const __m256i r = _mm256_blendv_epi8(rounded, _mm256_or_si256(hi, quiet), nan);
+        // the pack works within 128-bit lanes; gather the two halves' results into the low lane.
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0x08);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(packed));
+    }
+    for (; i < n; i++) {
+        dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+TARGET_AVX2 static float dot_f32_f16_avx2(const float* x, const uint16_t* w, uint32_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i),
+                               _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(w + i))), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8),
+                               _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(w + i + 8))),
+                               acc1);
+    }
+    for (; (i + 8) <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i),
+                               _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(w + i))), acc0);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+    float accum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                  ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; i < n; i++) {
+        accum += x[i] * f16_to_float(w[i]);
+    }
+    return accum;
+}
+
+TARGET_AVX2 static float dot_f32_bf16_avx2(const float* x, const uint16_t* w, uint32_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        const __m256i h0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(w + i)));
+        const __m256i h1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(w + i + 8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i),
+                               _mm256_castsi256_ps(_mm256_slli_epi32(h0, 16)), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8),
+                               _mm256_castsi256_ps(_mm256_slli_epi32(h1, 16)), acc1);
+    }
+    for (; (i + 8) <= n; i += 8) {
+        const __m256i h0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(w + i)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i),
+                               _mm256_castsi256_ps(_mm256_slli_epi32(h0, 16)), acc0);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+    float accum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                  ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; i < n; i++) {
+        accum += x[i] * bf16_to_float(w[i]);
+    }
+    return accum;
+}
+
+TARGET_AVX2 static float spdot_f32_avx2(const float* vals, const uint32_t* cols, uint32_t nnz,
+                                        const float* x)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; (i + 16) <= nnz; i += 16) {
+        const __m256i c0 = _mm256_loadu_si256((const __m256i*)(cols + i));
+        const __m256i c1 = _mm256_loadu_si256((const __m256i*)(cols + i + 8));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(vals + i), _mm256_i32gather_ps(x, c0, 4), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(vals + i + 8), _mm256_i32gather_ps(x, c1, 4),
+                               acc1);
+    }
+    for (; (i + 8) <= nnz; i += 8) {
+        const __m256i c0 = _mm256_loadu_si256((const __m256i*)(cols + i));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(vals + i), _mm256_i32gather_ps(x, c0, 4), acc0);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+    float accum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                  ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; i < nnz; i++) {
+        accum += vals[i] * x[cols[i]];
+    }
+    return accum;
+}
+
+TARGET_AVX2 static void spmm_f32_avx2(uint32_t nnz, const float* vals, const uint32_t* cols,
+                                      const float* x, uint32_t n, float* z)
+{
+    // each slice of z stays in registers while the whole row streams past it; alternate nonzeros
+    // go to separate accumulators so consecutive FMAs don't wait on each other.
+    uint32_t b = 0;
+    for (; (b + 16) <= n; b += 16) {
+        __m256 acc0 = _mm256_loadu_ps(z + b);
+        __m256 acc1 = _mm256_loadu_ps(z + b + 8);
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        uint32_t i = 0;
+        for (; (i + 2) <= nnz; i += 2) {
+            const float* x0 = x + ((size_t)cols[i] * n) + b;
+            const float* x1 = x + ((size_t)cols[i + 1] * n) + b;
+            const __m256 v0 = _mm256_set1_ps(vals[i]);
+            const __m256 v1 = _mm256_set1_ps(vals[i + 1]);
+            acc0 = _mm256_fmadd_ps(v0, _mm256_loadu_ps(x0), acc0);
+            acc1 = _mm256_fmadd_ps(v0, _mm256_loadu_ps(x0 + 8), acc1);
+            acc2 = _mm256_fmadd_ps(v1, _mm256_loadu_ps(x1), acc2);
+            acc3 = _mm256_fmadd_ps(v1, _mm256_loadu_ps(x1 + 8), acc3);
+        }
+        if (i < nnz) {
+            const float* x0 = x + ((size_t)cols[i] * n) + b;
+            const __m256 v0 = _mm256_set1_ps(vals[i]);
+            acc0 = _mm256_fmadd_ps(v0, _mm256_loadu_ps(x0), acc0);
+            acc1 = _mm256_fmadd_ps(v0, _mm256_loadu_ps(x0 + 8), acc1);
+        }
+        _mm256_storeu_ps(z + b, _mm256_add_ps(acc0, acc2));
+        _mm256_storeu_ps(z + b + 8, _mm256_add_ps(acc1, acc3));
+    }
+    for (; (b + 8) <= n; b += 8) {
+        __m256 acc = _mm256_loadu_ps(z + b);
+        for (uint32_t i = 0; i < nnz; i++) {
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(vals[i]),
+                                  _mm256_loadu_ps(x + ((size_t)cols[i] * n) + b), acc);
+        }
+        _mm256_storeu_ps(z + b, acc);
+    }
+    for (; b < n; b++) {
+        float accum = z[b];
+        for (uint32_t i = 0; i < nnz; i++) {
+            accum += vals[i] * x[((size_t)cols[i] * n) + b];
+        }
+        z[b] = accum;
+    }
+}
+
+DEFINE_DERIVED_KERNELS(avx2, TARGET_AVX2)
+
+////////////////////////////////////////////////////////////////
+// AVX-512
+////////////////////////////////////////////////////////////////
+TARGET_AVX512 static double dot_f64_avx512(const double* x, const double* y, uint32_t n)
+{
+    __m512d acc[4] = { _mm512_setzero_pd(), _mm512_setzero_pd(),
+                       _mm512_setzero_pd(), _mm512_setzero_pd() };
+    uint32_t i = 0;
+    for (; (i + 32) <= n; i += 32) {
+        for (int u = 0; u < 4; u++) {
+            acc[u] = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + (8 * u)),
+                                     _mm512_loadu_pd(y + i + (8 * u)), acc[u]);
+        }
+    }
+    for (; (i + 8) <= n; i += 8) {
+        acc[0] = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), acc[0]);
+    }
+    if (i < n) {
+        const __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        acc[1] = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(tail, x + i),
+                                 _mm512_maskz_loadu_pd(tail, y + i), acc[1]);
+    }
+
+    return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(acc[0], acc[1]),
+                                              _mm512_add_pd(acc[2], acc[3])));
+}
+
+TARGET_AVX512 static float dot_f32_avx512(const float* x, const float* y, uint32_t n)
+{
+    __m512 acc[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(),
+                      _mm512_setzero_ps(), _mm512_setzero_ps() };
+    uint32_t i = 0;
+    for (; (i + 64) <= n; i += 64) {
+        for (int u = 0; u < 4; u++) {
+            acc[u] = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + (16 * u)),
+                                     _mm512_loadu_ps(y + i + (16 * u)), acc[u]);
+        }
+    }
+    for (; (i + 16) <= n; i += 16) {
+        acc[0] = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc[0]);
+    }
+    if (i < n) {
+        const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+        acc[1] = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, x + i),
+                                 _mm512_maskz_loadu_ps(tail, y + i), acc[1]);
+    }
+
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]),
+                                              _mm512_add_ps(acc[2], acc[3])));
+}
+
+TARGET_AVX512 static void axpy_f64_avx512(uint32_t n, double alpha, const double* x, double* y)
+{
+    const __m512d a = _mm512_set1_pd(alpha);
+    uint32_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        _mm512_storeu_pd(y + i, _mm512_fmadd_pd(a, _mm512_loadu_pd(x + i),
+                                                _mm512_loadu_pd(y + i)));
+    }
+    if (i < n) {
+        const __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_pd(y + i, tail,
+                              _mm512_fmadd_pd(a, _mm512_maskz_loadu_pd(tail, x + i),
+                                              _mm512_maskz_loadu_pd(tail, y + i)));
+    }
+}
+
+TARGET_AVX512 static void axpy_f32_avx512(uint32_t n, float alpha, const float* x, float* y)
+{
+    const __m512 a = _mm512_set1_ps(alpha);
+    uint32_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i),
+                                                _mm512_loadu_ps(y + i)));
+    }
+    if (i < n) {
+        const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(y + i, tail,
+                              _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(tail, x + i),
+                                              _mm512_maskz_loadu_ps(tail, y + i)));
+    }
+}
+
+/**
+ * Byte arithmetic on zmm registers needs AVX512BW, which plain AVX-512F parts don't have.
+ */
+TARGET_AVX512 static int32_t dot_u8s8_avx512(const uint8_t* a, const int8_t* w, uint32_t n)
+{
+    return dot_u8s8_avx2(a, w, n);
+}
+
+TARGET_AVX512 static void f16_to_f32_avx512(size_t n, const uint16_t* src, float* dst)
+{
+    size_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(src + i))));
+    }
+    for (; i < n; i++) {
+        dst[i] = f16_to_float(src[i]);
+    }
+}
+
+TARGET_AVX512 static void bf16_to_f32_avx512(size_t n, const uint16_t* src, float* dst)
+{
+    size_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        const __m512i h = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(src + i)));
+        _mm512_storeu_si512(dst + i, _mm512_slli_epi32(h, 16));
+    }
+    for (; i < n; i++) {
+        dst[i] = bf16_to_float(src[i]);
+    }
+}
+
+TARGET_AVX512 static void f32_to_f16_avx512(size_t n, const float* src, uint16_t* dst)
+{
+    size_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        _mm256_storeu_si256((__m256i*)(dst + i),
+                            _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < n; i++) {
+        dst[i] = float_to_f16(src[i]);
+    }
+}
+
+TARGET_AVX512 static void f32_to_bf16_avx512(size_t n, const float* src, uint16_t* dst)
+{
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i bias = _mm512_set1_epi32(0x7fff);
+    const __m512i abs_mask = _mm512_set1_epi32(0x7fffffff);
+    const __m512i inf = _mm512_set1_epi32(0x7f800000);
+    const __m512i quiet = _mm512_set1_epi32(0x40);
+    size_t i = 0;
+    for (; (i + 16) <= n; i += 16) {
+        const __m512i x = _mm512_loadu_si512(src + i);
+        const __m512i hi = _mm512_srli_epi32(x, 16);
+        const __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(x, _mm512_add_epi32(bias,
+                                                  _mm512_and_si512(hi, one))), 16);
+        const __mmask16 nan = _mm512_cmpgt_epu32_mask(_mm512_and_si512(x, abs_mask), inf);
+        const __m512i r = _mm512_mask_blend_epi32(nan, rounded, _mm512_or_si512(hi, quiet));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm512_cvtepi32_epi16(r));
+    }
+    for (; i < n; i++) {
+        dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+TARGET_AVX512 static float dot_f32_f16_avx512(const float* x, const uint16_t* w, uint32_t n)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; (i + 32) <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i),
+                               _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(w + i))),
+                               acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16),
+                               _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(w + i + 16))),
+                               acc1);
+    }
+    for (; (i + 16) <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i),
+                               _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(w + i))),
+                               acc0);
+    }
+
+    // masked 16-bit loads need AVX512BW, so the tail is scalar.
+    float accum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        accum += x[i] * f16_to_float(w[i]);
+    }
+    return accum;
+}
+
+TARGET_AVX512 static float dot_f32_bf16_avx512(const float* x, const uint16_t* w, uint32_t n)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; (i + 32) <= n; i += 32) {
+        const __m512i h0 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(w + i)));
+        const __m512i h1 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(w + i + 16)));
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i),
+                               _mm512_castsi512_ps(_mm512_slli_epi32(h0, 16)), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16),
+                               _mm512_castsi512_ps(_mm512_slli_epi32(h1, 16)), acc1);
+    }
+    for (; (i + 16) <= n; i += 16) {
+        const __m512i h0 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(w + i)));
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i),
+                               _mm512_castsi512_ps(_mm512_slli_epi32(h0, 16)), acc0);
+    }
+
+    float accum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        accum += x[i] * bf16_to_float(w[i]);
+    }
+    return accum;
+}
+
+TARGET_AVX512 static float spdot_f32_avx512(const float* vals, const uint32_t* cols,
+                                            uint32_t nnz, const float* x)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; (i + 32) <= nnz; i += 32) {
+        const __m512i c0 = _mm512_loadu_si512(cols + i);
+        const __m512i c1 = _mm512_loadu_si512(cols + i + 16);
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(vals + i), _mm512_i32gather_ps(c0, x, 4), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(vals + i + 16), _mm512_i32gather_ps(c1, x, 4),
+                               acc1);
+    }
+    for (; (i + 16) <= nnz; i += 16) {
+        const __m512i c0 = _mm512_loadu_si512(cols + i);
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(vals + i), _mm512_i32gather_ps(c0, x, 4), acc0);
+    }
+    if (i < nnz) {
+        const __mmask16 tail = (__mmask16)((1u << (nnz - i)) - 1);
+        const __m512i c1 = _mm512_maskz_loadu_epi32(tail, cols + i);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, vals + i),
+                               _mm512_mask_i32gather_ps(_mm512_setzero_ps(), tail, c1, x, 4),
+                               acc1);
+    }
+
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+TARGET_AVX512 static void spmm_f32_avx512(uint32_t nnz, const float* vals, const uint32_t* cols,
+                                          const float* x, uint32_t n, float* z)
+{
+    for (uint32_t b = 0; b < n; b += 16) {
+        const __mmask16 lanes = ((n - b) >= 16) ? (__mmask16)0xffff :
+                                                  (__mmask16)((1u << (n - b)) - 1);
+        __m512 acc0 = _mm512_maskz_loadu_ps(lanes, z + b);
+        __m512 acc1 = _mm512_setzero_ps();
+        uint32_t i = 0;
+        for (; (i + 2) <= nnz; i += 2) {
+            acc0 = _mm512_fmadd_ps(_mm512_set1_ps(vals[i]),
+                                   _mm512_maskz_loadu_ps(lanes, x + ((size_t)cols[i] * n) + b),
+                                   acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_set1_ps(vals[i + 1]),
+                                   _mm512_maskz_loadu_ps(lanes, x + ((size_t)cols[i + 1] * n) + b),
+                                   acc1);
+        }
+        if (i < nnz) {
+            acc0 = _mm512_fmadd_ps(_mm512_set1_ps(vals[i]),
+                                   _mm512_maskz_loadu_ps(lanes, x + ((size_t)cols[i] * n) + b),
+                                   acc0);
+        }
+        _mm512_mask_storeu_ps(z + b, lanes, _mm512_add_ps(acc0, acc1));
+    }
+}
+
+DEFINE_DERIVED_KERNELS(avx512, TARGET_AVX512)
+
+////////////////////////////////////////////////////////////////
+// AVX-512 VNNI: the AVX-512 kernels plus a vpdpbusd integer dot product
+////////////////////////////////////////////////////////////////
+TARGET_AVX512VNNI static int32_t dot_u8s8_avx512vnni(const uint8_t* a, const int8_t* w,
+                                                     uint32_t n)
+{
+    __m512i acc0 = _mm512_setzero_si512();
+    __m512i acc1 = _mm512_setzero_si512();
+    uint32_t i = 0;
+    for (; (i + 128) <= n; i += 128) {
+        acc0 = _mm512_dpbusd_epi32(acc0, _mm512_loadu_si512(a + i), _mm512_loadu_si512(w + i));
+        acc1 = _mm512_dpbusd_epi32(acc1, _mm512_loadu_si512(a + i + 64),
+                                   _mm512_loadu_si512(w + i + 64));
+    }
+    for (; (i + 64) <= n; i += 64) {
+        acc0 = _mm512_dpbusd_epi32(acc0, _mm512_loadu_si512(a + i), _mm512_loadu_si512(w + i));
+    }
+    if (i < n) {
+        const __mmask64 tail = ((__mmask64)1 << (n - i)) - 1;
+        acc1 = _mm512_dpbusd_epi32(acc1, _mm512_maskz_loadu_epi8(tail, a + i),
+                                   _mm512_maskz_loadu_epi8(tail, w + i));
+    }
+
+    return _mm512_reduce_add_epi32(_mm512_add_epi32(acc0, acc1));
+}
+
+static const stoopidnet_kernels_t kernels_avx512vnni = {
+    "avx512vnni",
+    dot_f64_avx512, dot_f32_avx512,
+    axpy_f64_avx512, axpy_f32_avx512,
+    ger_f64_avx512, ger_f32_avx512,
+    update_f64_avx512, update_f32_avx512,
+    momentum_f64_avx512, momentum_f32_avx512,
+    adam_f64_avx512, adam_f32_avx512,
+    dot_u8s8_avx512vnni,
+    f16_to_f32_avx512, bf16_to_f32_avx512,
+    f32_to_f16_avx512, f32_to_bf16_avx512,
+    dot_f32_f16_avx512, dot_f32_bf16_avx512,
+    spdot_f32_avx512, spmm_f32_avx512,
+    activate_f64_avx512, activate_f32_avx512,
+    activate_prime_f64_avx512, activate_prime_f32_avx512,
+};
+#endif
+
+////////////////////////////////////////////////////////////////
+// dispatch
+////////////////////////////////////////////////////////////////
+static const stoopidnet_kernels_t* selected_kernels = &kernels_scalar;
+
+__attribute__((constructor)) static void stoopidnet_kernels_init(void)
+{
+    // candidates from least to most capable; the env var can cap how far down the list we go.
+    const stoopidnet_kernels_t* candidates[] = {
+        &kernels_scalar,
+#ifdef KERNELS_X86
+        &kernels_sse2, &kernels_avx2, &kernels_avx512, &kernels_avx512vnni,
+#endif
+    };
+    const int ncandidates = sizeof(candidates) / sizeof(candidates[0]);
+
+    int cap = ncandidates - 1;
+    const char* env = getenv("STOOPIDNET_KERNELS");
+    if (env != NULL) {
+        int i = 0;
+        for (; (i < ncandidates) && strcmp(env, candidates[i]->name); i++);
+        if (i < ncandidates) {
+            cap = i;
+        } else {
+            fprintf(stderr, "Unknown STOOPIDNET_KERNELS value %s, ignoring it\n", env);
+        }
+    }
+
+    int best = 0;
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        best = 1;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("f16c")) {
+        best = 2;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        best = 3;
+    }
+    if ((best == 3) && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vnni")) {
+        best = 4;
+    }
+#endif
+
+    selected_kernels = candidates[(best < cap) ? best : cap];
+}
+
+const stoopidnet_kernels_t* stoopidnet_kernels(void)
+{
+    return selected_kernels;
+}
@@ -0,0 +1,148 @@
+#ifndef STOOPIDNET_KERNELS_H
+#define STOOPIDNET_KERNELS_H
+
+/**
+ * The handful of vector kernels that all of stoopidnet's training and evaluation math is built
+ * out of.
+ *
+ * Every kernel has SSE2, AVX2 and AVX-512 implementations plus a portable C fallback, except that
+ * fp16 conversion needs F16C and the sparse dot product needs a gather, so the SSE2 set uses the
+ * portable ones (the AVX2 set requires F16C, which every AVX2 CPU has). Which one gets used is
+ * decided once at startup from what the CPU reports through cpuid, so a single binary runs at
+ * full speed across CPU generations. Setting the STOOPIDNET_KERNELS environment variable to
+ * "scalar", "sse2", "avx2", "avx512" or "avx512vnni" caps the choice, which is handy for comparing
+ * kernels against each other.
+ */
+
+#include "stoopidnet.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Everything one Adam step needs besides the vectors themselves.
+ */
+typedef struct stoopidnet_adam_step
+{
+    /**
+     * Gradients get multiplied by gscale before anything else, e.g. to average a minibatch's
+     * summed gradients.
+     */
+    double gscale;
+    double beta1;
+    double beta2;
+    double epsilon;
+
+    /**
+     * The learning rate divided by 1 - beta1^t, and 1 / (1 - beta2^t), for step t.
+     */
+    double rate;
+    double vscale;
+} stoopidnet_adam_step_t;
+
+typedef struct stoopidnet_kernels
+{
+    const char* name;
+
+    /**
+     * Returns sum(x[i] * y[i]) for i in [0, n).
+     */
+    double (*dot_f64)(const double* x, const double* y, uint32_t n);
+    float  (*dot_f32)(const float* x, const float* y, uint32_t n);
+
+    /**
+     * y[i] += alpha * x[i] for i in [0, n).
+     */
+    void (*axpy_f64)(uint32_t n, double alpha, const double* x, double* y);
+    void (*axpy_f32)(uint32_t n, float alpha, const float* x, float* y);
+
+    /**
+     * Outer-product accumulate: G[j][k] += d[j] * a[k] for the m x n row-major matrix G, whose rows
+     * are ldg elements apart.
+     */
+    void (*ger_f64)(uint32_t m, uint32_t n, const double* d, const double* a, double* G,
+                    size_t ldg);
+    void (*ger_f32)(uint32_t m, uint32_t n, const float* d, const float* a, float* G, size_t ldg);
+
+    /**
+     * Scaled update: w[i] -= rate * g[i] for i in [0, n).
+     */
+    void (*update_f64)(size_t n, double rate, const double* g, double* w);
+    void (*update_f32)(size_t n, float rate, const float* g, float* w);
+
+    /**
+     * Momentum update in one pass: v[i] = mu * v[i] + g[i], then w[i] -= rate * v[i], or with
+     * nesterov set, w[i] -= rate * (g[i] + mu * v[i]).
+     */
+    void (*momentum_f64)(size_t n, double rate, double mu, int nesterov, const double* g,
+                         double* v, double* w);
+    void (*momentum_f32)(size_t n, float rate, float mu, int nesterov, const float* g, float* v,
+                         float* w);
+
+    /**
+     * Adam update in one pass: m and v are the running first and second moments of g.
+     */
+    void (*adam_f64)(size_t n, const stoopidnet_adam_step_t* step, const double* g, double* m,
+                     double* v, double* w);
+    void (*adam_f32)(size_t n, const stoopidnet_adam_step_t* step, const float* g, float* m,
+                     float* v, float* w);
+
+    /**
+     * Integer dot product: returns sum(a[i] * w[i]) for i in [0, n). Every a[i] has to be at most
+     * 127 so that adjacent pairs of products can't saturate pmaddubsw's signed 16-bit sums.
+     */
+    int32_t (*dot_u8s8)(const uint8_t* a, const int8_t* w, uint32_t n);
+
+    /**
+     * Conversions between floats and 16-bit floats held as their bit patterns, either IEEE half
+     * precision (fp16) or bfloat16 (bf16). Narrowing rounds to nearest even.
+     */
+    void (*f16_to_f32)(size_t n, const uint16_t* src, float* dst);
+    void (*bf16_to_f32)(size_t n, const uint16_t* src, float* dst);
+    void (*f32_to_f16)(size_t n, const float* src, uint16_t* dst);
+    void (*f32_to_bf16)(size_t n, const float* src, uint16_t* dst);
+
+    /**
+     * Returns sum(x[i] * w[i]) for i in [0, n), widening the 16-bit w to float in registers.
+     */
+    float (*dot_f32_f16)(const float* x, const uint16_t* w, uint32_t n);
+    float (*dot_f32_bf16)(const float* x, const uint16_t* w, uint32_t n);
+
+    /**
+     * Sparse dot product: returns sum(vals[i] * x[cols[i]]) for i in [0, nnz), i.e. one row of a
+     * compressed sparse row matrix times the vector x.
+     */
+    float (*spdot_f32)(const float* vals, const uint32_t* cols, uint32_t nnz, const float* x);
+
+    /**
+     * The same row times n vectors at once: z[b] += sum(vals[i] * x[cols[i] * n + b]) for i in
+     * [0, nnz) and b in [0, n), with x holding each element's n values back to back.
+     */
+    void (*spmm_f32)(uint32_t nnz, const float* vals, const uint32_t* cols, const float* x,
+                     uint32_t n, float* z);
+
+    /**
+     * a = f(z) for the rows x width row-major matrix z, one row per example. Every activation
+     * but softmax is elementwise. a may be z.
+     */
+    void (*activate_f64)(stoopidnet_activation_t f, uint32_t rows, uint32_t width,
+                         const double* z, double* a);
+    void (*activate_f32)(stoopidnet_activation_t f, uint32_t rows, uint32_t width,
+                         const float* z, float* a);
+
+    /**
+     * Multiplies each row of d by the Jacobian of f at that row, i.e. d[i] *= f'(z[i]) for the
+     * elementwise activations, computed from the activations a = f(z) rather than from z.
+     */
+    void (*activate_prime_f64)(stoopidnet_activation_t f, uint32_t rows, uint32_t width,
+                               const double* a, double* d);
+    void (*activate_prime_f32)(stoopidnet_activation_t f, uint32_t rows, uint32_t width,
+                               const float* a, float* d);
+} stoopidnet_kernels_t;
+
+/**
+ * Returns the kernel implementations picked for this CPU.
+ */
+const stoopidnet_kernels_t* stoopidnet_kernels(void);
+
+#endif
@@ -0,0 +1,70 @@
+#include "stoopidnet_model.h"
+
+#include <stdio.h>
+
+
+int stoopidnet_model_init(stoopidnet_model_t* model, stoopidnet_t* net, uint32_t n_calib,
+                          const uint8_t* calib_inputs, stoopidnet_storage_t half_format,
+                          int sparse)
+{
+    *model = (stoopidnet_model_t){ .net = net };
+
+    if (calib_inputs != NULL) {
+        if ((model->quant = stoopidnet_quantize_u8(net, n_calib, calib_inputs)) == NULL) {
+            fprintf(stderr, "Failed to quantize the net\n");
+            return -1;
+        }
+    } else if (half_format != STOOPIDNET_STORAGE_NATIVE) {
+        if ((model->half = stoopidnet_half_create(net, half_format)) == NULL) {
+            fprintf(stderr, "Failed to convert the net to %s\n",
+                    stoopidnet_storage_name(half_format));
+            return -1;
+        }
+    } else if (sparse) {
+        if ((model->sparse = stoopidnet_sparse_create(net)) == NULL) {
+            fprintf(stderr, "Failed to build the sparse net\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void stoopidnet_model_destroy(stoopidnet_model_t* model)
+{
+    stoopidnet_quant_destroy(model->quant);
+    stoopidnet_half_destroy(model->half);
+    stoopidnet_sparse_destroy(model->sparse);
+    if (model->net != NULL) {
+        stoopidnet_destroy(model->net);
+    }
+    *model = (stoopidnet_model_t){ 0 };
+}
+
+
+size_t stoopidnet_model_size(const stoopidnet_model_t* model)
+{
+    if (model->quant != NULL) {
+        return stoopidnet_quant_size(model->quant);
+    } else if (model->half != NULL) {
+        return stoopidnet_half_size(model->half);
+    } else if (model->sparse != NULL) {
+        return stoopidnet_sparse_size(model->sparse);
+    }
+    return 0;
+}
+
+
+void stoopidnet_model_evaluate_batch_u8(const stoopidnet_model_t* model, uint32_t n_inputs,
+                                        const uint8_t* inputs, double* outputs)
+{
+    if (model->quant != NULL) {
+        stoopidnet_quant_evaluate_batch_u8(model->quant, n_inputs, inputs, outputs);
+    } else if (model->half != NULL) {
+        stoopidnet_half_evaluate_batch_u8(model->half, n_inputs, inputs, outputs);
+    } else if (model->sparse != NULL) {
+        stoopidnet_sparse_evaluate_batch_u8(model->sparse, n_inputs, inputs, outputs);
+    } else {
+        stoopidnet_evaluate_batch_u8(model->net, n_inputs, inputs, outputs);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef STOOPIDNET_MODEL_H
+#define STOOPIDNET_MODEL_H
+
+/**
+ * A trained stoopidnet together with the read-only copy of it, if any, that inference goes
+ * through instead: int8 (stoopidnet_quant.h), fp16 or bf16 (stoopidnet_half.h), or sparse
+ * (stoopidnet_sparse.h). Lets the tools that score with any of them share one code path.
+ */
+
+#include "stoopidnet.h"
+#include "stoopidnet_half.h"
+#include "stoopidnet_quant.h"
+#include "stoopidnet_sparse.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct stoopidnet_model
+{
+    stoopidnet_t* net;
+
+    /**
+     * At most one is non-NULL, and inference goes through it instead of net.
+     */
+    stoopidnet_quant_t* quant;
+    stoopidnet_half_t* half;
+    stoopidnet_sparse_t* sparse;
+} stoopidnet_model_t;
+
+/**
+ * Fills in model for net, building the copy inference goes through: an int8 one calibrated on the
+ * n_calib inputs in calib_inputs (laid out as in stoopidnet_evaluate_batch_u8) if that's
+ * non-NULL, else a 16-bit one if half_format isn't STOOPIDNET_STORAGE_NATIVE, else a sparse one
+ * if sparse is nonzero. Returns nonzero after printing why if the copy couldn't be built. The
+ * model takes ownership of net.
+ */
+int stoopidnet_model_init(stoopidnet_model_t* model, stoopidnet_t* net, uint32_t n_calib,
+                          const uint8_t* calib_inputs, stoopidnet_storage_t half_format,
+                          int sparse);
+
+/**
+ * Destroys the copy and the net.
+ */
+void stoopidnet_model_destroy(stoopidnet_model_t* model);
+
+/**
+ * Bytes taken up by the copy's parameters, or 0 if there isn't one.
+ */
+size_t stoopidnet_model_size(const stoopidnet_model_t* model);
+
+/**
+ * Same contract as stoopidnet_evaluate_batch_u8. Safe to call from several threads at once.
+ */
+void stoopidnet_model_evaluate_batch_u8(const stoopidnet_model_t* model, uint32_t n_inputs,
+                                        const uint8_t* inputs, double* outputs);
+
+#endif
@@ -0,0 +1,254 @@
+// for clock_gettime
+#define _DEFAULT_SOURCE
+
+#include "stoopidnet_profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct stoopidnet_trace_event
+{
+    uint64_t start;
+    uint64_t duration;
+    uint16_t phase;
+    uint16_t layer;
+    uint32_t thread;
+} stoopidnet_trace_event_t;
+
+/**
+ * One phase at one layer. Updated with relaxed atomic adds, since workers record concurrently.
+ */
+typedef struct stoopidnet_phase_timer
+{
+    uint64_t ns;
+    uint64_t calls;
+    uint64_t flops;
+    uint64_t bytes;
+} stoopidnet_phase_timer_t;
+
+struct stoopidnet_profile
+{
+    stoopidnet_phase_timer_t timers[STOOPIDNET_NUM_PHASES][STOOPIDNET_PROFILE_MAX_LAYERS];
+    stoopidnet_counters_t counters;
+
+    /**
+     * Timestamps in the trace are relative to this.
+     */
+    uint64_t origin;
+
+    /**
+     * Events are claimed by bumping num_events, so it can run past max_events; anything claimed
+     * past the end is dropped and counted.
+     */
+    stoopidnet_trace_event_t* events;
+    uint32_t max_events;
+    uint32_t num_events;
+    uint64_t dropped_events;
+};
+
+static const char* const PHASE_NAMES[STOOPIDNET_NUM_PHASES] = {
+    "train", "pack", "prefetch-wait", "forward", "bp1", "bp2", "gradients", "reduce", "update",
+};
+
+static void atomic_add(uint64_t* target, uint64_t v)
+{
+    if (v != 0) {
+        __atomic_fetch_add(target, v, __ATOMIC_RELAXED);
+    }
+}
+
+
+stoopidnet_profile_t* stoopidnet_profile_create(uint32_t max_trace_events)
+{
+    stoopidnet_profile_t* prof = calloc(1, sizeof(stoopidnet_profile_t));
+    prof->max_events = max_trace_events;
+    if (max_trace_events > 0) {
+        prof->events = malloc((size_t)max_trace_events * sizeof(stoopidnet_trace_event_t));
+    }
+    prof->origin = stoopidnet_profile_now();
+    return prof;
+}
+
+
+void stoopidnet_profile_destroy(stoopidnet_profile_t* prof)
+{
+    if (prof == NULL) {
+        return;
+    }
+    free(prof->events);
+    free(prof);
+}
+
+
+void stoopidnet_profile_reset(stoopidnet_profile_t* prof)
+{
+    memset(prof->timers, 0, sizeof(prof->timers));
+    memset(&prof->counters, 0, sizeof(prof->counters));
+    prof->num_events = 0;
+    prof->dropped_events = 0;
+    prof->origin = stoopidnet_profile_now();
+}
+
+
+const char* stoopidnet_phase_name(stoopidnet_phase_t phase)
+{
+    return (phase < STOOPIDNET_NUM_PHASES) ? PHASE_NAMES[phase] : NULL;
+}
+
+
+double stoopidnet_profile_seconds(const stoopidnet_profile_t* prof, stoopidnet_phase_t phase,
+                                  uint32_t layer)
+{
+    uint64_t ns = 0;
+    for (uint32_t l = 0; l < STOOPIDNET_PROFILE_MAX_LAYERS; l++) {
+        if ((layer == STOOPIDNET_PROFILE_ALL_LAYERS) || (layer == l)) {
+            ns += prof->timers[phase][l].ns;
+        }
+    }
+    return ns * 1e-9;
+}
+
+
+void stoopidnet_profile_get_counters(const stoopidnet_profile_t* prof,
+                                     stoopidnet_counters_t* counters)
+{
+    *counters = prof->counters;
+}
+
+
+void stoopidnet_profile_print(const stoopidnet_profile_t* prof, FILE* fp)
+{
+    const double total = stoopidnet_profile_seconds(prof, STOOPIDNET_PHASE_TRAIN,
+                                                    STOOPIDNET_PROFILE_ALL_LAYERS);
+    fprintf(fp, "phase          layer      calls     seconds   share   GFLOP/s     GB/s\n");
+    for (int p = 0; p < STOOPIDNET_NUM_PHASES; p++) {
+        for (uint32_t l = 0; l < STOOPIDNET_PROFILE_MAX_LAYERS; l++) {
+            const stoopidnet_phase_timer_t* t = &prof->timers[p][l];
+            if (t->calls == 0) {
+                continue;
+            }
+            const double s = t->ns * 1e-9;
+            fprintf(fp, "%-13s  %5u  %9llu  %10.4f  %5.1f%%  %8.2f  %7.2f\n", PHASE_NAMES[p], l,
+                    (unsigned long long)t->calls, s, (total > 0) ? (100 * s / total) : 0,
+                    (s > 0) ? (t->flops * 1e-9 / s) : 0, (s > 0) ? (t->bytes * 1e-9 / s) : 0);
+        }
+    }
+
+    const stoopidnet_counters_t* c = &prof->counters;
+    fprintf(fp, "%llu samples in %llu batches, %.3f GFLOP, %.3f GB touched, "
+            "%llu allocations (%.1f MB)\n", (unsigned long long)c->samples,
+            (unsigned long long)c->batches, c->flops * 1e-9, c->bytes * 1e-9,
+            (unsigned long long)c->allocations, c->allocated_bytes / (1024.0 * 1024.0));
+    if (prof->dropped_events > 0) {
+        fprintf(fp, "%llu trace events dropped\n", (unsigned long long)prof->dropped_events);
+    }
+}
+
+
+int stoopidnet_profile_write_trace(const stoopidnet_profile_t* prof, const char* file)
+{
+    FILE* fp = fopen(file, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s for writing\n", file);
+        return 0;
+    }
+
+    const uint32_t n = (prof->num_events < prof->max_events) ? prof->num_events :
+                                                                prof->max_events;
+
+    // name every thread that shows up so the viewer labels its track.
+    uint32_t max_worker = 0;
+    int prefetch = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const uint32_t t = prof->events[i].thread;
+        if (t == STOOPIDNET_PROFILE_PREFETCH_THREAD) {
+            prefetch = 1;
+        } else if (t > max_worker) {
+            max_worker = t;
+        }
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (uint32_t t = 0; t <= max_worker; t++) {
+        fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                "\"args\": {\"name\": \"worker %u\"}},\n", t, t);
+    }
+    if (prefetch) {
+        fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                "\"args\": {\"name\": \"prefetch\"}},\n", STOOPIDNET_PROFILE_PREFETCH_THREAD);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        const stoopidnet_trace_event_t* e = &prof->events[i];
+        fprintf(fp, "{\"name\": \"%s\", \"cat\": \"train\", \"ph\": \"X\", \"pid\": 1, "
+                "\"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": %u}},\n",
+                PHASE_NAMES[e->phase], e->thread, (e->start - prof->origin) * 1e-3,
+                e->duration * 1e-3, e->layer);
+    }
+    // trailing commas aren't allowed, so the list ends with an event that's always there.
+    fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"args\": {\"name\": \"stoopidnet\"}}\n]}\n");
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write %s\n", file);
+        return 0;
+    }
+    return 1;
+}
+
+
+uint64_t stoopidnet_profile_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint64_t)t.tv_sec * 1000000000ull) + (uint64_t)t.tv_nsec;
+}
+
+
+void stoopidnet_profile_record(stoopidnet_profile_t* prof, stoopidnet_phase_t phase,
+                               uint32_t layer, uint32_t thread, uint64_t start, uint64_t flops,
+                               uint64_t bytes)
+{
+    const uint64_t ns = stoopidnet_profile_now() - start;
+    const uint32_t slot = (layer < STOOPIDNET_PROFILE_MAX_LAYERS) ? layer :
+                          (STOOPIDNET_PROFILE_MAX_LAYERS - 1);
+    stoopidnet_phase_timer_t* t = &prof->timers[phase][slot];
+    atomic_add(&t->ns, ns);
+    atomic_add(&t->calls, 1);
+    atomic_add(&t->flops, flops);
+    atomic_add(&t->bytes, bytes);
+    atomic_add(&prof->counters.flops, flops);
+    atomic_add(&prof->counters.bytes, bytes);
+
+    if (prof->max_events > 0) {
+        const uint32_t i = __atomic_fetch_add(&prof->num_events, 1, __ATOMIC_RELAXED);
+        if (i < prof->max_events) {
+            stoopidnet_trace_event_t* e = &prof->events[i];
+            e->start    = start;
+            e->duration = ns;
+            e->phase    = phase;
+            e->layer    = layer;
+            e->thread   = thread;
+        } else {
+            // pull the claim counter back so it can't wrap around into the buffer on long runs.
+            __atomic_store_n(&prof->num_events, prof->max_events, __ATOMIC_RELAXED);
+            atomic_add(&prof->dropped_events, 1);
+        }
+    }
+}
+
+
+void stoopidnet_profile_count_samples(stoopidnet_profile_t* prof, uint64_t samples,
+                                      uint64_t batches)
+{
+    atomic_add(&prof->counters.samples, samples);
+    atomic_add(&prof->counters.batches, batches);
+}
+
+
+void stoopidnet_profile_count_alloc(stoopidnet_profile_t* prof, uint64_t allocations,
+                                    uint64_t bytes)
+{
+    atomic_add(&prof->counters.allocations, allocations);
+    atomic_add(&prof->counters.allocated_bytes, bytes);
+}
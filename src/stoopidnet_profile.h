@@ -0,0 +1,166 @@
+#ifndef STOOPIDNET_PROFILE_H
+#define STOOPIDNET_PROFILE_H
+
+/**
+ * Instrumentation of stoopidnet's training loop.
+ *
+ * A profile handed to training in stoopidnet_training_parameters_t::profile gets the time spent in
+ * every phase of every layer added to it, along with running counts of samples, floating point
+ * operations, bytes touched and heap allocations, and optionally a timeline of every phase that
+ * can be written out as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ *
+ * Training without a profile costs one pointer test per phase. Building stoopidnet.c with
+ * -DSTOOPIDNET_PROFILING=0 compiles the instrumentation out altogether.
+ */
+
+#include "stoopidnet.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Per-layer times are kept for this many layers; deeper layers are added to the last one.
+ */
+#define STOOPIDNET_PROFILE_MAX_LAYERS 32
+
+/**
+ * Passed as the layer to stoopidnet_profile_seconds to sum a phase over every layer.
+ */
+#define STOOPIDNET_PROFILE_ALL_LAYERS UINT32_MAX
+
+/**
+ * Thread id the prefetcher's work is recorded under; training workers use their index.
+ */
+#define STOOPIDNET_PROFILE_PREFETCH_THREAD 1000
+
+typedef enum stoopidnet_phase
+{
+    /**
+     * A whole stoopidnet_train call.
+     */
+    STOOPIDNET_PHASE_TRAIN = 0,
+
+    /**
+     * Gathering a minibatch's examples into contiguous rows of the net's precision.
+     */
+    STOOPIDNET_PHASE_PACK = 1,
+
+    /**
+     * The trainer waiting on the prefetcher for the next minibatch.
+     */
+    STOOPIDNET_PHASE_PREFETCH_WAIT = 2,
+
+    /**
+     * One layer's z = W * a + b and activation.
+     */
+    STOOPIDNET_PHASE_FORWARD = 3,
+
+    /**
+     * The output layer's error (BP1).
+     */
+    STOOPIDNET_PHASE_BP1 = 4,
+
+    /**
+     * Propagating the error back into one hidden layer (BP2).
+     */
+    STOOPIDNET_PHASE_BP2 = 5,
+
+    /**
+     * Accumulating one layer's weight and bias gradients.
+     */
+    STOOPIDNET_PHASE_GRADIENTS = 6,
+
+    /**
+     * Summing the workers' gradients.
+     */
+    STOOPIDNET_PHASE_REDUCE = 7,
+
+    /**
+     * The optimizer step.
+     */
+    STOOPIDNET_PHASE_UPDATE = 8,
+
+    STOOPIDNET_NUM_PHASES
+} stoopidnet_phase_t;
+
+typedef struct stoopidnet_counters
+{
+    uint64_t samples;
+    uint64_t batches;
+
+    /**
+     * Estimated from the layer shapes: a multiply-add counts as two, activation functions aren't
+     * counted.
+     */
+    uint64_t flops;
+
+    /**
+     * Estimated bytes of parameters, activations and gradients read and written, counting each
+     * tensor once per pass over it. Cache reuse within a pass isn't modeled.
+     */
+    uint64_t bytes;
+
+    /**
+     * Heap allocations made by training, and their total size.
+     */
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+} stoopidnet_counters_t;
+
+/**
+ * Creates an empty profile. If max_trace_events is nonzero, up to that many phases are also
+ * kept as trace events (24 bytes each); any past that are only counted.
+ */
+stoopidnet_profile_t* stoopidnet_profile_create(uint32_t max_trace_events);
+void stoopidnet_profile_destroy(stoopidnet_profile_t* prof);
+
+/**
+ * Zeroes every timer and counter and drops the recorded trace events.
+ */
+void stoopidnet_profile_reset(stoopidnet_profile_t* prof);
+
+/**
+ * Short lowercase name of the phase, e.g. "forward", or NULL if there's no such one.
+ */
+const char* stoopidnet_phase_name(stoopidnet_phase_t phase);
+
+/**
+ * Seconds spent in phase at layer (or STOOPIDNET_PROFILE_ALL_LAYERS). Phases that run on
+ * several threads at once add up every thread's time.
+ */
+double stoopidnet_profile_seconds(const stoopidnet_profile_t* prof, stoopidnet_phase_t phase,
+                                  uint32_t layer);
+void stoopidnet_profile_get_counters(const stoopidnet_profile_t* prof,
+                                     stoopidnet_counters_t* counters);
+
+/**
+ * Writes a human-readable table of every phase and layer with their share of the training
+ * time, and the counters, to fp.
+ */
+void stoopidnet_profile_print(const stoopidnet_profile_t* prof, FILE* fp);
+
+/**
+ * Writes the recorded trace events to file as Chrome trace-event JSON. Returns nonzero on
+ * success.
+ */
+int stoopidnet_profile_write_trace(const stoopidnet_profile_t* prof, const char* file);
+
+/**
+ * Recording, used by the training loop. Timestamps are CLOCK_MONOTONIC nanoseconds; every
+ * function may be called from any number of threads at once.
+ */
+uint64_t stoopidnet_profile_now(void);
+
+/**
+ * Adds a phase that started at start and ends now, which did about flops operations over about
+ * bytes of memory.
+ */
+void stoopidnet_profile_record(stoopidnet_profile_t* prof, stoopidnet_phase_t phase,
+                               uint32_t layer, uint32_t thread, uint64_t start, uint64_t flops,
+                               uint64_t bytes);
+void stoopidnet_profile_count_samples(stoopidnet_profile_t* prof, uint64_t samples,
+                                      uint64_t batches);
+void stoopidnet_profile_count_alloc(stoopidnet_profile_t* prof, uint64_t allocations,
+                                    uint64_t bytes);
+
+#endif
@@ -0,0 +1,196 @@
+// for clock_gettime
+#define _DEFAULT_SOURCE
+
+#include "math_util.h"
+#include "mnist_loader.h"
+#include "stoopidnet.h"
+#include "stoopidnet_sparse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Examples scored per batch evaluation call.
+ */
+#define SCORE_CHUNK 256
+
+/**
+ * Examples evaluated one at a time when timing single-example inference.
+ */
+#define SINGLE_SAMPLES 1000
+
+static double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+/**
+ * Scores the data set with the sparse net if s is non-NULL, and with net otherwise, batch_size
+ * examples per call (only the first SINGLE_SAMPLES of them if that's 1). Returns how many were
+ * right and leaves the time taken per example in *seconds.
+ */
+static uint32_t score(stoopidnet_t* net, stoopidnet_sparse_t* s, const mnist_dataset_t* ds,
+                      uint32_t batch_size, double* seconds)
+{
+    const uint32_t in = ds->width * ds->height;
+    const uint32_t out = stoopidnet_get_num_nodes_in_layer(net, stoopidnet_get_num_layers(net) - 1);
+    const uint32_t n = ((batch_size == 1) && (ds->count > SINGLE_SAMPLES)) ? SINGLE_SAMPLES :
+                                                                             ds->count;
+    double* outputs = malloc((size_t)batch_size * out * sizeof(double));
+
+    uint32_t correct = 0;
+    const double t0 = now_seconds();
+    for (uint32_t i = 0; i < n; i += batch_size) {
+        const uint32_t nb = ((n - i) < batch_size) ? (n - i) : batch_size;
+        if (s != NULL) {
+            stoopidnet_sparse_evaluate_batch_u8(s, nb, ds->images + ((size_t)i * in), outputs);
+        } else {
+            stoopidnet_evaluate_batch_u8(net, nb, ds->images + ((size_t)i * in), outputs);
+        }
+        for (uint32_t j = 0; j < nb; j++) {
+            correct += (maxidx(&outputs[(size_t)j * out], out) == ds->labels[i + j]);
+        }
+    }
+    *seconds = (now_seconds() - t0) / n;
+
+    free(outputs);
+    return correct;
+}
+
+int main(int argc, char** argv)
+{
+    // options come before the positional arguments.
+    int argi = 1;
+    double sparsity = 0.9;
+    double output_sparsity = 0;
+    int nepochs = 1;
+    double learn_rate = 0.5;
+    uint32_t num_threads = 1;
+    for (; (argi < argc) && !strncmp(argv[argi], "--", 2); argi++) {
+        if (!strcmp(argv[argi], "--sparsity") && ((argi + 1) < argc)) {
+            sparsity = strtod(argv[++argi], NULL);
+        } else if (!strcmp(argv[argi], "--output-sparsity") && ((argi + 1) < argc)) {
+            output_sparsity = strtod(argv[++argi], NULL);
+        } else if (!strcmp(argv[argi], "--epochs") && ((argi + 1) < argc)) {
+            nepochs = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--rate") && ((argi + 1) < argc)) {
+            learn_rate = strtod(argv[++argi], NULL);
+        } else if (!strcmp(argv[argi], "--threads") && ((argi + 1) < argc)) {
+            num_threads = strtol(argv[++argi], NULL, 10);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[argi]);
+            return -1;
+        }
+    }
+
+    if (((argc - argi) != 5) || (sparsity < 0) || (sparsity > 1) || (output_sparsity < 0) ||
+        (output_sparsity > 1)) {
+        printf("Usage: %s [--sparsity S] [--output-sparsity S] [--epochs N] [--rate R] "
+               "[--threads N] <stoopidnet input file> <stoopidnet output file> <mnist data> "
+               "<mnist labels> <randseed>\n", argv[0]);
+        printf("  --sparsity S fraction of each hidden layer's weights to zero, smallest\n"
+               "               magnitudes first (default 0.9)\n");
+        printf("  --output-sparsity S\n"
+               "               same, for the output layer's weights (default 0)\n");
+        printf("  --epochs N   passes over the data set fine-tuning the weights that are left\n"
+               "               (default 1, 0 to skip)\n");
+        printf("  --rate R     fine-tuning learning rate (default 0.5)\n");
+        printf("  --threads N  split each fine-tuning minibatch across N threads\n");
+        return -1;
+    }
+    argv += argi - 1;
+
+    const long seed = strtol(argv[5], NULL, 10);
+    srand(seed);
+    uint64_t rng = (uint64_t)seed;
+
+    // load files
+    stoopidnet_t* net = stoopidnet_load_from_file(argv[1]);
+    if (net == NULL) {
+        return -1;
+    }
+    mnist_dataset_t* ds = mnist_dataset_open(argv[3], argv[4]);
+    if ((ds == NULL) || (ds->count == 0) || (ds->labels == NULL) ||
+        ((ds->width * ds->height) != stoopidnet_get_num_nodes_in_layer(net, 0))) {
+        fprintf(stderr, "Something went wrong loading the mnist files\n");
+        return -1;
+    }
+    const uint32_t last = stoopidnet_get_num_layers(net) - 1;
+    if (mnist_dataset_check_labels(ds, stoopidnet_get_num_nodes_in_layer(net, last)) != 0) {
+        return -1;
+    }
+
+    double dense_batch, dense_single, sparse_batch, sparse_single;
+    const uint32_t dense_good = score(net, NULL, ds, SCORE_CHUNK, &dense_batch);
+    score(net, NULL, ds, 1, &dense_single);
+    printf("dense: %u / %u accuracy\n", dense_good, ds->count);
+
+    // prune
+    for (uint32_t l = 1; l <= last; l++) {
+        const uint64_t total = (uint64_t)stoopidnet_get_num_nodes_in_layer(net, l - 1) *
+                               stoopidnet_get_num_nodes_in_layer(net, l);
+        const uint64_t zeros = stoopidnet_sparse_prune(net, l, (l == last) ? output_sparsity :
+                                                                             sparsity);
+        printf("layer %u: %llu / %llu weights pruned (%.1f%%)\n", l, (unsigned long long)zeros,
+               (unsigned long long)total, (100.0 * zeros) / total);
+    }
+    printf("pruned: %u / %u accuracy\n", score(net, NULL, ds, SCORE_CHUNK, &sparse_batch),
+           ds->count);
+
+    // fine-tune what's left, with the pruned weights held at zero.
+    stoopidnet_training_parameters_t train_params = {
+        .learn_rate = learn_rate,
+        .batch_size = 10,
+        .loss = STOOPIDNET_LOSS_QUADRATIC,
+        .optimizer = STOOPIDNET_OPTIMIZER_SGD,
+        .num_threads = num_threads,
+        .keep_pruned = 1,
+        .rng = &rng,
+    };
+    if (stoopidnet_get_layer_activation(net, last) == STOOPIDNET_ACTIVATION_SOFTMAX) {
+        train_params.loss = STOOPIDNET_LOSS_CROSS_ENTROPY;
+    }
+    mnist_dataset_advise(ds, MNIST_ACCESS_RANDOM);
+    for (int i = 0; i < nepochs; i++) {
+        stoopidnet_train_u8(net, &train_params, ds->count, ds->images, ds->labels);
+        printf("fine-tuning epoch %i: %u / %u accuracy\n", i,
+               score(net, NULL, ds, SCORE_CHUNK, &sparse_batch), ds->count);
+    }
+
+    // compare CSR inference against the dense path.
+    stoopidnet_sparse_t* s = stoopidnet_sparse_create(net);
+    if (s == NULL) {
+        fprintf(stderr, "Failed to build the sparse net\n");
+        return -1;
+    }
+    const uint32_t sparse_good = score(net, s, ds, SCORE_CHUNK, &sparse_batch);
+    score(net, s, ds, 1, &sparse_single);
+
+    const size_t esize = (stoopidnet_get_precision(net) == STOOPIDNET_PRECISION_F32) ?
+                         sizeof(float) : sizeof(double);
+    size_t dense_bytes = 0;
+    for (uint32_t l = 1; l <= last; l++) {
+        dense_bytes += ((size_t)stoopidnet_get_num_nodes_in_layer(net, l - 1) + 1) *
+                       stoopidnet_get_num_nodes_in_layer(net, l) * esize;
+    }
+    printf("\nsparse vs dense:\n");
+    printf("  accuracy: %u vs %u / %u\n", sparse_good, dense_good, ds->count);
+    printf("  batched images/sec: %.0f vs %.0f (%.2fx)\n", 1 / sparse_batch, 1 / dense_batch,
+           dense_batch / sparse_batch);
+    printf("  single images/sec: %.0f vs %.0f (%.2fx)\n", 1 / sparse_single, 1 / dense_single,
+           dense_single / sparse_single);
+    printf("  parameter bytes: %zu vs %zu\n", stoopidnet_sparse_size(s), dense_bytes);
+
+    // the pruned net is stored dense, zeros and all.
+    stoopidnet_clear_optimizer_state(net);
+    const int stored = stoopidnet_store_to_file(net, argv[2]);
+
+    stoopidnet_sparse_destroy(s);
+    mnist_dataset_close(ds);
+    stoopidnet_destroy(net);
+    return stored;
+}
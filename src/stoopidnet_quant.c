@@ -0,0 +1,423 @@
+// for posix_memalign
+#define _DEFAULT_SOURCE
+
+#include "stoopidnet_quant.h"
+#include "stoopidnet_kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Quantized activations run from 0 to this; 7 bits rather than 8 so pmaddubsw can't saturate.
+ */
+#define QUANT_ACT_MAX 127
+
+/**
+ * Quantized weights run from -QUANT_WEIGHT_MAX to QUANT_WEIGHT_MAX.
+ */
+#define QUANT_WEIGHT_MAX 127
+
+/**
+ * Quantized weight rows start this many bytes apart, and are zero padded up to it.
+ */
+#define QUANT_ROW_ALIGN 64
+
+/**
+ * Entries in each layer's activation table, and the widest z range a sigmoid or tanh table may
+ * cover; past +-16 they're flat at 7-bit (and double) resolution anyway.
+ */
+#define ACT_LUT_SIZE 4096
+#define ACT_LUT_RANGE_MAX 16.0
+
+typedef struct stoopidnet_quant_layer
+{
+    uint32_t in;
+    uint32_t out;
+    stoopidnet_activation_t activation;
+
+    /**
+     * out rows of stride bytes each, pointing into the quantized net's weight slab.
+     */
+    size_t stride;
+    int8_t* weights;
+
+    /**
+     * z[j] = dot(a, weights[j]) * scales[j] + biases[j]. scales folds the input activations'
+     * scale together with row j's weight scale.
+     */
+    float* scales;
+    float* biases;
+
+    /**
+     * The activation table covers z in [-range, range]; z maps to entry
+     * z * lut_scale + lut_offset. lut holds the activation itself for the output layer, lut_q
+     * holds it as a 7-bit activation for the layers feeding the next one. Softmax layers depend on
+     * the whole row, so they don't have a table and are computed in float instead.
+     */
+    float lut_scale;
+    float lut_offset;
+    float lut[ACT_LUT_SIZE];
+    uint8_t lut_q[ACT_LUT_SIZE];
+
+    /**
+     * The layer's activations a are stored as round((a - act_lo) * act_scale), which puts
+     * [act_lo, act_hi] on [0, QUANT_ACT_MAX].
+     */
+    double act_lo;
+    double act_hi;
+    double act_scale;
+} stoopidnet_quant_layer_t;
+
+struct stoopidnet_quant
+{
+    uint32_t num_layers;
+    uint32_t* layer_sizes;
+
+    /**
+     * Inputs get multiplied by this before being rounded to 7 bits.
+     */
+    float input_scale;
+
+    /**
+     * Widest row stride of any layer; scratch activation buffers are this long.
+     */
+    size_t widest;
+
+    /**
+     * layers[i] holds the parameters feeding layer i + 1.
+     */
+    stoopidnet_quant_layer_t* layers;
+    int8_t* weight_slab;
+    size_t weight_slab_len;
+};
+
+static size_t round_up(size_t n, size_t to)
+{
+    return ((n + to - 1) / to) * to;
+}
+
+static double activate(stoopidnet_activation_t f, double z)
+{
+    double a;
+    stoopidnet_kernels()->activate_f64(f, 1, 1, &z, &a);
+    return a;
+}
+
+/**
+ * Index into a layer's activation table for the given z.
+ */
+static inline int lut_index(const stoopidnet_quant_layer_t* layer, float z)
+{
+    int idx = (int)((z * layer->lut_scale) + layer->lut_offset);
+    return (idx < 0) ? 0 : ((idx >= ACT_LUT_SIZE) ? (ACT_LUT_SIZE - 1) : idx);
+}
+
+/**
+ * Rounds an input to 7-bit activations, zero-filling dst up to the widest row stride. The input
+ * is either doubles or, if input is NULL, bytes standing for [0, 1].
+ */
+static void quantize_input(const stoopidnet_quant_t* q, const double* input,
+                           const uint8_t* input_u8, uint8_t* dst)
+{
+    const uint32_t n = q->layer_sizes[0];
+    for (uint32_t i = 0; i < n; i++) {
+        float v = (input != NULL) ? (float)input[i] : (input_u8[i] / 255.0f);
+        v = (v * q->input_scale) + 0.5f;
+        dst[i] = (v <= 0) ? 0 : ((v >= QUANT_ACT_MAX) ? QUANT_ACT_MAX : (uint8_t)v);
+    }
+    memset(dst + n, 0, q->widest - n);
+}
+
+/**
+ * Evaluates n_inputs inputs, taken from the rows in inputs or, if that's NULL, from the row-major
+ * byte matrix inputs_u8.
+ */
+static void quant_evaluate(stoopidnet_quant_t* q, uint32_t n_inputs, double** inputs,
+                           const uint8_t* inputs_u8, double* outputs);
+
+
+stoopidnet_quant_t* stoopidnet_quantize(stoopidnet_t* net, uint32_t n_calib, double** calib_inputs)
+{
+    stoopidnet_quant_t* q = calloc(1, sizeof(stoopidnet_quant_t));
+    q->num_layers = stoopidnet_get_num_layers(net);
+    q->layer_sizes = calloc(q->num_layers, sizeof(uint32_t));
+    q->layers = calloc(q->num_layers - 1, sizeof(stoopidnet_quant_layer_t));
+
+    uint32_t widest_nodes = 0;
+    for (uint32_t i = 0; i < q->num_layers; i++) {
+        q->layer_sizes[i] = stoopidnet_get_num_nodes_in_layer(net, i);
+        widest_nodes = (q->layer_sizes[i] > widest_nodes) ? q->layer_sizes[i] : widest_nodes;
+    }
+
+    // lay out every layer's rows in one aligned slab.
+    for (uint32_t l = 0; l < (q->num_layers - 1); l++) {
+        stoopidnet_quant_layer_t* layer = &q->layers[l];
+        layer->in = q->layer_sizes[l];
+        layer->out = q->layer_sizes[l + 1];
+        layer->activation = stoopidnet_get_layer_activation(net, l + 1);
+        layer->stride = round_up(layer->in, QUANT_ROW_ALIGN);
+
+        // the sigmoids and tanh have fixed ranges; the ReLUs' get calibrated.
+        layer->act_lo = (layer->activation == STOOPIDNET_ACTIVATION_TANH) ? -1 : 0;
+        layer->act_hi = ((layer->activation == STOOPIDNET_ACTIVATION_RELU) ||
+                         (layer->activation == STOOPIDNET_ACTIVATION_LEAKY_RELU)) ? 0 : 1;
+        q->weight_slab_len += layer->stride * layer->out;
+        q->widest = (layer->stride > q->widest) ? layer->stride : q->widest;
+    }
+    void* slab = NULL;
+    if (posix_memalign(&slab, QUANT_ROW_ALIGN, q->weight_slab_len) != 0) {
+        stoopidnet_quant_destroy(q);
+        return NULL;
+    }
+    q->weight_slab = slab;
+    memset(q->weight_slab, 0, q->weight_slab_len);
+
+    // the original parameters, plus room to run the calibration set through them.
+    double** weights = calloc(q->num_layers - 1, sizeof(double*));
+    double** biases  = calloc(q->num_layers - 1, sizeof(double*));
+    double* act[2] = { malloc(widest_nodes * sizeof(double)),
+                       malloc(widest_nodes * sizeof(double)) };
+    double* zmax = calloc(q->num_layers - 1, sizeof(double));
+    double input_max = 0;
+    for (uint32_t l = 0; l < (q->num_layers - 1); l++) {
+        weights[l] = malloc((size_t)q->layers[l].in * q->layers[l].out * sizeof(double));
+        biases[l]  = malloc(q->layers[l].out * sizeof(double));
+        stoopidnet_get_layer_params(net, l + 1, weights[l], biases[l]);
+    }
+
+    // calibrate
+    for (uint32_t s = 0; s < n_calib; s++) {
+        memcpy(act[0], calib_inputs[s], q->layer_sizes[0] * sizeof(double));
+        for (uint32_t i = 0; i < q->layer_sizes[0]; i++) {
+            input_max = (act[0][i] > input_max) ? act[0][i] : input_max;
+        }
+
+        for (uint32_t l = 0; l < (q->num_layers - 1); l++) {
+            stoopidnet_quant_layer_t* layer = &q->layers[l];
+            const double* src = act[l & 1];
+            double* dst = act[(l + 1) & 1];
+            for (uint32_t j = 0; j < layer->out; j++) {
+                const double* w = weights[l] + ((size_t)j * layer->in);
+                double z = biases[l][j];
+                for (uint32_t k = 0; k < layer->in; k++) {
+                    z += w[k] * src[k];
+                }
+                zmax[l] = (fabs(z) > zmax[l]) ? fabs(z) : zmax[l];
+                dst[j] = z;
+            }
+
+            stoopidnet_kernels()->activate_f64(layer->activation, 1, layer->out, dst, dst);
+            for (uint32_t j = 0; j < layer->out; j++) {
+                if (layer->activation == STOOPIDNET_ACTIVATION_LEAKY_RELU) {
+                    layer->act_lo = (dst[j] < layer->act_lo) ? dst[j] : layer->act_lo;
+                }
+                if ((layer->activation == STOOPIDNET_ACTIVATION_RELU) ||
+                    (layer->activation == STOOPIDNET_ACTIVATION_LEAKY_RELU)) {
+                    layer->act_hi = (dst[j] > layer->act_hi) ? dst[j] : layer->act_hi;
+                }
+            }
+        }
+    }
+
+    // quantize
+    q->input_scale = (input_max > 0) ? (float)(QUANT_ACT_MAX / input_max) : (float)QUANT_ACT_MAX;
+    int8_t* rows = q->weight_slab;
+    for (uint32_t l = 0; l < (q->num_layers - 1); l++) {
+        stoopidnet_quant_layer_t* layer = &q->layers[l];
+        // dequantizing the previous layer's activations is a scale and an offset; the scale
+        // folds into each row's scale and the offset, times the row's sum, into its bias.
+        const double act_scale = (l == 0) ? (1.0 / q->input_scale) :
+                                            (1.0 / q->layers[l - 1].act_scale);
+        const double act_lo    = (l == 0) ? 0 : q->layers[l - 1].act_lo;
+        layer->act_scale = (layer->act_hi > layer->act_lo) ?
+                           (QUANT_ACT_MAX / (layer->act_hi - layer->act_lo)) : QUANT_ACT_MAX;
+
+        layer->weights = rows;
+        layer->scales = malloc(layer->out * sizeof(float));
+        layer->biases = malloc(layer->out * sizeof(float));
+        rows += layer->stride * layer->out;
+
+        for (uint32_t j = 0; j < layer->out; j++) {
+            const double* w = weights[l] + ((size_t)j * layer->in);
+            int8_t* qw = layer->weights + (j * layer->stride);
+
+            double wmax = 0;
+            for (uint32_t k = 0; k < layer->in; k++) {
+                wmax = (fabs(w[k]) > wmax) ? fabs(w[k]) : wmax;
+            }
+            const double wscale = (wmax > 0) ? (wmax / QUANT_WEIGHT_MAX) : 1.0;
+            int32_t qsum = 0;
+            for (uint32_t k = 0; k < layer->in; k++) {
+                qw[k] = (int8_t)lrint(w[k] / wscale);
+                qsum += qw[k];
+            }
+
+            layer->scales[j] = (float)(act_scale * wscale);
+            layer->biases[j] = (float)(biases[l][j] + (act_lo * wscale * qsum));
+        }
+
+        // the table only has to cover the z range seen while calibrating. The ReLUs don't
+        // flatten out, so theirs has to cover all of it.
+        double range = (zmax[l] < 1.0) ? 1.0 : zmax[l];
+        if ((layer->activation != STOOPIDNET_ACTIVATION_RELU) &&
+            (layer->activation != STOOPIDNET_ACTIVATION_LEAKY_RELU) &&
+            (range > ACT_LUT_RANGE_MAX)) {
+            range = ACT_LUT_RANGE_MAX;
+        }
+        layer->lut_scale  = (float)((ACT_LUT_SIZE - 1) / (2 * range));
+        layer->lut_offset = (float)((ACT_LUT_SIZE - 1) / 2.0) + 0.5f;
+        for (int i = 0; (layer->activation != STOOPIDNET_ACTIVATION_SOFTMAX) && (i < ACT_LUT_SIZE);
+             i++) {
+            const double y = activate(layer->activation,
+                                      -range + ((2 * range * i) / (ACT_LUT_SIZE - 1)));
+            const long yq = lrint((y - layer->act_lo) * layer->act_scale);
+            layer->lut[i] = (float)y;
+            layer->lut_q[i] = (uint8_t)((yq < 0) ? 0 : ((yq > QUANT_ACT_MAX) ? QUANT_ACT_MAX : yq));
+        }
+    }
+
+    for (uint32_t l = 0; l < (q->num_layers - 1); l++) {
+        free(weights[l]);
+        free(biases[l]);
+    }
+    free(weights);
+    free(biases);
+    free(act[0]);
+    free(act[1]);
+    free(zmax);
+
+    return q;
+}
+
+
+stoopidnet_quant_t* stoopidnet_quantize_u8(stoopidnet_t* net, uint32_t n_calib,
+                                           const uint8_t* calib_inputs)
+{
+    // calibration runs through the original net, so it wants its (few) inputs as doubles.
+    const uint32_t in = stoopidnet_get_num_nodes_in_layer(net, 0);
+    double** rows = malloc(n_calib * sizeof(double*));
+    for (uint32_t s = 0; s < n_calib; s++) {
+        rows[s] = malloc(in * sizeof(double));
+        for (uint32_t k = 0; k < in; k++) {
+            rows[s][k] = calib_inputs[((size_t)s * in) + k] / 255.0;
+        }
+    }
+
+    stoopidnet_quant_t* q = stoopidnet_quantize(net, n_calib, rows);
+
+    for (uint32_t s = 0; s < n_calib; s++) {
+        free(rows[s]);
+    }
+    free(rows);
+    return q;
+}
+
+
+void stoopidnet_quant_destroy(stoopidnet_quant_t* q)
+{
+    if (q == NULL) {
+        return;
+    }
+
+    if (q->layers != NULL) {
+        for (uint32_t l = 0; l < (q->num_layers - 1); l++) {
+            free(q->layers[l].scales);
+            free(q->layers[l].biases);
+        }
+    }
+    free(q->layers);
+    free(q->weight_slab);
+    free(q->layer_sizes);
+    free(q);
+}
+
+
+size_t stoopidnet_quant_size(const stoopidnet_quant_t* q)
+{
+    size_t bytes = q->weight_slab_len;
+    for (uint32_t l = 0; l < (q->num_layers - 1); l++) {
+        bytes += 2 * q->layers[l].out * sizeof(float);
+    }
+    return bytes;
+}
+
+
+void stoopidnet_quant_evaluate_batch(stoopidnet_quant_t* q, uint32_t n_inputs, double** inputs,
+                                     double* outputs)
+{
+    quant_evaluate(q, n_inputs, inputs, NULL, outputs);
+}
+
+
+void stoopidnet_quant_evaluate_batch_u8(stoopidnet_quant_t* q, uint32_t n_inputs,
+                                        const uint8_t* inputs, double* outputs)
+{
+    quant_evaluate(q, n_inputs, NULL, inputs, outputs);
+}
+
+
+static void quant_evaluate(stoopidnet_quant_t* q, uint32_t n_inputs, double** inputs,
+                           const uint8_t* inputs_u8, double* outputs)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    const uint32_t last = q->num_layers - 2;
+    const uint32_t out_size = q->layer_sizes[q->num_layers - 1];
+
+    // activations ping-pong between two zero-padded buffers. The padding lines up with the zero
+    // padding of the weight rows, so the dot products can run over whole strides.
+    void* mem = NULL;
+    if (posix_memalign(&mem, QUANT_ROW_ALIGN, 2 * q->widest) != 0) {
+        return;
+    }
+    uint8_t* act[2] = { mem, (uint8_t*)mem + q->widest };
+    memset(act[1], 0, q->widest);
+    float* zrow = malloc(q->widest * sizeof(float));
+
+    for (uint32_t s = 0; s < n_inputs; s++) {
+        if (inputs != NULL) {
+            quantize_input(q, inputs[s], NULL, act[0]);
+        } else {
+            quantize_input(q, NULL, inputs_u8 + ((size_t)s * q->layer_sizes[0]), act[0]);
+        }
+
+        for (uint32_t l = 0; l <= last; l++) {
+            const stoopidnet_quant_layer_t* layer = &q->layers[l];
+            const uint8_t* src = act[l & 1];
+            uint8_t* dst = act[(l + 1) & 1];
+            double* out = &outputs[(size_t)s * out_size];
+
+            if (layer->activation == STOOPIDNET_ACTIVATION_SOFTMAX) {
+                for (uint32_t j = 0; j < layer->out; j++) {
+                    const int32_t acc = kernels->dot_u8s8(src,
+                                                          layer->weights + (j * layer->stride),
+                                                          (uint32_t)layer->stride);
+                    zrow[j] = ((float)acc * layer->scales[j]) + layer->biases[j];
+                }
+                kernels->activate_f32(layer->activation, 1, layer->out, zrow, zrow);
+                for (uint32_t j = 0; j < layer->out; j++) {
+                    if (l == last) {
+                        out[j] = zrow[j];
+                    } else {
+                        dst[j] = (uint8_t)lrintf(zrow[j] * (float)layer->act_scale);
+                    }
+                }
+                continue;
+            }
+
+            for (uint32_t j = 0; j < layer->out; j++) {
+                const int32_t acc = kernels->dot_u8s8(src, layer->weights + (j * layer->stride),
+                                                      (uint32_t)layer->stride);
+                const float z = ((float)acc * layer->scales[j]) + layer->biases[j];
+                if (l == last) {
+                    out[j] = layer->lut[lut_index(layer, z)];
+                } else {
+                    dst[j] = layer->lut_q[lut_index(layer, z)];
+                }
+            }
+        }
+    }
+
+    free(zrow);
+    free(mem);
+}
@@ -0,0 +1,59 @@
+#ifndef STOOPIDNET_QUANT_H
+#define STOOPIDNET_QUANT_H
+
+/**
+ * Post-training int8 quantization of a trained stoopidnet.
+ *
+ * Weights become int8 with one scale per row (per node), and activations become 7-bit unsigned
+ * integers spanning each layer's output range (fixed for the sigmoids and tanh, calibrated for
+ * the ReLUs), which keeps the integer dot products safe from pmaddubsw saturation. Each layer's
+ * activation function is a lookup table indexed by the dequantized z.
+ * The quantized net is read-only; it can't be trained or serialized.
+ */
+
+#include "stoopidnet.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * How many calibration inputs the tools quantize with by default.
+ */
+#define STOOPIDNET_QUANT_CALIBRATION_SAMPLES 1000
+
+typedef struct stoopidnet_quant stoopidnet_quant_t;
+
+/**
+ * Builds an int8 copy of net. The n_calib calibration inputs are pushed through the original net
+ * to find the range of the inputs and of every layer's z and activations, which set the input
+ * scale, the range each activation table covers and the scale of each layer's activations.
+ * Inputs are expected to be non-negative.
+ */
+stoopidnet_quant_t* stoopidnet_quantize(stoopidnet_t* net, uint32_t n_calib, double** calib_inputs);
+
+/**
+ * Same as stoopidnet_quantize, for calibration inputs laid out as in stoopidnet_evaluate_batch_u8.
+ */
+stoopidnet_quant_t* stoopidnet_quantize_u8(stoopidnet_t* net, uint32_t n_calib,
+                                           const uint8_t* calib_inputs);
+void stoopidnet_quant_destroy(stoopidnet_quant_t* q);
+
+/**
+ * Bytes taken up by the quantized weights, scales and biases.
+ */
+size_t stoopidnet_quant_size(const stoopidnet_quant_t* q);
+
+/**
+ * Same contract as stoopidnet_evaluate_batch: outputs must hold n_inputs * (size of the output
+ * layer) doubles. Safe to call from several threads at once.
+ */
+void stoopidnet_quant_evaluate_batch(stoopidnet_quant_t* q, uint32_t n_inputs, double** inputs,
+                                     double* outputs);
+
+/**
+ * Same as stoopidnet_quant_evaluate_batch, for inputs laid out as in stoopidnet_evaluate_batch_u8.
+ */
+void stoopidnet_quant_evaluate_batch_u8(stoopidnet_quant_t* q, uint32_t n_inputs,
+                                        const uint8_t* inputs, double* outputs);
+
+#endif
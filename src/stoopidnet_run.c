@@ -1,8 +1,51 @@
+// for clock_gettime
+#define _DEFAULT_SOURCE
+
 #include "mnist_loader.h"
 #include "stoopidnet.h"
+#include "stoopidnet_model.h"
+#include "thread_pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_CLASSES 10
+
+/**
+ * Everything one worker tallies about its shard of the dataset. Workers never share one of these,
+ * so no locking is needed; they're summed once everyone is done.
+ */
+typedef struct run_counts
+{
+    int goodcount;
+    int confident_but_wrong;
+    int low_confidence;
+
+    /**
+     * confusion[label][result]
+     */
+    int confusion[NUM_CLASSES][NUM_CLASSES];
+
+    /**
+     * Confidence (the winning output) of right and wrong answers, bucketed into num_bins equal
+     * bins over [0, 1].
+     */
+    int* hist_right;
+    int* hist_wrong;
+} run_counts_t;
+
+typedef struct run_job
+{
+    stoopidnet_model_t model;
+    int npics;
+    const mnist_dataset_t* ds;
+    double* outputs;
+    int num_bins;
+    uint32_t num_workers;
+    run_counts_t* counts;
+} run_job_t;
 
 static int maxidx(double* vec, int len)
 {
@@ -19,56 +62,285 @@ static int maxidx(double* vec, int len)
     return maxidx;
 }
 
+/**
+ * thread_pool_fn: scores one contiguous shard of the dataset into the worker's own counters.
+ */
+static void run_shard(void* ctx, uint32_t worker, uint32_t num_workers)
+{
+    run_job_t* job = ctx;
+    run_counts_t* counts = &job->counts[worker];
+    const int start = (int)(((int64_t)job->npics * worker) / num_workers);
+    const int end   = (int)(((int64_t)job->npics * (worker + 1)) / num_workers);
+    const size_t in = (size_t)job->ds->width * job->ds->height;
+
+    if (end <= start) {
+        return;
+    }
+    stoopidnet_model_evaluate_batch_u8(&job->model, end - start, job->ds->images + (start * in),
+                                       &job->outputs[start * NUM_CLASSES]);
+
+    for (int i = start; i < end; i++) {
+        double* output = &job->outputs[i * NUM_CLASSES];
+        int label  = job->ds->labels[i];
+        int result = maxidx(output, NUM_CLASSES);
+
+        if ((label != result) && (output[result] > 0.7)) {
+            counts->confident_but_wrong++;
+        } else if ((label == result) && (output[result] < 0.4)) {
+            counts->low_confidence++;
+        }
+
+        if (label == result) {
+            counts->goodcount++;
+        }
+        counts->confusion[label][result]++;
+
+        int bin = (int)(output[result] * job->num_bins);
+        bin = (bin < 0) ? 0 : ((bin >= job->num_bins) ? (job->num_bins - 1) : bin);
+        if (label == result) {
+            counts->hist_right[bin]++;
+        } else {
+            counts->hist_wrong[bin]++;
+        }
+    }
+}
+
+/**
+ * Scores the whole dataset on the pool, leaving the merged counters in job->counts[0]. Returns
+ * the wall time taken in seconds.
+ */
+static double run_scoring(thread_pool_t* pool, run_job_t* job)
+{
+    for (uint32_t t = 0; t < job->num_workers; t++) {
+        run_counts_t* c = &job->counts[t];
+        c->goodcount = 0;
+        c->confident_but_wrong = 0;
+        c->low_confidence = 0;
+        memset(c->confusion, 0, sizeof(c->confusion));
+        memset(c->hist_right, 0, job->num_bins * sizeof(int));
+        memset(c->hist_wrong, 0, job->num_bins * sizeof(int));
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    thread_pool_run(pool, run_shard, job);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    // merge everyone's counters into worker 0's
+    run_counts_t* total = &job->counts[0];
+    for (uint32_t t = 1; t < job->num_workers; t++) {
+        run_counts_t* c = &job->counts[t];
+        total->goodcount += c->goodcount;
+        total->confident_but_wrong += c->confident_but_wrong;
+        total->low_confidence += c->low_confidence;
+        for (int i = 0; i < NUM_CLASSES; i++) {
+            for (int j = 0; j < NUM_CLASSES; j++) {
+                total->confusion[i][j] += c->confusion[i][j];
+            }
+        }
+        for (int b = 0; b < job->num_bins; b++) {
+            total->hist_right[b] += c->hist_right[b];
+            total->hist_wrong[b] += c->hist_wrong[b];
+        }
+    }
+
+    return (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9;
+}
+
 int main(int argc, char** argv)
 {
-    if (argc != 4) {
-        printf("Usage: %s <stoopidnet input file> <mnist data> <mnist labels>\n", argv[0]);
+    // options come before the positional arguments.
+    int argi = 1;
+    uint32_t num_threads = 0;
+    int num_bins = 10;
+    const char* calibration_file = NULL;
+    stoopidnet_storage_t half_format = STOOPIDNET_STORAGE_NATIVE;
+    int sparse = 0;
+    for (; (argi < argc) && !strncmp(argv[argi], "--", 2); argi++) {
+        if (!strcmp(argv[argi], "--threads") && ((argi + 1) < argc)) {
+            num_threads = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--bins") && ((argi + 1) < argc)) {
+            num_bins = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--int8") && ((argi + 1) < argc)) {
+            calibration_file = argv[++argi];
+        } else if (!strcmp(argv[argi], "--half") && ((argi + 1) < argc)) {
+            argi++;
+            for (half_format = STOOPIDNET_STORAGE_F16; half_format < STOOPIDNET_NUM_STORAGES;
+                 half_format++) {
+                if (!strcmp(argv[argi], stoopidnet_storage_name(half_format))) {
+                    break;
+                }
+            }
+            if (half_format == STOOPIDNET_NUM_STORAGES) {
+                fprintf(stderr, "Unknown half precision format %s\n", argv[argi]);
+                return -1;
+            }
+        } else if (!strcmp(argv[argi], "--sparse")) {
+            sparse = 1;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[argi]);
+            return -1;
+        }
+    }
+
+    if (((argc - argi) != 3) || (num_bins < 1) ||
+        (((calibration_file != NULL) + (half_format != STOOPIDNET_STORAGE_NATIVE) + sparse) > 1)) {
+        printf("Usage: %s [--threads N] [--bins N] [--int8 <mnist data> | --half FORMAT | "
+               "--sparse] <stoopidnet input file> <mnist data> <mnist labels>\n", argv[0]);
+        printf("  --threads N  score on N threads (default: one per CPU)\n");
+        printf("  --bins N     number of confidence histogram bins (default: 10)\n");
+        printf("  --int8 FILE  score with an int8 quantized copy of the net, calibrated on the\n"
+               "               first %i images of FILE, and compare it to the original\n",
+               STOOPIDNET_QUANT_CALIBRATION_SAMPLES);
+        printf("  --half FORMAT\n"
+               "               score with a copy of the net whose weights are kept in fp16 or\n"
+               "               bf16, and compare it to the original\n");
+        printf("  --sparse     score with a copy of the net that keeps only its nonzero\n"
+               "               weights, e.g. one pruned by stoopidnet-prune, and compare it to\n"
+               "               the original\n");
         return -1;
     }
+    argv += argi - 1;
 
     // load files
     stoopidnet_t* net = stoopidnet_load_from_file(argv[1]);
     if (net == NULL) {
         return -1;
     }
-    double** pics;
-    double** labels;
-    int npics = load_data_file_doubles(argv[2], &pics);
-    int nlabels = load_label_file_doubles(argv[3], &labels);
-
-    if ((npics != nlabels) || (nlabels == 0)) {
+    if (stoopidnet_get_num_nodes_in_layer(net, stoopidnet_get_num_layers(net) - 1) !=
+        NUM_CLASSES) {
+        fprintf(stderr, "Expected a net with %i outputs\n", NUM_CLASSES);
+        return -1;
+    }
+    mnist_dataset_t* ds = mnist_dataset_open(argv[2], argv[3]);
+    if ((ds == NULL) || (ds->count == 0) ||
+        ((ds->width * ds->height) != stoopidnet_get_num_nodes_in_layer(net, 0))) {
         fprintf(stderr, "Something went wrong loading the mnist files\n");
         return -1;
     }
+    const int npics = ds->count;
+
+    // labels index the confusion matrix, so anything past the last class would land outside it.
+    if (mnist_dataset_check_labels(ds, NUM_CLASSES) != 0) {
+        return -1;
+    }
+
+    // with --int8, --half or --sparse, build the copy to score with.
+    uint32_t ncalib = 0;
+    mnist_dataset_t* calib_ds = NULL;
+    if (calibration_file != NULL) {
+        calib_ds = mnist_dataset_open(calibration_file, NULL);
+        if ((calib_ds == NULL) || (calib_ds->count == 0) ||
+            ((calib_ds->width * calib_ds->height) != (ds->width * ds->height))) {
+            fprintf(stderr, "Something went wrong loading the calibration file\n");
+            return -1;
+        }
+        ncalib = (calib_ds->count < STOOPIDNET_QUANT_CALIBRATION_SAMPLES) ?
+                 calib_ds->count : STOOPIDNET_QUANT_CALIBRATION_SAMPLES;
+    }
+    stoopidnet_model_t model;
+    const int failed = stoopidnet_model_init(&model, net, ncalib,
+                                             (calib_ds != NULL) ? calib_ds->images : NULL,
+                                             half_format, sparse);
+    mnist_dataset_close(calib_ds);
+    if (failed) {
+        return -1;
+    }
 
     // run
-    //printf("  index | label | result | confidence\n"
-    //"--------|-------|--------|--------------\n");
+    thread_pool_t* pool = thread_pool_create(num_threads);
+    num_threads = thread_pool_size(pool);
 
-    int goodcount = 0;
-    int confident_but_wrong = 0;
-    int low_confidence      = 0;
+    run_job_t job = {
+        .model = { .net = net },
+        .npics = npics,
+        .ds = ds,
+        .outputs = malloc(npics * NUM_CLASSES * sizeof(double)),
+        .num_bins = num_bins,
+        .num_workers = num_threads,
+        .counts = calloc(num_threads, sizeof(run_counts_t)),
+    };
+    for (uint32_t t = 0; t < num_threads; t++) {
+        job.counts[t].hist_right = calloc(num_bins, sizeof(int));
+        job.counts[t].hist_wrong = calloc(num_bins, sizeof(int));
+    }
 
-    for (int i = 0; i < npics; i++) {
-        double* output;
-        stoopidnet_evaluate(net, pics[i], &output);
-        int label  = maxidx(labels[i], 10);
-        int result = maxidx(output, 10);
+    // score the original net first as the baseline the copy is judged by.
+    const size_t copy_bytes = stoopidnet_model_size(&model);
+    int baseline_good = 0;
+    double baseline_seconds = 0;
+    if (copy_bytes > 0) {
+        baseline_seconds = run_scoring(pool, &job);
+        baseline_good = job.counts[0].goodcount;
+    }
+    job.model = model;
 
-        if ((label != result) && (output[result] > 0.7)) {
-            //printf("%7i |     %i |      %i |   %1.5lf\n", i, label, result, output[result]);
-            confident_but_wrong++;
-        } else if ((label == result) && (output[result] < 0.4)) {
-            low_confidence++;
+    const double seconds = run_scoring(pool, &job);
+    run_counts_t* total = &job.counts[0];
+
+    printf("accuracy: %i / %i\r\n", total->goodcount, npics);
+    printf("confident but wrong: %i / %i\n", total->confident_but_wrong, npics);
+    printf("low confidence: %i / %i\n", total->low_confidence, npics);
+
+    printf("\nconfusion matrix (rows are labels, columns are results):\n      ");
+    for (int j = 0; j < NUM_CLASSES; j++) {
+        printf(" %6i", j);
+    }
+    printf("\n");
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        printf("  %2i |", i);
+        for (int j = 0; j < NUM_CLASSES; j++) {
+            printf(" %6i", total->confusion[i][j]);
+        }
+        printf("\n");
+    }
+
+    printf("\nclass | precision | recall\n------|-----------|--------\n");
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        int predicted = 0;
+        int actual = 0;
+        for (int k = 0; k < NUM_CLASSES; k++) {
+            predicted += total->confusion[k][c];
+            actual += total->confusion[c][k];
         }
+        const int hits = total->confusion[c][c];
+        printf("   %2i |    %1.4lf | %1.4lf\n", c,
+               predicted ? ((double)hits / predicted) : 0.0,
+               actual ? ((double)hits / actual) : 0.0);
+    }
 
-        if (label == result) {
-            goodcount++;
+    printf("\nconfidence     |   right |   wrong\n---------------|---------|--------\n");
+    for (int b = 0; b < num_bins; b++) {
+        printf("[%1.3lf, %1.3lf%c | %7i | %7i\n", (double)b / num_bins, (double)(b + 1) / num_bins,
+               (b == (num_bins - 1)) ? ']' : ')', total->hist_right[b], total->hist_wrong[b]);
+    }
+
+    printf("\n%i images in %1.3lf s on %u threads: %.0f images/sec\n", npics, seconds, num_threads,
+           (seconds > 0) ? (npics / seconds) : 0.0);
+
+    if (copy_bytes > 0) {
+        size_t double_bytes = 0;
+        for (uint32_t l = 1; l < stoopidnet_get_num_layers(net); l++) {
+            double_bytes += ((size_t)stoopidnet_get_num_nodes_in_layer(net, l - 1) + 1) *
+                            stoopidnet_get_num_nodes_in_layer(net, l) * sizeof(double);
         }
+        const char* name = (model.quant != NULL) ? "int8" : ((model.sparse != NULL) ? "sparse" :
+                           stoopidnet_storage_name(half_format));
+        printf("\n%s vs double:\n", name);
+        printf("  accuracy: %i vs %i / %i (%+1.2lf%%)\n", total->goodcount, baseline_good, npics,
+               (100.0 * (total->goodcount - baseline_good)) / npics);
+        printf("  images/sec: %.0f vs %.0f\n", (seconds > 0) ? (npics / seconds) : 0.0,
+               (baseline_seconds > 0) ? (npics / baseline_seconds) : 0.0);
+        printf("  parameter bytes: %zu vs %zu\n", copy_bytes, double_bytes);
+    }
 
-        free(output);
+    for (uint32_t t = 0; t < num_threads; t++) {
+        free(job.counts[t].hist_right);
+        free(job.counts[t].hist_wrong);
     }
-    printf("accuracy: %i / %i\r\n", goodcount, npics);
-    printf("confident but wrong: %i / %i\n", confident_but_wrong, npics);
-    printf("low confidence: %i / %i\n", low_confidence, npics);
+    free(job.counts);
+    free(job.outputs);
+    mnist_dataset_close(ds);
+    thread_pool_destroy(pool);
+    stoopidnet_model_destroy(&job.model);
 }
@@ -1,121 +1,732 @@
+// for clock_gettime, scandir and getline
+#define _DEFAULT_SOURCE
+
+#include "math_util.h"
 #include "stoopidnet.h"
+#include "thread_pool.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <pam.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/**
+ * stoopidnet-run-pgm classifies netpbm images (PGM, PPM or PAM, plain or raw): one given on the
+ * command line, or any number of them from directories, glob patterns and list files. Images are
+ * decoded in parallel in chunks, each worker running the images it decoded through batched
+ * evaluation, and the results are written out in order as CSV or JSON lines.
+ *
+ * Images are dark ink on a light background unless --no-invert is given, and are area-resampled
+ * to the net's (square) input size if they aren't that size already. The decoder here is
+ * self-contained rather than libnetpbm's, whose readers exit the process on a malformed file and
+ * whose error recovery is process-global, so bad files can't be survived from worker threads.
+ */
 
-#define PAM_MEMBER_OFFSET(mbrname)                    \
-  ((unsigned long int)(char*)&((struct pam *)0)->mbrname)
-#define PAM_MEMBER_SIZE(mbrname) \
-  sizeof(((struct pam *)0)->mbrname)
-#define PAM_STRUCT_SIZE(mbrname) \
-(PAM_MEMBER_OFFSET(mbrname) + PAM_MEMBER_SIZE(mbrname))
+/**
+ * Images decoded and evaluated per chunk.
+ */
+#define DEFAULT_BATCH 256
 
+/**
+ * Longest reason a single image failed that gets reported.
+ */
+#define ERROR_LEN 128
 
+/**
+ * Largest image width or height that will be decoded.
+ */
+#define MAX_IMAGE_SIDE 16384
+
+typedef enum output_format
+{
+    /**
+     * The winning class on one line and every output on the next. Only for a single image.
+     */
+    OUTPUT_PLAIN,
+    OUTPUT_CSV,
+    OUTPUT_JSONL,
+} output_format_t;
 
 typedef struct image {
     int width;
     int height;
-    int depth;
 
-    // supports images with up to 4 components.
-    double* components;
+    /**
+     * Row-major, 0 for the background up to 1 for ink.
+     */
+    float* ink;
 } image_t;
 
+typedef struct path_list
+{
+    char** paths;
+    size_t count;
+    size_t capacity;
+} path_list_t;
 
-static int maxidx(double* vec, int len)
+/**
+ * One chunk of images; every worker decodes and evaluates its own contiguous share.
+ */
+typedef struct run_pgm_job
 {
-    double maxval = vec[0];
-    double maxidx = 0;
+    stoopidnet_t* net;
+    char** paths;
+    uint32_t n;
+    uint32_t in_size;
+    uint32_t out_size;
 
-    for (int i = 1; i < len; i++) {
-        if (vec[i] > maxval) {
-            maxval = vec[i];
-            maxidx = i;
-        }
-    }
+    /**
+     * Width and height of the net's input, or 0 if it isn't square and images can't be resized.
+     */
+    uint32_t side;
+    int strict;
+    int invert;
 
-    return maxidx;
+    /**
+     * n rows of the net's input and output sizes, and why each image failed ("" if it didn't).
+     */
+    uint8_t* inputs;
+    double* outputs;
+    char (*errors)[ERROR_LEN];
+} run_pgm_job_t;
+
+static double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
 }
 
-image_t* image_create_from_pam(const char* file, char* argv0)
+static image_t* image_create_from_pam(const char* file, int invert, char* error);
+static void image_destroy(image_t* image);
+static int read_number(FILE* fp, uint32_t* value);
+static int read_pam_header(FILE* fp, uint32_t* width, uint32_t* height, uint32_t* depth,
+                           uint32_t* maxval);
+static int read_sample(FILE* fp, int plain, uint32_t maxval, uint32_t* value);
+static void resample(const float* src, uint32_t sw, uint32_t sh, float* dst, uint32_t dw,
+                     uint32_t dh);
+static void run_pgm_share(void* ctx, uint32_t worker, uint32_t num_workers);
+static void path_list_add(path_list_t* list, const char* path);
+static int collect_paths(path_list_t* list, const char* arg);
+static int collect_list_file(path_list_t* list, const char* file);
+static void write_csv_field(FILE* fp, const char* s);
+static void write_json_string(FILE* fp, const char* s);
+
+
+int main(int argc, char** argv)
 {
-    image_t* result = calloc(1, sizeof(image_t*));
+    // options come before the positional arguments.
+    int argi = 1;
+    uint32_t num_threads = 0;
+    uint32_t batch = DEFAULT_BATCH;
+    int format_given = 0;
+    output_format_t format = OUTPUT_CSV;
+    const char* list_file = NULL;
+    int strict = 0;
+    int invert = 1;
+    for (; (argi < argc) && !strncmp(argv[argi], "--", 2); argi++) {
+        if (!strcmp(argv[argi], "--threads") && ((argi + 1) < argc)) {
+            num_threads = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--batch") && ((argi + 1) < argc)) {
+            batch = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--format") && ((argi + 1) < argc)) {
+            argi++;
+            format_given = 1;
+            if (!strcmp(argv[argi], "csv")) {
+                format = OUTPUT_CSV;
+            } else if (!strcmp(argv[argi], "jsonl")) {
+                format = OUTPUT_JSONL;
+            } else {
+                fprintf(stderr, "Unknown output format %s\n", argv[argi]);
+                return -1;
+            }
+        } else if (!strcmp(argv[argi], "--list") && ((argi + 1) < argc)) {
+            list_file = argv[++argi];
+        } else if (!strcmp(argv[argi], "--strict")) {
+            strict = 1;
+        } else if (!strcmp(argv[argi], "--no-invert")) {
+            invert = 0;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[argi]);
+            return -1;
+        }
+    }
 
-    pm_init(argv0, 0);
+    if (((argc - argi) < 1) || (((argc - argi) < 2) && (list_file == NULL)) || (batch < 1)) {
+        printf("Usage: %s [--threads N] [--batch N] [--format csv|jsonl] [--list FILE] [--strict] "
+               "[--no-invert] <stoopidnet input file> [image, directory or glob]...\n", argv[0]);
+        printf("  --threads N  decode and evaluate on N threads (default: one per CPU)\n");
+        printf("  --batch N    images per chunk (default %i)\n", DEFAULT_BATCH);
+        printf("  --format F   write a CSV row or a JSON line per image (default csv; a single\n"
+               "               image without --format gets the class and outputs on two lines)\n");
+        printf("  --list FILE  also classify the images listed in FILE, one path per line\n"
+               "               (- for stdin)\n");
+        printf("  --strict     fail images that aren't the net's input size instead of\n"
+               "               resizing them\n");
+        printf("  --no-invert  images are light ink on a dark background, as in mnist\n");
+        printf("Directories are searched (not recursively) for .pgm, .ppm, .pnm and .pam files.\n");
+        return -1;
+    }
+    argv += argi - 1;
+    argc -= argi - 1;
 
-    struct pam image;
-    tuple * tuplerow;
-    unsigned int row;
+    int result = -1;
+    thread_pool_t* pool = NULL;
+    path_list_t list = { 0 };
+    run_pgm_job_t job = { .strict = strict, .invert = invert };
 
-    FILE* fp = fopen(file, "r");
-    pnm_readpaminit(fp, &image, PAM_STRUCT_SIZE(tuple_type));
+    if ((job.net = stoopidnet_load_from_file(argv[1])) == NULL) {
+        goto cleanup;
+    }
+    job.in_size = stoopidnet_get_num_nodes_in_layer(job.net, 0);
+    job.out_size = stoopidnet_get_num_nodes_in_layer(job.net,
+                                                     stoopidnet_get_num_layers(job.net) - 1);
+    job.side = (uint32_t)(sqrt((double)job.in_size) + 0.5);
+    job.side = ((job.side * job.side) == job.in_size) ? job.side : 0;
 
-    result->height = image.height;
-    result->width  = image.width;
-    result->depth  = image.depth;
-    if (result->depth > 4) {
-        goto _fail_cleanup1;
+    // a lone image file keeps the original two-line output unless a format is asked for.
+    struct stat st;
+    if (!format_given && (list_file == NULL) && (argc == 3) && (stat(argv[2], &st) == 0) &&
+        S_ISREG(st.st_mode)) {
+        format = OUTPUT_PLAIN;
     }
 
-    result->components = calloc(result->height * result->width, sizeof(double));
-    tuplerow = pnm_allocpamrow(&image);
-    for (row = 0; row < image.height; row++) {
-        unsigned int column;
-        pnm_readpamrow(&image, tuplerow);
-        for (column = 0; column < image.width; ++column) {
-            unsigned int plane;
-            for (plane = 0; plane < image.depth; ++plane) {
-                result->components[(row * result->width) + column] = 1.f -
-                    ((double)tuplerow[column][plane] / ((double)255.0));
+    if ((list_file != NULL) && (collect_list_file(&list, list_file) != 0)) {
+        goto cleanup;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (collect_paths(&list, argv[i]) != 0) {
+            goto cleanup;
+        }
+    }
+    if (list.count == 0) {
+        fprintf(stderr, "No images to classify\n");
+        goto cleanup;
+    }
+
+    pool = thread_pool_create(num_threads);
+    num_threads = thread_pool_size(pool);
+    batch = (list.count < batch) ? (uint32_t)list.count : batch;
+    job.inputs = malloc((size_t)batch * job.in_size);
+    job.outputs = malloc((size_t)batch * job.out_size * sizeof(double));
+    job.errors = malloc((size_t)batch * ERROR_LEN);
+
+    if (format == OUTPUT_CSV) {
+        printf("file,label");
+        for (uint32_t j = 0; j < job.out_size; j++) {
+            printf(",score_%u", j);
+        }
+        printf(",error\n");
+    }
+
+    size_t failed = 0;
+    const double t0 = now_seconds();
+    for (size_t s0 = 0; s0 < list.count; s0 += batch) {
+        job.paths = list.paths + s0;
+        job.n = ((list.count - s0) < batch) ? (uint32_t)(list.count - s0) : batch;
+        thread_pool_run(pool, run_pgm_share, &job);
+
+        for (uint32_t i = 0; i < job.n; i++) {
+            const char* path = job.paths[i];
+            const char* error = job.errors[i];
+            double* output = &job.outputs[(size_t)i * job.out_size];
+            const int label = maxidx(output, job.out_size);
+            failed += (error[0] != '\0');
+
+            if (format == OUTPUT_PLAIN) {
+                if (error[0] != '\0') {
+                    fprintf(stderr, "error opening image %s: %s\n", path, error);
+                    continue;
+                }
+                printf("%i\n", label);
+                for (uint32_t j = 0; j < job.out_size; j++) {
+                    printf("%f ", output[j]);
+                }
+                printf("\n");
+            } else if (format == OUTPUT_CSV) {
+                write_csv_field(stdout, path);
+                if (error[0] != '\0') {
+                    printf(",");
+                    for (uint32_t j = 0; j < job.out_size; j++) {
+                        printf(",");
+                    }
+                    printf(",");
+                    write_csv_field(stdout, error);
+                } else {
+                    printf(",%i", label);
+                    for (uint32_t j = 0; j < job.out_size; j++) {
+                        printf(",%.6g", output[j]);
+                    }
+                    printf(",");
+                }
+                printf("\n");
+            } else {
+                printf("{\"file\":");
+                write_json_string(stdout, path);
+                if (error[0] != '\0') {
+                    printf(",\"error\":");
+                    write_json_string(stdout, error);
+                } else {
+                    printf(",\"label\":%i,\"scores\":[", label);
+                    for (uint32_t j = 0; j < job.out_size; j++) {
+                        printf((j > 0) ? ",%.6g" : "%.6g", output[j]);
+                    }
+                    printf("]");
+                }
+                printf("}\n");
             }
         }
     }
-    pnm_freepamrow(tuplerow);
+    const double seconds = now_seconds() - t0;
+
+    if (format != OUTPUT_PLAIN) {
+        fprintf(stderr, "%zu images (%zu failed) in %1.3lf s on %u threads: %.0f images/sec\n",
+                list.count, failed, seconds, num_threads,
+                (seconds > 0) ? (list.count / seconds) : 0.0);
+    }
+    result = (failed == 0) ? 0 : -1;
 
+cleanup:
+    for (size_t i = 0; i < list.count; i++) {
+        free(list.paths[i]);
+    }
+    free(list.paths);
+    free(job.inputs);
+    free(job.outputs);
+    free(job.errors);
+    thread_pool_destroy(pool);
+    stoopidnet_destroy(job.net);
     return result;
+}
 
-//_fail_cleanup0:
-//    free(result->components);
-//    pnm_freepamrow(tuplerow);
+
+////////////////////////////////////////////////////////////////
+// static function impl
+////////////////////////////////////////////////////////////////
+/**
+ * Reads a netpbm image: P2/P5 (PGM), P3/P6 (PPM) or P7 (PAM, up to 4 planes). Color is averaged
+ * to gray, and alpha composited over the background. Returns NULL, with the reason in error
+ * (ERROR_LEN bytes), if it can't be read.
+ */
+static image_t* image_create_from_pam(const char* file, int invert, char* error)
+{
+    image_t* result = NULL;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t depth = 1;
+    uint32_t maxval = 0;
+    int plain = 0;
+    FILE* fp = fopen(file, "rb");
+    if (fp == NULL) {
+        snprintf(error, ERROR_LEN, "%s", strerror(errno));
+        return NULL;
+    }
+
+    char magic[2];
+    if ((fread(magic, 1, 2, fp) != 2) || (magic[0] != 'P')) {
+        snprintf(error, ERROR_LEN, "not a netpbm image");
+        goto _fail_cleanup0;
+    }
+    switch (magic[1]) {
+    case '2':
+    case '3':
+    case '5':
+    case '6':
+        plain = (magic[1] == '2') || (magic[1] == '3');
+        depth = ((magic[1] == '3') || (magic[1] == '6')) ? 3 : 1;
+        if (!read_number(fp, &width) || !read_number(fp, &height) || !read_number(fp, &maxval)) {
+            snprintf(error, ERROR_LEN, "bad header");
+            goto _fail_cleanup0;
+        }
+        break;
+    case '7':
+        if (!read_pam_header(fp, &width, &height, &depth, &maxval)) {
+            snprintf(error, ERROR_LEN, "bad PAM header");
+            goto _fail_cleanup0;
+        }
+        break;
+    default:
+        snprintf(error, ERROR_LEN, "unsupported netpbm format P%c", magic[1]);
+        goto _fail_cleanup0;
+    }
+    if ((width == 0) || (height == 0) || (width > MAX_IMAGE_SIDE) || (height > MAX_IMAGE_SIDE) ||
+        (depth == 0) || (depth > 4) || (maxval == 0) || (maxval > 65535)) {
+        snprintf(error, ERROR_LEN, "unsupported %ux%u image with %u planes and maxval %u", width,
+                 height, depth, maxval);
+        goto _fail_cleanup0;
+    }
+
+    result = calloc(1, sizeof(image_t));
+    result->width = width;
+    result->height = height;
+    result->ink = malloc((size_t)width * height * sizeof(float));
+
+    // the background is light paper, or dark with --no-invert.
+    const uint32_t colors = (depth >= 3) ? 3 : 1;
+    const int alpha = (depth == 2) || (depth == 4);
+    const float background = invert ? 1.f : 0.f;
+    for (size_t i = 0; i < ((size_t)width * height); i++) {
+        uint32_t samples[4];
+        for (uint32_t p = 0; p < depth; p++) {
+            if (!read_sample(fp, plain, maxval, &samples[p])) {
+                snprintf(error, ERROR_LEN, "truncated image");
+                goto _fail_cleanup1;
+            }
+        }
+        float gray = 0;
+        for (uint32_t p = 0; p < colors; p++) {
+            gray += (float)samples[p];
+        }
+        gray /= (float)colors * maxval;
+        if (alpha) {
+            const float a = (float)samples[depth - 1] / maxval;
+            gray = (a * gray) + ((1.f - a) * background);
+        }
+        result->ink[i] = invert ? (1.f - gray) : gray;
+    }
+
+    fclose(fp);
+    return result;
 
 _fail_cleanup1:
-    free(result);
+    image_destroy(result);
+_fail_cleanup0:
+    fclose(fp);
     return NULL;
 }
 
-
-void image_destroy(image_t* image)
+static void image_destroy(image_t* image)
 {
-    free(image->components);
+    if (image == NULL) {
+        return;
+    }
+    free(image->ink);
     free(image);
 }
 
+/**
+ * Reads one ASCII number of a header or plain raster, skipping whitespace and comments before it
+ * and eating the single whitespace byte after it. Returns 0 if there isn't one.
+ */
+static int read_number(FILE* fp, uint32_t* value)
+{
+    int c = getc(fp);
+    while ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == '#')) {
+        if (c == '#') {
+            while ((c != '\n') && (c != EOF)) {
+                c = getc(fp);
+            }
+        }
+        c = getc(fp);
+    }
 
-int main(int argc, char** argv)
+    if ((c < '0') || (c > '9')) {
+        return 0;
+    }
+    uint64_t v = 0;
+    while ((c >= '0') && (c <= '9')) {
+        v = (v * 10) + (c - '0');
+        if (v > UINT32_MAX) {
+            return 0;
+        }
+        c = getc(fp);
+    }
+    *value = (uint32_t)v;
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == EOF);
+}
+
+/**
+ * Reads the "KEY value" lines of a PAM header up to ENDHDR. TUPLTYPE is ignored; the number of
+ * planes says everything needed.
+ */
+static int read_pam_header(FILE* fp, uint32_t* width, uint32_t* height, uint32_t* depth,
+                           uint32_t* maxval)
 {
-    if (argc != 3) {
-        printf("Usage: %s <stoopidnet input file> <pgm image>\n", argv[0]);
-        return -1;
+    char line[256];
+    *depth = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char key[16];
+        unsigned int v = 0;
+        const int fields = sscanf(line, "%15s %u", key, &v);
+        if ((fields < 1) || (key[0] == '#')) {
+            continue;
+        } else if (!strcmp(key, "ENDHDR")) {
+            return 1;
+        } else if (fields < 2) {
+            continue;
+        } else if (!strcmp(key, "WIDTH")) {
+            *width = v;
+        } else if (!strcmp(key, "HEIGHT")) {
+            *height = v;
+        } else if (!strcmp(key, "DEPTH")) {
+            *depth = v;
+        } else if (!strcmp(key, "MAXVAL")) {
+            *maxval = v;
+        }
     }
+    return 0;
+}
 
-    image_t* im;
-    if ((im = image_create_from_pam(argv[2], argv[0])) == NULL) {
-        printf("error opening image %s", argv[2]);
-        return -1;
+/**
+ * Raw samples are one byte, or two big-endian ones past a maxval of 255.
+ */
+static int read_sample(FILE* fp, int plain, uint32_t maxval, uint32_t* value)
+{
+    if (plain) {
+        if (!read_number(fp, value)) {
+            return 0;
+        }
+    } else if (maxval > 255) {
+        const int hi = getc(fp);
+        const int lo = getc(fp);
+        if ((hi == EOF) || (lo == EOF)) {
+            return 0;
+        }
+        *value = ((uint32_t)hi << 8) | (uint32_t)lo;
+    } else {
+        const int c = getc(fp);
+        if (c == EOF) {
+            return 0;
+        }
+        *value = (uint32_t)c;
+    }
+    *value = (*value > maxval) ? maxval : *value;
+    return 1;
+}
+
+/**
+ * Mean of the n values v[0], v[stride], ... over the span destination pixel i of m covers.
+ */
+static float area_mean(const float* v, size_t stride, uint32_t n, uint32_t i, uint32_t m)
+{
+    const double scale = (double)n / m;
+    const double a = i * scale;
+    const double b = (i + 1) * scale;
+    double sum = 0;
+    for (uint32_t s = (uint32_t)a; (s < n) && (s < b); s++) {
+        const double lo = (s > a) ? s : a;
+        const double hi = ((s + 1) < b) ? (s + 1) : b;
+        sum += (hi - lo) * v[s * stride];
+    }
+    return (float)(sum / scale);
+}
+
+/**
+ * Resizes src (sw x sh) to dst (dw x dh), every destination pixel being the mean of the source
+ * area it covers; rows first, then columns.
+ */
+static void resample(const float* src, uint32_t sw, uint32_t sh, float* dst, uint32_t dw,
+                     uint32_t dh)
+{
+    float* rows = malloc((size_t)dw * sh * sizeof(float));
+    for (uint32_t y = 0; y < sh; y++) {
+        for (uint32_t x = 0; x < dw; x++) {
+            rows[((size_t)y * dw) + x] = area_mean(src + ((size_t)y * sw), 1, sw, x, dw);
+        }
+    }
+    for (uint32_t y = 0; y < dh; y++) {
+        for (uint32_t x = 0; x < dw; x++) {
+            dst[((size_t)y * dw) + x] = area_mean(rows + x, dw, sh, y, dh);
+        }
     }
+    free(rows);
+}
+
+/**
+ * thread_pool_fn: decodes the worker's share of the chunk into input rows, then evaluates them
+ * all at once. Rows of images that failed are zeroed and their outputs ignored.
+ */
+static void run_pgm_share(void* ctx, uint32_t worker, uint32_t num_workers)
+{
+    run_pgm_job_t* job = ctx;
+    const uint32_t lo = (uint32_t)(((uint64_t)job->n * worker) / num_workers);
+    const uint32_t hi = (uint32_t)(((uint64_t)job->n * (worker + 1)) / num_workers);
+    float* resized = NULL;
+
+    for (uint32_t i = lo; i < hi; i++) {
+        uint8_t* row = job->inputs + ((size_t)i * job->in_size);
+        char* error = job->errors[i];
+        error[0] = '\0';
+        memset(row, 0, job->in_size);
 
-    stoopidnet_t* net = stoopidnet_load_from_file(argv[1]);
-    if (net == NULL) {
+        image_t* im = image_create_from_pam(job->paths[i], job->invert, error);
+        if (im == NULL) {
+            continue;
+        }
+        const float* ink = im->ink;
+        const size_t pixels = (size_t)im->width * im->height;
+        const int fits = (pixels == job->in_size) &&
+                         ((job->side == 0) || ((uint32_t)im->width == job->side));
+        if (!fits) {
+            if (job->strict || (job->side == 0)) {
+                snprintf(error, ERROR_LEN, "image is %ix%i, the net takes %u pixels", im->width,
+                         im->height, job->in_size);
+                image_destroy(im);
+                continue;
+            }
+            if (resized == NULL) {
+                resized = malloc(job->in_size * sizeof(float));
+            }
+            resample(im->ink, im->width, im->height, resized, job->side, job->side);
+            ink = resized;
+        }
+        for (uint32_t k = 0; k < job->in_size; k++) {
+            const float v = ink[k];
+            row[k] = (uint8_t)(((v < 0) ? 0 : ((v > 1) ? 1 : v)) * 255.f + 0.5f);
+        }
+        image_destroy(im);
+    }
+    free(resized);
+
+    if (hi > lo) {
+        stoopidnet_evaluate_batch_u8(job->net, hi - lo, job->inputs + ((size_t)lo * job->in_size),
+                                     &job->outputs[(size_t)lo * job->out_size]);
+    }
+}
+
+static void path_list_add(path_list_t* list, const char* path)
+{
+    if (list->count == list->capacity) {
+        list->capacity = (list->capacity > 0) ? (list->capacity * 2) : 64;
+        list->paths = realloc(list->paths, list->capacity * sizeof(char*));
+    }
+    list->paths[list->count++] = strdup(path);
+}
+
+/**
+ * scandir filter for the netpbm extensions.
+ */
+static int is_image_name(const struct dirent* entry)
+{
+    static const char* extensions[] = { ".pgm", ".ppm", ".pnm", ".pam" };
+    const char* dot = strrchr(entry->d_name, '.');
+    if ((dot == NULL) || (entry->d_name[0] == '.')) {
+        return 0;
+    }
+    for (size_t i = 0; i < (sizeof(extensions) / sizeof(extensions[0])); i++) {
+        if (!strcasecmp(dot, extensions[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Adds arg if it's a file, the images in it (in name order) if it's a directory, or whatever it
+ * matches if it's a glob pattern.
+ */
+static int collect_paths(path_list_t* list, const char* arg)
+{
+    struct stat st;
+    if (stat(arg, &st) == 0) {
+        if (!S_ISDIR(st.st_mode)) {
+            path_list_add(list, arg);
+            return 0;
+        }
+
+        struct dirent** entries;
+        const int n = scandir(arg, &entries, is_image_name, alphasort);
+        if (n < 0) {
+            fprintf(stderr, "Failed to read directory %s: %s\n", arg, strerror(errno));
+            return -1;
+        }
+        const size_t len = strlen(arg);
+        for (int i = 0; i < n; i++) {
+            char* path = malloc(len + strlen(entries[i]->d_name) + 2);
+            sprintf(path, "%s%s%s", arg, ((len > 0) && (arg[len - 1] == '/')) ? "" : "/",
+                    entries[i]->d_name);
+            path_list_add(list, path);
+            free(path);
+            free(entries[i]);
+        }
+        free(entries);
+        return 0;
+    }
+
+    if (strpbrk(arg, "*?[") != NULL) {
+        glob_t g;
+        const int err = glob(arg, 0, NULL, &g);
+        if (err == 0) {
+            for (size_t i = 0; i < g.gl_pathc; i++) {
+                path_list_add(list, g.gl_pathv[i]);
+            }
+        }
+        globfree(&g);
+        if ((err == 0) || (err == GLOB_NOMATCH)) {
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No such file or directory %s\n", arg);
+    return -1;
+}
+
+/**
+ * Adds every non-empty line of file ("-" for stdin) as a path.
+ */
+static int collect_list_file(path_list_t* list, const char* file)
+{
+    FILE* fp = !strcmp(file, "-") ? stdin : fopen(file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open list %s: %s\n", file, strerror(errno));
         return -1;
     }
 
-    double* output;
-    stoopidnet_evaluate(net, im->components, &output);
-    int result = maxidx(output, 10);
-    printf("%i\n", result);
-    for (int i = 0; i < 10; i++)
-        printf("%f ", output[i]);
-    printf("\n");
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) >= 0) {
+        while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            path_list_add(list, line);
+        }
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
     return 0;
 }
+
+/**
+ * Writes s as a CSV field, quoted if it needs to be.
+ */
+static void write_csv_field(FILE* fp, const char* s)
+{
+    if (strpbrk(s, ",\"\r\n") == NULL) {
+        fputs(s, fp);
+        return;
+    }
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        if (*s == '"') {
+            fputc('"', fp);
+        }
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void write_json_string(FILE* fp, const char* s)
+{
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        const unsigned char c = (unsigned char)*s;
+        if ((c == '"') || (c == '\\')) {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
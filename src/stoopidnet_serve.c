@@ -0,0 +1,663 @@
+// for clock_gettime, sigaction and friends
+#define _DEFAULT_SOURCE
+
+#include "math_util.h"
+#include "mnist_loader.h"
+#include "stoopidnet.h"
+#include "stoopidnet_model.h"
+#include "stoopidnet_profile.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * stoopidnet-serve loads a net once and classifies images sent to it over a Unix domain socket.
+ *
+ * A connection carries any number of requests, each answered with one line in the order they
+ * were sent:
+ *
+ *   - a raw image: (size of the input layer) bytes, 0 for background up to 255 for ink, as in the
+ *     mnist data sets. Answered with the winning class, then every output:
+ *         "7 1.2e-05 0.000301 ... 0.98122\n"
+ *   - a binary PGM ("P5") image with as many pixels as the input layer, dark ink on a light
+ *     background like stoopidnet-run-pgm takes. Answered the same way.
+ *   - "STATS\n". Answered with the server's counters as key=value pairs on one line.
+ *
+ * A request is told apart by its first two bytes, so a raw image that happens to start with the
+ * bytes "P5" or "ST" has to be sent as a PGM. Anything malformed gets "error: ...\n" and the
+ * connection is closed.
+ *
+ * Every connection has a thread that reads its requests and queues them. Batching threads take
+ * requests off the queue as soon as max_batch of them are waiting, every open connection has one
+ * waiting, or the oldest has waited deadline, whichever is first, and evaluate them as one batch.
+ */
+
+/**
+ * Latencies are histogrammed with this many buckets per power of two microseconds, so the
+ * reported percentiles are within 1/8 of the true ones.
+ */
+#define SERVE_LATENCY_SUB_BITS 3
+#define SERVE_LATENCY_BUCKETS (64 << SERVE_LATENCY_SUB_BITS)
+
+typedef enum serve_request_kind
+{
+    SERVE_REQUEST_IMAGE,
+    SERVE_REQUEST_STATS,
+    SERVE_REQUEST_EOF,
+    SERVE_REQUEST_BAD,
+} serve_request_kind_t;
+
+/**
+ * One image waiting to be classified. Lives on its connection thread's stack until it's answered.
+ */
+typedef struct serve_request
+{
+    const uint8_t* pixels;
+    double* outputs;
+    uint64_t arrived;
+    int done;
+    struct serve_request* next;
+} serve_request_t;
+
+typedef struct serve_stats
+{
+    uint64_t requests;
+    uint64_t batches;
+    uint32_t connections;
+    uint32_t max_depth;
+    uint64_t max_latency;
+
+    /**
+     * Time from a request being read in full to its answer being ready, in microseconds.
+     */
+    uint64_t latency[SERVE_LATENCY_BUCKETS];
+} serve_stats_t;
+
+typedef struct serve
+{
+    stoopidnet_model_t model;
+    uint32_t in_size;
+    uint32_t out_size;
+    uint32_t max_batch;
+    uint64_t deadline;
+    uint64_t started;
+
+    /**
+     * Everything below is guarded by lock. Batching threads wait on queued for requests, and
+     * connection threads on answered for theirs to be done.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t answered;
+    serve_request_t* head;
+    serve_request_t* tail;
+    uint32_t depth;
+    int stop;
+    serve_stats_t stats;
+} serve_t;
+
+typedef struct serve_connection
+{
+    serve_t* server;
+    int fd;
+} serve_connection_t;
+
+/**
+ * Set by the signal handlers, polled by the accept loop.
+ */
+static volatile sig_atomic_t serve_quit = 0;
+static volatile sig_atomic_t serve_dump_stats = 0;
+
+static void on_quit(int sig)
+{
+    (void)sig;
+    serve_quit = 1;
+}
+
+static void on_dump_stats(int sig)
+{
+    (void)sig;
+    serve_dump_stats = 1;
+}
+
+static int start_thread(pthread_t* thread, void* (*fn)(void*), void* arg);
+static void* serve_batcher(void* arg);
+static void* serve_connection(void* arg);
+static serve_request_kind_t read_request(FILE* in, uint32_t in_size, uint8_t* pixels,
+                                         const char** error);
+static int read_pgm_number(FILE* in, uint32_t* value);
+static int write_all(int fd, const char* buf, size_t len);
+static uint32_t latency_bucket(uint64_t us);
+static uint64_t latency_bucket_floor(uint32_t bucket);
+static void format_stats(serve_t* server, char* buf, size_t len);
+
+
+int main(int argc, char** argv)
+{
+    // options come before the positional arguments.
+    int argi = 1;
+    uint32_t max_batch = 32;
+    double deadline_us = 500;
+    uint32_t num_batchers = 1;
+    const char* calibration_file = NULL;
+    stoopidnet_storage_t half_format = STOOPIDNET_STORAGE_NATIVE;
+    int sparse = 0;
+    for (; (argi < argc) && !strncmp(argv[argi], "--", 2); argi++) {
+        if (!strcmp(argv[argi], "--max-batch") && ((argi + 1) < argc)) {
+            max_batch = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--deadline-us") && ((argi + 1) < argc)) {
+            deadline_us = strtod(argv[++argi], NULL);
+        } else if (!strcmp(argv[argi], "--batchers") && ((argi + 1) < argc)) {
+            num_batchers = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--int8") && ((argi + 1) < argc)) {
+            calibration_file = argv[++argi];
+        } else if (!strcmp(argv[argi], "--half") && ((argi + 1) < argc)) {
+            argi++;
+            for (half_format = STOOPIDNET_STORAGE_F16; half_format < STOOPIDNET_NUM_STORAGES;
+                 half_format++) {
+                if (!strcmp(argv[argi], stoopidnet_storage_name(half_format))) {
+                    break;
+                }
+            }
+            if (half_format == STOOPIDNET_NUM_STORAGES) {
+                fprintf(stderr, "Unknown half precision format %s\n", argv[argi]);
+                return -1;
+            }
+        } else if (!strcmp(argv[argi], "--sparse")) {
+            sparse = 1;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[argi]);
+            return -1;
+        }
+    }
+
+    if (((argc - argi) != 2) || (max_batch < 1) || (deadline_us < 0) || (num_batchers < 1) ||
+        (((calibration_file != NULL) + (half_format != STOOPIDNET_STORAGE_NATIVE) + sparse) > 1)) {
+        printf("Usage: %s [--max-batch N] [--deadline-us U] [--batchers N] [--int8 <mnist data> | "
+               "--half FORMAT | --sparse] <stoopidnet input file> <socket path>\n", argv[0]);
+        printf("  --max-batch N    evaluate up to N requests at once (default 32)\n");
+        printf("  --deadline-us U  let a request wait up to U microseconds for a batch to fill\n"
+               "                   (default 500, 0 to never wait)\n");
+        printf("  --batchers N     evaluate batches on N threads (default 1)\n");
+        printf("  --int8 FILE      serve an int8 quantized copy of the net, calibrated on the\n"
+               "                   first %i images of FILE\n",
+               STOOPIDNET_QUANT_CALIBRATION_SAMPLES);
+        printf("  --half FORMAT    serve a copy of the net with fp16 or bf16 weights\n");
+        printf("  --sparse         serve a copy of the net that keeps only its nonzero weights\n");
+        printf("Send SIGUSR1 to print the stats to stderr; SIGINT or SIGTERM to stop.\n");
+        return -1;
+    }
+    argv += argi - 1;
+
+    int result = -1;
+    int listener = -1;
+    uint32_t started_batchers = 0;
+    pthread_t* batchers = calloc(num_batchers, sizeof(pthread_t));
+    serve_t server = {
+        .max_batch = max_batch,
+        .deadline = (uint64_t)(deadline_us * 1000.0),
+    };
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&server.queued, &attr);
+    pthread_cond_init(&server.answered, NULL);
+    pthread_condattr_destroy(&attr);
+
+    // load the model
+    stoopidnet_t* net = stoopidnet_load_from_file(argv[1]);
+    if (net == NULL) {
+        goto cleanup;
+    }
+    server.in_size = stoopidnet_get_num_nodes_in_layer(net, 0);
+    server.out_size = stoopidnet_get_num_nodes_in_layer(net, stoopidnet_get_num_layers(net) - 1);
+    uint32_t ncalib = 0;
+    mnist_dataset_t* calib_ds = NULL;
+    if (calibration_file != NULL) {
+        calib_ds = mnist_dataset_open(calibration_file, NULL);
+        if ((calib_ds == NULL) || (calib_ds->count == 0) ||
+            ((calib_ds->width * calib_ds->height) != server.in_size)) {
+            fprintf(stderr, "Something went wrong loading the calibration file\n");
+            mnist_dataset_close(calib_ds);
+            stoopidnet_destroy(net);
+            goto cleanup;
+        }
+        ncalib = (calib_ds->count < STOOPIDNET_QUANT_CALIBRATION_SAMPLES) ?
+                 calib_ds->count : STOOPIDNET_QUANT_CALIBRATION_SAMPLES;
+    }
+    const int failed = stoopidnet_model_init(&server.model, net, ncalib,
+                                             (calib_ds != NULL) ? calib_ds->images : NULL,
+                                             half_format, sparse);
+    mnist_dataset_close(calib_ds);
+    if (failed) {
+        goto cleanup;
+    }
+
+    // replace a socket left behind by an earlier run, but nothing else.
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", argv[2]);
+        goto cleanup;
+    }
+    strcpy(addr.sun_path, argv[2]);
+    struct stat st;
+    if ((stat(argv[2], &st) == 0) && S_ISSOCK(st.st_mode)) {
+        unlink(argv[2]);
+    }
+    if (((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+        (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+        (listen(listener, SOMAXCONN) != 0)) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", argv[2], strerror(errno));
+        goto cleanup;
+    }
+
+    // without SA_RESTART, a signal interrupts accept so the loop gets to see it. Only the main
+    // thread takes them; start_thread keeps them blocked everywhere else.
+    struct sigaction sa = { .sa_handler = on_quit };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = on_dump_stats;
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    server.started = stoopidnet_profile_now();
+    for (; started_batchers < num_batchers; started_batchers++) {
+        if (start_thread(&batchers[started_batchers], serve_batcher, &server) != 0) {
+            fprintf(stderr, "Failed to start batching thread\n");
+            goto cleanup;
+        }
+    }
+    fprintf(stderr, "Serving %s on %s\n", argv[1], argv[2]);
+
+    char stats[512];
+    while (!serve_quit) {
+        const int fd = accept(listener, NULL, NULL);
+        if (serve_dump_stats) {
+            serve_dump_stats = 0;
+            format_stats(&server, stats, sizeof(stats));
+            fprintf(stderr, "%s", stats);
+        }
+        if (fd < 0) {
+            if ((errno != EINTR) && (errno != ECONNABORTED)) {
+                fprintf(stderr, "accept failed: %s\n", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        serve_connection_t* conn = malloc(sizeof(serve_connection_t));
+        conn->server = &server;
+        conn->fd = fd;
+        pthread_t thread;
+        if (start_thread(&thread, serve_connection, conn) != 0) {
+            fprintf(stderr, "Failed to start connection thread\n");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    format_stats(&server, stats, sizeof(stats));
+    fprintf(stderr, "%s", stats);
+    unlink(argv[2]);
+    result = 0;
+
+cleanup:
+    // the batchers answer whatever is still queued before they stop. Connection threads still
+    // waiting on their clients go down with the process.
+    pthread_mutex_lock(&server.lock);
+    server.stop = 1;
+    pthread_cond_broadcast(&server.queued);
+    pthread_mutex_unlock(&server.lock);
+    for (uint32_t i = 0; i < started_batchers; i++) {
+        pthread_join(batchers[i], NULL);
+    }
+    free(batchers);
+    if (listener >= 0) {
+        close(listener);
+    }
+    stoopidnet_model_destroy(&server.model);
+    return result;
+}
+
+
+////////////////////////////////////////////////////////////////
+// static function impl
+////////////////////////////////////////////////////////////////
+static int start_thread(pthread_t* thread, void* (*fn)(void*), void* arg)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    const int err = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return err;
+}
+
+static void* serve_batcher(void* arg)
+{
+    serve_t* server = arg;
+    serve_request_t** batch = malloc(server->max_batch * sizeof(serve_request_t*));
+    uint8_t* pixels = malloc((size_t)server->max_batch * server->in_size);
+    double* outputs = malloc((size_t)server->max_batch * server->out_size * sizeof(double));
+
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        // anything still queued gets answered before stopping.
+        while ((server->head == NULL) && !server->stop) {
+            pthread_cond_wait(&server->queued, &server->lock);
+        }
+        if (server->head == NULL) {
+            break;
+        }
+
+        // give the batch until the oldest request's deadline to fill up. A connection only has
+        // one request in flight, so once every open one has queued there's nothing to wait for.
+        // Another batcher may take the requests in the meantime.
+        const uint64_t deadline = server->head->arrived + server->deadline;
+        const struct timespec until = { (time_t)(deadline / 1000000000),
+                                        (long)(deadline % 1000000000) };
+        while ((server->head != NULL) && (server->depth < server->max_batch) &&
+               (server->depth < server->stats.connections) && !server->stop &&
+               (stoopidnet_profile_now() < deadline)) {
+            pthread_cond_timedwait(&server->queued, &server->lock, &until);
+        }
+        if (server->head == NULL) {
+            continue;
+        }
+
+        uint32_t n = 0;
+        for (; (n < server->max_batch) && (server->head != NULL); n++) {
+            batch[n] = server->head;
+            server->head = server->head->next;
+        }
+        if (server->head == NULL) {
+            server->tail = NULL;
+        }
+        server->depth -= n;
+        pthread_mutex_unlock(&server->lock);
+
+        for (uint32_t i = 0; i < n; i++) {
+            memcpy(pixels + ((size_t)i * server->in_size), batch[i]->pixels, server->in_size);
+        }
+        stoopidnet_model_evaluate_batch_u8(&server->model, n, pixels, outputs);
+        for (uint32_t i = 0; i < n; i++) {
+            memcpy(batch[i]->outputs, outputs + ((size_t)i * server->out_size),
+                   server->out_size * sizeof(double));
+        }
+        const uint64_t now = stoopidnet_profile_now();
+
+        pthread_mutex_lock(&server->lock);
+        for (uint32_t i = 0; i < n; i++) {
+            const uint64_t latency = (now - batch[i]->arrived) / 1000;
+            server->stats.latency[latency_bucket(latency)]++;
+            server->stats.max_latency = (latency > server->stats.max_latency) ?
+                                        latency : server->stats.max_latency;
+            batch[i]->done = 1;
+        }
+        server->stats.requests += n;
+        server->stats.batches++;
+        pthread_cond_broadcast(&server->answered);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    free(batch);
+    free(pixels);
+    free(outputs);
+    return NULL;
+}
+
+static void* serve_connection(void* arg)
+{
+    serve_connection_t* conn = arg;
+    serve_t* server = conn->server;
+    FILE* in = fdopen(conn->fd, "rb");
+    uint8_t* pixels = malloc(server->in_size);
+    double* outputs = malloc(server->out_size * sizeof(double));
+    const size_t reply_len = ((size_t)server->out_size * 16) + 512;
+    char* reply = malloc(reply_len);
+
+    pthread_mutex_lock(&server->lock);
+    server->stats.connections++;
+    pthread_mutex_unlock(&server->lock);
+
+    for (;;) {
+        const char* error = NULL;
+        const serve_request_kind_t kind = read_request(in, server->in_size, pixels, &error);
+        if (kind == SERVE_REQUEST_EOF) {
+            break;
+        } else if (kind == SERVE_REQUEST_BAD) {
+            snprintf(reply, reply_len, "error: %s\n", error);
+            write_all(conn->fd, reply, strlen(reply));
+            break;
+        } else if (kind == SERVE_REQUEST_STATS) {
+            format_stats(server, reply, reply_len);
+            if (write_all(conn->fd, reply, strlen(reply)) != 0) {
+                break;
+            }
+            continue;
+        }
+
+        serve_request_t req = {
+            .pixels = pixels,
+            .outputs = outputs,
+            .arrived = stoopidnet_profile_now(),
+        };
+        pthread_mutex_lock(&server->lock);
+        if (server->tail != NULL) {
+            server->tail->next = &req;
+        } else {
+            server->head = &req;
+        }
+        server->tail = &req;
+        server->depth++;
+        server->stats.max_depth = (server->depth > server->stats.max_depth) ?
+                                  server->depth : server->stats.max_depth;
+        pthread_cond_signal(&server->queued);
+        while (!req.done) {
+            pthread_cond_wait(&server->answered, &server->lock);
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        size_t len = snprintf(reply, reply_len, "%i", maxidx(outputs, server->out_size));
+        for (uint32_t j = 0; j < server->out_size; j++) {
+            len += snprintf(reply + len, reply_len - len, " %.6g", outputs[j]);
+        }
+        reply[len++] = '\n';
+        if (write_all(conn->fd, reply, len) != 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server->stats.connections--;
+    pthread_mutex_unlock(&server->lock);
+
+    fclose(in);
+    free(pixels);
+    free(outputs);
+    free(reply);
+    free(conn);
+    return NULL;
+}
+
+/**
+ * Reads the next request off the connection, leaving an image's pixels in pixels (in_size bytes,
+ * mnist style). Sets *error to say what was wrong with a bad one.
+ */
+static serve_request_kind_t read_request(FILE* in, uint32_t in_size, uint8_t* pixels,
+                                         const char** error)
+{
+    uint8_t magic[2];
+    const size_t got = fread(magic, 1, (in_size < 2) ? in_size : 2, in);
+    if (got == 0) {
+        return SERVE_REQUEST_EOF;
+    }
+
+    if ((got == 2) && (magic[0] == 'S') && (magic[1] == 'T')) {
+        char rest[4];
+        if ((fread(rest, 1, 4, in) != 4) || memcmp(rest, "ATS\n", 4)) {
+            *error = "expected STATS";
+            return SERVE_REQUEST_BAD;
+        }
+        return SERVE_REQUEST_STATS;
+    }
+
+    if ((got < 2) || (magic[0] != 'P') || (magic[1] != '5')) {
+        memcpy(pixels, magic, got);
+        if (fread(pixels + got, 1, in_size - got, in) != (in_size - got)) {
+            *error = "truncated image";
+            return SERVE_REQUEST_BAD;
+        }
+        return SERVE_REQUEST_IMAGE;
+    }
+
+    uint32_t width, height, maxval;
+    if (!read_pgm_number(in, &width) || !read_pgm_number(in, &height) ||
+        !read_pgm_number(in, &maxval) || (maxval == 0) || (maxval > 65535)) {
+        *error = "bad PGM header";
+        return SERVE_REQUEST_BAD;
+    }
+    if (((uint64_t)width * height) != in_size) {
+        *error = "PGM size doesn't match the net's input layer";
+        return SERVE_REQUEST_BAD;
+    }
+
+    // samples are one byte, or two big-endian ones past 255. Dark ink on light paper is flipped
+    // to the mnist convention.
+    const int wide = (maxval > 255);
+    for (uint32_t k = 0; k < in_size; k++) {
+        uint8_t sample[2];
+        if (fread(sample, 1, wide + 1, in) != (size_t)(wide + 1)) {
+            *error = "truncated image";
+            return SERVE_REQUEST_BAD;
+        }
+        uint32_t v = wide ? ((sample[0] << 8) | sample[1]) : sample[0];
+        v = (v > maxval) ? maxval : v;
+        pixels[k] = (uint8_t)(255 - (((v * 255) + (maxval / 2)) / maxval));
+    }
+    return SERVE_REQUEST_IMAGE;
+}
+
+/**
+ * Reads one number of a PGM header, skipping whitespace and comments before it and eating the
+ * single whitespace byte after it. Returns 0 if there isn't one.
+ */
+static int read_pgm_number(FILE* in, uint32_t* value)
+{
+    int c = getc(in);
+    while ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == '#')) {
+        if (c == '#') {
+            while ((c != '\n') && (c != EOF)) {
+                c = getc(in);
+            }
+        }
+        c = getc(in);
+    }
+
+    if ((c < '0') || (c > '9')) {
+        return 0;
+    }
+    uint64_t v = 0;
+    while ((c >= '0') && (c <= '9')) {
+        v = (v * 10) + (c - '0');
+        if (v > UINT32_MAX) {
+            return 0;
+        }
+        c = getc(in);
+    }
+    *value = (uint32_t)v;
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+/**
+ * Returns nonzero if the connection went away.
+ */
+static int write_all(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        const ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Values below 2^SERVE_LATENCY_SUB_BITS get a bucket each; past that, every power of two is split
+ * into 2^SERVE_LATENCY_SUB_BITS equal buckets.
+ */
+static uint32_t latency_bucket(uint64_t us)
+{
+    const uint32_t sub = 1u << SERVE_LATENCY_SUB_BITS;
+    if (us < sub) {
+        return (uint32_t)us;
+    }
+    uint32_t msb = 63;
+    while (!(us >> msb)) {
+        msb--;
+    }
+    const uint32_t shift = msb - SERVE_LATENCY_SUB_BITS;
+    return ((shift + 1) * sub) + (uint32_t)((us >> shift) & (sub - 1));
+}
+
+/**
+ * Smallest latency that falls in bucket.
+ */
+static uint64_t latency_bucket_floor(uint32_t bucket)
+{
+    const uint32_t sub = 1u << SERVE_LATENCY_SUB_BITS;
+    if (bucket < sub) {
+        return bucket;
+    }
+    const uint32_t shift = (bucket / sub) - 1;
+    return (uint64_t)(sub + (bucket % sub)) << shift;
+}
+
+static void format_stats(serve_t* server, char* buf, size_t len)
+{
+    static const double percentiles[] = { 0.5, 0.9, 0.99 };
+    uint64_t at[3] = { 0, 0, 0 };
+
+    pthread_mutex_lock(&server->lock);
+    const serve_stats_t* st = &server->stats;
+    for (uint32_t p = 0; p < 3; p++) {
+        const uint64_t rank = (uint64_t)(percentiles[p] * st->requests);
+        uint64_t seen = 0;
+        for (uint32_t b = 0; b < SERVE_LATENCY_BUCKETS; b++) {
+            seen += st->latency[b];
+            if ((seen > rank) || (seen == st->requests)) {
+                at[p] = latency_bucket_floor(b);
+                break;
+            }
+        }
+    }
+    const double seconds = (stoopidnet_profile_now() - server->started) * 1e-9;
+    snprintf(buf, len, "requests=%llu batches=%llu mean_batch=%.2f requests_per_sec=%.1f "
+             "queue_depth=%u max_queue_depth=%u connections=%u latency_us_p50=%llu "
+             "latency_us_p90=%llu latency_us_p99=%llu latency_us_max=%llu\n",
+             (unsigned long long)st->requests, (unsigned long long)st->batches,
+             st->batches ? ((double)st->requests / st->batches) : 0.0,
+             (seconds > 0) ? (st->requests / seconds) : 0.0, server->depth, st->max_depth,
+             st->connections, (unsigned long long)at[0], (unsigned long long)at[1],
+             (unsigned long long)at[2], (unsigned long long)st->max_latency);
+    pthread_mutex_unlock(&server->lock);
+}
@@ -0,0 +1,307 @@
+#include "stoopidnet_sparse.h"
+#include "stoopidnet_kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Examples evaluated together. Each nonzero weight is read once per block and applied to all of
+ * the block's values of its input at once, and a block's activations for the widest layer stay in
+ * L2.
+ */
+#define SPARSE_BLOCK 16
+
+typedef struct stoopidnet_sparse_layer
+{
+    uint32_t in;
+    uint32_t out;
+    stoopidnet_activation_t activation;
+
+    /**
+     * Row j's nonzero weights are vals[rows[j]] up to (not including) vals[rows[j + 1]], in column
+     * order, and cols holds the column of each.
+     */
+    uint32_t* rows;
+    uint32_t* cols;
+    float* vals;
+    float* biases;
+} stoopidnet_sparse_layer_t;
+
+struct stoopidnet_sparse
+{
+    uint32_t num_layers;
+    uint32_t* layer_sizes;
+    uint32_t widest;
+
+    /**
+     * layers[i] holds the parameters feeding layer i + 1.
+     */
+    stoopidnet_sparse_layer_t* layers;
+};
+
+static int compare_doubles(const void* a, const void* b);
+
+/**
+ * Evaluates n_inputs inputs, taken from the rows in inputs or, if that's NULL, from the row-major
+ * byte matrix inputs_u8.
+ */
+static void sparse_evaluate(stoopidnet_sparse_t* s, uint32_t n_inputs, double** inputs,
+                            const uint8_t* inputs_u8, double* outputs);
+
+
+uint64_t stoopidnet_sparse_prune(stoopidnet_t* net, uint32_t layer_idx, double sparsity)
+{
+    const size_t n = (size_t)stoopidnet_get_num_nodes_in_layer(net, layer_idx - 1) *
+                     stoopidnet_get_num_nodes_in_layer(net, layer_idx);
+    sparsity = (sparsity < 0) ? 0 : ((sparsity > 1) ? 1 : sparsity);
+    const size_t target = (size_t)((sparsity * (double)n) + 0.5);
+
+    double* weights = malloc(n * sizeof(double));
+    double* magnitudes = malloc(n * sizeof(double));
+    stoopidnet_get_layer_params(net, layer_idx, weights, NULL);
+    for (size_t k = 0; k < n; k++) {
+        magnitudes[k] = fabs(weights[k]);
+    }
+    qsort(magnitudes, n, sizeof(double), compare_doubles);
+
+    // everything smaller than the target-th smallest magnitude goes, then as many of the weights
+    // tied with it as it takes to make up the count.
+    if (target > 0) {
+        const double cut = magnitudes[target - 1];
+        size_t zeroed = 0;
+        for (size_t k = 0; k < n; k++) {
+            if (fabs(weights[k]) < cut) {
+                weights[k] = 0;
+                zeroed++;
+            }
+        }
+        for (size_t k = 0; (k < n) && (zeroed < target); k++) {
+            if ((weights[k] != 0) && (fabs(weights[k]) == cut)) {
+                weights[k] = 0;
+                zeroed++;
+            }
+        }
+        stoopidnet_set_layer_weights(net, layer_idx, weights);
+    }
+
+    uint64_t zeros = 0;
+    for (size_t k = 0; k < n; k++) {
+        zeros += (weights[k] == 0);
+    }
+
+    free(magnitudes);
+    free(weights);
+    return zeros;
+}
+
+
+stoopidnet_sparse_t* stoopidnet_sparse_create(stoopidnet_t* net)
+{
+    stoopidnet_sparse_t* s = calloc(1, sizeof(stoopidnet_sparse_t));
+    s->num_layers = stoopidnet_get_num_layers(net);
+    s->layer_sizes = calloc(s->num_layers, sizeof(uint32_t));
+    s->layers = calloc(s->num_layers - 1, sizeof(stoopidnet_sparse_layer_t));
+
+    for (uint32_t i = 0; i < s->num_layers; i++) {
+        s->layer_sizes[i] = stoopidnet_get_num_nodes_in_layer(net, i);
+        s->widest = (s->layer_sizes[i] > s->widest) ? s->layer_sizes[i] : s->widest;
+    }
+
+    for (uint32_t l = 0; l < (s->num_layers - 1); l++) {
+        stoopidnet_sparse_layer_t* layer = &s->layers[l];
+        layer->in = s->layer_sizes[l];
+        layer->out = s->layer_sizes[l + 1];
+        layer->activation = stoopidnet_get_layer_activation(net, l + 1);
+
+        const size_t n = (size_t)layer->in * layer->out;
+        double* weights = malloc(n * sizeof(double));
+        double* biases = malloc(layer->out * sizeof(double));
+        stoopidnet_get_layer_params(net, l + 1, weights, biases);
+
+        // row offsets are 32 bits.
+        size_t nnz = 0;
+        for (size_t k = 0; k < n; k++) {
+            nnz += (weights[k] != 0);
+        }
+        if (nnz > UINT32_MAX) {
+            free(weights);
+            free(biases);
+            stoopidnet_sparse_destroy(s);
+            return NULL;
+        }
+
+        layer->rows = malloc((layer->out + 1) * sizeof(uint32_t));
+        layer->cols = malloc(((nnz > 0) ? nnz : 1) * sizeof(uint32_t));
+        layer->vals = malloc(((nnz > 0) ? nnz : 1) * sizeof(float));
+        layer->biases = malloc(layer->out * sizeof(float));
+
+        uint32_t count = 0;
+        for (uint32_t j = 0; j < layer->out; j++) {
+            const double* w = weights + ((size_t)j * layer->in);
+            layer->rows[j] = count;
+            for (uint32_t k = 0; k < layer->in; k++) {
+                if (w[k] != 0) {
+                    layer->cols[count] = k;
+                    layer->vals[count] = (float)w[k];
+                    count++;
+                }
+            }
+            layer->biases[j] = (float)biases[j];
+        }
+        layer->rows[layer->out] = count;
+
+        free(weights);
+        free(biases);
+    }
+
+    return s;
+}
+
+
+void stoopidnet_sparse_destroy(stoopidnet_sparse_t* s)
+{
+    if (s == NULL) {
+        return;
+    }
+
+    if (s->layers != NULL) {
+        for (uint32_t l = 0; l < (s->num_layers - 1); l++) {
+            free(s->layers[l].rows);
+            free(s->layers[l].cols);
+            free(s->layers[l].vals);
+            free(s->layers[l].biases);
+        }
+    }
+    free(s->layers);
+    free(s->layer_sizes);
+    free(s);
+}
+
+
+size_t stoopidnet_sparse_size(const stoopidnet_sparse_t* s)
+{
+    size_t bytes = 0;
+    for (uint32_t l = 0; l < (s->num_layers - 1); l++) {
+        const stoopidnet_sparse_layer_t* layer = &s->layers[l];
+        bytes += (size_t)layer->rows[layer->out] * (sizeof(uint32_t) + sizeof(float));
+        bytes += (layer->out + 1) * sizeof(uint32_t);
+        bytes += layer->out * sizeof(float);
+    }
+    return bytes;
+}
+
+
+uint64_t stoopidnet_sparse_nnz(const stoopidnet_sparse_t* s, uint32_t layer_idx)
+{
+    const stoopidnet_sparse_layer_t* layer = &s->layers[layer_idx - 1];
+    return layer->rows[layer->out];
+}
+
+
+void stoopidnet_sparse_evaluate_batch(stoopidnet_sparse_t* s, uint32_t n_inputs, double** inputs,
+                                      double* outputs)
+{
+    sparse_evaluate(s, n_inputs, inputs, NULL, outputs);
+}
+
+
+void stoopidnet_sparse_evaluate_batch_u8(stoopidnet_sparse_t* s, uint32_t n_inputs,
+                                         const uint8_t* inputs, double* outputs)
+{
+    sparse_evaluate(s, n_inputs, NULL, inputs, outputs);
+}
+
+
+////////////////////////////////////////////////////////////////
+// static function impl
+////////////////////////////////////////////////////////////////
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void sparse_evaluate(stoopidnet_sparse_t* s, uint32_t n_inputs, double** inputs,
+                            const uint8_t* inputs_u8, double* outputs)
+{
+    const stoopidnet_kernels_t* kernels = stoopidnet_kernels();
+    const uint32_t in_size = s->layer_sizes[0];
+    const uint32_t out_size = s->layer_sizes[s->num_layers - 1];
+
+    // a block's activations ping-pong between two buffers. Within a block they're stored one
+    // node at a time, element k of example b at k * nb + b, so the values each nonzero weight
+    // multiplies are contiguous. Softmax works on whole examples, so it goes through a third
+    // buffer with the block transposed back.
+    float* act[2] = { malloc((size_t)SPARSE_BLOCK * s->widest * sizeof(float)),
+                      malloc((size_t)SPARSE_BLOCK * s->widest * sizeof(float)) };
+    float* rows = malloc((size_t)SPARSE_BLOCK * s->widest * sizeof(float));
+
+    for (uint32_t s0 = 0; s0 < n_inputs; s0 += SPARSE_BLOCK) {
+        const uint32_t nb = ((n_inputs - s0) < SPARSE_BLOCK) ? (n_inputs - s0) : SPARSE_BLOCK;
+        // the block is transposed as it's packed, writing one node's values at a time.
+        float* dst = act[0];
+        if (inputs != NULL) {
+            for (uint32_t k = 0; k < in_size; k++) {
+                for (uint32_t b = 0; b < nb; b++) {
+                    *dst++ = (float)inputs[s0 + b][k];
+                }
+            }
+        } else {
+            const uint8_t* src = inputs_u8 + ((size_t)s0 * in_size);
+            for (uint32_t k = 0; k < in_size; k++) {
+                for (uint32_t b = 0; b < nb; b++) {
+                    *dst++ = src[((size_t)b * in_size) + k] / 255.0f;
+                }
+            }
+        }
+
+        for (uint32_t l = 0; l < (s->num_layers - 1); l++) {
+            const stoopidnet_sparse_layer_t* layer = &s->layers[l];
+            const float* src = act[l & 1];
+            float* dst = act[(l + 1) & 1];
+            for (uint32_t j = 0; j < layer->out; j++) {
+                const uint32_t lo = layer->rows[j];
+                const uint32_t nnz = layer->rows[j + 1] - lo;
+                float* z = dst + ((size_t)j * nb);
+                if (nb == 1) {
+                    z[0] = kernels->spdot_f32(layer->vals + lo, layer->cols + lo, nnz, src) +
+                           layer->biases[j];
+                } else {
+                    for (uint32_t b = 0; b < nb; b++) {
+                        z[b] = layer->biases[j];
+                    }
+                    kernels->spmm_f32(nnz, layer->vals + lo, layer->cols + lo, src, nb, z);
+                }
+            }
+
+            if (layer->activation != STOOPIDNET_ACTIVATION_SOFTMAX) {
+                kernels->activate_f32(layer->activation, 1, layer->out * nb, dst, dst);
+            } else {
+                for (uint32_t j = 0; j < layer->out; j++) {
+                    for (uint32_t b = 0; b < nb; b++) {
+                        rows[((size_t)b * layer->out) + j] = dst[((size_t)j * nb) + b];
+                    }
+                }
+                kernels->activate_f32(layer->activation, nb, layer->out, rows, rows);
+                for (uint32_t j = 0; j < layer->out; j++) {
+                    for (uint32_t b = 0; b < nb; b++) {
+                        dst[((size_t)j * nb) + b] = rows[((size_t)b * layer->out) + j];
+                    }
+                }
+            }
+        }
+
+        const float* result = act[(s->num_layers - 1) & 1];
+        for (uint32_t b = 0; b < nb; b++) {
+            for (uint32_t j = 0; j < out_size; j++) {
+                outputs[((size_t)(s0 + b) * out_size) + j] = result[((size_t)j * nb) + b];
+            }
+        }
+    }
+
+    free(act[0]);
+    free(act[1]);
+    free(rows);
+}
@@ -0,0 +1,62 @@
+#ifndef STOOPIDNET_SPARSE_H
+#define STOOPIDNET_SPARSE_H
+
+/**
+ * Magnitude pruning, and inference with a pruned stoopidnet's weights kept in compressed sparse
+ * row (CSR) form.
+ *
+ * Pruning zeroes a layer's smallest-magnitude weights in place; the net is still an ordinary
+ * stoopidnet_t, and training it with stoopidnet_training_parameters_t::keep_pruned set fine-tunes
+ * the weights that are left while the pruned ones stay at zero. A sparse net then stores only the
+ * nonzero weights of each row, as float values with their column indices, so each pass over a
+ * layer reads and multiplies only those. Biases and activations are float. Single examples go
+ * through a gathering sparse dot product per row; batches are evaluated in blocks, with every
+ * nonzero weight applied to the whole block at once. The sparse net is read-only; it can't be
+ * trained or serialized.
+ */
+
+#include "stoopidnet.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct stoopidnet_sparse stoopidnet_sparse_t;
+
+/**
+ * Zeroes the sparsity fraction (0 to 1) of the weights feeding layer layer_idx
+ * (1 <= layer_idx < num_layers) that have the smallest magnitudes, counting any that are zero
+ * already. Biases are left alone. Returns how many of the layer's weights are zero afterwards.
+ */
+uint64_t stoopidnet_sparse_prune(stoopidnet_t* net, uint32_t layer_idx, double sparsity);
+
+/**
+ * Builds a copy of net that holds only its nonzero weights.
+ */
+stoopidnet_sparse_t* stoopidnet_sparse_create(stoopidnet_t* net);
+void stoopidnet_sparse_destroy(stoopidnet_sparse_t* s);
+
+/**
+ * Bytes taken up by the nonzero weights, their indices, the row offsets and the biases.
+ */
+size_t stoopidnet_sparse_size(const stoopidnet_sparse_t* s);
+
+/**
+ * Number of nonzero weights feeding layer layer_idx (1 <= layer_idx < num_layers).
+ */
+uint64_t stoopidnet_sparse_nnz(const stoopidnet_sparse_t* s, uint32_t layer_idx);
+
+/**
+ * Same contract as stoopidnet_evaluate_batch: outputs must hold n_inputs * (size of the output
+ * layer) doubles. Safe to call from several threads at once.
+ */
+void stoopidnet_sparse_evaluate_batch(stoopidnet_sparse_t* s, uint32_t n_inputs, double** inputs,
+                                      double* outputs);
+
+/**
+ * Same as stoopidnet_sparse_evaluate_batch, for inputs laid out as in
+ * stoopidnet_evaluate_batch_u8.
+ */
+void stoopidnet_sparse_evaluate_batch_u8(stoopidnet_sparse_t* s, uint32_t n_inputs,
+                                         const uint8_t* inputs, double* outputs);
+
+#endif
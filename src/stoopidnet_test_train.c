@@ -0,0 +1,405 @@
+#include "stoopidnet.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Trains a small fixed net on fixed data through stoopidnet_train and checks its parameters and
+ * outputs against a naive one-example-at-a-time backprop of the same full-batch steps, with each
+ * optimizer and output layer, so changes to the batched and fused kernels can't drift from the
+ * math unnoticed.
+ */
+
+#define NUM_INPUTS 20
+#define NUM_HIDDEN 7
+#define NUM_OUTPUTS 4
+#define NUM_EXAMPLES 64
+#define NUM_EPOCHS 5
+#define LEARN_RATE 0.5
+
+/**
+ * The optimizer hyperparameters the library defaults to.
+ */
+#define MOMENTUM 0.9
+#define BETA2 0.999
+#define EPSILON 1e-8
+
+/**
+ * The Hogwild case trains in batches this small so every worker has several per epoch.
+ */
+#define HOGWILD_BATCH 4
+#define HOGWILD_EPOCHS 20
+
+typedef struct reference
+{
+    double w1[NUM_HIDDEN][NUM_INPUTS];
+    double b1[NUM_HIDDEN];
+    double w2[NUM_OUTPUTS][NUM_HIDDEN];
+    double b2[NUM_OUTPUTS];
+} reference_t;
+
+#define REFERENCE_LEN (sizeof(reference_t) / sizeof(double))
+
+/**
+ * The reference's optimizer state: momentum's velocity in v, or Adam's moments in m and v, laid
+ * out like the parameters.
+ */
+typedef struct reference_optimizer
+{
+    stoopidnet_optimizer_t optimizer;
+    reference_t m;
+    reference_t v;
+    uint64_t step;
+} reference_optimizer_t;
+
+typedef struct test_case
+{
+    stoopidnet_precision_t precision;
+    uint32_t num_threads;
+    int asynchronous;
+    stoopidnet_optimizer_t optimizer;
+    double learn_rate;
+
+    /**
+     * Softmax output layer trained with cross-entropy, instead of a sigmoid one with quadratic
+     * loss.
+     */
+    int softmax;
+
+    /**
+     * Serialize and deserialize the net, optimizer state and all, between epochs.
+     */
+    int round_trip;
+    double tolerance;
+} test_case_t;
+
+static double sigmoid(double z)
+{
+    return 1.0 / (1.0 + exp(-z));
+}
+
+static void reference_forward(const reference_t* r, int softmax, const double* x, double* h,
+                              double* y)
+{
+    for (int j = 0; j < NUM_HIDDEN; j++) {
+        double z = r->b1[j];
+        for (int k = 0; k < NUM_INPUTS; k++) {
+            z += r->w1[j][k] * x[k];
+        }
+        h[j] = sigmoid(z);
+    }
+    double sum = 0;
+    for (int j = 0; j < NUM_OUTPUTS; j++) {
+        double z = r->b2[j];
+        for (int k = 0; k < NUM_HIDDEN; k++) {
+            z += r->w2[j][k] * h[k];
+        }
+        y[j] = softmax ? exp(z) : sigmoid(z);
+        sum += y[j];
+    }
+    for (int j = 0; softmax && (j < NUM_OUTPUTS); j++) {
+        y[j] /= sum;
+    }
+}
+
+/**
+ * One full-batch step on the quadratic loss (or cross-entropy for a softmax output), accumulating
+ * each example's gradient in turn and then applying the optimizer's update as written in the
+ * textbooks.
+ */
+static void reference_step(reference_t* r, reference_optimizer_t* opt, const test_case_t* tc,
+                           double** inputs, double** expected)
+{
+    reference_t g = { 0 };
+    for (int i = 0; i < NUM_EXAMPLES; i++) {
+        double h[NUM_HIDDEN], y[NUM_OUTPUTS], d2[NUM_OUTPUTS], d1[NUM_HIDDEN];
+        reference_forward(r, tc->softmax, inputs[i], h, y);
+        for (int j = 0; j < NUM_OUTPUTS; j++) {
+            d2[j] = tc->softmax ? (y[j] - expected[i][j]) :
+                                  ((y[j] - expected[i][j]) * y[j] * (1 - y[j]));
+            g.b2[j] += d2[j];
+            for (int k = 0; k < NUM_HIDDEN; k++) {
+                g.w2[j][k] += d2[j] * h[k];
+            }
+        }
+        for (int k = 0; k < NUM_HIDDEN; k++) {
+            double e = 0;
+            for (int j = 0; j < NUM_OUTPUTS; j++) {
+                e += r->w2[j][k] * d2[j];
+            }
+            d1[k] = e * h[k] * (1 - h[k]);
+            g.b1[k] += d1[k];
+            for (int m = 0; m < NUM_INPUTS; m++) {
+                g.w1[k][m] += d1[k] * inputs[i][m];
+            }
+        }
+    }
+
+    double* p = &r->w1[0][0];
+    double* m = &opt->m.w1[0][0];
+    double* v = &opt->v.w1[0][0];
+    const double* q = &g.w1[0][0];
+    const double rate = tc->learn_rate / NUM_EXAMPLES;
+    opt->step++;
+    for (size_t k = 0; k < REFERENCE_LEN; k++) {
+        switch (opt->optimizer) {
+        case STOOPIDNET_OPTIMIZER_MOMENTUM:
+            v[k] = (MOMENTUM * v[k]) + q[k];
+            p[k] -= rate * v[k];
+            break;
+        case STOOPIDNET_OPTIMIZER_NESTEROV:
+            v[k] = (MOMENTUM * v[k]) + q[k];
+            p[k] -= rate * (q[k] + (MOMENTUM * v[k]));
+            break;
+        case STOOPIDNET_OPTIMIZER_ADAM: {
+            const double mean = q[k] / NUM_EXAMPLES;
+            m[k] = (MOMENTUM * m[k]) + ((1 - MOMENTUM) * mean);
+            v[k] = (BETA2 * v[k]) + ((1 - BETA2) * mean * mean);
+            const double mhat = m[k] / (1 - pow(MOMENTUM, (double)opt->step));
+            const double vhat = v[k] / (1 - pow(BETA2, (double)opt->step));
+            p[k] -= (tc->learn_rate * mhat) / (sqrt(vhat) + EPSILON);
+            break;
+        }
+        default:
+            p[k] -= rate * q[k];
+            break;
+        }
+    }
+}
+
+/**
+ * Largest difference between the net's parameters and the reference's.
+ */
+static double compare_params(stoopidnet_t* net, const reference_t* r)
+{
+    double w1[NUM_HIDDEN * NUM_INPUTS], b1[NUM_HIDDEN], w2[NUM_OUTPUTS * NUM_HIDDEN],
+           b2[NUM_OUTPUTS];
+    stoopidnet_get_layer_params(net, 1, w1, b1);
+    stoopidnet_get_layer_params(net, 2, w2, b2);
+
+    double worst = 0;
+    for (int k = 0; k < (NUM_HIDDEN * NUM_INPUTS); k++) {
+        worst = fmax(worst, fabs(w1[k] - (&r->w1[0][0])[k]));
+    }
+    for (int k = 0; k < (NUM_OUTPUTS * NUM_HIDDEN); k++) {
+        worst = fmax(worst, fabs(w2[k] - (&r->w2[0][0])[k]));
+    }
+    for (int k = 0; k < NUM_HIDDEN; k++) {
+        worst = fmax(worst, fabs(b1[k] - r->b1[k]));
+    }
+    for (int k = 0; k < NUM_OUTPUTS; k++) {
+        worst = fmax(worst, fabs(b2[k] - r->b2[k]));
+    }
+    return worst;
+}
+
+static stoopidnet_t* create_net(stoopidnet_precision_t precision, int softmax)
+{
+    srand(1);
+    stoopidnet_t* net = stoopidnet_create_with_precision(NUM_INPUTS, precision);
+    stoopidnet_add_fc_layer(net, NUM_HIDDEN);
+    stoopidnet_add_fc_layer_with_activation(net, NUM_OUTPUTS, softmax ?
+                                            STOOPIDNET_ACTIVATION_SOFTMAX :
+                                            STOOPIDNET_ACTIVATION_SIGMOID);
+    return net;
+}
+
+/**
+ * Trains a fresh net as tc says and returns whether it stays within tolerance of the reference.
+ * The whole data set is one minibatch, so asynchronous training has one worker take each epoch's
+ * single step and still matches.
+ */
+static int check(const test_case_t* tc, double** inputs, double** expected)
+{
+    stoopidnet_t* net = create_net(tc->precision, tc->softmax);
+
+    reference_t r;
+    reference_optimizer_t opt = { .optimizer = tc->optimizer };
+    stoopidnet_get_layer_params(net, 1, &r.w1[0][0], r.b1);
+    stoopidnet_get_layer_params(net, 2, &r.w2[0][0], r.b2);
+
+    uint64_t rng = 1;
+    stoopidnet_training_parameters_t params = {
+        .learn_rate = tc->learn_rate,
+        .batch_size = NUM_EXAMPLES,
+        .loss = tc->softmax ? STOOPIDNET_LOSS_CROSS_ENTROPY : STOOPIDNET_LOSS_QUADRATIC,
+        .optimizer = tc->optimizer,
+        .num_threads = tc->num_threads,
+        .asynchronous = tc->asynchronous,
+        .rng = &rng,
+    };
+    for (int epoch = 0; epoch < NUM_EPOCHS; epoch++) {
+        stoopidnet_train(net, &params, NUM_EXAMPLES, inputs, expected);
+        reference_step(&r, &opt, tc, inputs, expected);
+
+        if (tc->round_trip) {
+            uint8_t* data;
+            const uint32_t len = stoopidnet_serialize(net, &data);
+            stoopidnet_destroy(net);
+            net = stoopidnet_deserialize(data, len);
+            free(data);
+        }
+    }
+
+    // outputs through both the single and the batched evaluation paths.
+    double worst_params = compare_params(net, &r);
+    double worst_outputs = 0;
+    double batched[NUM_EXAMPLES * NUM_OUTPUTS];
+    stoopidnet_evaluate_batch(net, NUM_EXAMPLES, inputs, batched);
+    for (int i = 0; i < NUM_EXAMPLES; i++) {
+        double h[NUM_HIDDEN], y[NUM_OUTPUTS];
+        double* single;
+        reference_forward(&r, tc->softmax, inputs[i], h, y);
+        stoopidnet_evaluate(net, inputs[i], &single);
+        for (int j = 0; j < NUM_OUTPUTS; j++) {
+            worst_outputs = fmax(worst_outputs, fabs(single[j] - y[j]));
+            worst_outputs = fmax(worst_outputs, fabs(batched[(i * NUM_OUTPUTS) + j] - y[j]));
+        }
+        free(single);
+    }
+    stoopidnet_destroy(net);
+
+    const int ok = (worst_params <= tc->tolerance) && (worst_outputs <= tc->tolerance);
+    printf("%s %s %s%s, %u threads%s%s: params off by %g, outputs by %g (tolerance %g)\n",
+           ok ? "ok  " : "FAIL", (tc->precision == STOOPIDNET_PRECISION_F32) ? "float" : "double",
+           stoopidnet_optimizer_name(tc->optimizer), tc->softmax ? " softmax" : "",
+           tc->num_threads, tc->asynchronous ? " async" : "",
+           tc->round_trip ? " serialized" : "", worst_params, worst_outputs, tc->tolerance);
+    return ok;
+}
+
+/**
+ * Mean over the examples of the quadratic loss.
+ */
+static double mean_loss(stoopidnet_t* net, double** inputs, double** expected)
+{
+    double outputs[NUM_EXAMPLES * NUM_OUTPUTS];
+    stoopidnet_evaluate_batch(net, NUM_EXAMPLES, inputs, outputs);
+    double loss = 0;
+    for (int i = 0; i < NUM_EXAMPLES; i++) {
+        for (int j = 0; j < NUM_OUTPUTS; j++) {
+            const double d = outputs[(i * NUM_OUTPUTS) + j] - expected[i][j];
+            loss += 0.5 * d * d;
+        }
+    }
+    return loss / NUM_EXAMPLES;
+}
+
+/**
+ * Trains asynchronously on num_threads threads with several small batches per epoch, so workers
+ * really do update the weights concurrently, and with every third weight pruned and held there
+ * by keep_pruned. The result isn't deterministic, so this only checks that the loss went down
+ * and that the pruned weights are still zero.
+ */
+static int check_hogwild(stoopidnet_precision_t precision, uint32_t num_threads,
+                         double** inputs, double** expected)
+{
+    stoopidnet_t* net = create_net(precision, 0);
+
+    double w1[NUM_HIDDEN * NUM_INPUTS], b1[NUM_HIDDEN], w2[NUM_OUTPUTS * NUM_HIDDEN],
+           b2[NUM_OUTPUTS];
+    stoopidnet_get_layer_params(net, 1, w1, b1);
+    stoopidnet_get_layer_params(net, 2, w2, b2);
+    for (int k = 0; k < (NUM_HIDDEN * NUM_INPUTS); k += 3) {
+        w1[k] = 0;
+    }
+    for (int k = 0; k < (NUM_OUTPUTS * NUM_HIDDEN); k += 3) {
+        w2[k] = 0;
+    }
+    stoopidnet_set_layer_weights(net, 1, w1);
+    stoopidnet_set_layer_weights(net, 2, w2);
+
+    const double before = mean_loss(net, inputs, expected);
+    uint64_t rng = 1;
+    stoopidnet_training_parameters_t params = {
+        .learn_rate = LEARN_RATE,
+        .batch_size = HOGWILD_BATCH,
+        .loss = STOOPIDNET_LOSS_QUADRATIC,
+        .optimizer = STOOPIDNET_OPTIMIZER_SGD,
+        .num_threads = num_threads,
+        .asynchronous = 1,
+        .keep_pruned = 1,
+        .rng = &rng,
+    };
+    for (int epoch = 0; epoch < HOGWILD_EPOCHS; epoch++) {
+        stoopidnet_train(net, &params, NUM_EXAMPLES, inputs, expected);
+    }
+    const double after = mean_loss(net, inputs, expected);
+
+    int unpruned = 0;
+    stoopidnet_get_layer_params(net, 1, w1, b1);
+    stoopidnet_get_layer_params(net, 2, w2, b2);
+    for (int k = 0; k < (NUM_HIDDEN * NUM_INPUTS); k += 3) {
+        unpruned += (w1[k] != 0);
+    }
+    for (int k = 0; k < (NUM_OUTPUTS * NUM_HIDDEN); k += 3) {
+        unpruned += (w2[k] != 0);
+    }
+    stoopidnet_destroy(net);
+
+    const int ok = (after < before) && (unpruned == 0);
+    printf("%s %s, %u threads async, %u per batch: loss %g -> %g, %i pruned weights nonzero\n",
+           ok ? "ok  " : "FAIL", (precision == STOOPIDNET_PRECISION_F32) ? "float" : "double",
+           num_threads, HOGWILD_BATCH, before, after, unpruned);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    // inputs in [0, 1) from a fixed LCG, with every fourth column and the smallest values zero so
+    // that asynchronous training's sparse first-layer update gets exercised. Each example's class
+    // is the quarter its inputs' sum falls in.
+    double* storage = malloc(NUM_EXAMPLES * (NUM_INPUTS + NUM_OUTPUTS) * sizeof(double));
+    double* inputs[NUM_EXAMPLES];
+    double* expected[NUM_EXAMPLES];
+    uint32_t state = 12345;
+    for (int i = 0; i < NUM_EXAMPLES; i++) {
+        inputs[i] = storage + (i * (NUM_INPUTS + NUM_OUTPUTS));
+        expected[i] = inputs[i] + NUM_INPUTS;
+        double sum = 0;
+        for (int k = 0; k < NUM_INPUTS; k++) {
+            state = (state * 1664525u) + 1013904223u;
+            inputs[i][k] = (state >> 8) / 16777216.0;
+            inputs[i][k] = (((k % 4) == 1) || (inputs[i][k] < 0.2)) ? 0 : inputs[i][k];
+            sum += inputs[i][k];
+        }
+        int label = (int)((sum / NUM_INPUTS) * NUM_OUTPUTS * 3) - 3;
+        label = (label < 0) ? 0 : ((label >= NUM_OUTPUTS) ? (NUM_OUTPUTS - 1) : label);
+        for (int j = 0; j < NUM_OUTPUTS; j++) {
+            expected[i][j] = (j == label);
+        }
+    }
+
+    const stoopidnet_precision_t f64 = STOOPIDNET_PRECISION_F64;
+    const stoopidnet_precision_t f32 = STOOPIDNET_PRECISION_F32;
+    const test_case_t cases[] = {
+        { f64, 1, 0, STOOPIDNET_OPTIMIZER_SGD,      LEARN_RATE, 0, 0, 1e-12 },
+        { f64, 3, 0, STOOPIDNET_OPTIMIZER_SGD,      LEARN_RATE, 0, 0, 1e-12 },
+        { f64, 2, 1, STOOPIDNET_OPTIMIZER_SGD,      LEARN_RATE, 0, 0, 1e-12 },
+        { f32, 1, 0, STOOPIDNET_OPTIMIZER_SGD,      LEARN_RATE, 0, 0, 1e-4 },
+        { f32, 2, 1, STOOPIDNET_OPTIMIZER_SGD,      LEARN_RATE, 0, 0, 1e-4 },
+        { f64, 1, 0, STOOPIDNET_OPTIMIZER_SGD,      LEARN_RATE, 1, 0, 1e-12 },
+        { f32, 3, 0, STOOPIDNET_OPTIMIZER_SGD,      LEARN_RATE, 1, 0, 1e-4 },
+        { f64, 1, 0, STOOPIDNET_OPTIMIZER_MOMENTUM, LEARN_RATE, 0, 0, 1e-12 },
+        { f64, 3, 0, STOOPIDNET_OPTIMIZER_MOMENTUM, LEARN_RATE, 0, 1, 1e-12 },
+        { f32, 1, 0, STOOPIDNET_OPTIMIZER_MOMENTUM, LEARN_RATE, 0, 0, 1e-4 },
+        { f64, 1, 0, STOOPIDNET_OPTIMIZER_NESTEROV, LEARN_RATE, 0, 0, 1e-12 },
+        { f64, 3, 0, STOOPIDNET_OPTIMIZER_NESTEROV, LEARN_RATE, 1, 1, 1e-12 },
+        { f32, 1, 0, STOOPIDNET_OPTIMIZER_NESTEROV, LEARN_RATE, 0, 0, 1e-4 },
+        { f64, 1, 0, STOOPIDNET_OPTIMIZER_ADAM,     0.05,       0, 0, 1e-12 },
+        { f64, 3, 0, STOOPIDNET_OPTIMIZER_ADAM,     0.05,       0, 1, 1e-12 },
+        { f32, 2, 0, STOOPIDNET_OPTIMIZER_ADAM,     0.05,       1, 1, 1e-4 },
+    };
+
+    int ok = 1;
+    for (size_t c = 0; c < (sizeof(cases) / sizeof(cases[0])); c++) {
+        ok &= check(&cases[c], inputs, expected);
+    }
+    ok &= check_hogwild(f64, 4, inputs, expected);
+    ok &= check_hogwild(f32, 4, inputs, expected);
+
+    free(storage);
+    return ok ? 0 : 1;
+}
@@ -1,66 +1,413 @@
 #include "mnist_loader.h"
 #include "stoopidnet.h"
-#include "math_util.h"
+#include "stoopidnet_checkpoint.h"
+#include "stoopidnet_evaluator.h"
+#include "stoopidnet_profile.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/**
+ * Trace events kept by --profile; at 24 bytes each, enough for several epochs of MNIST.
+ */
+#define PROFILE_TRACE_EVENTS (1 << 22)
+
+/**
+ * Minibatches between progress updates.
+ */
+#define PROGRESS_INTERVAL 200
+
+/**
+ * Seconds between checkpoints if --checkpoint is given without --checkpoint-batches or
+ * --checkpoint-seconds.
+ */
+#define CHECKPOINT_SECONDS 60
+
+/**
+ * What the accuracy reports need to know about each epoch's training.
+ */
+typedef struct epoch_log
+{
+    double* samples_per_sec;
+    uint32_t num_threads;
+} epoch_log_t;
+
+/**
+ * stoopidnet_eval_fn for the training set; the tag is the epoch and ctx the epoch_log_t.
+ */
+static void print_accuracy(void* ctx, const stoopidnet_eval_result_t* result)
+{
+    const epoch_log_t* log = ctx;
+    printf("%i examples trained. %u / %u accuracy. %.0f samples/sec on %u threads.\n",
+           (int)result->tag, result->correct, result->count, log->samples_per_sec[result->tag],
+           log->num_threads);
+    fflush(stdout);
+}
+
+/**
+ * stoopidnet_eval_fn for the validation set.
+ */
+static void print_validation(void* ctx, const stoopidnet_eval_result_t* result)
+{
+    printf("%i validation: %u / %u accuracy.\n", (int)result->tag, result->correct,
+           result->count);
+    fflush(stdout);
+}
+
+/**
+ * stoopidnet_progress_fn that keeps a status line for the current epoch (ctx) on stderr.
+ */
+static void print_progress(void* ctx, const stoopidnet_progress_t* progress)
+{
+    fprintf(stderr, "\repoch %d: %llu / %llu examples, %.0f samples/sec", *(const int*)ctx,
+            (unsigned long long)progress->samples_done,
+            (unsigned long long)progress->samples_total, progress->samples_per_sec);
+    if (progress->samples_done == progress->samples_total) {
+        fprintf(stderr, "\n");
+    }
+}
+
 int main(int argc, char** argv)
 {
-    if (argc != 6) {
-        printf("Usage: %s <stoopidnet input file OR \"null\"> <stoopidnet output file> "
-               "<mnist data> <mnist labels> <randseed>\n", argv[0]);
+    // options come before the positional arguments.
+    int argi = 1;
+    int use_f32 = 0;
+    uint32_t num_threads = 1;
+    uint32_t asynchronous = 0;
+    uint32_t prefetch = 0;
+    uint32_t keep_pruned = 0;
+    int scaling = 0;
+    int progress = 0;
+    uint32_t eval_threads = 1;
+    uint32_t eval_samples = 0;
+    const char* validation[2] = { NULL, NULL };
+    const char* profile_file = NULL;
+    const char* checkpoint_file = NULL;
+    uint32_t checkpoint_batches = 0;
+    double checkpoint_seconds = 0;
+    int resume = 0;
+    stoopidnet_storage_t storage = STOOPIDNET_STORAGE_NATIVE;
+    double learn_rate = 2.0;
+    int softmax = 0;
+    stoopidnet_optimizer_t optimizer = STOOPIDNET_OPTIMIZER_SGD;
+    int nepochs = 30;
+    stoopidnet_activation_t hidden = STOOPIDNET_ACTIVATION_SIGMOID;
+    for (; (argi < argc) && !strncmp(argv[argi], "--", 2); argi++) {
+        if (!strcmp(argv[argi], "--f32")) {
+            use_f32 = 1;
+        } else if (!strcmp(argv[argi], "--softmax")) {
+            softmax = 1;
+        } else if (!strcmp(argv[argi], "--optimizer") && ((argi + 1) < argc)) {
+            argi++;
+            for (optimizer = 0; optimizer < STOOPIDNET_NUM_OPTIMIZERS; optimizer++) {
+                if (!strcmp(argv[argi], stoopidnet_optimizer_name(optimizer))) {
+                    break;
+                }
+            }
+            if (optimizer == STOOPIDNET_NUM_OPTIMIZERS) {
+                fprintf(stderr, "Unknown optimizer %s\n", argv[argi]);
+                return -1;
+            }
+        } else if (!strcmp(argv[argi], "--epochs") && ((argi + 1) < argc)) {
+            nepochs = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--rate") && ((argi + 1) < argc)) {
+            learn_rate = strtod(argv[++argi], NULL);
+        } else if (!strcmp(argv[argi], "--threads") && ((argi + 1) < argc)) {
+            num_threads = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--async")) {
+            asynchronous = 1;
+        } else if (!strcmp(argv[argi], "--prefetch")) {
+            prefetch = 1;
+        } else if (!strcmp(argv[argi], "--keep-pruned")) {
+            keep_pruned = 1;
+        } else if (!strcmp(argv[argi], "--activation") && ((argi + 1) < argc)) {
+            argi++;
+            for (hidden = 0; hidden < STOOPIDNET_NUM_ACTIVATIONS; hidden++) {
+                if (!strcmp(argv[argi], stoopidnet_activation_name(hidden))) {
+                    break;
+                }
+            }
+            if (hidden == STOOPIDNET_NUM_ACTIVATIONS) {
+                fprintf(stderr, "Unknown activation %s\n", argv[argi]);
+                return -1;
+            }
+        } else if (!strcmp(argv[argi], "--scaling")) {
+            scaling = 1;
+        } else if (!strcmp(argv[argi], "--eval-threads") && ((argi + 1) < argc)) {
+            eval_threads = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--eval-samples") && ((argi + 1) < argc)) {
+            eval_samples = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--validation") && ((argi + 2) < argc)) {
+            validation[0] = argv[++argi];
+            validation[1] = argv[++argi];
+        } else if (!strcmp(argv[argi], "--progress")) {
+            progress = 1;
+        } else if (!strcmp(argv[argi], "--profile") && ((argi + 1) < argc)) {
+            profile_file = argv[++argi];
+        } else if (!strcmp(argv[argi], "--checkpoint") && ((argi + 1) < argc)) {
+            checkpoint_file = argv[++argi];
+        } else if (!strcmp(argv[argi], "--checkpoint-batches") && ((argi + 1) < argc)) {
+            checkpoint_batches = strtol(argv[++argi], NULL, 10);
+        } else if (!strcmp(argv[argi], "--checkpoint-seconds") && ((argi + 1) < argc)) {
+            checkpoint_seconds = strtod(argv[++argi], NULL);
+        } else if (!strcmp(argv[argi], "--resume")) {
+            resume = 1;
+        } else if (!strcmp(argv[argi], "--save-as") && ((argi + 1) < argc)) {
+            argi++;
+            for (storage = 0; storage < STOOPIDNET_NUM_STORAGES; storage++) {
+                if (!strcmp(argv[argi], stoopidnet_storage_name(storage))) {
+                    break;
+                }
+            }
+            if (storage == STOOPIDNET_NUM_STORAGES) {
+                fprintf(stderr, "Unknown storage format %s\n", argv[argi]);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[argi]);
+            return -1;
+        }
+    }
+
+    if ((argc - argi) != 5) {
+        printf("Usage: %s [--f32] [--activation NAME] [--softmax] [--optimizer NAME] [--rate R] "
+               "[--epochs N] [--threads N] [--async] [--prefetch] [--keep-pruned] [--scaling] "
+               "[--eval-threads N] [--eval-samples N] [--validation DATA LABELS] [--progress] "
+               "[--profile FILE] [--checkpoint FILE] [--checkpoint-batches N] "
+               "[--checkpoint-seconds S] [--resume] [--save-as FORMAT] "
+               "<stoopidnet input file OR \"null\"> <stoopidnet output file> <mnist data> "
+               "<mnist labels> <randseed>\n", argv[0]);
+        printf("  --f32        train a new net in float32 (a loaded net keeps its precision)\n");
+        printf("  --activation NAME\n"
+               "               hidden layer activation of a new net: sigmoid (default), relu,\n"
+               "               leaky-relu, tanh or fast-sigmoid\n");
+        printf("  --softmax    give a new net a softmax output layer; nets with one train with\n"
+               "               cross-entropy loss\n");
+        printf("  --optimizer NAME\n"
+               "               sgd (default), momentum, nesterov or adam. The optimizer's state\n"
+               "               is saved with the net, so training it again picks up where it\n"
+               "               left off\n");
+        printf("  --rate R     learning rate (default 2.0)\n");
+        printf("  --epochs N   number of passes over the training set (default 30)\n");
+        printf("  --threads N  split each minibatch across N threads\n");
+        printf("  --async      let the threads update the weights Hogwild-style, unsynchronized.\n"
+               "               Only with the sgd optimizer\n");
+        printf("  --prefetch   stage the next minibatch on a background thread while one trains\n");
+        printf("  --keep-pruned\n"
+               "               hold the input net's zero weights at zero, e.g. to fine-tune a net\n"
+               "               pruned by stoopidnet-prune\n");
+        printf("  --scaling    report one epoch's samples/sec at 1, 2, 4... N threads and exit\n");
+        printf("  --eval-threads N\n"
+               "               threads that score each epoch's snapshot of the net while the next\n"
+               "               epoch trains (default 1)\n");
+        printf("  --eval-samples N\n"
+               "               only score the first N training images after each epoch\n");
+        printf("  --validation DATA LABELS\n"
+               "               also score each epoch on this mnist data set\n");
+        printf("  --progress   show how far along each epoch is on stderr\n");
+        printf("  --profile FILE\n"
+               "               time every phase and layer of training, print a summary to stderr\n"
+               "               and write a Chrome trace (chrome://tracing, Perfetto) to FILE\n");
+        printf("  --checkpoint FILE\n"
+               "               save the net, optimizer state and position in the training run to\n"
+               "               FILE in the background as training goes, and after every epoch\n");
+        printf("  --checkpoint-batches N\n"
+               "               checkpoint every N minibatches\n");
+        printf("  --checkpoint-seconds S\n"
+               "               checkpoint every S seconds (default %d if neither is given)\n",
+               CHECKPOINT_SECONDS);
+        printf("  --resume     if the checkpoint file exists, carry on the run saved in it\n"
+               "               instead of training the input net. Give the same options and\n"
+               "               randseed as the original run to end up with exactly the same net\n"
+               "               (close to it with --async)\n");
+        printf("  --save-as FORMAT\n"
+               "               store the trained net's parameters as native (default), fp16 or\n"
+               "               bf16. The 16-bit formats drop the optimizer state\n");
+        return -1;
+    }
+    argv += argi - 1;
+    if (resume && (checkpoint_file == NULL)) {
+        fprintf(stderr, "--resume needs --checkpoint\n");
+        return -1;
+    }
+    if (asynchronous && (optimizer != STOOPIDNET_OPTIMIZER_SGD)) {
+        fprintf(stderr, "--async only works with the sgd optimizer, not %s\n",
+                stoopidnet_optimizer_name(optimizer));
         return -1;
     }
 
-    // srand
-    srand(strtol(argv[5], NULL, 10));
+    // srand. The training examples are shuffled with a generator of their own, so that a
+    // checkpoint can save its state.
+    const long seed = strtol(argv[5], NULL, 10);
+    srand(seed);
+    uint64_t rng = (uint64_t)seed;
 
     // load files
     stoopidnet_t* net;
-    if (!strcmp(argv[1], "null")) {
-        net = stoopidnet_create(784);
-        stoopidnet_add_fc_layer(net, 30);
-        stoopidnet_add_fc_layer(net, 10);
+    stoopidnet_checkpoint_info_t resume_info = { 0, 0, rng };
+    FILE* probe = resume ? fopen(checkpoint_file, "rb") : NULL;
+    if (probe != NULL) {
+        fclose(probe);
+        net = stoopidnet_checkpoint_load(checkpoint_file, &resume_info);
+        if (net == NULL) {
+            return -1;
+        }
+        printf("Resuming from epoch %llu, example %u.\n",
+               (unsigned long long)resume_info.epoch, resume_info.position);
+    } else if (!strcmp(argv[1], "null")) {
+        net = stoopidnet_create_with_precision(784, use_f32 ? STOOPIDNET_PRECISION_F32 :
+                                                              STOOPIDNET_PRECISION_F64);
+        stoopidnet_add_fc_layer_with_activation(net, 30, hidden);
+        stoopidnet_add_fc_layer_with_activation(net, 10, softmax ? STOOPIDNET_ACTIVATION_SOFTMAX :
+                                                                   STOOPIDNET_ACTIVATION_SIGMOID);
     } else {
         net = stoopidnet_load_from_file(argv[1]);
         if (net == NULL) {
             return -1;
         }
     }
-
-    double** pics;
-    double** labels;
-    int npics = load_data_file_doubles(argv[3], &pics);
-    int nlabels = load_label_file_doubles(argv[4], &labels);
-
-    if ((npics != nlabels) || (nlabels == 0)) {
+    // the images stay as bytes in the mapped file; they're normalized batch by batch as they're
+    // packed for the net.
+    mnist_dataset_t* ds = mnist_dataset_open(argv[3], argv[4]);
+    if ((ds == NULL) || (ds->count == 0) ||
+        ((ds->width * ds->height) != stoopidnet_get_num_nodes_in_layer(net, 0))) {
         fprintf(stderr, "Something went wrong loading the mnist files\n");
         return -1;
     }
+    const uint32_t last = stoopidnet_get_num_layers(net) - 1;
+    const uint32_t num_classes = stoopidnet_get_num_nodes_in_layer(net, last);
+    if (mnist_dataset_check_labels(ds, num_classes) != 0) {
+        return -1;
+    }
+    // every epoch reads the images in a new shuffled order.
+    mnist_dataset_advise(ds, MNIST_ACCESS_RANDOM);
+    const int npics = ds->count;
 
     // train.
-    stoopidnet_training_parameters_t train_params = { 2.0, 10 };
-    const int nepochs = 30;
-    for (int i = 0; i < nepochs; i++) {
-        stoopidnet_train(net, &train_params, npics, pics, labels);
-
-        int num_good = 0;
-        for (int j = 0; j < npics; j++) {
-            double* output;
-            stoopidnet_evaluate(net, pics[j], &output);
-
-            int size = 10;
-            if(maxidx(output, size) == (maxidx(labels[j], size))) {
-                num_good++;
+    int epoch = 0;
+    stoopidnet_training_stats_t stats;
+    stoopidnet_profile_t* profile = profile_file ? stoopidnet_profile_create(PROFILE_TRACE_EVENTS) :
+                                                   NULL;
+    stoopidnet_training_parameters_t train_params = {
+        .learn_rate = learn_rate,
+        .batch_size = 10,
+        .loss = STOOPIDNET_LOSS_QUADRATIC,
+        .optimizer = optimizer,
+        .num_threads = num_threads,
+        .asynchronous = asynchronous,
+        .prefetch = prefetch,
+        .keep_pruned = keep_pruned,
+        .stats = &stats,
+        .progress = progress ? print_progress : NULL,
+        .progress_ctx = &epoch,
+        .progress_interval = PROGRESS_INTERVAL,
+        .profile = profile,
+        .rng = &rng,
+    };
+
+    if (stoopidnet_get_layer_activation(net, last) == STOOPIDNET_ACTIVATION_SOFTMAX) {
+        train_params.loss = STOOPIDNET_LOSS_CROSS_ENTROPY;
+    }
+
+    if (scaling) {
+        // each run trains its own copy so they all start from the same weights.
+        const stoopidnet_precision_t precision = stoopidnet_get_precision(net);
+        double base = 0;
+        printf("threads  samples/sec  speedup\n");
+        for (uint32_t t = 1;; t *= 2) {
+            if (t > num_threads) {
+                t = num_threads;
+            }
+            stoopidnet_t* copy = stoopidnet_convert_precision(net, precision);
+            train_params.num_threads = t;
+            stoopidnet_train_u8(copy, &train_params, npics, ds->images, ds->labels);
+            stoopidnet_destroy(copy);
+            if (t == 1) {
+                base = stats.samples_per_sec;
             }
+            printf("%7u  %11.0f  %6.2fx\n", t, stats.samples_per_sec,
+                   (base > 0) ? (stats.samples_per_sec / base) : 0);
+            if (t >= num_threads) {
+                break;
+            }
+        }
+        return 0;
+    }
+
+    // each epoch's weights are scored on background threads while the next epoch trains.
+    mnist_dataset_t* vds = NULL;
+    stoopidnet_evaluator_t* val = NULL;
+    if (validation[0] != NULL) {
+        vds = mnist_dataset_open(validation[0], validation[1]);
+        if ((vds == NULL) || (vds->labels == NULL) ||
+            ((vds->width * vds->height) != stoopidnet_get_num_nodes_in_layer(net, 0))) {
+            fprintf(stderr, "Something went wrong loading the validation files\n");
+            return -1;
         }
-        printf("%i examples trained. %i / %i accuracy.\n", i, num_good, npics);
+        if (mnist_dataset_check_labels(vds, num_classes) != 0) {
+            return -1;
+        }
+        val = stoopidnet_evaluator_create(net, eval_threads, vds->count, vds->images, vds->labels,
+                                          print_validation, NULL);
+    }
+    epoch_log_t log = {
+        .samples_per_sec = calloc(nepochs, sizeof(double)),
+        .num_threads = (num_threads > 1) ? num_threads : 1,
+    };
+    const uint32_t neval = ((eval_samples > 0) && (eval_samples < npics)) ? eval_samples : npics;
+    stoopidnet_evaluator_t* ev = stoopidnet_evaluator_create(net, eval_threads, neval, ds->images,
+                                                             ds->labels, print_accuracy, &log);
+
+    stoopidnet_checkpointer_t* ck = NULL;
+    if (checkpoint_file != NULL) {
+        if ((checkpoint_batches == 0) && (checkpoint_seconds <= 0)) {
+            checkpoint_seconds = CHECKPOINT_SECONDS;
+        }
+        ck = stoopidnet_checkpointer_create(checkpoint_file, checkpoint_batches,
+                                            checkpoint_seconds);
+        train_params.checkpointer = ck;
+    }
+
+    // a resumed run finishes the epoch it was saved in from the same shuffled order.
+    rng = resume_info.rng;
+    train_params.start = resume_info.position;
+    for (int i = resume_info.epoch; i < nepochs; i++) {
+        epoch = i;
+        if (ck != NULL) {
+            stoopidnet_checkpointer_begin_epoch(ck, i);
+        }
+        stoopidnet_train_u8(net, &train_params, npics, ds->images, ds->labels);
+        train_params.start = 0;
+        if (ck != NULL) {
+            const stoopidnet_checkpoint_info_t info = { i + 1, 0, rng };
+            stoopidnet_checkpointer_save(ck, net, &info);
+        }
+        log.samples_per_sec[i] = stats.samples_per_sec;
+        stoopidnet_evaluator_submit(ev, net, i);
+        if (val != NULL) {
+            stoopidnet_evaluator_submit(val, net, i);
+        }
+    }
+
+    // destroying the evaluators waits for the last epochs to be scored.
+    stoopidnet_evaluator_destroy(ev);
+    stoopidnet_evaluator_destroy(val);
+    stoopidnet_checkpointer_destroy(ck);
+    free(log.samples_per_sec);
+    mnist_dataset_close(ds);
+    if (vds != NULL) {
+        mnist_dataset_close(vds);
+    }
+
+    if (profile != NULL) {
+        stoopidnet_profile_print(profile, stderr);
+        stoopidnet_profile_write_trace(profile, profile_file);
+        stoopidnet_profile_destroy(profile);
     }
 
     // store the final network
-    stoopidnet_store_to_file(net, argv[2]);
+    stoopidnet_store_to_file_with_storage(net, argv[2], storage);
 
     return 0;
 }
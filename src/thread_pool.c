@@ -0,0 +1,154 @@
+// for sysconf(_SC_NPROCESSORS_ONLN)
+#define _DEFAULT_SOURCE
+
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct thread_pool_worker
+{
+    thread_pool_t* pool;
+    uint32_t index;
+    pthread_t thread;
+} thread_pool_worker_t;
+
+struct thread_pool
+{
+    uint32_t num_threads;
+    thread_pool_worker_t* workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+
+    /**
+     * Bumped every time a job is handed out, so sleeping workers can tell a new job from a
+     * spurious wakeup.
+     */
+    uint64_t generation;
+    uint32_t remaining;
+    int shutdown;
+
+    thread_pool_fn fn;
+    void* ctx;
+};
+
+static void* thread_pool_worker_main(void* arg);
+
+
+thread_pool_t* thread_pool_create(uint32_t num_threads)
+{
+    if (num_threads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (ncpu > 0) ? (uint32_t)ncpu : 1;
+    }
+
+    thread_pool_t* pool = calloc(1, sizeof(thread_pool_t));
+    pool->num_threads = num_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    // worker 0 is whoever calls thread_pool_run, so only start the rest.
+    pool->workers = calloc(num_threads, sizeof(thread_pool_worker_t));
+    for (uint32_t i = 1; i < num_threads; i++) {
+        pool->workers[i].pool  = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, thread_pool_worker_main,
+                           &pool->workers[i]) != 0) {
+            fprintf(stderr, "Failed to start thread pool worker %u\n", i);
+            abort();
+        }
+    }
+
+    return pool;
+}
+
+
+void thread_pool_destroy(thread_pool_t* pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 1; i < pool->num_threads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
+
+
+uint32_t thread_pool_size(thread_pool_t* pool)
+{
+    return pool->num_threads;
+}
+
+
+void thread_pool_run(thread_pool_t* pool, thread_pool_fn fn, void* ctx)
+{
+    if (pool->num_threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->fn = fn;
+        pool->ctx = ctx;
+        pool->remaining = pool->num_threads - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    fn(ctx, 0, pool->num_threads);
+
+    if (pool->num_threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->remaining > 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+
+static void* thread_pool_worker_main(void* arg)
+{
+    thread_pool_worker_t* worker = arg;
+    thread_pool_t* pool = worker->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && (pool->generation == seen)) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        seen = pool->generation;
+
+        thread_pool_fn fn = pool->fn;
+        void* ctx = pool->ctx;
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(ctx, worker->index, pool->num_threads);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->remaining == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/**
+ * A tiny fork-join thread pool.
+ *
+ * thread_pool_run hands the same function to every worker and returns once they've all finished,
+ * so callers split their work by worker index. The calling thread takes part as worker 0, which
+ * means a pool of 1 thread never starts any threads at all.
+ */
+
+#include <stdint.h>
+
+typedef struct thread_pool thread_pool_t;
+
+/**
+ * Work function; called once on each worker with that worker's index in [0, num_workers).
+ */
+typedef void (*thread_pool_fn)(void* ctx, uint32_t worker, uint32_t num_workers);
+
+/**
+ * Creates a pool of num_threads workers (including the calling thread). 0 means one per online
+ * CPU.
+ */
+thread_pool_t* thread_pool_create(uint32_t num_threads);
+void thread_pool_destroy(thread_pool_t* pool);
+
+uint32_t thread_pool_size(thread_pool_t* pool);
+
+/**
+ * Runs fn(ctx, worker, num_workers) on every worker and waits for all of them to return.
+ */
+void thread_pool_run(thread_pool_t* pool, thread_pool_fn fn, void* ctx);
+
+#endif